@@ -21,6 +21,7 @@
 #include "config.h"
 
 #include "ostree-checksum-input-stream.h"
+#include "ostree-core-private.h"
 #include "libgsystem.h"
 
 enum {
@@ -32,6 +33,7 @@ G_DEFINE_TYPE (OstreeChecksumInputStream, ostree_checksum_input_stream, G_TYPE_F
 
 struct _OstreeChecksumInputStreamPrivate {
   GChecksum *checksum;
+  OtChecksum *ot_checksum;
 };
 
 static void     ostree_checksum_input_stream_set_property (GObject              *object,
@@ -142,6 +144,28 @@ ostree_checksum_input_stream_new (GInputStream    *base,
   return (OstreeChecksumInputStream*) (stream);
 }
 
+/*
+ * _ostree_checksum_input_stream_new:
+ *
+ * Like ostree_checksum_input_stream_new(), but updates an #OtChecksum,
+ * which can use the CPU's SHA-256 instructions.
+ */
+OstreeChecksumInputStream *
+_ostree_checksum_input_stream_new (GInputStream    *base,
+                                   OtChecksum      *checksum)
+{
+  OstreeChecksumInputStream *stream;
+
+  g_return_val_if_fail (G_IS_INPUT_STREAM (base), NULL);
+
+  stream = g_object_new (OSTREE_TYPE_CHECKSUM_INPUT_STREAM,
+			 "base-stream", base,
+			 NULL);
+  stream->priv->ot_checksum = checksum;
+
+  return stream;
+}
+
 static gssize
 ostree_checksum_input_stream_read (GInputStream  *stream,
                                    void          *buffer,
@@ -162,7 +186,12 @@ ostree_checksum_input_stream_read (GInputStream  *stream,
                              cancellable,
                              error);
   if (res > 0)
-    g_checksum_update (self->priv->checksum, buffer, res);
+    {
+      if (self->priv->ot_checksum)
+        ot_checksum_update (self->priv->ot_checksum, buffer, res);
+      else
+        g_checksum_update (self->priv->checksum, buffer, res);
+    }
 
   return res;
 }
@@ -21,6 +21,8 @@
 #pragma once
 
 #include "ostree-core.h"
+#include "ostree-checksum-input-stream.h"
+#include "otutil.h"
 
 G_BEGIN_DECLS
 
@@ -63,6 +65,14 @@ G_BEGIN_DECLS
  */
 #define _OSTREE_ZLIB_FILE_HEADER_GVARIANT_FORMAT G_VARIANT_TYPE ("(tuuuusa(ayay))")
 
+GVariant *_ostree_file_header_new (GFileInfo         *file_info,
+                                   GVariant          *xattrs);
+
+gboolean _ostree_file_header_parse (GVariant         *metadata,
+                                    GFileInfo       **out_file_info,
+                                    GVariant        **out_xattrs,
+                                    GError          **error);
+
 GVariant *_ostree_zlib_file_header_new (GFileInfo         *file_info,
                                         GVariant          *xattrs);
 
@@ -70,10 +80,13 @@ gboolean _ostree_write_variant_with_size (GOutputStream      *output,
                                           GVariant           *variant,
                                           guint64             alignment_offset,
                                           gsize              *out_bytes_written,
-                                          GChecksum          *checksum,
+                                          OtChecksum         *checksum,
                                           GCancellable       *cancellable,
                                           GError            **error);
 
+OstreeChecksumInputStream *_ostree_checksum_input_stream_new (GInputStream   *base,
+                                                               OtChecksum     *checksum);
+
 gboolean
 _ostree_make_temporary_symlink_at (int             tmp_dirfd,
                                    const char     *target,
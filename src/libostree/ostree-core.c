@@ -36,11 +36,6 @@
   (( ((unsigned long)(this)) + (((unsigned long)(boundary)) -1)) & (~(((unsigned long)(boundary))-1)))
 
 static gboolean
-file_header_parse (GVariant         *metadata,
-                   GFileInfo       **out_file_info,
-                   GVariant        **out_xattrs,
-                   GError          **error);
-static gboolean
 zlib_file_header_parse (GVariant         *metadata,
                         GFileInfo       **out_file_info,
                         GVariant        **out_xattrs,
@@ -200,9 +195,9 @@ ostree_validate_rev (const char *rev,
   return ret;
 }
 
-static GVariant *
-file_header_new (GFileInfo         *file_info,
-                 GVariant          *xattrs)
+GVariant *
+_ostree_file_header_new (GFileInfo         *file_info,
+                         GVariant          *xattrs)
 {
   guint32 uid;
   guint32 gid;
@@ -279,7 +274,7 @@ write_padding (GOutputStream    *output,
                guint             alignment,
                gsize             offset,
                gsize            *out_bytes_written,
-               GChecksum        *checksum,
+               OtChecksum       *checksum,
                GCancellable     *cancellable,
                GError          **error)
 {
@@ -327,7 +322,7 @@ _ostree_write_variant_with_size (GOutputStream      *output,
                                  GVariant           *variant,
                                  guint64             alignment_offset,
                                  gsize              *out_bytes_written,
-                                 GChecksum          *checksum,
+                                 OtChecksum         *checksum,
                                  GCancellable       *cancellable,
                                  GError            **error)
 {
@@ -385,7 +380,7 @@ _ostree_write_variant_with_size (GOutputStream      *output,
 static gboolean
 write_file_header_update_checksum (GOutputStream         *out,
                                    GVariant              *header,
-                                   GChecksum             *checksum,
+                                   OtChecksum            *checksum,
                                    GCancellable          *cancellable,
                                    GError               **error)
 {
@@ -433,7 +428,7 @@ ostree_raw_file_to_content_stream (GInputStream       *input,
   gs_unref_object GOutputStream *header_out_stream = NULL;
   gs_unref_object GInputStream *header_in_stream = NULL;
 
-  file_header = file_header_new (file_info, xattrs);
+  file_header = _ostree_file_header_new (file_info, xattrs);
 
   header_out_stream = g_memory_output_stream_new (NULL, 0, g_realloc, g_free);
 
@@ -544,10 +539,10 @@ ostree_content_stream_parse (gboolean                compressed,
     }
   else
     {
-      if (!file_header_parse (file_header,
-                              out_file_info ? &ret_file_info : NULL,
-                              out_xattrs ? &ret_xattrs : NULL,
-                              error))
+      if (!_ostree_file_header_parse (file_header,
+                                      out_file_info ? &ret_file_info : NULL,
+                                      out_xattrs ? &ret_xattrs : NULL,
+                                      error))
         goto out;
       if (ret_file_info)
         g_file_info_set_size (ret_file_info, input_length - archive_header_size - 8);
@@ -673,9 +668,9 @@ ostree_checksum_file_from_input (GFileInfo        *file_info,
 {
   gboolean ret = FALSE;
   gs_free guchar *ret_csum = NULL;
-  GChecksum *checksum = NULL;
+  OtChecksum *checksum = NULL;
 
-  checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  checksum = ot_checksum_new (G_CHECKSUM_SHA256);
 
   if (OSTREE_OBJECT_TYPE_IS_META (objtype))
     {
@@ -685,15 +680,15 @@ ostree_checksum_file_from_input (GFileInfo        *file_info,
   else if (g_file_info_get_file_type (file_info) == G_FILE_TYPE_DIRECTORY)
     {
       gs_unref_variant GVariant *dirmeta = ostree_create_directory_metadata (file_info, xattrs);
-      g_checksum_update (checksum, g_variant_get_data (dirmeta),
-                         g_variant_get_size (dirmeta));
+      ot_checksum_update (checksum, g_variant_get_data (dirmeta),
+                          g_variant_get_size (dirmeta));
       
     }
   else
     {
       gs_unref_variant GVariant *file_header = NULL;
 
-      file_header = file_header_new (file_info, xattrs);
+      file_header = _ostree_file_header_new (file_info, xattrs);
 
       if (!write_file_header_update_checksum (NULL, file_header, checksum,
                                               cancellable, error))
@@ -706,12 +701,12 @@ ostree_checksum_file_from_input (GFileInfo        *file_info,
         }
     }
 
-  ret_csum = ot_csum_from_gchecksum (checksum);
+  ret_csum = ot_csum_from_checksum (checksum);
 
   ret = TRUE;
   ot_transfer_out_value (out_csum, &ret_csum);
  out:
-  g_clear_pointer (&checksum, (GDestroyNotify)g_checksum_free);
+  g_clear_pointer (&checksum, (GDestroyNotify)ot_checksum_free);
   return ret;
 }
 
@@ -1321,10 +1316,13 @@ _ostree_get_relative_object_path (const char         *checksum,
   return g_string_free (path, FALSE);
 }
 
+/* A %NULL @from names a delta from scratch, containing all of @to */
 char *
 _ostree_get_relative_static_delta_path (const char        *from,
                                         const char        *to)
 {
+  if (from == NULL)
+    return g_strdup_printf ("deltas/%s/meta", to);
   return g_strdup_printf ("deltas/%s-%s/meta", from, to);
 }
 
@@ -1333,11 +1331,13 @@ _ostree_get_relative_static_delta_part_path (const char        *from,
                                              const char        *to,
                                              guint              i)
 {
+  if (from == NULL)
+    return g_strdup_printf ("deltas/%s/%u", to, i);
   return g_strdup_printf ("deltas/%s-%s/%u", from, to, i);
 }
 
 /*
- * file_header_parse:
+ * _ostree_file_header_parse:
  * @metadata: A metadata variant of type %OSTREE_FILE_HEADER_GVARIANT_FORMAT
  * @out_file_info: (out): Parsed file information
  * @out_xattrs: (out): Parsed extended attribute set
@@ -1346,11 +1346,11 @@ _ostree_get_relative_static_delta_part_path (const char        *from,
  * Load file header information into standard Gio #GFileInfo object,
  * along with extended attributes tored in @out_xattrs.
  */
-static gboolean
-file_header_parse (GVariant         *metadata,
-                   GFileInfo       **out_file_info,
-                   GVariant        **out_xattrs,
-                   GError          **error)
+gboolean
+_ostree_file_header_parse (GVariant         *metadata,
+                           GFileInfo       **out_file_info,
+                           GVariant        **out_xattrs,
+                           GError          **error)
 {
   gboolean ret = FALSE;
   guint32 uid, gid, mode, rdev;
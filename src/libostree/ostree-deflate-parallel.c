@@ -0,0 +1,423 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2014 Colin Walters <walters@verbum.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "config.h"
+
+#include <zlib.h>
+
+#include "ostree-deflate-parallel.h"
+#include "otutil.h"
+#include "libgsystem.h"
+
+/* Raw deflate compression of large inputs using several threads, in
+ * the manner of pigz.  The input is cut into blocks that are
+ * compressed independently; every block but the last ends with a sync
+ * flush, which byte-aligns the output without marking the final
+ * deflate block, so the concatenated output is a single ordinary raw
+ * deflate stream.  Each block is primed with the tail of the previous
+ * block's input as dictionary, which keeps the compression ratio close
+ * to that of one stream.
+ *
+ * Callers may themselves run on several threads (e.g. the commit
+ * pipeline), so all of them share one pool of worker threads, and the
+ * number of blocks in flight is bounded process-wide; that bounds
+ * memory to a few blocks per CPU however many files are compressed at
+ * once.
+ */
+
+#define DEFLATE_BLOCK_SIZE (1024 * 1024)
+#define DEFLATE_DICT_SIZE (32 * 1024)
+
+typedef struct {
+  GMutex lock;
+  GCond cond;
+  int level;
+} DeflateContext;
+
+typedef struct {
+  DeflateContext *ctx;
+  GBytes *input;
+  GBytes *dict;
+
+  /* Owned by the worker until done is set, under the context lock */
+  gboolean is_last;
+  guint8 *output;
+  gsize output_len;
+  gboolean failed;
+  gboolean done;
+} DeflateBlock;
+
+static void
+deflate_block_free (DeflateBlock *block)
+{
+  g_bytes_unref (block->input);
+  if (block->dict)
+    g_bytes_unref (block->dict);
+  g_free (block->output);
+  g_free (block);
+}
+
+static GThreadPool *deflate_pool;
+static GMutex budget_lock;
+static GCond budget_cond;
+static guint blocks_in_flight;
+static guint max_blocks_in_flight;
+
+static void deflate_block_thread (gpointer data,
+                                  gpointer user_data);
+
+static GThreadPool *
+get_deflate_pool (void)
+{
+  static gsize initialized;
+
+  if (g_once_init_enter (&initialized))
+    {
+      deflate_pool = ot_thread_pool_new_nproc (deflate_block_thread, NULL);
+      max_blocks_in_flight = 2 * g_thread_pool_get_max_threads (deflate_pool);
+      g_once_init_leave (&initialized, 1);
+    }
+  return deflate_pool;
+}
+
+/* Take one of the process-wide block slots.  Only waits for other
+ * callers to release one if @wait is set; a caller with blocks of its
+ * own outstanding should write those out instead.
+ */
+static gboolean
+reserve_block (gboolean wait)
+{
+  gboolean ret;
+
+  g_mutex_lock (&budget_lock);
+  while (wait && blocks_in_flight >= max_blocks_in_flight)
+    g_cond_wait (&budget_cond, &budget_lock);
+  ret = blocks_in_flight < max_blocks_in_flight;
+  if (ret)
+    blocks_in_flight++;
+  g_mutex_unlock (&budget_lock);
+
+  return ret;
+}
+
+static void
+release_block (void)
+{
+  g_mutex_lock (&budget_lock);
+  blocks_in_flight--;
+  g_cond_broadcast (&budget_cond);
+  g_mutex_unlock (&budget_lock);
+}
+
+static void
+deflate_block_thread (gpointer data,
+                      gpointer user_data)
+{
+  DeflateBlock *block = data;
+  DeflateContext *ctx = block->ctx;
+  z_stream zs = { 0, };
+  gboolean initialized = FALSE;
+  const int flush = block->is_last ? Z_FINISH : Z_SYNC_FLUSH;
+  const guint8 *input;
+  gsize input_len;
+  gsize allocated;
+
+  input = g_bytes_get_data (block->input, &input_len);
+
+  if (deflateInit2 (&zs, ctx->level, Z_DEFLATED, -MAX_WBITS, 8,
+                    Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+      block->failed = TRUE;
+      goto out;
+    }
+  initialized = TRUE;
+
+  if (block->dict)
+    {
+      gsize dict_len;
+      const guint8 *dict = g_bytes_get_data (block->dict, &dict_len);
+
+      if (dict_len > DEFLATE_DICT_SIZE)
+        {
+          dict += dict_len - DEFLATE_DICT_SIZE;
+          dict_len = DEFLATE_DICT_SIZE;
+        }
+      if (deflateSetDictionary (&zs, dict, dict_len) != Z_OK)
+        {
+          block->failed = TRUE;
+          goto out;
+        }
+    }
+
+  allocated = deflateBound (&zs, input_len) + 16;
+  block->output = g_malloc (allocated);
+  zs.next_in = (Bytef*) input;
+  zs.avail_in = input_len;
+
+  while (TRUE)
+    {
+      int zret;
+
+      zs.next_out = block->output + block->output_len;
+      zs.avail_out = allocated - block->output_len;
+      zret = deflate (&zs, flush);
+      block->output_len = allocated - zs.avail_out;
+
+      if (zret == Z_STREAM_ERROR)
+        {
+          block->failed = TRUE;
+          break;
+        }
+      else if (block->is_last ? zret == Z_STREAM_END : zs.avail_out > 0)
+        break;
+
+      allocated *= 2;
+      block->output = g_realloc (block->output, allocated);
+    }
+
+ out:
+  if (initialized)
+    (void) deflateEnd (&zs);
+  g_mutex_lock (&ctx->lock);
+  block->done = TRUE;
+  g_cond_broadcast (&ctx->cond);
+  g_mutex_unlock (&ctx->lock);
+}
+
+static gboolean
+read_block (GInputStream   *in,
+            GBytes        **out_bytes,
+            GCancellable   *cancellable,
+            GError        **error)
+{
+  gboolean ret = FALSE;
+  guint8 *buf = g_malloc (DEFLATE_BLOCK_SIZE);
+  gsize bytes_read;
+
+  if (!g_input_stream_read_all (in, buf, DEFLATE_BLOCK_SIZE, &bytes_read,
+                                cancellable, error))
+    goto out;
+
+  ret = TRUE;
+  *out_bytes = g_bytes_new_take (g_realloc (buf, bytes_read), bytes_read);
+  buf = NULL;
+ out:
+  g_free (buf);
+  return ret;
+}
+
+static void
+wait_block (DeflateContext *ctx,
+            DeflateBlock   *block)
+{
+  g_mutex_lock (&ctx->lock);
+  while (!block->done)
+    g_cond_wait (&ctx->cond, &ctx->lock);
+  g_mutex_unlock (&ctx->lock);
+}
+
+/* Write out finished blocks, in order, until no more than @max_queued
+ * remain.
+ */
+static gboolean
+write_completed_blocks (DeflateContext  *ctx,
+                        GQueue          *blocks,
+                        guint            max_queued,
+                        GOutputStream   *out,
+                        GCancellable    *cancellable,
+                        GError         **error)
+{
+  gboolean ret = FALSE;
+
+  while (g_queue_get_length (blocks) > max_queued)
+    {
+      DeflateBlock *block = g_queue_peek_head (blocks);
+      gsize bytes_written;
+
+      wait_block (ctx, block);
+
+      if (block->failed)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Failed to compress block");
+          goto out;
+        }
+
+      if (!g_output_stream_write_all (out, block->output, block->output_len,
+                                      &bytes_written, cancellable, error))
+        goto out;
+
+      deflate_block_free (g_queue_pop_head (blocks));
+      release_block ();
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/**
+ * _ostree_deflate_is_incompressible:
+ * @data: Sample of the content
+ * @len: Length of @data
+ *
+ * Compress @data at the fastest level to see whether deflate helps at
+ * all.  Content which doesn't shrink by at least 1/32 is almost always
+ * already compressed (gzip, xz, PNG, JPEG, jar...), and the highest
+ * level won't do meaningfully better; it's cheaper to store it.
+ *
+ * Returns: %TRUE if @data looks incompressible
+ */
+gboolean
+_ostree_deflate_is_incompressible (const guint8  *data,
+                                   gsize          len)
+{
+  gboolean ret = FALSE;
+  z_stream zs = { 0, };
+  guint8 *buf = NULL;
+  gsize allocated;
+
+  if (len == 0)
+    return FALSE;
+
+  if (deflateInit2 (&zs, 1, Z_DEFLATED, -MAX_WBITS, 8,
+                    Z_DEFAULT_STRATEGY) != Z_OK)
+    return FALSE;
+
+  /* deflateBound() is enough for Z_FINISH to complete in one call */
+  allocated = deflateBound (&zs, len);
+  buf = g_malloc (allocated);
+  zs.next_in = (Bytef*) data;
+  zs.avail_in = len;
+  zs.next_out = buf;
+  zs.avail_out = allocated;
+
+  if (deflate (&zs, Z_FINISH) == Z_STREAM_END)
+    ret = (allocated - zs.avail_out) >= len - len / 32;
+
+  (void) deflateEnd (&zs);
+  g_free (buf);
+  return ret;
+}
+
+/**
+ * _ostree_deflate_parallel_splice:
+ * @out: Destination
+ * @in: Uncompressed input
+ * @level: zlib compression level
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Like g_output_stream_splice() through a raw #GZlibCompressor, but
+ * compressing on multiple threads.  Input is read on the calling
+ * thread, so @in may be e.g. a checksumming stream.
+ *
+ * Returns: Number of bytes read from @in, or -1 on error
+ */
+gssize
+_ostree_deflate_parallel_splice (GOutputStream  *out,
+                                 GInputStream   *in,
+                                 int             level,
+                                 GCancellable   *cancellable,
+                                 GError        **error)
+{
+  gssize ret = -1;
+  DeflateContext ctx;
+  GThreadPool *pool;
+  GQueue blocks = G_QUEUE_INIT;
+  DeflateBlock *pending = NULL;
+  DeflateBlock *block;
+  GBytes *prev_input = NULL;
+  guint64 total_read = 0;
+
+  g_mutex_init (&ctx.lock);
+  g_cond_init (&ctx.cond);
+  ctx.level = level;
+  pool = get_deflate_pool ();
+
+  while (TRUE)
+    {
+      GBytes *input = NULL;
+      gsize input_len;
+
+      if (!read_block (in, &input, cancellable, error))
+        goto out;
+      input_len = g_bytes_get_size (input);
+
+      /* A block can only be submitted once we know whether it's the
+       * last one.  An empty input still needs one (empty) final block.
+       */
+      if (input_len == 0 && pending == NULL && total_read == 0)
+        {
+          pending = g_new0 (DeflateBlock, 1);
+          pending->ctx = &ctx;
+          pending->input = g_bytes_ref (input);
+        }
+      if (pending)
+        {
+          while (!reserve_block (g_queue_is_empty (&blocks)))
+            {
+              if (!write_completed_blocks (&ctx, &blocks, g_queue_get_length (&blocks) - 1,
+                                           out, cancellable, error))
+                {
+                  g_bytes_unref (input);
+                  goto out;
+                }
+            }
+
+          pending->is_last = input_len == 0;
+          g_queue_push_tail (&blocks, pending);
+          g_thread_pool_push (pool, pending, NULL);
+          pending = NULL;
+        }
+
+      if (input_len == 0)
+        {
+          g_bytes_unref (input);
+          break;
+        }
+
+      total_read += input_len;
+      pending = g_new0 (DeflateBlock, 1);
+      pending->ctx = &ctx;
+      pending->input = input;
+      pending->dict = prev_input;
+      prev_input = g_bytes_ref (input);
+    }
+
+  if (!write_completed_blocks (&ctx, &blocks, 0, out, cancellable, error))
+    goto out;
+
+  ret = total_read;
+ out:
+  /* The pool is shared, so wait for our remaining blocks to finish */
+  while ((block = g_queue_pop_head (&blocks)) != NULL)
+    {
+      wait_block (&ctx, block);
+      deflate_block_free (block);
+      release_block ();
+    }
+  if (pending)
+    deflate_block_free (pending);
+  if (prev_input)
+    g_bytes_unref (prev_input);
+  g_mutex_clear (&ctx.lock);
+  g_cond_clear (&ctx.cond);
+  return ret;
+}
@@ -0,0 +1,46 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2014 Colin Walters <walters@verbum.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/* Below this, a single GZlibCompressor is faster than farming out
+ * blocks to threads.
+ */
+#define _OSTREE_DEFLATE_PARALLEL_MIN_SIZE (4 * 1024 * 1024)
+
+/* Content of at least _OSTREE_DEFLATE_PROBE_MIN_SIZE is probed with
+ * _ostree_deflate_is_incompressible() on its first
+ * _OSTREE_DEFLATE_PROBE_SIZE bytes.
+ */
+#define _OSTREE_DEFLATE_PROBE_MIN_SIZE (4096)
+#define _OSTREE_DEFLATE_PROBE_SIZE (64 * 1024)
+
+gboolean _ostree_deflate_is_incompressible (const guint8  *data,
+                                            gsize          len);
+
+gssize _ostree_deflate_parallel_splice (GOutputStream  *out,
+                                        GInputStream   *in,
+                                        int             level,
+                                        GCancellable   *cancellable,
+                                        GError        **error);
+
+G_END_DECLS
@@ -26,8 +26,13 @@
 
 #include <fcntl.h>
 #include <sys/ioctl.h>
+#include <linux/fs.h>
 #include <ext2fs/ext2_fs.h>
 
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
 /**
  * _ostree_linuxfs_fd_alter_immutable_flag:
  * @fd: A file descriptor
@@ -135,3 +140,56 @@ _ostree_linuxfs_alter_immutable_flag (GFile         *path,
   return ret;
 }
 
+
+/**
+ * _ostree_linuxfs_fd_reflink:
+ * @src_fd: Source regular file
+ * @dest_fd: Destination regular file, opened for writing
+ * @out_did_reflink: (out): Whether @dest_fd now shares the extents of @src_fd
+ * @error: GError
+ *
+ * Make the contents of @dest_fd a copy-on-write clone of @src_fd, on
+ * filesystems which support it (e.g. btrfs and XFS).  If the files
+ * are on different filesystems, or the filesystem does not support
+ * cloning, @out_did_reflink is set to %FALSE and the caller should
+ * copy the data instead.
+ */
+gboolean
+_ostree_linuxfs_fd_reflink (int            src_fd,
+                            int            dest_fd,
+                            gboolean      *out_did_reflink,
+                            GError       **error)
+{
+  gboolean ret = FALSE;
+
+  *out_did_reflink = FALSE;
+
+  /* Support depends on both files' filesystems, so just try it; a
+   * failed ioctl is cheap next to the copy it would have replaced.
+   */
+  if (ioctl (dest_fd, FICLONE, src_fd) == -1)
+    {
+      int errsv = errno;
+      /* Filesystems and kernels report lack of support in different
+       * ways; EBADF and EPERM come from e.g. overlayfs, NFS and
+       * CIFS, for files an ordinary copy can still handle.
+       */
+      if (errsv == EXDEV || errsv == EOPNOTSUPP || errsv == ENOTSUP
+          || errsv == ENOTTY || errsv == EINVAL || errsv == ENOSYS
+          || errsv == EISDIR || errsv == EBADF || errsv == EPERM)
+        ;
+      else
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "ioctl(FICLONE): %s",
+                       g_strerror (errsv));
+          goto out;
+        }
+    }
+  else
+    *out_did_reflink = TRUE;
+
+  ret = TRUE;
+ out:
+  return ret;
+}
@@ -36,5 +36,11 @@ _ostree_linuxfs_alter_immutable_flag (GFile         *path,
                                       GCancellable  *cancellable,
                                       GError       **error);
 
+gboolean
+_ostree_linuxfs_fd_reflink (int            src_fd,
+                            int            dest_fd,
+                            gboolean      *out_did_reflink,
+                            GError       **error);
+
 G_END_DECLS
 
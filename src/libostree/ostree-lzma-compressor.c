@@ -81,7 +81,7 @@ _ostree_lzma_compressor_set_property (GObject      *object,
   switch (prop_id)
     {
     case PROP_PARAMS:
-      self->params = g_value_get_variant (value);
+      self->params = g_value_dup_variant (value);
       break;
 
     default:
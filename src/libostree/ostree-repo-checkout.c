@@ -31,6 +31,7 @@
 #include "ostree-repo-file.h"
 #include "ostree-core-private.h"
 #include "ostree-repo-private.h"
+#include "ostree-linuxfsutil.h"
 
 static gboolean
 checkout_object_for_uncompressed_cache (OstreeRepo      *self,
@@ -64,13 +65,16 @@ checkout_object_for_uncompressed_cache (OstreeRepo      *self,
 
   fd = g_file_descriptor_based_get_fd ((GFileDescriptorBased*)temp_out);
 
-  do
-    res = fsync (fd);
-  while (G_UNLIKELY (res == -1 && errno == EINTR));
-  if (G_UNLIKELY (res == -1))
+  if (_ostree_repo_fsync_each_file (self))
     {
-      ot_util_set_error_from_errno (error, errno);
-      goto out;
+      do
+        res = fsync (fd);
+      while (G_UNLIKELY (res == -1 && errno == EINTR));
+      if (G_UNLIKELY (res == -1))
+        {
+          ot_util_set_error_from_errno (error, errno);
+          goto out;
+        }
     }
 
   if (!g_output_stream_close (temp_out, cancellable, error))
@@ -100,7 +104,8 @@ checkout_object_for_uncompressed_cache (OstreeRepo      *self,
 }
 
 static gboolean
-write_regular_file_content (OstreeRepoCheckoutMode mode,
+write_regular_file_content (OstreeRepo            *repo,
+                            OstreeRepoCheckoutMode mode,
                             GOutputStream         *output,
                             GFileInfo             *file_info,
                             GVariant              *xattrs,
@@ -109,17 +114,31 @@ write_regular_file_content (OstreeRepoCheckoutMode mode,
                             GError               **error)
 {
   gboolean ret = FALSE;
+  gboolean did_reflink = FALSE;
   int fd;
   int res;
 
-  if (g_output_stream_splice (output, input, 0,
-                              cancellable, error) < 0)
-    goto out;
+  fd = g_file_descriptor_based_get_fd ((GFileDescriptorBased*)output);
 
-  if (!g_output_stream_flush (output, cancellable, error))
-    goto out;
+  /* For objects stored uncompressed, try to share their extents
+   * rather than copying the data.
+   */
+  if (G_IS_FILE_DESCRIPTOR_BASED (input))
+    {
+      if (!_ostree_linuxfs_fd_reflink (g_file_descriptor_based_get_fd ((GFileDescriptorBased*)input),
+                                       fd, &did_reflink, error))
+        goto out;
+    }
 
-  fd = g_file_descriptor_based_get_fd ((GFileDescriptorBased*)output);
+  if (!did_reflink)
+    {
+      if (g_output_stream_splice (output, input, 0,
+                                  cancellable, error) < 0)
+        goto out;
+
+      if (!g_output_stream_flush (output, cancellable, error))
+        goto out;
+    }
 
   if (mode != OSTREE_REPO_CHECKOUT_MODE_USER)
     {
@@ -150,10 +169,13 @@ write_regular_file_content (OstreeRepoCheckoutMode mode,
         }
     }
           
-  if (fsync (fd) == -1)
+  if (_ostree_repo_fsync_each_file (repo))
     {
-      ot_util_set_error_from_errno (error, errno);
-      goto out;
+      if (fsync (fd) == -1)
+        {
+          ot_util_set_error_from_errno (error, errno);
+          goto out;
+        }
     }
           
   if (!g_output_stream_close (output, cancellable, error))
@@ -165,7 +187,8 @@ write_regular_file_content (OstreeRepoCheckoutMode mode,
 }
 
 static gboolean
-checkout_file_from_input_at (OstreeRepoCheckoutMode mode,
+checkout_file_from_input_at (OstreeRepo     *repo,
+                             OstreeRepoCheckoutMode mode,
                              GFileInfo      *file_info,
                              GVariant       *xattrs,
                              GInputStream   *input,
@@ -219,7 +242,7 @@ checkout_file_from_input_at (OstreeRepoCheckoutMode mode,
       temp_out = g_unix_output_stream_new (fd, TRUE);
       fd = -1; /* Transfer ownership */
 
-      if (!write_regular_file_content (mode, temp_out, file_info, xattrs, input,
+      if (!write_regular_file_content (repo, mode, temp_out, file_info, xattrs, input,
                                        cancellable, error))
         goto out;
     }
@@ -236,7 +259,8 @@ checkout_file_from_input_at (OstreeRepoCheckoutMode mode,
  * it into place.  This implements union-like behavior.
  */
 static gboolean
-checkout_file_unioning_from_input_at (OstreeRepoCheckoutMode mode,
+checkout_file_unioning_from_input_at (OstreeRepo     *repo,
+                                      OstreeRepoCheckoutMode mode,
                                       GFileInfo      *file_info,
                                       GVariant       *xattrs,
                                       GInputStream   *input,
@@ -279,7 +303,7 @@ checkout_file_unioning_from_input_at (OstreeRepoCheckoutMode mode,
                                       cancellable, error))
         goto out;
 
-      if (!write_regular_file_content (mode, temp_out, file_info, xattrs, input,
+      if (!write_regular_file_content (repo, mode, temp_out, file_info, xattrs, input,
                                        cancellable, error))
         goto out;
     }
@@ -408,7 +432,12 @@ checkout_one_file_at (OstreeRepo                        *repo,
                                            cancellable, error))
                 goto out;
               if (did_hardlink)
-                break;
+                {
+                  if (is_archive_z2_with_cache)
+                    _ostree_repo_uncompressed_cache_touch (current_repo, checksum,
+                                                           g_file_info_get_size (source_info));
+                  break;
+                }
             }
           current_repo = current_repo->parent_repo;
         }
@@ -465,6 +494,9 @@ checkout_one_file_at (OstreeRepo                        *repo,
       }
       g_mutex_unlock (&repo->cache_lock);
 
+      _ostree_repo_uncompressed_cache_touch (repo, checksum,
+                                             g_file_info_get_size (source_info));
+
       if (!checkout_file_hardlink (repo, mode, overwrite_mode, loose_path_buf,
                                    destination_dfd, destination_name,
                                    FALSE, &did_hardlink,
@@ -484,7 +516,7 @@ checkout_one_file_at (OstreeRepo                        *repo,
 
       if (overwrite_mode == OSTREE_REPO_CHECKOUT_OVERWRITE_UNION_FILES)
         {
-          if (!checkout_file_unioning_from_input_at (mode, source_info, xattrs, input,
+          if (!checkout_file_unioning_from_input_at (repo, mode, source_info, xattrs, input,
                                                      destination_dfd, destination_parent,
                                                      destination_name,
                                                      cancellable, error)) 
@@ -495,7 +527,7 @@ checkout_one_file_at (OstreeRepo                        *repo,
         }
       else
         {
-          if (!checkout_file_from_input_at (mode, source_info, xattrs, input,
+          if (!checkout_file_from_input_at (repo, mode, source_info, xattrs, input,
                                             destination_dfd, destination_parent,
                                             destination_name,
                                             cancellable, error))
@@ -518,38 +550,28 @@ checkout_one_file_at (OstreeRepo                        *repo,
 }
 
 /*
- * checkout_tree_at:
- * @self: Repo
- * @mode: Options controlling all files
- * @overwrite_mode: Whether or not to overwrite files
- * @destination_parent_fd: Place tree here
- * @destination_name: Use this name for tree
- * @source: Source tree
- * @source_info: Source info
- * @cancellable: Cancellable
- * @error: Error
+ * checkout_dir_begin:
  *
- * Like ostree_repo_checkout_tree(), but check out @source into the
- * relative @destination_name, located by @destination_parent_fd.
+ * Create @destination_name, or with union checkouts, reuse it if it
+ * already exists.  The directory is returned open in
+ * @out_destination_dfd.
  */
 static gboolean
-checkout_tree_at (OstreeRepo                        *self,
-                  OstreeRepoCheckoutMode             mode,
-                  OstreeRepoCheckoutOverwriteMode    overwrite_mode,
-                  int                                destination_parent_fd,
-                  const char                        *destination_name,
-                  GFile                             *destination,
-                  OstreeRepoFile                    *source,
-                  GFileInfo                         *source_info,
-                  GCancellable                      *cancellable,
-                  GError                           **error)
+checkout_dir_begin (OstreeRepoCheckoutMode             mode,
+                    OstreeRepoCheckoutOverwriteMode    overwrite_mode,
+                    int                                destination_parent_fd,
+                    const char                        *destination_name,
+                    OstreeRepoFile                    *source,
+                    gboolean                          *out_did_exist,
+                    int                               *out_destination_dfd,
+                    GCancellable                      *cancellable,
+                    GError                           **error)
 {
   gboolean ret = FALSE;
   gboolean did_exist = FALSE;
   int destination_dfd = -1;
   int res;
   gs_unref_variant GVariant *xattrs = NULL;
-  gs_unref_object GFileEnumerator *dir_enum = NULL;
 
   /* Create initially with mode 0700, then chown/chmod only when we're
    * done.  This avoids anyone else being able to operate on partially
@@ -587,6 +609,119 @@ checkout_tree_at (OstreeRepo                        *self,
         }
     }
 
+  ret = TRUE;
+  *out_did_exist = did_exist;
+  *out_destination_dfd = destination_dfd;
+  destination_dfd = -1;
+ out:
+  if (destination_dfd != -1)
+    (void) close (destination_dfd);
+  return ret;
+}
+
+/*
+ * checkout_dir_finish:
+ *
+ * Called once everything in @destination_dfd has been checked out.
+ */
+static gboolean
+checkout_dir_finish (OstreeRepo                        *self,
+                     OstreeRepoCheckoutMode             mode,
+                     int                                destination_dfd,
+                     GFileInfo                         *source_info,
+                     gboolean                           did_exist,
+                     GCancellable                      *cancellable,
+                     GError                           **error)
+{
+  gboolean ret = FALSE;
+  int res;
+
+  /* We do fchmod/fchown last so that no one else could access the
+   * partially created directory and change content we're laying out.
+   */
+  if (!did_exist)
+    {
+      do
+        res = fchmod (destination_dfd,
+                      g_file_info_get_attribute_uint32 (source_info, "unix::mode"));
+      while (G_UNLIKELY (res == -1 && errno == EINTR));
+      if (G_UNLIKELY (res == -1))
+        {
+          ot_util_set_error_from_errno (error, errno);
+          goto out;
+        }
+    }
+
+  if (!did_exist && mode != OSTREE_REPO_CHECKOUT_MODE_USER)
+    {
+      do
+        res = fchown (destination_dfd,
+                      g_file_info_get_attribute_uint32 (source_info, "unix::uid"),
+                      g_file_info_get_attribute_uint32 (source_info, "unix::gid"));
+      while (G_UNLIKELY (res == -1 && errno == EINTR));
+      if (G_UNLIKELY (res == -1))
+        {
+          ot_util_set_error_from_errno (error, errno);
+          goto out;
+        }
+    }
+
+  /* Finally, fsync to ensure all entries are on disk.  With batched
+   * fsync, ostree_repo_checkout_tree() does this once for the whole
+   * tree.
+   */
+  if (_ostree_repo_fsync_each_file (self))
+    {
+    if (fsync (destination_dfd) == -1)
+      {
+        ot_util_set_error_from_errno (error, errno);
+        goto out;
+      }
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/*
+ * checkout_tree_at:
+ * @self: Repo
+ * @mode: Options controlling all files
+ * @overwrite_mode: Whether or not to overwrite files
+ * @destination_parent_fd: Place tree here
+ * @destination_name: Use this name for tree
+ * @source: Source tree
+ * @source_info: Source info
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Like ostree_repo_checkout_tree(), but check out @source into the
+ * relative @destination_name, located by @destination_parent_fd.
+ */
+static gboolean
+checkout_tree_at (OstreeRepo                        *self,
+                  OstreeRepoCheckoutMode             mode,
+                  OstreeRepoCheckoutOverwriteMode    overwrite_mode,
+                  int                                destination_parent_fd,
+                  const char                        *destination_name,
+                  GFile                             *destination,
+                  OstreeRepoFile                    *source,
+                  GFileInfo                         *source_info,
+                  GCancellable                      *cancellable,
+                  GError                           **error)
+{
+  gboolean ret = FALSE;
+  gboolean did_exist = FALSE;
+  int destination_dfd = -1;
+  gs_unref_object GFileEnumerator *dir_enum = NULL;
+
+  if (!checkout_dir_begin (mode, overwrite_mode,
+                           destination_parent_fd, destination_name, source,
+                           &did_exist, &destination_dfd,
+                           cancellable, error))
+    goto out;
+
   if (g_file_info_get_file_type (source_info) != G_FILE_TYPE_DIRECTORY)
     {
       ret = checkout_one_file_at (self, (GFile *) source,
@@ -638,47 +773,319 @@ checkout_tree_at (OstreeRepo                        *self,
         }
     }
 
-  /* We do fchmod/fchown last so that no one else could access the
-   * partially created directory and change content we're laying out.
-   */
-  if (!did_exist)
+  if (!checkout_dir_finish (self, mode, destination_dfd, source_info, did_exist,
+                            cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  if (destination_dfd != -1)
+    (void) close (destination_dfd);
+  return ret;
+}
+
+/*
+ * A parallel checkout runs one task per directory on a thread pool.
+ * A task creates its directory, checks out the files in it, and
+ * queues a new task for each subdirectory, so idle threads pick up
+ * whichever part of the tree is next.
+ *
+ * Each task counts itself plus its unfinished subdirectories in
+ * @pending; whichever thread drops that to zero does the final
+ * fchmod/fchown/fsync via checkout_dir_finish() and then releases
+ * the parent.  So as with checkout_tree_at(), a directory keeps mode
+ * 0700 until everything below it is complete.
+ *
+ * A wide tree can have far more directories waiting to finish than
+ * we may have fds, so a task only keeps its directory open while
+ * checking out its files.  Subdirectories are created by path, and
+ * the directory is reopened by path to be finished.
+ */
+typedef struct _CheckoutDirTask CheckoutDirTask;
+
+struct _CheckoutDirTask {
+  CheckoutDirTask *parent;
+  GFile *destination;
+  OstreeRepoFile *source;
+  GFileInfo *source_info;
+
+  gboolean did_begin;
+  gboolean did_exist;
+  volatile gint pending;
+};
+
+typedef struct {
+  OstreeRepo *repo;
+  OstreeRepoCheckoutMode mode;
+  OstreeRepoCheckoutOverwriteMode overwrite_mode;
+  GThreadPool *pool;
+  GCancellable *cancellable;
+
+  volatile gint failed;
+  GMutex lock;
+  GCond cond;
+  gboolean done;
+  GError *error;
+} ParallelCheckout;
+
+static CheckoutDirTask *
+checkout_dir_task_new (CheckoutDirTask  *parent,
+                       GFile            *destination,
+                       OstreeRepoFile   *source,
+                       GFileInfo        *source_info)
+{
+  CheckoutDirTask *task = g_new0 (CheckoutDirTask, 1);
+
+  task->parent = parent;
+  task->destination = g_object_ref (destination);
+  task->source = g_object_ref (source);
+  task->source_info = g_object_ref (source_info);
+  task->pending = 1;
+
+  if (parent)
+    g_atomic_int_inc (&parent->pending);
+
+  return task;
+}
+
+static void
+checkout_dir_task_free (CheckoutDirTask *task)
+{
+  g_object_unref (task->destination);
+  g_object_unref (task->source);
+  g_object_unref (task->source_info);
+  g_free (task);
+}
+
+static void
+parallel_checkout_set_error (ParallelCheckout  *checkout,
+                             GError            *error)
+{
+  g_mutex_lock (&checkout->lock);
+  if (checkout->error == NULL)
+    checkout->error = error;
+  else
+    g_error_free (error);
+  g_mutex_unlock (&checkout->lock);
+
+  g_atomic_int_set (&checkout->failed, TRUE);
+}
+
+static gboolean
+checkout_dir_task_run (ParallelCheckout  *checkout,
+                       CheckoutDirTask   *task,
+                       GError           **error)
+{
+  gboolean ret = FALSE;
+  GCancellable *cancellable = checkout->cancellable;
+  gs_unref_object GFileEnumerator *dir_enum = NULL;
+  int destination_dfd = -1;
+
+  if (!checkout_dir_begin (checkout->mode, checkout->overwrite_mode,
+                           AT_FDCWD, gs_file_get_path_cached (task->destination),
+                           task->source,
+                           &task->did_exist, &destination_dfd,
+                           cancellable, error))
+    goto out;
+  task->did_begin = TRUE;
+
+  dir_enum = g_file_enumerate_children ((GFile*)task->source,
+                                        OSTREE_GIO_FAST_QUERYINFO,
+                                        G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                        cancellable,
+                                        error);
+  if (!dir_enum)
+    goto out;
+
+  while (!g_atomic_int_get (&checkout->failed))
     {
-      do
-        res = fchmod (destination_dfd,
-                      g_file_info_get_attribute_uint32 (source_info, "unix::mode"));
-      while (G_UNLIKELY (res == -1 && errno == EINTR));
-      if (G_UNLIKELY (res == -1))
+      GFileInfo *file_info;
+      GFile *src_child;
+      const char *name;
+
+      if (!gs_file_enumerator_iterate (dir_enum, &file_info, &src_child,
+                                       cancellable, error))
+        goto out;
+      if (file_info == NULL)
+        break;
+
+      name = g_file_info_get_name (file_info);
+
+      if (g_file_info_get_file_type (file_info) == G_FILE_TYPE_DIRECTORY)
         {
-          ot_util_set_error_from_errno (error, errno);
-          goto out;
+          gs_unref_object GFile *child_destination = g_file_get_child (task->destination, name);
+
+          /* Resolve it here, so other threads only read our tree */
+          if (!ostree_repo_file_ensure_resolved ((OstreeRepoFile*)src_child, error))
+            goto out;
+
+          g_thread_pool_push (checkout->pool,
+                              checkout_dir_task_new (task, child_destination,
+                                                     (OstreeRepoFile*)src_child,
+                                                     file_info),
+                              NULL);
+        }
+      else
+        {
+          if (!checkout_one_file_at (checkout->repo, src_child, file_info,
+                                     destination_dfd, task->destination, name,
+                                     checkout->mode, checkout->overwrite_mode,
+                                     cancellable, error))
+            goto out;
         }
     }
 
-  if (!did_exist && mode != OSTREE_REPO_CHECKOUT_MODE_USER)
+  ret = TRUE;
+ out:
+  if (destination_dfd != -1)
+    (void) close (destination_dfd);
+  return ret;
+}
+
+static gboolean
+checkout_dir_task_finish (ParallelCheckout  *checkout,
+                          CheckoutDirTask   *task,
+                          GError           **error)
+{
+  gboolean ret = FALSE;
+  int destination_dfd = -1;
+
+  if (!gs_file_open_dir_fd (task->destination, &destination_dfd,
+                            checkout->cancellable, error))
+    goto out;
+
+  if (!checkout_dir_finish (checkout->repo, checkout->mode,
+                            destination_dfd, task->source_info,
+                            task->did_exist,
+                            checkout->cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  if (destination_dfd != -1)
+    (void) close (destination_dfd);
+  return ret;
+}
+
+/* Drop one pending reference on @task, finishing it and then its
+ * parents as each becomes complete.
+ */
+static void
+checkout_dir_task_complete (ParallelCheckout  *checkout,
+                            CheckoutDirTask   *task)
+{
+  while (task && g_atomic_int_dec_and_test (&task->pending))
     {
-      do
-        res = fchown (destination_dfd,
-                      g_file_info_get_attribute_uint32 (source_info, "unix::uid"),
-                      g_file_info_get_attribute_uint32 (source_info, "unix::gid"));
-      while (G_UNLIKELY (res == -1 && errno == EINTR));
-      if (G_UNLIKELY (res == -1))
+      CheckoutDirTask *parent = task->parent;
+      GError *local_error = NULL;
+
+      if (task->did_begin && !g_atomic_int_get (&checkout->failed))
         {
-          ot_util_set_error_from_errno (error, errno);
-          goto out;
+          if (!checkout_dir_task_finish (checkout, task, &local_error))
+            parallel_checkout_set_error (checkout, local_error);
+        }
+      checkout_dir_task_free (task);
+
+      if (parent == NULL)
+        {
+          g_mutex_lock (&checkout->lock);
+          checkout->done = TRUE;
+          g_cond_signal (&checkout->cond);
+          g_mutex_unlock (&checkout->lock);
         }
+
+      task = parent;
     }
+}
 
-  /* Finally, fsync to ensure all entries are on disk.  Ultimately
-   * this should be configurable for the case where we're constructing
-   * buildroots.
-   */
-  if (!self->disable_fsync)
+static void
+checkout_dir_thread (gpointer   data,
+                     gpointer   user_data)
+{
+  CheckoutDirTask *task = data;
+  ParallelCheckout *checkout = user_data;
+  GError *local_error = NULL;
+
+  if (!g_atomic_int_get (&checkout->failed))
     {
-    if (fsync (destination_dfd) == -1)
-      {
-        ot_util_set_error_from_errno (error, errno);
+      if (!checkout_dir_task_run (checkout, task, &local_error))
+        parallel_checkout_set_error (checkout, local_error);
+    }
+
+  checkout_dir_task_complete (checkout, task);
+}
+
+static gboolean
+checkout_tree_parallel (OstreeRepo                        *self,
+                        OstreeRepoCheckoutMode             mode,
+                        OstreeRepoCheckoutOverwriteMode    overwrite_mode,
+                        GFile                             *destination,
+                        OstreeRepoFile                    *source,
+                        GFileInfo                         *source_info,
+                        GCancellable                      *cancellable,
+                        GError                           **error)
+{
+  ParallelCheckout checkout = { 0, };
+
+  if (!ostree_repo_file_ensure_resolved (source, error))
+    return FALSE;
+
+  checkout.repo = self;
+  checkout.mode = mode;
+  checkout.overwrite_mode = overwrite_mode;
+  checkout.cancellable = cancellable;
+  g_mutex_init (&checkout.lock);
+  g_cond_init (&checkout.cond);
+  checkout.pool = ot_thread_pool_new_nproc (checkout_dir_thread, &checkout);
+
+  g_thread_pool_push (checkout.pool,
+                      checkout_dir_task_new (NULL, destination, source, source_info),
+                      NULL);
+
+  g_mutex_lock (&checkout.lock);
+  while (!checkout.done)
+    g_cond_wait (&checkout.cond, &checkout.lock);
+  g_mutex_unlock (&checkout.lock);
+
+  g_thread_pool_free (checkout.pool, FALSE, TRUE);
+  g_mutex_clear (&checkout.lock);
+  g_cond_clear (&checkout.cond);
+
+  if (checkout.error)
+    {
+      g_propagate_error (error, checkout.error);
+      return FALSE;
+    }
+  return TRUE;
+}
+
+/* With batched fsync, this is the barrier for a checkout, and for
+ * any objects we unpacked into the uncompressed cache.
+ */
+static gboolean
+checkout_syncfs (OstreeRepo               *self,
+                 OstreeRepoCheckoutMode    mode,
+                 GFile                    *destination,
+                 GCancellable             *cancellable,
+                 GError                  **error)
+{
+  gboolean ret = FALSE;
+  int destination_dfd = -1;
+
+  if (!self->batch_fsync)
+    return TRUE;
+
+  if (!gs_file_open_dir_fd (destination, &destination_dfd, cancellable, error))
+    goto out;
+  if (!_ostree_repo_syncfs (self, destination_dfd, cancellable, error))
+    goto out;
+
+  if (mode == OSTREE_REPO_CHECKOUT_MODE_USER
+      && self->uncompressed_objects_dir_fd != -1)
+    {
+      if (!_ostree_repo_syncfs (self, self->uncompressed_objects_dir_fd,
+                                cancellable, error))
         goto out;
-      }
     }
 
   ret = TRUE;
@@ -714,12 +1121,407 @@ ostree_repo_checkout_tree (OstreeRepo               *self,
                            GCancellable             *cancellable,
                            GError                  **error)
 {
-  return checkout_tree_at (self, mode, overwrite_mode,
-                           AT_FDCWD,
-                           gs_file_get_path_cached (destination),
-                           destination,
-                           source, source_info,
-                           cancellable, error);
+  return ostree_repo_checkout_tree_full (self, mode, overwrite_mode,
+                                         OSTREE_REPO_CHECKOUT_FLAGS_NONE,
+                                         destination, source, source_info,
+                                         cancellable, error);
+}
+
+/**
+ * ostree_repo_checkout_tree_full:
+ * @self: Repo
+ * @mode: Options controlling all files
+ * @overwrite_mode: Whether or not to overwrite files
+ * @flags: Options controlling how the checkout is performed
+ * @destination: Place tree here
+ * @source: Source tree
+ * @source_info: Source info
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Like ostree_repo_checkout_tree(), but with additional @flags.
+ * With %OSTREE_REPO_CHECKOUT_FLAGS_PARALLEL, directories are checked
+ * out on several threads; each directory still only becomes
+ * accessible once all of its contents are in place.
+ */
+gboolean
+ostree_repo_checkout_tree_full (OstreeRepo               *self,
+                                OstreeRepoCheckoutMode    mode,
+                                OstreeRepoCheckoutOverwriteMode    overwrite_mode,
+                                OstreeRepoCheckoutFlags   flags,
+                                GFile                    *destination,
+                                OstreeRepoFile           *source,
+                                GFileInfo                *source_info,
+                                GCancellable             *cancellable,
+                                GError                  **error)
+{
+  gboolean ret = FALSE;
+
+  if ((flags & OSTREE_REPO_CHECKOUT_FLAGS_PARALLEL) != 0
+      && g_file_info_get_file_type (source_info) == G_FILE_TYPE_DIRECTORY)
+    {
+      if (!checkout_tree_parallel (self, mode, overwrite_mode,
+                                   destination, source, source_info,
+                                   cancellable, error))
+        goto out;
+    }
+  else
+    {
+      if (!checkout_tree_at (self, mode, overwrite_mode,
+                             AT_FDCWD,
+                             gs_file_get_path_cached (destination),
+                             destination,
+                             source, source_info,
+                             cancellable, error))
+        goto out;
+    }
+
+  if (mode == OSTREE_REPO_CHECKOUT_MODE_USER)
+    {
+      if (!_ostree_repo_uncompressed_cache_flush (self, FALSE, cancellable, error))
+        goto out;
+    }
+
+  if (!checkout_syncfs (self, mode, destination, cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/* Remove the extended attributes named in @from_xattrs but not in
+ * @to_xattrs from @dfd; setting @to_xattrs only adds and replaces.
+ */
+static gboolean
+remove_dropped_xattrs (int            dfd,
+                       GVariant      *from_xattrs,
+                       GVariant      *to_xattrs,
+                       GError       **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_hashtable GHashTable *to_names = NULL;
+  gsize i, n;
+
+  to_names = g_hash_table_new (g_str_hash, g_str_equal);
+  if (to_xattrs)
+    {
+      n = g_variant_n_children (to_xattrs);
+      for (i = 0; i < n; i++)
+        {
+          const char *name;
+
+          g_variant_get_child (to_xattrs, i, "(^&ay@ay)", &name, NULL);
+          g_hash_table_add (to_names, (char*)name);
+        }
+    }
+
+  n = g_variant_n_children (from_xattrs);
+  for (i = 0; i < n; i++)
+    {
+      const char *name;
+
+      g_variant_get_child (from_xattrs, i, "(^&ay@ay)", &name, NULL);
+      if (g_hash_table_contains (to_names, name))
+        continue;
+
+      if (fremovexattr (dfd, name) == -1 && errno != ENODATA)
+        {
+          ot_util_set_error_from_errno (error, errno);
+          goto out;
+        }
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/*
+ * checkout_update_dir_at:
+ *
+ * Turn @destination_dfd, a checkout of @from, into a checkout of @to.
+ * Subdirectories with the same contents in both are skipped without
+ * being read, and only entries which differ are replaced.
+ */
+static gboolean
+checkout_update_dir_at (OstreeRepo                        *self,
+                        OstreeRepoCheckoutMode             mode,
+                        int                                destination_dfd,
+                        GFile                             *destination,
+                        OstreeRepoFile                    *from,
+                        OstreeRepoFile                    *to,
+                        GFileInfo                         *to_info,
+                        GCancellable                      *cancellable,
+                        GError                           **error)
+{
+  gboolean ret = FALSE;
+  gboolean contents_changed;
+  gboolean metadata_changed;
+  gs_unref_hashtable GHashTable *from_children = NULL;
+  gs_unref_object GFileEnumerator *dir_enum = NULL;
+  GHashTableIter hashiter;
+  gpointer hkey, hvalue;
+
+  if (!ostree_repo_file_ensure_resolved (from, error))
+    goto out;
+  if (!ostree_repo_file_ensure_resolved (to, error))
+    goto out;
+
+  contents_changed = strcmp (ostree_repo_file_tree_get_contents_checksum (from),
+                             ostree_repo_file_tree_get_contents_checksum (to)) != 0;
+  metadata_changed = strcmp (ostree_repo_file_tree_get_metadata_checksum (from),
+                             ostree_repo_file_tree_get_metadata_checksum (to)) != 0;
+
+  if (contents_changed)
+    {
+      from_children = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                             g_free, g_object_unref);
+
+      dir_enum = g_file_enumerate_children ((GFile*)from, OSTREE_GIO_FAST_QUERYINFO,
+                                            G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                            cancellable, error);
+      if (!dir_enum)
+        goto out;
+
+      while (TRUE)
+        {
+          GFileInfo *file_info;
+
+          if (!gs_file_enumerator_iterate (dir_enum, &file_info, NULL,
+                                           cancellable, error))
+            goto out;
+          if (file_info == NULL)
+            break;
+
+          g_hash_table_insert (from_children, g_strdup (g_file_info_get_name (file_info)),
+                               g_object_ref (file_info));
+        }
+      g_clear_object (&dir_enum);
+
+      dir_enum = g_file_enumerate_children ((GFile*)to, OSTREE_GIO_FAST_QUERYINFO,
+                                            G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                            cancellable, error);
+      if (!dir_enum)
+        goto out;
+
+      while (TRUE)
+        {
+          GFileInfo *file_info;
+          GFileInfo *from_info;
+          GFile *to_child;
+          GFileType type;
+          GFileType from_type;
+          const char *name;
+          gs_unref_object GFile *from_child = NULL;
+          gs_unref_object GFile *child_destination = NULL;
+
+          if (!gs_file_enumerator_iterate (dir_enum, &file_info, &to_child,
+                                           cancellable, error))
+            goto out;
+          if (file_info == NULL)
+            break;
+
+          name = g_file_info_get_name (file_info);
+          type = g_file_info_get_file_type (file_info);
+          from_info = g_hash_table_lookup (from_children, name);
+          from_type = from_info ? g_file_info_get_file_type (from_info) : G_FILE_TYPE_UNKNOWN;
+          from_child = g_file_get_child ((GFile*)from, name);
+          child_destination = g_file_get_child (destination, name);
+
+          if (from_type == G_FILE_TYPE_DIRECTORY && type == G_FILE_TYPE_DIRECTORY)
+            {
+              int child_dfd = -1;
+              gboolean child_ok;
+
+              if (!gs_file_open_dir_fd_at (destination_dfd, name, &child_dfd,
+                                           cancellable, error))
+                goto out;
+              child_ok = checkout_update_dir_at (self, mode, child_dfd, child_destination,
+                                                 (OstreeRepoFile*)from_child,
+                                                 (OstreeRepoFile*)to_child, file_info,
+                                                 cancellable, error);
+              (void) close (child_dfd);
+              if (!child_ok)
+                goto out;
+            }
+          else if (from_info != NULL
+                   && from_type != G_FILE_TYPE_DIRECTORY && type != G_FILE_TYPE_DIRECTORY
+                   && strcmp (ostree_repo_file_get_checksum ((OstreeRepoFile*)from_child),
+                              ostree_repo_file_get_checksum ((OstreeRepoFile*)to_child)) == 0)
+            {
+              /* Unchanged file */
+            }
+          else
+            {
+              /* Files replace files atomically; anything else goes first */
+              if (from_type == G_FILE_TYPE_DIRECTORY)
+                {
+                  if (!gs_shutil_rm_rf (child_destination, cancellable, error))
+                    goto out;
+                }
+              else if (from_info != NULL && type == G_FILE_TYPE_DIRECTORY)
+                {
+                  if (unlinkat (destination_dfd, name, 0) == -1)
+                    {
+                      ot_util_set_error_from_errno (error, errno);
+                      goto out;
+                    }
+                }
+
+              if (type == G_FILE_TYPE_DIRECTORY)
+                {
+                  if (!checkout_tree_at (self, mode, OSTREE_REPO_CHECKOUT_OVERWRITE_NONE,
+                                         destination_dfd, name, child_destination,
+                                         (OstreeRepoFile*)to_child, file_info,
+                                         cancellable, error))
+                    goto out;
+                }
+              else
+                {
+                  if (!checkout_one_file_at (self, to_child, file_info,
+                                             destination_dfd, destination, name,
+                                             mode, OSTREE_REPO_CHECKOUT_OVERWRITE_UNION_FILES,
+                                             cancellable, error))
+                    goto out;
+                }
+            }
+
+          g_hash_table_remove (from_children, name);
+        }
+
+      /* Whatever is left was removed in @to */
+      g_hash_table_iter_init (&hashiter, from_children);
+      while (g_hash_table_iter_next (&hashiter, &hkey, &hvalue))
+        {
+          const char *name = hkey;
+          GFileInfo *from_info = hvalue;
+
+          if (g_file_info_get_file_type (from_info) == G_FILE_TYPE_DIRECTORY)
+            {
+              gs_unref_object GFile *child_destination = g_file_get_child (destination, name);
+
+              if (!gs_shutil_rm_rf (child_destination, cancellable, error))
+                goto out;
+            }
+          else if (unlinkat (destination_dfd, name, 0) == -1)
+            {
+              ot_util_set_error_from_errno (error, errno);
+              goto out;
+            }
+        }
+    }
+
+  if (metadata_changed)
+    {
+      gs_unref_variant GVariant *from_xattrs = NULL;
+      gs_unref_variant GVariant *xattrs = NULL;
+
+      if (mode != OSTREE_REPO_CHECKOUT_MODE_USER)
+        {
+          if (!ostree_repo_file_get_xattrs (from, &from_xattrs, NULL, error))
+            goto out;
+          if (!ostree_repo_file_get_xattrs (to, &xattrs, NULL, error))
+            goto out;
+
+          if (from_xattrs)
+            {
+              if (!remove_dropped_xattrs (destination_dfd, from_xattrs, xattrs, error))
+                goto out;
+            }
+          if (xattrs)
+            {
+              if (!gs_fd_set_all_xattrs (destination_dfd, xattrs, cancellable, error))
+                goto out;
+            }
+        }
+
+      if (!checkout_dir_finish (self, mode, destination_dfd, to_info, FALSE,
+                                cancellable, error))
+        goto out;
+    }
+  else if (contents_changed && _ostree_repo_fsync_each_file (self))
+    {
+      if (fsync (destination_dfd) == -1)
+        {
+          ot_util_set_error_from_errno (error, errno);
+          goto out;
+        }
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/**
+ * ostree_repo_checkout_tree_update:
+ * @self: Repo
+ * @mode: Options controlling all files
+ * @destination: An existing checkout of @from_source
+ * @from_source: Source tree currently checked out in @destination
+ * @source: Source tree
+ * @source_info: Source info
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Update @destination, which must be an unmodified checkout of the
+ * directory @from_source made with the same @mode, to a checkout of
+ * @source.  Both trees are walked together, and any subdirectory
+ * whose contents are the same in both is skipped without being read,
+ * so the cost is proportional to the size of the change rather than
+ * the size of the tree.  Changed files are replaced atomically.
+ */
+gboolean
+ostree_repo_checkout_tree_update (OstreeRepo               *self,
+                                  OstreeRepoCheckoutMode    mode,
+                                  GFile                    *destination,
+                                  OstreeRepoFile           *from_source,
+                                  OstreeRepoFile           *source,
+                                  GFileInfo                *source_info,
+                                  GCancellable             *cancellable,
+                                  GError                  **error)
+{
+  gboolean ret = FALSE;
+  int destination_dfd = -1;
+  gs_unref_object GFileInfo *from_info = NULL;
+
+  from_info = g_file_query_info ((GFile*)from_source, OSTREE_GIO_FAST_QUERYINFO,
+                                 G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                 cancellable, error);
+  if (!from_info)
+    goto out;
+
+  if (g_file_info_get_file_type (from_info) != G_FILE_TYPE_DIRECTORY
+      || g_file_info_get_file_type (source_info) != G_FILE_TYPE_DIRECTORY)
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NOT_DIRECTORY,
+                           "Can only update a checkout of a directory");
+      goto out;
+    }
+
+  if (!gs_file_open_dir_fd (destination, &destination_dfd, cancellable, error))
+    goto out;
+
+  if (!checkout_update_dir_at (self, mode, destination_dfd, destination,
+                               from_source, source, source_info,
+                               cancellable, error))
+    goto out;
+
+  if (mode == OSTREE_REPO_CHECKOUT_MODE_USER)
+    {
+      if (!_ostree_repo_uncompressed_cache_flush (self, FALSE, cancellable, error))
+        goto out;
+    }
+
+  if (!checkout_syncfs (self, mode, destination, cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  if (destination_dfd != -1)
+    (void) close (destination_dfd);
+  return ret;
 }
 
 /**
@@ -730,7 +1532,8 @@ ostree_repo_checkout_tree (OstreeRepo               *self,
  *
  * Call this after finishing a succession of checkout operations; it
  * will delete any currently-unused uncompressed objects from the
- * cache.
+ * cache.  If core.uncompressed-cache-size is set, it instead trims
+ * the cache to that size, removing the least recently used objects.
  */
 gboolean
 ostree_repo_checkout_gc (OstreeRepo        *self,
@@ -747,6 +1550,14 @@ ostree_repo_checkout_gc (OstreeRepo        *self,
   self->updated_uncompressed_dirs = g_hash_table_new (NULL, NULL);
   g_mutex_unlock (&self->cache_lock);
 
+  if (self->uncompressed_cache_size > 0)
+    {
+      if (!_ostree_repo_uncompressed_cache_flush (self, TRUE, cancellable, error))
+        goto out;
+      ret = TRUE;
+      goto out;
+    }
+
   if (to_clean_dirs)
     g_hash_table_iter_init (&iter, to_clean_dirs);
   while (to_clean_dirs && g_hash_table_iter_next (&iter, &key, &value))
@@ -24,6 +24,7 @@
 
 #include <glib-unix.h>
 #include <gio/gfiledescriptorbased.h>
+#include <gio/gunixoutputstream.h>
 #include "otutil.h"
 #include "libgsystem.h"
 
@@ -33,6 +34,9 @@
 #include "ostree-checksum-input-stream.h"
 #include "ostree-mutable-tree.h"
 #include "ostree-varint.h"
+#include "ostree-chain-input-stream.h"
+#include "ostree-deflate-parallel.h"
+#include "ostree-linuxfsutil.h"
 
 gboolean
 _ostree_repo_ensure_loose_objdir_at (int             dfd,
@@ -57,11 +61,126 @@ _ostree_repo_ensure_loose_objdir_at (int             dfd,
   return TRUE;
 }
 
+/* Give the anonymous O_TMPFILE @fd the name @path in @dfd.
+ * linkat (AT_EMPTY_PATH) needs CAP_DAC_READ_SEARCH; otherwise, go
+ * through /proc.
+ */
+static int
+link_tmpfile_at (int          fd,
+                 gboolean     empty_path,
+                 int          dfd,
+                 const char  *path)
+{
+  char fdpath[64];
+
+  if (empty_path)
+    return linkat (fd, "", dfd, path, AT_EMPTY_PATH);
+
+  g_snprintf (fdpath, sizeof (fdpath), "/proc/self/fd/%d", fd);
+  return linkat (AT_FDCWD, fdpath, dfd, path, AT_SYMLINK_FOLLOW);
+}
+
+/* Check whether new objects can be written as anonymous O_TMPFILEs:
+ * besides kernel and filesystem support, they must be linkable into
+ * place afterwards, which fails without the capability or /proc.
+ * This links a test file into the tmp directory once, rather than
+ * misreading a failure at commit time as a missing fanout directory.
+ */
+static void
+check_tmpfile_support (OstreeRepo *self)
+{
+#ifdef O_TMPFILE
+  gs_free char *name = NULL;
+  int fd;
+
+  if (self->tmpfile_checked)
+    return;
+
+  fd = openat (self->tmp_dir_fd, ".", O_WRONLY | O_TMPFILE | O_CLOEXEC, 0644);
+  if (fd == -1)
+    {
+      self->tmpfile_unsupported = TRUE;
+      self->tmpfile_checked = TRUE;
+      return;
+    }
+
+  name = g_strdup_printf ("tmpfile-check-%u-%u", (guint)getpid (), g_random_int ());
+  if (link_tmpfile_at (fd, TRUE, self->tmp_dir_fd, name) == 0)
+    self->tmpfile_link_empty_path = TRUE;
+  else if (link_tmpfile_at (fd, FALSE, self->tmp_dir_fd, name) == -1)
+    self->tmpfile_unsupported = TRUE;
+  (void) unlinkat (self->tmp_dir_fd, name, 0);
+  (void) close (fd);
+
+  self->tmpfile_checked = TRUE;
+#else
+  self->tmpfile_unsupported = TRUE;
+  self->tmpfile_checked = TRUE;
+#endif
+}
+
+/* Open a temporary file for a new object.  Where
+ * check_tmpfile_support() found it works, this is an anonymous
+ * O_TMPFILE, opened read-write since it can't be reopened, and
+ * *@out_temp_filename is set to %NULL; it is given a name by
+ * link_temporary_object().  Otherwise it's a regular named file in
+ * the tmp directory.
+ */
+static gboolean
+open_temporary_object (OstreeRepo        *self,
+                       char             **out_temp_filename,
+                       GOutputStream    **out_temp_out,
+                       GCancellable      *cancellable,
+                       GError           **error)
+{
+#ifdef O_TMPFILE
+  if (self->tmpfile_checked && !self->tmpfile_unsupported)
+    {
+      int fd = openat (self->tmp_dir_fd, ".", O_RDWR | O_TMPFILE | O_CLOEXEC, 0644);
+
+      if (fd != -1)
+        {
+          *out_temp_filename = NULL;
+          *out_temp_out = g_unix_output_stream_new (fd, TRUE);
+          return TRUE;
+        }
+      else if (errno == EOPNOTSUPP || errno == EISDIR || errno == EINVAL)
+        self->tmpfile_unsupported = TRUE;
+      else
+        {
+          ot_util_set_error_from_errno (error, errno);
+          return FALSE;
+        }
+    }
+#endif
+
+  return gs_file_open_in_tmpdir_at (self->tmp_dir_fd, 0644,
+                                    out_temp_filename, out_temp_out,
+                                    cancellable, error);
+}
+
+/* Move a temporary object into place; returns -1 with errno set on
+ * failure, as renameat() does.
+ */
+static int
+link_temporary_object (OstreeRepo        *self,
+                       int                fd,
+                       const char        *temp_filename,
+                       const char        *loose_path)
+{
+  if (temp_filename)
+    return renameat (self->tmp_dir_fd, temp_filename,
+                     self->objects_dir_fd, loose_path);
+
+  return link_tmpfile_at (fd, self->tmpfile_link_empty_path,
+                          self->objects_dir_fd, loose_path);
+}
+
 static gboolean
 commit_loose_object_trusted (OstreeRepo        *self,
+                             const char        *checksum,
                              OstreeObjectType   objtype,
                              const char        *loose_path,
-                             GFile             *temp_file,
                              const char        *temp_filename,
                              gboolean           is_symlink,
                              GFileInfo         *file_info,
@@ -71,6 +190,14 @@ commit_loose_object_trusted (OstreeRepo        *self,
                              GError           **error)
 {
   gboolean ret = FALSE;
+  int fd = -1;
+  int link_fd = -1;
+  int res;
+
+  /* A NULL @temp_filename means @temp_out is an anonymous O_TMPFILE */
+  g_assert (temp_filename != NULL || temp_out != NULL);
+  if (temp_out)
+    fd = g_file_descriptor_based_get_fd ((GFileDescriptorBased*)temp_out);
 
   /* We may be writing as root to a non-root-owned repository; if so,
    * automatically inherit the non-root ownership.
@@ -78,10 +205,14 @@ commit_loose_object_trusted (OstreeRepo        *self,
   if (self->mode == OSTREE_REPO_MODE_ARCHIVE_Z2
       && self->target_owner_uid != -1) 
     {
-      if (G_UNLIKELY (fchownat (self->tmp_dir_fd, temp_filename,
-                                self->target_owner_uid,
-                                self->target_owner_gid,
-                                AT_SYMLINK_NOFOLLOW) == -1))
+      if (temp_filename)
+        res = fchownat (self->tmp_dir_fd, temp_filename,
+                        self->target_owner_uid,
+                        self->target_owner_gid,
+                        AT_SYMLINK_NOFOLLOW);
+      else
+        res = fchown (fd, self->target_owner_uid, self->target_owner_gid);
+      if (G_UNLIKELY (res == -1))
         {
           ot_util_set_error_from_errno (error, errno);
           goto out;
@@ -112,14 +243,10 @@ commit_loose_object_trusted (OstreeRepo        *self,
     }
   else
     {
-      int fd;
-      int res;
       struct timespec times[2];
 
       g_assert (temp_out != NULL);
 
-      fd = g_file_descriptor_based_get_fd ((GFileDescriptorBased*)temp_out);
-
       if (objtype == OSTREE_OBJECT_TYPE_FILE && self->mode == OSTREE_REPO_MODE_BARE)
         {
           g_assert (file_info != NULL);
@@ -170,8 +297,9 @@ commit_loose_object_trusted (OstreeRepo        *self,
 
       /* Ensure that in case of a power cut, these files have the data we
        * want.   See http://lwn.net/Articles/322823/
+       * With batched fsync, ostree_repo_commit_transaction() does this.
        */
-      if (!self->disable_fsync)
+      if (_ostree_repo_fsync_each_file (self))
         {
           if (fsync (fd) == -1)
             {
@@ -179,30 +307,57 @@ commit_loose_object_trusted (OstreeRepo        *self,
               goto out;
             }
         }
-          
+    }
+
+  /* Close before the object is visible, so that errors close() can
+   * report (e.g. over NFS) fail the write.  An anonymous O_TMPFILE can
+   * only be linked through a descriptor, so keep a duplicate for that.
+   */
+  if (temp_out)
+    {
+      if (!temp_filename)
+        {
+          link_fd = fcntl (fd, F_DUPFD_CLOEXEC, 3);
+          if (G_UNLIKELY (link_fd == -1))
+            {
+              ot_util_set_error_from_errno (error, errno);
+              goto out;
+            }
+        }
       if (!g_output_stream_close (temp_out, cancellable, error))
         goto out;
     }
-  
-  if (!_ostree_repo_ensure_loose_objdir_at (self->objects_dir_fd, loose_path,
-                                            cancellable, error))
-    goto out;
-  
-  if (G_UNLIKELY (renameat (self->tmp_dir_fd, temp_filename,
-                            self->objects_dir_fd, loose_path) == -1))
+
+  /* The fanout directories are created when the transaction starts, so
+   * only create one here if it has gone missing since.
+   */
+  res = link_temporary_object (self, link_fd, temp_filename, loose_path);
+  if (G_UNLIKELY (res == -1 && errno == ENOENT))
+    {
+      if (!_ostree_repo_ensure_loose_objdir_at (self->objects_dir_fd, loose_path,
+                                                cancellable, error))
+        goto out;
+      res = link_temporary_object (self, link_fd, temp_filename, loose_path);
+    }
+  if (G_UNLIKELY (res == -1))
     {
       if (errno != EEXIST)
         {
           ot_util_set_error_from_errno (error, errno);
-          g_prefix_error (error, "Storing file '%s': ", temp_filename);
+          g_prefix_error (error, "Storing object %s: ", checksum);
           goto out;
         }
-      else
+      else if (temp_filename)
         (void) unlinkat (self->tmp_dir_fd, temp_filename, 0);
     }
 
+  if (objtype == OSTREE_OBJECT_TYPE_FILE && self->mode == OSTREE_REPO_MODE_BARE)
+    _ostree_repo_devino_cache_add (self, checksum);
+
   ret = TRUE;
  out:
+  if (link_fd != -1)
+    (void) close (link_fd);
   return ret;
 }
 
@@ -353,12 +508,196 @@ fallocate_stream (GFileDescriptorBased      *stream,
   return ret;
 }
 
+/* Below this size, splicing through a stream costs less than the
+ * extra system calls of copying in the kernel and reading back.
+ */
+#define OSTREE_REPO_COPY_FD_MIN_SIZE (64 * 1024)
+#define OSTREE_REPO_COPY_FD_BUFSIZE (128 * 1024)
+
+/* Copy the @size bytes of regular file @src_fd into @dest_fd, cloning
+ * or copying them in the kernel where possible.  The checksum is then
+ * computed by reading back @dest_read_fd, a readable descriptor for
+ * the same file, so that it covers exactly the data stored even if
+ * the source is modified meanwhile.
+ */
+static gboolean
+copy_content_fd (int            src_fd,
+                 guint64        size,
+                 int            dest_fd,
+                 int            dest_read_fd,
+                 OtChecksum    *checksum,
+                 GCancellable  *cancellable,
+                 GError       **error)
+{
+  gboolean ret = FALSE;
+  struct stat stbuf;
+  gboolean did_reflink;
+  guint64 offset = 0;
+  gs_free guint8 *buf = NULL;
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    goto out;
+
+  buf = g_malloc (OSTREE_REPO_COPY_FD_BUFSIZE);
+
+  if (!_ostree_linuxfs_fd_reflink (src_fd, dest_fd, &did_reflink, error))
+    goto out;
+
+  if (!did_reflink)
+    {
+      int r = posix_fallocate (dest_fd, 0, size);
+      if (r != 0)
+        {
+          ot_util_set_error_from_errno (error, r);
+          goto out;
+        }
+
+#ifdef HAVE_COPY_FILE_RANGE
+      while (offset < size)
+        {
+          loff_t off_in = offset;
+          loff_t off_out = offset;
+          ssize_t n = copy_file_range (src_fd, &off_in, dest_fd, &off_out,
+                                       size - offset, 0);
+          if (n == -1)
+            {
+              if (errno == EINTR)
+                continue;
+              /* Not supported here; copy the rest through the buffer */
+              if (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EINVAL)
+                break;
+              ot_util_set_error_from_errno (error, errno);
+              goto out;
+            }
+          else if (n == 0)
+            break;
+          offset += n;
+        }
+#endif
+
+      while (offset < size)
+        {
+          ssize_t n = pread (src_fd, buf, MIN (OSTREE_REPO_COPY_FD_BUFSIZE, size - offset), offset);
+          ssize_t written = 0;
+
+          if (n == -1)
+            {
+              if (errno == EINTR)
+                continue;
+              ot_util_set_error_from_errno (error, errno);
+              goto out;
+            }
+          else if (n == 0)
+            {
+              /* The destination was preallocated, so check here */
+              g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                           "File size changed while committing");
+              goto out;
+            }
+
+          while (written < n)
+            {
+              ssize_t w = pwrite (dest_fd, buf + written, n - written, offset + written);
+              if (w == -1)
+                {
+                  if (errno == EINTR)
+                    continue;
+                  ot_util_set_error_from_errno (error, errno);
+                  goto out;
+                }
+              written += w;
+            }
+          offset += n;
+        }
+    }
+
+  if (fstat (dest_fd, &stbuf) == -1)
+    {
+      ot_util_set_error_from_errno (error, errno);
+      goto out;
+    }
+  if ((guint64)stbuf.st_size != size)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "File size changed while committing");
+      goto out;
+    }
+
+  if (checksum)
+    {
+      offset = 0;
+      while (offset < size)
+        {
+          ssize_t n = pread (dest_read_fd, buf, MIN (OSTREE_REPO_COPY_FD_BUFSIZE, size - offset), offset);
+          if (n == -1)
+            {
+              if (errno == EINTR)
+                continue;
+              ot_util_set_error_from_errno (error, errno);
+              goto out;
+            }
+          else if (n == 0)
+            {
+              g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                           "File size changed while committing");
+              goto out;
+            }
+          ot_checksum_update (checksum, buf, n);
+          offset += n;
+        }
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/* Read the start of *@inout_input, and if it looks like it's already
+ * compressed, lower *@inout_level to 0 so it's just stored.
+ * *@inout_input is replaced by a stream returning the same content.
+ */
+static gboolean
+probe_compression_level (GInputStream   **inout_input,
+                         int             *inout_level,
+                         GCancellable    *cancellable,
+                         GError         **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_ptrarray GPtrArray *streams = NULL;
+  guint8 *buf = g_malloc (_OSTREE_DEFLATE_PROBE_SIZE);
+  gsize bytes_read;
+
+  if (!g_input_stream_read_all (*inout_input, buf, _OSTREE_DEFLATE_PROBE_SIZE,
+                                &bytes_read, cancellable, error))
+    goto out;
+
+  if (_ostree_deflate_is_incompressible (buf, bytes_read))
+    *inout_level = 0;
+
+  streams = g_ptr_array_new_with_free_func (g_object_unref);
+  g_ptr_array_add (streams, g_memory_input_stream_new_from_data (buf, bytes_read, g_free));
+  buf = NULL;
+  g_ptr_array_add (streams, *inout_input);
+  *inout_input = (GInputStream*)ostree_chain_input_stream_new (streams);
+
+  ret = TRUE;
+ out:
+  g_free (buf);
+  return ret;
+}
+
+/*
+ * For content objects, @content_fd may be a file descriptor for the
+ * regular file whose content follows the header in @input, or -1.
+ * Bare repositories then copy the data directly from it.
+ */
 static gboolean
 write_object (OstreeRepo         *self,
               OstreeObjectType    objtype,
               const char         *expected_checksum,
               GInputStream       *input,
               guint64             file_object_length,
+              int                 content_fd,
               guchar            **out_csum,
               GCancellable       *cancellable,
               GError            **error)
@@ -368,7 +707,6 @@ write_object (OstreeRepo         *self,
   gboolean do_commit;
   OstreeRepoMode repo_mode;
   gs_free char *temp_filename = NULL;
-  gs_unref_object GFile *temp_file = NULL;
   gs_unref_object GFile *stored_path = NULL;
   gs_free guchar *ret_csum = NULL;
   gs_unref_object OstreeChecksumInputStream *checksum_input = NULL;
@@ -377,7 +715,7 @@ write_object (OstreeRepo         *self,
   gs_unref_variant GVariant *xattrs = NULL;
   gs_unref_object GOutputStream *temp_out = NULL;
   gboolean have_obj;
-  GChecksum *checksum = NULL;
+  OtChecksum *checksum = NULL;
   gboolean temp_file_is_regular;
   gboolean is_symlink = FALSE;
   char loose_objpath[_OSTREE_LOOSE_PATH_MAX];
@@ -395,6 +733,13 @@ write_object (OstreeRepo         *self,
                                           &have_obj, loose_objpath,
                                           cancellable, error))
         goto out;
+      if (!have_obj)
+        {
+          if (!_ostree_repo_find_packed_object (self, objtype, expected_checksum,
+                                                &have_obj, NULL,
+                                                cancellable, error))
+            goto out;
+        }
       if (have_obj)
         {
           ret = TRUE;
@@ -406,9 +751,9 @@ write_object (OstreeRepo         *self,
 
   if (out_csum)
     {
-      checksum = g_checksum_new (G_CHECKSUM_SHA256);
+      checksum = ot_checksum_new (G_CHECKSUM_SHA256);
       if (input)
-        checksum_input = ostree_checksum_input_stream_new (input, checksum);
+        checksum_input = _ostree_checksum_input_stream_new (input, checksum);
     }
 
   if (objtype == OSTREE_OBJECT_TYPE_FILE)
@@ -440,18 +785,44 @@ write_object (OstreeRepo         *self,
         {
           guint64 size = g_file_info_get_size (file_info);
 
-          if (!gs_file_open_in_tmpdir_at (self->tmp_dir_fd, 0644, &temp_filename, &temp_out,
-                                          cancellable, error))
+          if (!open_temporary_object (self, &temp_filename, &temp_out,
+                                      cancellable, error))
             goto out;
 
-          if (!fallocate_stream ((GFileDescriptorBased*)temp_out, size,
-                                 cancellable, error))
-            goto out;
+          if (content_fd != -1 && size >= OSTREE_REPO_COPY_FD_MIN_SIZE)
+            {
+              int dest_fd = g_file_descriptor_based_get_fd ((GFileDescriptorBased*)temp_out);
+              int dest_read_fd = dest_fd;
+              gboolean copied;
+
+              /* Anonymous O_TMPFILEs are opened read-write */
+              if (temp_filename)
+                {
+                  dest_read_fd = openat (self->tmp_dir_fd, temp_filename, O_RDONLY | O_CLOEXEC);
+                  if (dest_read_fd == -1)
+                    {
+                      ot_util_set_error_from_errno (error, errno);
+                      goto out;
+                    }
+                }
+
+              copied = copy_content_fd (content_fd, size, dest_fd, dest_read_fd,
+                                        checksum, cancellable, error);
+              if (dest_read_fd != dest_fd)
+                (void) close (dest_read_fd);
+              if (!copied)
+                goto out;
+            }
+          else
+            {
+              if (!fallocate_stream ((GFileDescriptorBased*)temp_out, size,
+                                     cancellable, error))
+                goto out;
 
-          temp_file = g_file_get_child (self->tmp_dir, temp_filename);
-          if (g_output_stream_splice (temp_out, file_input, 0,
-                                      cancellable, error) < 0)
-            goto out;
+              if (g_output_stream_splice (temp_out, file_input, 0,
+                                          cancellable, error) < 0)
+                goto out;
+            }
         }
       else if (repo_mode == OSTREE_REPO_MODE_BARE && is_symlink)
         {
@@ -460,7 +831,6 @@ write_object (OstreeRepo         *self,
                                                   &temp_filename,
                                                   cancellable, error))
             goto out;
-          temp_file = g_file_get_child (self->tmp_dir, temp_filename);
         }
       else if (repo_mode == OSTREE_REPO_MODE_ARCHIVE_Z2)
         {
@@ -471,11 +841,9 @@ write_object (OstreeRepo         *self,
           if (self->generate_sizes)
             indexable = TRUE;
 
-          if (!gs_file_open_in_tmpdir_at (self->tmp_dir_fd, 0644,
-                                          &temp_filename, &temp_out,
-                                          cancellable, error))
+          if (!open_temporary_object (self, &temp_filename, &temp_out,
+                                      cancellable, error))
             goto out;
-          temp_file = g_file_get_child (self->tmp_dir, temp_filename);
           temp_file_is_regular = TRUE;
 
           file_meta = _ostree_zlib_file_header_new (file_info, xattrs);
@@ -486,15 +854,35 @@ write_object (OstreeRepo         *self,
 
           if (g_file_info_get_file_type (file_info) == G_FILE_TYPE_REGULAR)
             {
-              zlib_compressor = (GConverter*)g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_RAW, 9);
-              compressed_out_stream = g_converter_output_stream_new (temp_out, zlib_compressor);
-              /* Don't close the base; we'll do that later */
-              g_filter_output_stream_set_close_base_stream ((GFilterOutputStream*)compressed_out_stream, FALSE);
-              
-              unpacked_size = g_output_stream_splice (compressed_out_stream, file_input,
-                                                      0, cancellable, error);
-              if (unpacked_size < 0)
-                goto out;
+              guint64 size = g_file_info_get_size (file_info);
+              int level = self->compression_level;
+
+              if (level > 0 && size >= _OSTREE_DEFLATE_PROBE_MIN_SIZE)
+                {
+                  if (!probe_compression_level (&file_input, &level,
+                                                cancellable, error))
+                    goto out;
+                }
+
+              if (level > 0 && size >= _OSTREE_DEFLATE_PARALLEL_MIN_SIZE)
+                {
+                  unpacked_size = _ostree_deflate_parallel_splice (temp_out, file_input, level,
+                                                                   cancellable, error);
+                  if (unpacked_size < 0)
+                    goto out;
+                }
+              else
+                {
+                  zlib_compressor = (GConverter*)g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_RAW, level);
+                  compressed_out_stream = g_converter_output_stream_new (temp_out, zlib_compressor);
+                  /* Don't close the base; we'll do that later */
+                  g_filter_output_stream_set_close_base_stream ((GFilterOutputStream*)compressed_out_stream, FALSE);
+
+                  unpacked_size = g_output_stream_splice (compressed_out_stream, file_input,
+                                                          0, cancellable, error);
+                  if (unpacked_size < 0)
+                    goto out;
+                }
             }
         }
       else
@@ -502,15 +890,14 @@ write_object (OstreeRepo         *self,
     }
   else
     {
-      if (!gs_file_open_in_tmpdir_at (self->tmp_dir_fd, 0644, &temp_filename, &temp_out,
-                                      cancellable, error))
+      if (!open_temporary_object (self, &temp_filename, &temp_out,
+                                  cancellable, error))
         goto out;
 
       if (!fallocate_stream ((GFileDescriptorBased*)temp_out, file_object_length,
                              cancellable, error))
         goto out;
 
-      temp_file = g_file_get_child (self->tmp_dir, temp_filename);
       if (g_output_stream_splice (temp_out, checksum_input ? (GInputStream*)checksum_input : input,
                                   0,
                                   cancellable, error) < 0)
@@ -528,7 +915,7 @@ write_object (OstreeRepo         *self,
     actual_checksum = expected_checksum;
   else
     {
-      actual_checksum = g_checksum_get_string (checksum);
+      actual_checksum = ot_checksum_get_string (checksum);
       if (expected_checksum && strcmp (actual_checksum, expected_checksum) != 0)
         {
           g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
@@ -543,27 +930,37 @@ write_object (OstreeRepo         *self,
           
   if (indexable)
     {
-      gsize archived_size;
-      gs_unref_object GFileInfo *compressed_info =
-        g_file_query_info (temp_file, G_FILE_ATTRIBUTE_STANDARD_SIZE, 0,
-                           cancellable, error);
-      if (!compressed_info)
-        goto out;
-      archived_size = g_file_info_get_size (compressed_info);
-      repo_store_size_entry (self, actual_checksum, unpacked_size, archived_size);
+      struct stat stbuf;
+
+      if (fstat (g_file_descriptor_based_get_fd ((GFileDescriptorBased*)temp_out), &stbuf) == -1)
+        {
+          ot_util_set_error_from_errno (error, errno);
+          goto out;
+        }
+      /* Content may be written from several threads during a commit */
+      g_mutex_lock (&self->txn_stats_lock);
+      repo_store_size_entry (self, actual_checksum, unpacked_size, stbuf.st_size);
+      g_mutex_unlock (&self->txn_stats_lock);
     }
 
   if (!_ostree_repo_has_loose_object (self, actual_checksum, objtype,
                                       &have_obj, loose_objpath,
                                       cancellable, error))
     goto out;
+  if (!have_obj)
+    {
+      if (!_ostree_repo_find_packed_object (self, objtype, actual_checksum,
+                                            &have_obj, NULL,
+                                            cancellable, error))
+        goto out;
+    }
           
   do_commit = !have_obj;
 
   if (do_commit)
     {
-      if (!commit_loose_object_trusted (self, objtype, loose_objpath,
-                                        temp_file, temp_filename,
+      if (!commit_loose_object_trusted (self, actual_checksum, objtype, loose_objpath,
+                                        temp_filename,
                                         is_symlink, file_info,
                                         xattrs, temp_out,
                                         cancellable, error))
@@ -584,7 +981,6 @@ write_object (OstreeRepo         *self,
         }
 
       g_clear_pointer (&temp_filename, g_free);
-      g_clear_object (&temp_file);
     }
 
   g_mutex_lock (&self->txn_stats_lock);
@@ -607,144 +1003,394 @@ write_object (OstreeRepo         *self,
   g_mutex_unlock (&self->txn_stats_lock);
       
   if (checksum)
-    ret_csum = ot_csum_from_gchecksum (checksum);
+    ret_csum = ot_csum_from_checksum (checksum);
 
   ret = TRUE;
   ot_transfer_out_value(out_csum, &ret_csum);
  out:
   if (temp_filename)
     (void) unlinkat (self->tmp_dir_fd, temp_filename, 0);
-  g_clear_pointer (&checksum, (GDestroyNotify) g_checksum_free);
+  g_clear_pointer (&checksum, (GDestroyNotify) ot_checksum_free);
   return ret;
 }
 
-typedef struct {
-  dev_t dev;
-  ino_t ino;
-} OstreeDevIno;
-
-static guint
-devino_hash (gconstpointer a)
-{
-  OstreeDevIno *a_i = (gpointer)a;
-  return (guint) (a_i->dev + a_i->ino);
-}
-
-static int
-devino_equal (gconstpointer   a,
-              gconstpointer   b)
-{
-  OstreeDevIno *a_i = (gpointer)a;
-  OstreeDevIno *b_i = (gpointer)b;
-  return a_i->dev == b_i->dev
-    && a_i->ino == b_i->ino;
-}
-
+/* Parse and checksum the archive-z2 content object in @content.
+ * Unlike ostree_content_stream_parse(), only the encoding we write is
+ * accepted: a header in normal form, and for regular files a single
+ * deflate stream which ends exactly at the end of the object and
+ * inflates to the size given in the header.  Anything else would be
+ * stored verbatim while checksumming like a valid object.
+ */
 static gboolean
-scan_loose_devino (OstreeRepo                     *self,
-                   GHashTable                     *devino_cache,
-                   GCancellable                   *cancellable,
-                   GError                        **error)
+checksum_archive_content (GBytes         *content,
+                          GFileInfo     **out_file_info,
+                          GVariant      **out_xattrs,
+                          guchar        **out_csum,
+                          GCancellable   *cancellable,
+                          GError        **error)
 {
   gboolean ret = FALSE;
-  guint i;
-  OstreeRepoMode repo_mode;
-  gs_unref_ptrarray GPtrArray *object_dirs = NULL;
+  const guint8 *data;
+  gsize len;
+  gsize offset;
+  guint32 header_size;
+  gs_unref_variant GVariant *zlib_header = NULL;
+  gs_unref_variant GVariant *file_header = NULL;
+  gs_unref_object GInputStream *content_in = NULL;
+  gs_unref_object GFileInfo *ret_file_info = NULL;
+  gs_unref_variant GVariant *ret_xattrs = NULL;
+  gs_free guchar *ret_csum = NULL;
+  OtChecksum *checksum = NULL;
+
+  data = g_bytes_get_data (content, &len);
 
-  if (self->parent_repo)
+  if (len < 8)
     {
-      if (!scan_loose_devino (self->parent_repo, devino_cache, cancellable, error))
-        goto out;
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Archive content of size %" G_GSIZE_FORMAT " is truncated", len);
+      goto out;
+    }
+  memcpy (&header_size, data, 4);
+  header_size = GUINT32_FROM_BE (header_size);
+  if (header_size > len - 8)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Archive content header size %u exceeds size %" G_GSIZE_FORMAT,
+                   header_size, len);
+      goto out;
     }
+  offset = 8 + header_size;
 
-  repo_mode = ostree_repo_get_mode (self);
+  zlib_header = g_variant_ref_sink (g_variant_new_from_data (_OSTREE_ZLIB_FILE_HEADER_GVARIANT_FORMAT,
+                                                             data + 8, header_size, FALSE,
+                                                             NULL, NULL));
+  if (!g_variant_is_normal_form (zlib_header))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Archive content header is not in normal form");
+      goto out;
+    }
 
-  if (!_ostree_repo_get_loose_object_dirs (self, &object_dirs, cancellable, error))
+  content_in = g_memory_input_stream_new_from_bytes (content);
+  if (!ostree_content_stream_parse (TRUE, content_in, len, FALSE,
+                                    NULL, &ret_file_info, &ret_xattrs,
+                                    cancellable, error))
     goto out;
 
-  for (i = 0; i < object_dirs->len; i++)
-    {
-      GFile *objdir = object_dirs->pdata[i];
-      gs_unref_object GFileEnumerator *enumerator = NULL;
-      gs_unref_object GFileInfo *file_info = NULL;
-      const char *dirname;
-
-      enumerator = g_file_enumerate_children (objdir, OSTREE_GIO_FAST_QUERYINFO,
-                                              G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
-                                              cancellable,
-                                              error);
-      if (!enumerator)
-        goto out;
+  checksum = ot_checksum_new (G_CHECKSUM_SHA256);
+  file_header = _ostree_file_header_new (ret_file_info, ret_xattrs);
+  if (!_ostree_write_variant_with_size (NULL, file_header, 0, NULL, checksum,
+                                        cancellable, error))
+    goto out;
 
-      dirname = gs_file_get_basename_cached (objdir);
+  if (g_file_info_get_file_type (ret_file_info) == G_FILE_TYPE_REGULAR)
+    {
+      gs_unref_object GConverter *decompressor = NULL;
+      guint64 remaining = g_file_info_get_size (ret_file_info);
+      guint8 buf[8192];
 
+      decompressor = (GConverter*)g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_RAW);
       while (TRUE)
         {
-          const char *name;
-          const char *dot;
-          guint32 type;
-          OstreeDevIno *key;
-          GString *checksum;
-          gboolean skip;
-
-          if (!gs_file_enumerator_iterate (enumerator, &file_info, NULL,
-                                           NULL, error))
+          GConverterResult result;
+          gsize bytes_read, bytes_written;
+
+          if (g_cancellable_set_error_if_cancelled (cancellable, error))
             goto out;
-          if (file_info == NULL)
-            break;
 
-          name = g_file_info_get_attribute_byte_string (file_info, "standard::name");
-          type = g_file_info_get_attribute_uint32 (file_info, "standard::type");
+          result = g_converter_convert (decompressor, data + offset, len - offset,
+                                        buf, sizeof (buf), G_CONVERTER_INPUT_AT_END,
+                                        &bytes_read, &bytes_written, error);
+          if (result == G_CONVERTER_ERROR)
+            goto out;
+          offset += bytes_read;
 
-          if (type == G_FILE_TYPE_DIRECTORY)
-            continue;
+          if (bytes_written > remaining)
+            {
+              g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                           "Archive content inflates to more than its size %" G_GUINT64_FORMAT,
+                           g_file_info_get_size (ret_file_info));
+              goto out;
+            }
+          remaining -= bytes_written;
+          ot_checksum_update (checksum, buf, bytes_written);
 
-          switch (repo_mode)
+          if (result == G_CONVERTER_FINISHED)
+            break;
+          if (bytes_read == 0 && bytes_written == 0)
             {
-            case OSTREE_REPO_MODE_ARCHIVE_Z2:
-            case OSTREE_REPO_MODE_BARE:
-              skip = !g_str_has_suffix (name, ".file");
-              break;
-            default:
-              g_assert_not_reached ();
+              g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                           "Archive content is truncated");
+              goto out;
             }
-          if (skip)
-            continue;
+        }
+
+      if (remaining != 0)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Archive content inflates to less than its size %" G_GUINT64_FORMAT,
+                       g_file_info_get_size (ret_file_info));
+          goto out;
+        }
+    }
 
-          dot = strrchr (name, '.');
-          g_assert (dot);
+  if (offset != len)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Archive content has %" G_GSIZE_FORMAT " bytes of trailing data",
+                   len - offset);
+      goto out;
+    }
+
+  ret_csum = ot_csum_from_checksum (checksum);
+
+  ret = TRUE;
+  ot_transfer_out_value (out_file_info, &ret_file_info);
+  ot_transfer_out_value (out_xattrs, &ret_xattrs);
+  ot_transfer_out_value (out_csum, &ret_csum);
+ out:
+  g_clear_pointer (&checksum, (GDestroyNotify)ot_checksum_free);
+  return ret;
+}
+
+/*
+ * _ostree_repo_write_archive_content:
+ * @self: Repo, in archive-z2 mode
+ * @expected_checksum: (allow-none): If provided, validate content against this checksum
+ * @archive_path: Content object in archive-z2 form, in the repo's tmp directory
+ * @out_csum: (out) (allow-none): Binary checksum
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Store a content object which is already in archive-z2 form (for
+ * example, fetched from an archive-z2 remote).  The content is only
+ * inflated to verify its checksum and encoding; the compressed bytes are then
+ * stored verbatim rather than being recompressed by write_object().
+ * @archive_path is moved into place or deleted.
+ */
+gboolean
+_ostree_repo_write_archive_content (OstreeRepo         *self,
+                                    const char         *expected_checksum,
+                                    GFile              *archive_path,
+                                    guchar            **out_csum,
+                                    GCancellable       *cancellable,
+                                    GError            **error)
+{
+  gboolean ret = FALSE;
+  const char *temp_filename = gs_file_get_basename_cached (archive_path);
+  gboolean consumed = FALSE;
+  GMappedFile *mfile = NULL;
+  gs_unref_bytes GBytes *content = NULL;
+  gs_unref_object GFileInfo *file_info = NULL;
+  gs_unref_variant GVariant *xattrs = NULL;
+  gs_unref_object GOutputStream *temp_out = NULL;
+  gs_free guchar *ret_csum = NULL;
+  gs_free char *actual_checksum = NULL;
+  char loose_objpath[_OSTREE_LOOSE_PATH_MAX];
+  gboolean have_obj;
+  struct stat stbuf;
+  int fd;
+
+  g_return_val_if_fail (self->mode == OSTREE_REPO_MODE_ARCHIVE_Z2, FALSE);
+  g_return_val_if_fail (g_file_has_parent (archive_path, self->tmp_dir), FALSE);
+
+  mfile = gs_file_map_noatime (archive_path, cancellable, error);
+  if (!mfile)
+    goto out;
+  content = g_mapped_file_get_bytes (mfile);
+  g_mapped_file_unref (mfile);
 
-          if ((dot - name) != 62)
-            continue;
+  if (!checksum_archive_content (content, &file_info, &xattrs, &ret_csum,
+                                 cancellable, error))
+    goto out;
 
-          checksum = g_string_new (dirname);
-          g_string_append_len (checksum, name, 62);
+  actual_checksum = ostree_checksum_from_bytes (ret_csum);
+  if (expected_checksum && strcmp (actual_checksum, expected_checksum) != 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Corrupted %s object %s (actual checksum is %s)",
+                   ostree_object_type_to_string (OSTREE_OBJECT_TYPE_FILE),
+                   expected_checksum, actual_checksum);
+      goto out;
+    }
 
-          key = g_new (OstreeDevIno, 1);
-          key->dev = g_file_info_get_attribute_uint32 (file_info, "unix::device");
-          key->ino = g_file_info_get_attribute_uint64 (file_info, "unix::inode");
+  if (!_ostree_repo_has_loose_object (self, actual_checksum, OSTREE_OBJECT_TYPE_FILE,
+                                      &have_obj, loose_objpath,
+                                      cancellable, error))
+    goto out;
+  if (!have_obj)
+    {
+      if (!_ostree_repo_find_packed_object (self, OSTREE_OBJECT_TYPE_FILE, actual_checksum,
+                                            &have_obj, NULL,
+                                            cancellable, error))
+        goto out;
+    }
 
-          g_hash_table_replace (devino_cache, key, g_string_free (checksum, FALSE));
+  if (!have_obj)
+    {
+      /* commit_loose_object_trusted() wants a stream to fsync and close */
+      fd = openat (self->tmp_dir_fd, temp_filename, O_WRONLY | O_CLOEXEC);
+      if (fd == -1 || fstat (fd, &stbuf) == -1 || fchmod (fd, 0644) == -1)
+        {
+          ot_util_set_error_from_errno (error, errno);
+          if (fd != -1)
+            (void) close (fd);
+          goto out;
         }
+      temp_out = g_unix_output_stream_new (fd, TRUE);
+
+      if (self->generate_sizes)
+        {
+          guint64 unpacked_size = 0;
+
+          if (g_file_info_get_file_type (file_info) == G_FILE_TYPE_REGULAR)
+            unpacked_size = g_file_info_get_size (file_info);
+          g_mutex_lock (&self->txn_stats_lock);
+          repo_store_size_entry (self, actual_checksum, unpacked_size, stbuf.st_size);
+          g_mutex_unlock (&self->txn_stats_lock);
+        }
+
+      if (!commit_loose_object_trusted (self, actual_checksum, OSTREE_OBJECT_TYPE_FILE,
+                                        loose_objpath, temp_filename,
+                                        FALSE, file_info, xattrs, temp_out,
+                                        cancellable, error))
+        goto out;
+      consumed = TRUE;
+    }
+
+  g_mutex_lock (&self->txn_stats_lock);
+  if (!have_obj)
+    {
+      self->txn_stats.content_objects_written++;
+      self->txn_stats.content_bytes_written += stbuf.st_size;
     }
+  self->txn_stats.content_objects_total++;
+  g_mutex_unlock (&self->txn_stats_lock);
 
   ret = TRUE;
+  ot_transfer_out_value (out_csum, &ret_csum);
  out:
+  if (!consumed)
+    (void) unlinkat (self->tmp_dir_fd, temp_filename, 0);
   return ret;
 }
 
-static const char *
-devino_cache_lookup (OstreeRepo           *self,
-                     GFileInfo            *finfo)
+/*
+ * _ostree_repo_write_loose_object_reflink:
+ * @self: Repo
+ * @objtype: Object type
+ * @checksum: ASCII SHA256 checksum of the object, trusted
+ * @src_fd: The object as stored loose by another repository of the same mode
+ * @file_info: (allow-none): For content, the file's metadata
+ * @xattrs: (allow-none): For content, extended attributes
+ * @out_did_reflink: (out): Whether the object is now stored in @self
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Store a metadata object, or a regular file in a bare repository, by
+ * cloning the extents of @src_fd.  If the filesystems don't support
+ * that, @out_did_reflink is set to %FALSE and nothing is written; the
+ * caller should copy the object instead.
+ */
+gboolean
+_ostree_repo_write_loose_object_reflink (OstreeRepo         *self,
+                                         OstreeObjectType    objtype,
+                                         const char         *checksum,
+                                         int                 src_fd,
+                                         GFileInfo          *file_info,
+                                         GVariant           *xattrs,
+                                         gboolean           *out_did_reflink,
+                                         GCancellable       *cancellable,
+                                         GError            **error)
 {
-  OstreeDevIno dev_ino;
+  gboolean ret = FALSE;
+  gs_free char *temp_filename = NULL;
+  gs_unref_object GOutputStream *temp_out = NULL;
+  char loose_objpath[_OSTREE_LOOSE_PATH_MAX];
+  gboolean have_obj;
+  gboolean did_reflink;
+  struct stat stbuf;
 
-  if (!self->loose_object_devino_hash)
-    return NULL;
+  g_return_val_if_fail (OSTREE_OBJECT_TYPE_IS_META (objtype)
+                        || self->mode == OSTREE_REPO_MODE_BARE, FALSE);
+
+  *out_did_reflink = FALSE;
+
+  if (!_ostree_repo_has_loose_object (self, checksum, objtype,
+                                      &have_obj, loose_objpath,
+                                      cancellable, error))
+    goto out;
+  if (!have_obj)
+    {
+      if (!_ostree_repo_find_packed_object (self, objtype, checksum,
+                                            &have_obj, NULL,
+                                            cancellable, error))
+        goto out;
+    }
+
+  if (!have_obj)
+    {
+      if (fstat (src_fd, &stbuf) == -1)
+        {
+          ot_util_set_error_from_errno (error, errno);
+          goto out;
+        }
+
+      if (!open_temporary_object (self, &temp_filename, &temp_out,
+                                  cancellable, error))
+        goto out;
 
-  dev_ino.dev = g_file_info_get_attribute_uint32 (finfo, "unix::device");
-  dev_ino.ino = g_file_info_get_attribute_uint64 (finfo, "unix::inode");
-  return g_hash_table_lookup (self->loose_object_devino_hash, &dev_ino);
+      if (!_ostree_linuxfs_fd_reflink (src_fd,
+                                       g_file_descriptor_based_get_fd ((GFileDescriptorBased*)temp_out),
+                                       &did_reflink, error))
+        goto out;
+      if (!did_reflink)
+        {
+          ret = TRUE;
+          goto out;
+        }
+
+      if (!commit_loose_object_trusted (self, checksum, objtype, loose_objpath,
+                                        temp_filename, FALSE, file_info, xattrs, temp_out,
+                                        cancellable, error))
+        goto out;
+      g_clear_pointer (&temp_filename, g_free);
+    }
+
+  g_mutex_lock (&self->txn_stats_lock);
+  if (!have_obj)
+    {
+      if (OSTREE_OBJECT_TYPE_IS_META (objtype))
+        self->txn_stats.metadata_objects_written++;
+      else
+        {
+          self->txn_stats.content_objects_written++;
+          self->txn_stats.content_bytes_written += stbuf.st_size;
+        }
+    }
+  if (OSTREE_OBJECT_TYPE_IS_META (objtype))
+    self->txn_stats.metadata_objects_total++;
+  else
+    self->txn_stats.content_objects_total++;
+  g_mutex_unlock (&self->txn_stats_lock);
+
+  ret = TRUE;
+  *out_did_reflink = TRUE;
+ out:
+  if (temp_filename)
+    (void) unlinkat (self->tmp_dir_fd, temp_filename, 0);
+  return ret;
+}
+
+static gboolean
+devino_cache_lookup (OstreeRepo           *self,
+                     GFileInfo            *finfo,
+                     char                 *out_checksum)
+{
+  return _ostree_repo_devino_cache_lookup (self,
+                                           g_file_info_get_attribute_uint32 (finfo, "unix::device"),
+                                           g_file_info_get_attribute_uint64 (finfo, "unix::inode"),
+                                           out_checksum);
 }
 
 /**
@@ -759,7 +1405,8 @@ devino_cache_lookup (OstreeRepo           *self,
  * ostree's existing repo, ostree can build a mapping of device numbers and
  * inodes to their checksum.
  *
- * There is an upfront cost to creating this mapping, as this will scan the
+ * The mapping is kept in the repository and updated as objects are
+ * written, so only the first call has the upfront cost of scanning the
  * entire objects directory. If your commit is composed of mostly hardlinks to
  * existing ostree objects, then this will speed up considerably, so call it
  * before you call ostree_write_directory_to_mtree() or similar.
@@ -773,15 +1420,35 @@ ostree_repo_scan_hardlinks (OstreeRepo    *self,
 
   g_return_val_if_fail (self->in_transaction == TRUE, FALSE);
 
-  if (!self->loose_object_devino_hash)
-    self->loose_object_devino_hash = g_hash_table_new_full (devino_hash, devino_equal, g_free, g_free);
-  g_hash_table_remove_all (self->loose_object_devino_hash);
-  if (!scan_loose_devino (self, self->loose_object_devino_hash, cancellable, error))
-    goto out;
+  if (!_ostree_repo_devino_cache_ensure (self, cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/* Create all 256 objects/XX directories up front, so that writing
+ * an object doesn't need a mkdirat() call of its own.
+ */
+static gboolean
+ensure_loose_objdirs (OstreeRepo     *self,
+                      GCancellable   *cancellable,
+                      GError        **error)
+{
+  guint i;
+
+  for (i = 0; i < 256; i++)
+    {
+      char loose_prefix[3];
+
+      g_snprintf (loose_prefix, sizeof (loose_prefix), "%02x", i);
+      if (!_ostree_repo_ensure_loose_objdir_at (self->objects_dir_fd, loose_prefix,
+                                                cancellable, error))
+        return FALSE;
+    }
 
-  ret = TRUE;
- out:
-  return ret;
+  return TRUE;
 }
 
 /**
@@ -822,6 +1489,13 @@ ostree_repo_prepare_transaction (OstreeRepo     *self,
 
   memset (&self->txn_stats, 0, sizeof (OstreeRepoTransactionStats));
 
+  _ostree_repo_devino_cache_prepare (self);
+
+  if (!ensure_loose_objdirs (self, cancellable, error))
+    goto out;
+
+  check_tmpfile_support (self);
+
   self->in_transaction = TRUE;
   if (ret_transaction_resume)
     {
@@ -1010,14 +1684,18 @@ ostree_repo_commit_transaction (OstreeRepo                  *self,
   if (!cleanup_tmpdir (self, cancellable, error))
     goto out;
 
-  if (self->loose_object_devino_hash)
-    g_hash_table_remove_all (self->loose_object_devino_hash);
+  /* Objects must be on disk before any ref points to them */
+  if (!_ostree_repo_syncfs (self, self->objects_dir_fd, cancellable, error))
+    goto out;
 
   if (self->txn_refs)
     if (!_ostree_repo_update_refs (self, self->txn_refs, cancellable, error))
       goto out;
   g_clear_pointer (&self->txn_refs, g_hash_table_destroy);
 
+  if (!_ostree_repo_devino_cache_flush (self, cancellable, error))
+    goto out;
+
   self->in_transaction = FALSE;
 
   if (!ot_gfile_ensure_unlinked (self->transaction_lock_path, cancellable, error))
@@ -1044,8 +1722,7 @@ ostree_repo_abort_transaction (OstreeRepo     *self,
   if (!cleanup_tmpdir (self, cancellable, error))
     goto out;
 
-  if (self->loose_object_devino_hash)
-    g_hash_table_remove_all (self->loose_object_devino_hash);
+  _ostree_repo_devino_cache_clear (self);
 
   g_clear_pointer (&self->txn_refs, g_hash_table_destroy);
 
@@ -1102,7 +1779,7 @@ ostree_repo_write_metadata (OstreeRepo         *self,
   input = ot_variant_read (normalized);
 
   if (!write_object (self, objtype, expected_checksum,
-                     input, g_variant_get_size (normalized),
+                     input, g_variant_get_size (normalized), -1,
                      out_csum,
                      cancellable, error))
     goto out;
@@ -1134,7 +1811,7 @@ ostree_repo_write_metadata_stream_trusted (OstreeRepo        *self,
                                            GCancellable      *cancellable,
                                            GError           **error)
 {
-  return write_object (self, objtype, checksum, object_input, length, NULL,
+  return write_object (self, objtype, checksum, object_input, length, -1, NULL,
                        cancellable, error);
 }
 
@@ -1165,7 +1842,7 @@ ostree_repo_write_metadata_trusted (OstreeRepo         *self,
   input = ot_variant_read (normalized);
 
   return write_object (self, type, checksum,
-                       input, g_variant_get_size (normalized),
+                       input, g_variant_get_size (normalized), -1,
                        NULL,
                        cancellable, error);
 }
@@ -1333,7 +2010,7 @@ ostree_repo_write_content_trusted (OstreeRepo       *self,
                                    GError          **error)
 {
   return write_object (self, OSTREE_OBJECT_TYPE_FILE, checksum,
-                       object_input, length, NULL,
+                       object_input, length, -1, NULL,
                        cancellable, error);
 }
 
@@ -1361,7 +2038,7 @@ ostree_repo_write_content (OstreeRepo       *self,
                            GError          **error)
 {
   return write_object (self, OSTREE_OBJECT_TYPE_FILE, expected_checksum,
-                       object_input, length, out_csum,
+                       object_input, length, -1, out_csum,
                        cancellable, error);
 }
 
@@ -1370,6 +2047,7 @@ typedef struct {
   char *expected_checksum;
   GInputStream *object;
   guint64 file_object_length;
+  GFile *archive_path;
   GCancellable *cancellable;
   GSimpleAsyncResult *result;
 
@@ -1384,6 +2062,7 @@ write_content_async_data_free (gpointer user_data)
   g_clear_object (&data->repo);
   g_clear_object (&data->cancellable);
   g_clear_object (&data->object);
+  g_clear_object (&data->archive_path);
   g_free (data->result_csum);
   g_free (data->expected_checksum);
   g_free (data);
@@ -1398,10 +2077,17 @@ write_content_thread (GSimpleAsyncResult  *res,
   WriteContentAsyncData *data;
 
   data = g_simple_async_result_get_op_res_gpointer (res);
-  if (!ostree_repo_write_content (data->repo, data->expected_checksum,
-                                  data->object, data->file_object_length,
-                                  &data->result_csum,
-                                  cancellable, &error))
+  if (data->archive_path)
+    {
+      if (!_ostree_repo_write_archive_content (data->repo, data->expected_checksum,
+                                               data->archive_path, &data->result_csum,
+                                               cancellable, &error))
+        g_simple_async_result_take_error (res, error);
+    }
+  else if (!ostree_repo_write_content (data->repo, data->expected_checksum,
+                                       data->object, data->file_object_length,
+                                       &data->result_csum,
+                                       cancellable, &error))
     g_simple_async_result_take_error (res, error);
 }
 
@@ -1446,6 +2132,45 @@ ostree_repo_write_content_async (OstreeRepo               *self,
   g_object_unref (asyncdata->result);
 }
 
+/*
+ * _ostree_repo_write_archive_content_async:
+ * @self: Repo, in archive-z2 mode
+ * @expected_checksum: (allow-none): If provided, validate content against this checksum
+ * @archive_path: Content object in archive-z2 form, in the repo's tmp directory
+ * @cancellable: Cancellable
+ * @callback: Invoked when content is written
+ * @user_data: User data for @callback
+ *
+ * Asynchronous version of _ostree_repo_write_archive_content(); complete
+ * with ostree_repo_write_content_finish().
+ */
+void
+_ostree_repo_write_archive_content_async (OstreeRepo               *self,
+                                          const char               *expected_checksum,
+                                          GFile                    *archive_path,
+                                          GCancellable             *cancellable,
+                                          GAsyncReadyCallback       callback,
+                                          gpointer                  user_data)
+{
+  WriteContentAsyncData *asyncdata;
+
+  asyncdata = g_new0 (WriteContentAsyncData, 1);
+  asyncdata->repo = g_object_ref (self);
+  asyncdata->expected_checksum = g_strdup (expected_checksum);
+  asyncdata->archive_path = g_object_ref (archive_path);
+  asyncdata->cancellable = cancellable ? g_object_ref (cancellable) : NULL;
+
+  /* Shares ostree_repo_write_content_finish() */
+  asyncdata->result = g_simple_async_result_new ((GObject*) self,
+                                                 callback, user_data,
+                                                 ostree_repo_write_content_async);
+
+  g_simple_async_result_set_op_res_gpointer (asyncdata->result, asyncdata,
+                                             write_content_async_data_free);
+  g_simple_async_result_run_in_thread (asyncdata->result, write_content_thread, G_PRIORITY_DEFAULT, cancellable);
+  g_object_unref (asyncdata->result);
+}
+
 /**
  * ostree_repo_write_content_finish:
  * @self: a #OstreeRepo
@@ -1731,6 +2456,8 @@ struct OstreeRepoCommitModifier {
   gpointer xattr_user_data;
 
   OstreeSePolicy *sepolicy;
+
+  GFile *stat_cache_path;
 };
 
 OstreeRepoCommitFilterResult
@@ -1857,11 +2584,476 @@ get_modified_xattrs (OstreeRepo                       *self,
   return ret;
 }
 
+/*
+ * Committing a directory is a pipeline: the walker (the calling
+ * thread) runs the commit filter and gathers xattrs for each file,
+ * then hands it to a thread pool which reads, checksums, compresses
+ * and stores the content object.  Completed files are added to their
+ * #OstreeMutableTree in the order the walker found them, by
+ * commit_pipeline_drain().  At most COMMIT_PIPELINE_MAX_QUEUED files
+ * are in flight at once.
+ */
+#define COMMIT_PIPELINE_MAX_QUEUED 1024
+
+typedef struct {
+  OstreeMutableTree *mtree;
+  char *name;
+  GFile *path;
+  GFileInfo *file_info;
+  GVariant *xattrs;
+
+  /* Only set if a stat cache is in use */
+  char *relpath;
+  GFileInfo *stat_info;
+  guchar header_csum[32];
+
+  /* Set by write_content_thread() */
+  gboolean done;
+  char *checksum;
+  GError *error;
+} CommitContentTask;
+
+typedef struct {
+  OstreeRepo *repo;
+  GThreadPool *pool;
+  GQueue tasks;
+  GCancellable *cancellable;
+  GMutex lock;
+  GCond cond;
+
+  /* See ostree_repo_commit_modifier_set_stat_cache() */
+  GFile *stat_cache_path;
+  char *stat_cache_root; /* Path of the directory being committed, "" for / */
+  GVariant *stat_cache;
+  GPtrArray *stat_cache_entries;
+  guint64 stat_cache_time;
+} CommitPipeline;
+
+/*
+ * The stat cache is a (ta(sttutttayay)) variant: the time the walk
+ * that wrote it started, in microseconds, then one entry per file
+ * sorted by absolute path, holding its device, inode, raw mode, size,
+ * modification and change times in microseconds, the checksum of its
+ * (possibly modified) file header, and its content checksum.
+ */
+#define OSTREE_STAT_CACHE_FORMAT "(ta(sttutttayay))"
+#define OSTREE_STAT_CACHE_QUERYINFO OSTREE_GIO_FAST_QUERYINFO ",time::modified,time::modified-usec,time::changed,time::changed-usec"
+
+static void
+commit_content_task_free (CommitContentTask *task)
+{
+  g_object_unref (task->mtree);
+  g_free (task->name);
+  g_object_unref (task->path);
+  g_object_unref (task->file_info);
+  if (task->xattrs)
+    g_variant_unref (task->xattrs);
+  g_free (task->relpath);
+  g_clear_object (&task->stat_info);
+  g_free (task->checksum);
+  g_clear_error (&task->error);
+  g_free (task);
+}
+
+static gboolean
+write_content_task (OstreeRepo         *repo,
+                    CommitContentTask  *task,
+                    GCancellable       *cancellable,
+                    GError            **error)
+{
+  gboolean ret = FALSE;
+  guint64 file_obj_length;
+  gs_unref_object GInputStream *file_input = NULL;
+  gs_unref_object GInputStream *file_object_input = NULL;
+  gs_free guchar *child_file_csum = NULL;
+
+  if (g_file_info_get_file_type (task->file_info) == G_FILE_TYPE_REGULAR)
+    {
+      file_input = (GInputStream*)g_file_read (task->path, cancellable, error);
+      if (!file_input)
+        goto out;
+    }
+
+  if (!ostree_raw_file_to_content_stream (file_input,
+                                          task->file_info, task->xattrs,
+                                          &file_object_input, &file_obj_length,
+                                          cancellable, error))
+    goto out;
+  /* Let bare repositories copy the data straight from the file */
+  if (!write_object (repo, OSTREE_OBJECT_TYPE_FILE, NULL,
+                     file_object_input, file_obj_length,
+                     G_IS_FILE_DESCRIPTOR_BASED (file_input) ?
+                     g_file_descriptor_based_get_fd ((GFileDescriptorBased*)file_input) : -1,
+                     &child_file_csum, cancellable, error))
+    goto out;
+
+  task->checksum = ostree_checksum_from_bytes (child_file_csum);
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+static void
+write_content_thread (gpointer   data,
+                      gpointer   user_data)
+{
+  CommitContentTask *task = data;
+  CommitPipeline *pipeline = user_data;
+
+  (void) write_content_task (pipeline->repo, task, pipeline->cancellable, &task->error);
+
+  g_mutex_lock (&pipeline->lock);
+  task->done = TRUE;
+  g_cond_broadcast (&pipeline->cond);
+  g_mutex_unlock (&pipeline->lock);
+}
+
+static void
+stat_cache_header_csum (GFileInfo   *file_info,
+                        GVariant    *xattrs,
+                        guchar      *out_csum)
+{
+  gs_unref_variant GVariant *header = _ostree_file_header_new (file_info, xattrs);
+  OtChecksum *checksum = ot_checksum_new (G_CHECKSUM_SHA256);
+  gsize len = 32;
+
+  ot_checksum_update (checksum, g_variant_get_data (header), g_variant_get_size (header));
+  ot_checksum_get_digest (checksum, out_csum, &len);
+  ot_checksum_free (checksum);
+}
+
+static guint64
+stat_cache_get_time (GFileInfo   *file_info,
+                     const char  *attribute)
+{
+  gs_free char *usec_attribute = g_strconcat (attribute, "-usec", NULL);
+
+  return g_file_info_get_attribute_uint64 (file_info, attribute) * G_USEC_PER_SEC
+    + g_file_info_get_attribute_uint32 (file_info, usec_attribute);
+}
+
+static gboolean
+stat_cache_load (CommitPipeline  *pipeline,
+                 GFile           *path,
+                 GFile           *root,
+                 GCancellable    *cancellable,
+                 GError         **error)
+{
+  gboolean ret = FALSE;
+
+  pipeline->stat_cache_path = g_object_ref (path);
+  pipeline->stat_cache_root = g_file_get_path (root);
+  /* Relative paths start with '/' */
+  if (strcmp (pipeline->stat_cache_root, "/") == 0)
+    pipeline->stat_cache_root[0] = '\0';
+  pipeline->stat_cache_entries = g_ptr_array_new_with_free_func ((GDestroyNotify)g_variant_unref);
+  pipeline->stat_cache_time = g_get_real_time ();
+
+  if (g_file_query_exists (path, cancellable))
+    {
+      if (!ot_util_variant_map (path, G_VARIANT_TYPE (OSTREE_STAT_CACHE_FORMAT), FALSE,
+                                &pipeline->stat_cache, error))
+        goto out;
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/* Returns the cached entry for @relpath, if its stat information and
+ * file header still match.
+ */
+static GVariant *
+stat_cache_lookup (CommitPipeline  *pipeline,
+                   const char      *relpath,
+                   GFileInfo       *stat_info,
+                   const guchar    *header_csum)
+{
+  gs_unref_variant GVariant *entries = NULL;
+  gs_free char *key = NULL;
+  guint64 cache_time;
+  gsize lo, hi;
+
+  if (!pipeline->stat_cache)
+    return NULL;
+
+  key = g_strconcat (pipeline->stat_cache_root, relpath, NULL);
+
+  g_variant_get (pipeline->stat_cache, "(t@a(sttutttayay))", &cache_time, &entries);
+
+  lo = 0;
+  hi = g_variant_n_children (entries);
+  while (lo < hi)
+    {
+      gsize mid = lo + (hi - lo) / 2;
+      gs_unref_variant GVariant *entry = g_variant_get_child_value (entries, mid);
+      gs_unref_variant GVariant *entry_header_csum = NULL;
+      gs_unref_variant GVariant *entry_csum = NULL;
+      const char *entry_path;
+      guint64 dev, ino, size, mtime, ctime;
+      guint32 mode;
+      int c;
+
+      g_variant_get (entry, "(&sttuttt@ay@ay)", &entry_path, &dev, &ino, &mode, &size,
+                     &mtime, &ctime, &entry_header_csum, &entry_csum);
+
+      c = strcmp (entry_path, key);
+      if (c < 0)
+        {
+          lo = mid + 1;
+          continue;
+        }
+      else if (c > 0)
+        {
+          hi = mid;
+          continue;
+        }
+
+      /* Like git, don't trust entries for files modified around the
+       * time the cache was written, since a later change could have
+       * the same modification time.
+       */
+      if (mtime + G_USEC_PER_SEC >= cache_time)
+        return NULL;
+
+      if (dev != g_file_info_get_attribute_uint32 (stat_info, "unix::device")
+          || ino != g_file_info_get_attribute_uint64 (stat_info, "unix::inode")
+          || mode != g_file_info_get_attribute_uint32 (stat_info, "unix::mode")
+          || size != (guint64)g_file_info_get_size (stat_info)
+          || mtime != stat_cache_get_time (stat_info, "time::modified")
+          || ctime != stat_cache_get_time (stat_info, "time::changed"))
+        return NULL;
+
+      if (g_variant_get_size (entry_header_csum) != 32
+          || memcmp (g_variant_get_data (entry_header_csum), header_csum, 32) != 0
+          || g_variant_get_size (entry_csum) != 32)
+        return NULL;
+
+      return g_variant_ref (entry);
+    }
+
+  return NULL;
+}
+
+static void
+stat_cache_add (CommitPipeline  *pipeline,
+                const char      *relpath,
+                GFileInfo       *stat_info,
+                const guchar    *header_csum,
+                const char      *checksum)
+{
+  gs_free char *key = g_strconcat (pipeline->stat_cache_root, relpath, NULL);
+  GVariant *entry;
+
+  entry = g_variant_new ("(sttuttt@ay@ay)", key,
+                         (guint64)g_file_info_get_attribute_uint32 (stat_info, "unix::device"),
+                         g_file_info_get_attribute_uint64 (stat_info, "unix::inode"),
+                         g_file_info_get_attribute_uint32 (stat_info, "unix::mode"),
+                         (guint64)g_file_info_get_size (stat_info),
+                         stat_cache_get_time (stat_info, "time::modified"),
+                         stat_cache_get_time (stat_info, "time::changed"),
+                         ot_gvariant_new_bytearray (header_csum, 32),
+                         ostree_checksum_to_bytes_v (checksum));
+  g_ptr_array_add (pipeline->stat_cache_entries, g_variant_ref_sink (entry));
+}
+
+static int
+compare_stat_cache_entries (gconstpointer a,
+                            gconstpointer b)
+{
+  GVariant *entry_a = *(GVariant**)a;
+  GVariant *entry_b = *(GVariant**)b;
+  const char *relpath_a;
+  const char *relpath_b;
+
+  g_variant_get_child (entry_a, 0, "&s", &relpath_a);
+  g_variant_get_child (entry_b, 0, "&s", &relpath_b);
+  return strcmp (relpath_a, relpath_b);
+}
+
+static gboolean
+stat_cache_write (CommitPipeline  *pipeline,
+                  GCancellable    *cancellable,
+                  GError         **error)
+{
+  gboolean ret = FALSE;
+  GVariantBuilder builder;
+  gs_unref_variant GVariant *cache = NULL;
+  gsize root_len = strlen (pipeline->stat_cache_root);
+  guint i;
+
+  /* Several directories may share a cache, e.g. a commit made from
+   * more than one tree, so keep the entries for files outside this
+   * one.  Those written around the time of the previous walk were
+   * never trusted and would be under the new time, so drop them.
+   */
+  if (pipeline->stat_cache)
+    {
+      gs_unref_variant GVariant *old_entries = NULL;
+      guint64 old_cache_time;
+      gsize n;
+
+      g_variant_get (pipeline->stat_cache, "(t@a(sttutttayay))", &old_cache_time, &old_entries);
+      n = g_variant_n_children (old_entries);
+      for (i = 0; i < n; i++)
+        {
+          GVariant *entry = g_variant_get_child_value (old_entries, i);
+          const char *entry_path;
+          guint64 mtime;
+
+          g_variant_get_child (entry, 0, "&s", &entry_path);
+          g_variant_get_child (entry, 5, "t", &mtime);
+          if ((strncmp (entry_path, pipeline->stat_cache_root, root_len) == 0
+               && entry_path[root_len] == '/')
+              || mtime + G_USEC_PER_SEC >= old_cache_time)
+            {
+              g_variant_unref (entry);
+              continue;
+            }
+          g_ptr_array_add (pipeline->stat_cache_entries, entry);
+        }
+    }
+
+  g_ptr_array_sort (pipeline->stat_cache_entries, compare_stat_cache_entries);
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(sttutttayay)"));
+  for (i = 0; i < pipeline->stat_cache_entries->len; i++)
+    g_variant_builder_add_value (&builder, pipeline->stat_cache_entries->pdata[i]);
+  cache = g_variant_ref_sink (g_variant_new ("(t@a(sttutttayay))",
+                                             pipeline->stat_cache_time,
+                                             g_variant_builder_end (&builder)));
+
+  if (!g_file_replace_contents (pipeline->stat_cache_path,
+                                g_variant_get_data (cache),
+                                g_variant_get_size (cache),
+                                NULL, FALSE, 0, NULL,
+                                cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+static void
+commit_pipeline_init (CommitPipeline  *pipeline,
+                      OstreeRepo      *repo,
+                      GCancellable    *cancellable)
+{
+  pipeline->repo = repo;
+  pipeline->cancellable = cancellable;
+  g_queue_init (&pipeline->tasks);
+  g_mutex_init (&pipeline->lock);
+  g_cond_init (&pipeline->cond);
+  pipeline->pool = ot_thread_pool_new_nproc (write_content_thread, pipeline);
+}
+
+static void
+commit_pipeline_clear (CommitPipeline  *pipeline)
+{
+  CommitContentTask *task;
+
+  /* On error, drop files that haven't been started yet */
+  if (pipeline->pool)
+    g_thread_pool_free (pipeline->pool, TRUE, TRUE);
+  pipeline->pool = NULL;
+
+  while ((task = g_queue_pop_head (&pipeline->tasks)) != NULL)
+    commit_content_task_free (task);
+
+  g_clear_object (&pipeline->stat_cache_path);
+  g_clear_pointer (&pipeline->stat_cache_root, g_free);
+  g_clear_pointer (&pipeline->stat_cache, g_variant_unref);
+  g_clear_pointer (&pipeline->stat_cache_entries, g_ptr_array_unref);
+
+  g_mutex_clear (&pipeline->lock);
+  g_cond_clear (&pipeline->cond);
+}
+
+/* Add completed files to their trees, in walk order, until no more
+ * than @max_queued remain in flight.
+ */
+static gboolean
+commit_pipeline_drain (CommitPipeline  *pipeline,
+                       guint            max_queued,
+                       GError         **error)
+{
+  gboolean ret = FALSE;
+
+  while (g_queue_get_length (&pipeline->tasks) > max_queued)
+    {
+      CommitContentTask *task = g_queue_peek_head (&pipeline->tasks);
+
+      g_mutex_lock (&pipeline->lock);
+      while (!task->done)
+        g_cond_wait (&pipeline->cond, &pipeline->lock);
+      g_mutex_unlock (&pipeline->lock);
+
+      if (task->error)
+        {
+          g_propagate_error (error, task->error);
+          task->error = NULL;
+          goto out;
+        }
+
+      if (!ostree_mutable_tree_replace_file (task->mtree, task->name, task->checksum,
+                                             error))
+        goto out;
+
+      if (task->relpath)
+        stat_cache_add (pipeline, task->relpath, task->stat_info,
+                        task->header_csum, task->checksum);
+
+      commit_content_task_free (g_queue_pop_head (&pipeline->tasks));
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+static gboolean
+commit_pipeline_submit (CommitPipeline     *pipeline,
+                        OstreeMutableTree  *mtree,
+                        const char         *name,
+                        GFile              *path,
+                        GFileInfo          *file_info,
+                        GVariant           *xattrs,
+                        const char         *relpath,
+                        GFileInfo          *stat_info,
+                        const guchar       *header_csum,
+                        GError            **error)
+{
+  CommitContentTask *task = g_new0 (CommitContentTask, 1);
+
+  task->mtree = g_object_ref (mtree);
+  task->name = g_strdup (name);
+  task->path = g_object_ref (path);
+  task->file_info = g_object_ref (file_info);
+  task->xattrs = xattrs ? g_variant_ref (xattrs) : NULL;
+  if (pipeline->stat_cache_path)
+    {
+      task->relpath = g_strdup (relpath);
+      task->stat_info = g_object_ref (stat_info);
+      memcpy (task->header_csum, header_csum, 32);
+    }
+
+  g_queue_push_tail (&pipeline->tasks, task);
+  g_thread_pool_push (pipeline->pool, task, NULL);
+
+  if (g_queue_get_length (&pipeline->tasks) > COMMIT_PIPELINE_MAX_QUEUED)
+    return commit_pipeline_drain (pipeline, COMMIT_PIPELINE_MAX_QUEUED / 2, error);
+  return TRUE;
+}
+
 static gboolean
 write_directory_to_mtree_internal (OstreeRepo                  *self,
                                    GFile                       *dir,
                                    OstreeMutableTree           *mtree,
                                    OstreeRepoCommitModifier    *modifier,
+                                   CommitPipeline              *pipeline,
                                    GPtrArray                   *path,
                                    GCancellable                *cancellable,
                                    GError                     **error);
@@ -1873,6 +3065,7 @@ write_directory_content_to_mtree_internal (OstreeRepo                  *self,
                                            GFileInfo                   *child_info,
                                            OstreeMutableTree           *mtree,
                                            OstreeRepoCommitModifier    *modifier,
+                                           CommitPipeline              *pipeline,
                                            GPtrArray                   *path,
                                            GCancellable                *cancellable,
                                            GError                     **error)
@@ -1923,7 +3116,7 @@ write_directory_content_to_mtree_internal (OstreeRepo                  *self,
         goto out;
 
       if (!write_directory_to_mtree_internal (self, child, child_mtree,
-                                              modifier, path,
+                                              modifier, pipeline, path,
                                               cancellable, error))
         goto out;
     }
@@ -1937,18 +3130,12 @@ write_directory_content_to_mtree_internal (OstreeRepo                  *self,
     }
   else
     {
-      guint64 file_obj_length;
-      const char *loose_checksum;
-      gs_unref_object GInputStream *file_input = NULL;
+      char loose_checksum[65];
       gs_unref_variant GVariant *xattrs = NULL;
-      gs_unref_object GInputStream *file_object_input = NULL;
-      gs_free guchar *child_file_csum = NULL;
-      gs_free char *tmp_checksum = NULL;
 
       g_debug ("Adding: %s", gs_file_get_path_cached (child));
-      loose_checksum = devino_cache_lookup (self, child_info);
 
-      if (loose_checksum)
+      if (devino_cache_lookup (self, child_info, loose_checksum))
         {
           if (!ostree_mutable_tree_replace_file (mtree, name, loose_checksum,
                                                  error))
@@ -1956,33 +3143,58 @@ write_directory_content_to_mtree_internal (OstreeRepo                  *self,
         }
       else
         {
-          if (g_file_info_get_file_type (modified_info) == G_FILE_TYPE_REGULAR)
-            {
-              file_input = (GInputStream*)g_file_read (child, cancellable, error);
-              if (!file_input)
-                goto out;
-            }
+          guchar header_csum[32] = { 0, };
+          gs_unref_variant GVariant *cached = NULL;
 
+          /* Modifier callbacks and the SELinux policy are only ever
+           * called from this thread.
+           */
           if (!get_modified_xattrs (self, modifier,
                                     child_relpath, child_info, child,
                                     &xattrs,
                                     cancellable, error))
             goto out;
 
-          if (!ostree_raw_file_to_content_stream (file_input,
-                                                  modified_info, xattrs,
-                                                  &file_object_input, &file_obj_length,
-                                                  cancellable, error))
-            goto out;
-          if (!ostree_repo_write_content (self, NULL, file_object_input, file_obj_length,
-                                          &child_file_csum, cancellable, error))
-            goto out;
+          if (pipeline->stat_cache_path)
+            {
+              stat_cache_header_csum (modified_info, xattrs, header_csum);
+              cached = stat_cache_lookup (pipeline, child_relpath, child_info, header_csum);
+            }
 
-          g_free (tmp_checksum);
-          tmp_checksum = ostree_checksum_from_bytes (child_file_csum);
-          if (!ostree_mutable_tree_replace_file (mtree, name, tmp_checksum,
-                                                 error))
-            goto out;
+          if (cached)
+            {
+              gs_unref_variant GVariant *csum_v = NULL;
+              gboolean have_obj;
+
+              g_variant_get_child (cached, 8, "@ay", &csum_v);
+              ostree_checksum_inplace_from_bytes (ostree_checksum_bytes_peek (csum_v),
+                                                  loose_checksum);
+
+              /* The cache may outlive the object, e.g. after a prune */
+              if (!ostree_repo_has_object (self, OSTREE_OBJECT_TYPE_FILE, loose_checksum,
+                                           &have_obj, cancellable, error))
+                goto out;
+              if (!have_obj)
+                g_clear_pointer (&cached, g_variant_unref);
+            }
+
+          if (cached)
+            {
+              g_debug ("Unchanged: %s", gs_file_get_path_cached (child));
+              if (!ostree_mutable_tree_replace_file (mtree, name, loose_checksum,
+                                                     error))
+                goto out;
+              stat_cache_add (pipeline, child_relpath, child_info,
+                              header_csum, loose_checksum);
+            }
+          else
+            {
+              if (!commit_pipeline_submit (pipeline, mtree, name, child,
+                                           modified_info, xattrs,
+                                           child_relpath, child_info, header_csum,
+                                           error))
+                goto out;
+            }
         }
     }
 
@@ -1998,6 +3210,7 @@ write_directory_to_mtree_internal (OstreeRepo                  *self,
                                    GFile                       *dir,
                                    OstreeMutableTree           *mtree,
                                    OstreeRepoCommitModifier    *modifier,
+                                   CommitPipeline              *pipeline,
                                    GPtrArray                   *path,
                                    GCancellable                *cancellable,
                                    GError                     **error)
@@ -2082,7 +3295,9 @@ write_directory_to_mtree_internal (OstreeRepo                  *self,
     {
       gs_unref_object GFileEnumerator *dir_enum = NULL;
 
-      dir_enum = g_file_enumerate_children ((GFile*)dir, OSTREE_GIO_FAST_QUERYINFO,
+      dir_enum = g_file_enumerate_children ((GFile*)dir,
+                                            pipeline->stat_cache_path ? OSTREE_STAT_CACHE_QUERYINFO :
+                                            OSTREE_GIO_FAST_QUERYINFO,
                                             G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
                                             cancellable,
                                             error);
@@ -2100,7 +3315,7 @@ write_directory_to_mtree_internal (OstreeRepo                  *self,
             break;
 
           if (!write_directory_content_to_mtree_internal (self, repo_dir, dir_enum, child_info,
-                                                          mtree, modifier, path,
+                                                          mtree, modifier, pipeline, path,
                                                           cancellable, error))
             goto out;
         }
@@ -2133,14 +3348,34 @@ ostree_repo_write_directory_to_mtree (OstreeRepo                *self,
 {
   gboolean ret = FALSE;
   GPtrArray *path = NULL;
+  CommitPipeline pipeline = { 0, };
+
+  commit_pipeline_init (&pipeline, self, cancellable);
+
+  if (modifier && modifier->stat_cache_path && !OSTREE_IS_REPO_FILE (dir)
+      && g_file_is_native (dir))
+    {
+      if (!stat_cache_load (&pipeline, modifier->stat_cache_path, dir, cancellable, error))
+        goto out;
+    }
 
   path = g_ptr_array_new ();
-  if (!write_directory_to_mtree_internal (self, dir, mtree, modifier, path,
+  if (!write_directory_to_mtree_internal (self, dir, mtree, modifier, &pipeline, path,
                                           cancellable, error))
     goto out;
 
+  if (!commit_pipeline_drain (&pipeline, 0, error))
+    goto out;
+
+  if (pipeline.stat_cache_path)
+    {
+      if (!stat_cache_write (&pipeline, cancellable, error))
+        goto out;
+    }
+
   ret = TRUE;
  out:
+  commit_pipeline_clear (&pipeline);
   if (path)
     g_ptr_array_free (path, TRUE);
   return ret;
@@ -2283,6 +3518,7 @@ ostree_repo_commit_modifier_unref (OstreeRepoCommitModifier *modifier)
     modifier->xattr_destroy (modifier->xattr_user_data);
 
   g_clear_object (&modifier->sepolicy);
+  g_clear_object (&modifier->stat_cache_path);
 
   g_free (modifier);
   return;
@@ -2333,6 +3569,29 @@ ostree_repo_commit_modifier_set_sepolicy (OstreeRepoCommitModifier
   modifier->sepolicy = sepolicy ? g_object_ref (sepolicy) : NULL;
 }
 
+/**
+ * ostree_repo_commit_modifier_set_stat_cache:
+ * @modifier: An #OstreeRepoCommitModifier
+ * @path: (allow-none): Path to a stat cache file
+ *
+ * If @path is non-%NULL, ostree_repo_write_directory_to_mtree() will
+ * remember the content checksum of each file it commits in @path,
+ * along with its device, inode, size, mode and modification and change
+ * times.  When the same directory is committed again, files whose
+ * stat information and metadata are unchanged are not read.
+ *
+ * Entries are keyed by absolute path, and committing a directory only
+ * replaces the entries for files beneath it, so one cache file may be
+ * shared by several directories, e.g. all those making up a commit.
+ */
+void
+ostree_repo_commit_modifier_set_stat_cache (OstreeRepoCommitModifier              *modifier,
+                                            GFile                                 *path)
+{
+  g_clear_object (&modifier->stat_cache_path);
+  modifier->stat_cache_path = path ? g_object_ref (path) : NULL;
+}
+
 G_DEFINE_BOXED_TYPE(OstreeRepoCommitModifier, ostree_repo_commit_modifier,
                     ostree_repo_commit_modifier_ref,
                     ostree_repo_commit_modifier_unref);
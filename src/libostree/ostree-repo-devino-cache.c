@@ -0,0 +1,629 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2014 Colin Walters <walters@verbum.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include "ostree-core-private.h"
+#include "ostree-repo-private.h"
+#include "otutil.h"
+#include "libgsystem.h"
+
+/* ostree_repo_scan_hardlinks() maps the (device, inode) of each
+ * loose content object in a bare repository to its checksum, so
+ * that committing a tree hardlinked from a checkout can skip reading
+ * the files.
+ *
+ * Rather than enumerating every object directory for each commit,
+ * the mapping is kept in state/devino-cache: a fixed header followed
+ * by fixed size entries sorted by (device, inode), in host byte
+ * order, and looked up directly against the mapped file.  The header
+ * records the device and inode of the objects directory, so that a
+ * cache copied along with the repository is ignored.
+ *
+ * While the cache exists, every content object a transaction stores
+ * is added to loose_object_devino_hash, and the two are merged back
+ * into the file when the transaction is committed.  Entries can go
+ * stale when objects are deleted, so each hit is confirmed by a stat
+ * of the object itself.  Concurrent writers may lose each other's
+ * additions; that only costs a later commit some checksumming.
+ */
+
+#define OSTREE_DEVINO_CACHE_MAGIC "OSTDVIN1"
+#define OSTREE_DEVINO_CACHE_NAME "devino-cache"
+
+typedef struct {
+  char magic[8];
+  guint64 n_entries;
+  guint64 objects_dev;
+  guint64 objects_ino;
+} OstreeDevinoCacheHeader;
+
+typedef struct {
+  guint64 ino;
+  guint32 dev;
+  guint32 reserved;
+  guint8 csum[32];
+} OstreeDevinoCacheEntry;
+
+G_STATIC_ASSERT (sizeof (OstreeDevinoCacheHeader) == 32);
+G_STATIC_ASSERT (sizeof (OstreeDevinoCacheEntry) == 48);
+
+/* Devices are truncated to 32 bits, like the unix::device attribute */
+typedef struct {
+  guint32 dev;
+  guint64 ino;
+} OstreeDevIno;
+
+static guint
+devino_hash (gconstpointer a)
+{
+  const OstreeDevIno *a_i = a;
+  return (guint) (a_i->dev + a_i->ino);
+}
+
+static int
+devino_equal (gconstpointer   a,
+              gconstpointer   b)
+{
+  const OstreeDevIno *a_i = a;
+  const OstreeDevIno *b_i = b;
+  return a_i->dev == b_i->dev
+    && a_i->ino == b_i->ino;
+}
+
+static int
+compare_entries (gconstpointer a,
+                 gconstpointer b)
+{
+  const OstreeDevinoCacheEntry *entry_a = a;
+  const OstreeDevinoCacheEntry *entry_b = b;
+
+  if (entry_a->dev != entry_b->dev)
+    return entry_a->dev < entry_b->dev ? -1 : 1;
+  if (entry_a->ino != entry_b->ino)
+    return entry_a->ino < entry_b->ino ? -1 : 1;
+  return 0;
+}
+
+static void
+ensure_devino_hash (OstreeRepo *self)
+{
+  if (!self->loose_object_devino_hash)
+    self->loose_object_devino_hash = g_hash_table_new_full (devino_hash, devino_equal, g_free, g_free);
+}
+
+static void
+devino_hash_insert (GHashTable    *devino_hash,
+                    guint32        dev,
+                    guint64        ino,
+                    char          *checksum)
+{
+  OstreeDevIno *key = g_new (OstreeDevIno, 1);
+
+  key->dev = dev;
+  key->ino = ino;
+  g_hash_table_replace (devino_hash, key, checksum);
+}
+
+static gboolean
+scan_loose_devino (OstreeRepo                     *self,
+                   GHashTable                     *devino_cache,
+                   GCancellable                   *cancellable,
+                   GError                        **error)
+{
+  gboolean ret = FALSE;
+  guint i;
+  gs_unref_ptrarray GPtrArray *object_dirs = NULL;
+
+  if (!_ostree_repo_get_loose_object_dirs (self, &object_dirs, cancellable, error))
+    goto out;
+
+  for (i = 0; i < object_dirs->len; i++)
+    {
+      GFile *objdir = object_dirs->pdata[i];
+      gs_unref_object GFileEnumerator *enumerator = NULL;
+      gs_unref_object GFileInfo *file_info = NULL;
+      const char *dirname;
+
+      enumerator = g_file_enumerate_children (objdir, OSTREE_GIO_FAST_QUERYINFO,
+                                              G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                              cancellable,
+                                              error);
+      if (!enumerator)
+        goto out;
+
+      dirname = gs_file_get_basename_cached (objdir);
+
+      while (TRUE)
+        {
+          const char *name;
+          const char *dot;
+          guint32 type;
+          GString *checksum;
+
+          if (!gs_file_enumerator_iterate (enumerator, &file_info, NULL,
+                                           NULL, error))
+            goto out;
+          if (file_info == NULL)
+            break;
+
+          name = g_file_info_get_attribute_byte_string (file_info, "standard::name");
+          type = g_file_info_get_attribute_uint32 (file_info, "standard::type");
+
+          if (type == G_FILE_TYPE_DIRECTORY)
+            continue;
+
+          if (!g_str_has_suffix (name, ".file"))
+            continue;
+
+          dot = strrchr (name, '.');
+          g_assert (dot);
+
+          if ((dot - name) != 62)
+            continue;
+
+          checksum = g_string_new (dirname);
+          g_string_append_len (checksum, name, 62);
+
+          devino_hash_insert (devino_cache,
+                              g_file_info_get_attribute_uint32 (file_info, "unix::device"),
+                              g_file_info_get_attribute_uint64 (file_info, "unix::inode"),
+                              g_string_free (checksum, FALSE));
+        }
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/* Sets *out_map to NULL if there is no usable cache file */
+static gboolean
+map_devino_cache (OstreeRepo    *self,
+                  GBytes       **out_map,
+                  GError       **error)
+{
+  gboolean ret = FALSE;
+  int fd = -1;
+  GMappedFile *mfile = NULL;
+  gs_unref_object GFile *path = g_file_get_child (self->state_dir, OSTREE_DEVINO_CACHE_NAME);
+  gs_unref_bytes GBytes *ret_map = NULL;
+  const OstreeDevinoCacheHeader *header;
+  struct stat stbuf;
+  gsize size;
+
+  do
+    fd = open (gs_file_get_path_cached (path), O_RDONLY | O_CLOEXEC);
+  while (G_UNLIKELY (fd == -1 && errno == EINTR));
+  if (fd == -1)
+    {
+      if (errno != ENOENT)
+        {
+          ot_util_set_error_from_errno (error, errno);
+          goto out;
+        }
+      ret = TRUE;
+      *out_map = NULL;
+      goto out;
+    }
+
+  if (fstat (self->objects_dir_fd, &stbuf) != 0)
+    {
+      ot_util_set_error_from_errno (error, errno);
+      goto out;
+    }
+
+  mfile = g_mapped_file_new_from_fd (fd, FALSE, error);
+  if (!mfile)
+    goto out;
+  ret_map = g_mapped_file_get_bytes (mfile);
+
+  header = g_bytes_get_data (ret_map, &size);
+  if (size < sizeof (OstreeDevinoCacheHeader)
+      || memcmp (header->magic, OSTREE_DEVINO_CACHE_MAGIC, 8) != 0
+      || (size - sizeof (OstreeDevinoCacheHeader)) % sizeof (OstreeDevinoCacheEntry) != 0
+      || (size - sizeof (OstreeDevinoCacheHeader)) / sizeof (OstreeDevinoCacheEntry) != header->n_entries
+      || header->objects_dev != (guint64)stbuf.st_dev
+      || header->objects_ino != (guint64)stbuf.st_ino)
+    {
+      g_debug ("Ignoring invalid %s", gs_file_get_path_cached (path));
+      g_clear_pointer (&ret_map, g_bytes_unref);
+    }
+
+  ret = TRUE;
+  ot_transfer_out_value (out_map, &ret_map);
+ out:
+  if (mfile)
+    g_mapped_file_unref (mfile);
+  if (fd != -1)
+    (void) close (fd);
+  return ret;
+}
+
+static const OstreeDevinoCacheEntry *
+map_lookup (GBytes    *map,
+            guint32    dev,
+            guint64    ino)
+{
+  const OstreeDevinoCacheHeader *header = g_bytes_get_data (map, NULL);
+  const OstreeDevinoCacheEntry *entries = (const OstreeDevinoCacheEntry*)(header + 1);
+  OstreeDevinoCacheEntry key = { 0, };
+  guint64 lo = 0;
+  guint64 hi = header->n_entries;
+
+  key.dev = dev;
+  key.ino = ino;
+
+  while (lo < hi)
+    {
+      guint64 mid = lo + (hi - lo) / 2;
+      int c = compare_entries (&entries[mid], &key);
+
+      if (c < 0)
+        lo = mid + 1;
+      else if (c > 0)
+        hi = mid;
+      else
+        return &entries[mid];
+    }
+
+  return NULL;
+}
+
+static gboolean
+object_has_devino (OstreeRepo   *self,
+                   const char   *checksum,
+                   guint32       dev,
+                   guint64       ino)
+{
+  char loose_path[_OSTREE_LOOSE_PATH_MAX];
+  struct stat stbuf;
+
+  _ostree_loose_path (loose_path, checksum, OSTREE_OBJECT_TYPE_FILE, self->mode);
+  if (fstatat (self->objects_dir_fd, loose_path, &stbuf, AT_SYMLINK_NOFOLLOW) != 0)
+    return FALSE;
+
+  return (guint32)stbuf.st_dev == dev && (guint64)stbuf.st_ino == ino;
+}
+
+/**
+ * _ostree_repo_devino_cache_prepare:
+ * @self: Repo
+ *
+ * Called when a transaction starts; if @self has a cache file, track
+ * the content objects written so they can be merged into it.
+ */
+void
+_ostree_repo_devino_cache_prepare (OstreeRepo   *self)
+{
+  gs_unref_object GFile *path = NULL;
+
+  if (self->mode != OSTREE_REPO_MODE_BARE)
+    return;
+
+  path = g_file_get_child (self->state_dir, OSTREE_DEVINO_CACHE_NAME);
+  if (access (gs_file_get_path_cached (path), F_OK) == 0)
+    ensure_devino_hash (self);
+}
+
+/**
+ * _ostree_repo_devino_cache_ensure:
+ * @self: Repo
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Enable _ostree_repo_devino_cache_lookup() for @self and its parent
+ * repositories, mapping their cache files, or scanning the loose
+ * objects of any which don't have a valid one.
+ */
+gboolean
+_ostree_repo_devino_cache_ensure (OstreeRepo    *self,
+                                  GCancellable  *cancellable,
+                                  GError       **error)
+{
+  gboolean ret = FALSE;
+
+  if (self->parent_repo)
+    {
+      if (!_ostree_repo_devino_cache_ensure (self->parent_repo, cancellable, error))
+        goto out;
+    }
+
+  if (self->mode != OSTREE_REPO_MODE_BARE || self->devino_cache_loaded)
+    {
+      ret = TRUE;
+      goto out;
+    }
+
+  ensure_devino_hash (self);
+
+  if (!map_devino_cache (self, &self->devino_cache, error))
+    goto out;
+
+  if (!self->devino_cache)
+    {
+      if (!scan_loose_devino (self, self->loose_object_devino_hash, cancellable, error))
+        goto out;
+      self->devino_cache_scanned = TRUE;
+      self->devino_cache_dirty = TRUE;
+    }
+
+  self->devino_cache_loaded = TRUE;
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/**
+ * _ostree_repo_devino_cache_lookup:
+ * @self: Repo
+ * @dev: Device number, truncated to 32 bits
+ * @ino: Inode number
+ * @out_checksum: (out): Buffer of at least 65 bytes
+ *
+ * Returns: %TRUE if the file @dev, @ino is a content object of @self
+ * or one of its parent repositories, and write its checksum to
+ * @out_checksum.
+ */
+gboolean
+_ostree_repo_devino_cache_lookup (OstreeRepo   *self,
+                                  guint32       dev,
+                                  guint64       ino,
+                                  char         *out_checksum)
+{
+  gboolean found = FALSE;
+
+  if (self->devino_cache_loaded)
+    {
+      OstreeDevIno dev_ino;
+      const char *checksum;
+
+      dev_ino.dev = dev;
+      dev_ino.ino = ino;
+
+      g_mutex_lock (&self->cache_lock);
+      checksum = g_hash_table_lookup (self->loose_object_devino_hash, &dev_ino);
+      if (checksum)
+        {
+          memcpy (out_checksum, checksum, 65);
+          found = TRUE;
+        }
+      g_mutex_unlock (&self->cache_lock);
+
+      if (!found && self->devino_cache)
+        {
+          const OstreeDevinoCacheEntry *entry = map_lookup (self->devino_cache, dev, ino);
+          if (entry)
+            {
+              ostree_checksum_inplace_from_bytes (entry->csum, out_checksum);
+              found = TRUE;
+            }
+        }
+
+      if (found)
+        found = object_has_devino (self, out_checksum, dev, ino);
+    }
+
+  if (!found && self->parent_repo)
+    return _ostree_repo_devino_cache_lookup (self->parent_repo, dev, ino, out_checksum);
+
+  return found;
+}
+
+/**
+ * _ostree_repo_devino_cache_add:
+ * @self: Repo
+ * @checksum: Checksum of a content object just stored in @self
+ *
+ * Record @checksum in the cache, if one is being kept.  May be
+ * called from any thread.
+ */
+void
+_ostree_repo_devino_cache_add (OstreeRepo   *self,
+                               const char   *checksum)
+{
+  char loose_path[_OSTREE_LOOSE_PATH_MAX];
+  struct stat stbuf;
+
+  if (!self->loose_object_devino_hash)
+    return;
+
+  _ostree_loose_path (loose_path, checksum, OSTREE_OBJECT_TYPE_FILE, self->mode);
+  if (fstatat (self->objects_dir_fd, loose_path, &stbuf, AT_SYMLINK_NOFOLLOW) != 0)
+    return;
+
+  g_mutex_lock (&self->cache_lock);
+  devino_hash_insert (self->loose_object_devino_hash,
+                      (guint32)stbuf.st_dev, (guint64)stbuf.st_ino,
+                      g_strdup (checksum));
+  self->devino_cache_dirty = TRUE;
+  g_mutex_unlock (&self->cache_lock);
+}
+
+static gboolean
+write_devino_cache (OstreeRepo    *self,
+                    GCancellable  *cancellable,
+                    GError       **error)
+{
+  gboolean ret = FALSE;
+  GHashTableIter hashiter;
+  gpointer hkey, hvalue;
+  OstreeDevinoCacheHeader header = { { 0, }, };
+  gs_unref_array GArray *entries = NULL;
+  gs_free char *tmpname = NULL;
+  gs_unref_object GOutputStream *out = NULL;
+  gs_unref_object GFile *path = NULL;
+  struct stat stbuf;
+  gsize bytes_written;
+  guint64 i;
+
+  if (fstat (self->objects_dir_fd, &stbuf) != 0)
+    {
+      ot_util_set_error_from_errno (error, errno);
+      goto out;
+    }
+
+  entries = g_array_new (FALSE, TRUE, sizeof (OstreeDevinoCacheEntry));
+
+  if (self->devino_cache)
+    {
+      const OstreeDevinoCacheHeader *old_header = g_bytes_get_data (self->devino_cache, NULL);
+      const OstreeDevinoCacheEntry *old_entries = (const OstreeDevinoCacheEntry*)(old_header + 1);
+
+      for (i = 0; i < old_header->n_entries; i++)
+        {
+          OstreeDevIno dev_ino;
+
+          dev_ino.dev = old_entries[i].dev;
+          dev_ino.ino = old_entries[i].ino;
+          if (g_hash_table_contains (self->loose_object_devino_hash, &dev_ino))
+            continue;
+          g_array_append_val (entries, old_entries[i]);
+        }
+    }
+
+  g_hash_table_iter_init (&hashiter, self->loose_object_devino_hash);
+  while (g_hash_table_iter_next (&hashiter, &hkey, &hvalue))
+    {
+      const OstreeDevIno *dev_ino = hkey;
+      OstreeDevinoCacheEntry entry = { 0, };
+
+      entry.dev = dev_ino->dev;
+      entry.ino = dev_ino->ino;
+      ostree_checksum_inplace_to_bytes (hvalue, entry.csum);
+      g_array_append_val (entries, entry);
+    }
+
+  g_array_sort (entries, compare_entries);
+
+  memcpy (header.magic, OSTREE_DEVINO_CACHE_MAGIC, 8);
+  header.n_entries = entries->len;
+  header.objects_dev = stbuf.st_dev;
+  header.objects_ino = stbuf.st_ino;
+
+  if (!gs_file_open_in_tmpdir_at (self->tmp_dir_fd, 0644, &tmpname, &out,
+                                  cancellable, error))
+    goto out;
+  if (!g_output_stream_write_all (out, &header, sizeof (header), &bytes_written,
+                                  cancellable, error))
+    goto out;
+  if (!g_output_stream_write_all (out, entries->data,
+                                  entries->len * sizeof (OstreeDevinoCacheEntry),
+                                  &bytes_written, cancellable, error))
+    goto out;
+  if (!g_output_stream_close (out, cancellable, error))
+    goto out;
+
+  if (!gs_file_ensure_directory (self->state_dir, FALSE, cancellable, error))
+    goto out;
+
+  path = g_file_get_child (self->state_dir, OSTREE_DEVINO_CACHE_NAME);
+  if (renameat (self->tmp_dir_fd, tmpname, AT_FDCWD, gs_file_get_path_cached (path)) == -1)
+    {
+      ot_util_set_error_from_errno (error, errno);
+      goto out;
+    }
+  g_clear_pointer (&tmpname, g_free);
+
+  ret = TRUE;
+ out:
+  if (tmpname)
+    (void) unlinkat (self->tmp_dir_fd, tmpname, 0);
+  return ret;
+}
+
+/**
+ * _ostree_repo_devino_cache_flush:
+ * @self: Repo
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Merge the objects recorded during this transaction into the cache
+ * file, then release it.
+ */
+gboolean
+_ostree_repo_devino_cache_flush (OstreeRepo    *self,
+                                 GCancellable  *cancellable,
+                                 GError       **error)
+{
+  gboolean ret = FALSE;
+
+  if (!self->devino_cache_dirty)
+    {
+      ret = TRUE;
+      goto out;
+    }
+
+  if (!self->devino_cache_loaded)
+    {
+      if (!map_devino_cache (self, &self->devino_cache, error))
+        goto out;
+    }
+
+  /* Without a full scan or a valid file to merge into, the objects
+   * we wrote would be all the cache knew about.
+   */
+  if (self->devino_cache || self->devino_cache_scanned)
+    {
+      if (!write_devino_cache (self, cancellable, error))
+        goto out;
+    }
+
+  ret = TRUE;
+ out:
+  _ostree_repo_devino_cache_clear (self);
+  return ret;
+}
+
+/**
+ * _ostree_repo_devino_cache_clear:
+ * @self: Repo
+ *
+ * Drop the in-memory cache state, without writing it.
+ */
+void
+_ostree_repo_devino_cache_clear (OstreeRepo   *self)
+{
+  g_clear_pointer (&self->loose_object_devino_hash, g_hash_table_destroy);
+  g_clear_pointer (&self->devino_cache, g_bytes_unref);
+  self->devino_cache_loaded = FALSE;
+  self->devino_cache_scanned = FALSE;
+  self->devino_cache_dirty = FALSE;
+}
+
+/**
+ * _ostree_repo_devino_cache_invalidate:
+ * @self: Repo
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Delete the cache file, for example after objects have been pruned;
+ * the next ostree_repo_scan_hardlinks() will rebuild it.
+ */
+gboolean
+_ostree_repo_devino_cache_invalidate (OstreeRepo    *self,
+                                      GCancellable  *cancellable,
+                                      GError       **error)
+{
+  gs_unref_object GFile *path = g_file_get_child (self->state_dir, OSTREE_DEVINO_CACHE_NAME);
+
+  return ot_gfile_ensure_unlinked (path, cancellable, error);
+}
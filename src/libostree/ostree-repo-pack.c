@@ -0,0 +1,934 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2014 Colin Walters <walters@verbum.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include <gio/gfiledescriptorbased.h>
+
+#include "ostree-core-private.h"
+#include "ostree-repo-private.h"
+#include "otutil.h"
+#include "libgsystem.h"
+
+/* Pack files live in objects/pack/, as pairs:
+ *
+ *   ost{meta,data}pack-<checksum>.index
+ *   ost{meta,data}pack-<checksum>.data
+ *
+ * where <checksum> is the SHA256 of the index file.  Metadata packs
+ * hold commit, dirtree and dirmeta objects; data packs hold
+ * archive-z2 content objects in their on-disk (.filez) form.  Bare
+ * repositories never pack content, since checkouts hardlink it.
+ *
+ * The index is a fixed header followed by fixed size entries sorted
+ * by (checksum, objtype), all integers in big endian.  The header
+ * contains a 256-entry cumulative fanout table keyed by the first
+ * checksum byte, so a lookup is one table load and a binary search
+ * over a handful of entries, directly against the mapped file.
+ *
+ * The data file is a magic followed by the objects, each aligned to 8
+ * bytes so that metadata can be used in place as a #GVariant.
+ */
+
+#define OSTREE_PACK_INDEX_MAGIC "OSTPKIX1"
+#define OSTREE_PACK_DATA_MAGIC "OSTPKDT1"
+#define OSTREE_PACK_META_PREFIX "ostmetapack-"
+#define OSTREE_PACK_CONTENT_PREFIX "ostdatapack-"
+#define OSTREE_PACK_ALIGNMENT 8
+
+typedef struct {
+  char magic[8];
+  guint32 n_entries;
+  guint32 reserved;
+  guint32 fanout[256];
+} OstreePackIndexHeader;
+
+typedef struct {
+  guint8 csum[32];
+  guint8 objtype;
+  guint8 padding[7];
+  guint64 offset;
+  guint64 size;
+} OstreePackIndexEntry;
+
+G_STATIC_ASSERT (sizeof (OstreePackIndexHeader) == 1040);
+G_STATIC_ASSERT (sizeof (OstreePackIndexEntry) == 56);
+
+typedef struct {
+  char *checksum;
+  GBytes *index;
+  GBytes *data;
+  const OstreePackIndexHeader *header;
+  const OstreePackIndexEntry *entries;
+  guint32 n_entries;
+} OstreeRepoPack;
+
+static void
+pack_free (OstreeRepoPack *pack)
+{
+  g_free (pack->checksum);
+  g_bytes_unref (pack->index);
+  g_bytes_unref (pack->data);
+  g_free (pack);
+}
+
+static gboolean
+map_pack_file (int            dfd,
+               const char    *name,
+               GBytes       **out_bytes,
+               GCancellable  *cancellable,
+               GError       **error)
+{
+  gboolean ret = FALSE;
+  int fd = -1;
+  GMappedFile *mfile = NULL;
+
+  if (!gs_file_openat_noatime (dfd, name, &fd, cancellable, error))
+    goto out;
+
+  mfile = g_mapped_file_new_from_fd (fd, FALSE, error);
+  if (!mfile)
+    goto out;
+
+  ret = TRUE;
+  *out_bytes = g_mapped_file_get_bytes (mfile);
+ out:
+  if (mfile)
+    g_mapped_file_unref (mfile);
+  if (fd != -1)
+    (void) close (fd);
+  return ret;
+}
+
+static gboolean
+pack_open (int               pack_dfd,
+           const char       *prefix,
+           const char       *checksum,
+           OstreeRepoPack  **out_pack,
+           GCancellable     *cancellable,
+           GError          **error)
+{
+  gboolean ret = FALSE;
+  OstreeRepoPack *pack = NULL;
+  gs_free char *index_name = g_strconcat (prefix, checksum, ".index", NULL);
+  gs_free char *data_name = g_strconcat (prefix, checksum, ".data", NULL);
+  gsize index_size;
+  guint32 prev;
+  guint i;
+
+  pack = g_new0 (OstreeRepoPack, 1);
+  pack->checksum = g_strdup (checksum);
+
+  if (!map_pack_file (pack_dfd, index_name, &pack->index, cancellable, error))
+    goto out;
+  if (!map_pack_file (pack_dfd, data_name, &pack->data, cancellable, error))
+    goto out;
+
+  pack->header = g_bytes_get_data (pack->index, &index_size);
+  if (index_size < sizeof (OstreePackIndexHeader)
+      || memcmp (pack->header->magic, OSTREE_PACK_INDEX_MAGIC, 8) != 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Invalid pack index %s", index_name);
+      goto out;
+    }
+
+  pack->n_entries = GUINT32_FROM_BE (pack->header->n_entries);
+  if ((index_size - sizeof (OstreePackIndexHeader)) / sizeof (OstreePackIndexEntry) != pack->n_entries
+      || (index_size - sizeof (OstreePackIndexHeader)) % sizeof (OstreePackIndexEntry) != 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Truncated pack index %s", index_name);
+      goto out;
+    }
+  pack->entries = (const OstreePackIndexEntry*)(((const guint8*)pack->header) + sizeof (OstreePackIndexHeader));
+
+  prev = 0;
+  for (i = 0; i < 256; i++)
+    {
+      guint32 v = GUINT32_FROM_BE (pack->header->fanout[i]);
+      if (v < prev || v > pack->n_entries)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Invalid fanout table in pack index %s", index_name);
+          goto out;
+        }
+      prev = v;
+    }
+  if (prev != pack->n_entries)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Invalid fanout table in pack index %s", index_name);
+      goto out;
+    }
+
+  if (g_bytes_get_size (pack->data) < 8
+      || memcmp (g_bytes_get_data (pack->data, NULL), OSTREE_PACK_DATA_MAGIC, 8) != 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Invalid pack data %s", data_name);
+      goto out;
+    }
+
+  ret = TRUE;
+  *out_pack = pack;
+  pack = NULL;
+ out:
+  if (pack)
+    pack_free (pack);
+  return ret;
+}
+
+static const OstreePackIndexEntry *
+pack_lookup (OstreeRepoPack   *pack,
+             const guchar     *csum,
+             OstreeObjectType  objtype)
+{
+  guint32 lo, hi;
+
+  lo = csum[0] == 0 ? 0 : GUINT32_FROM_BE (pack->header->fanout[csum[0] - 1]);
+  hi = GUINT32_FROM_BE (pack->header->fanout[csum[0]]);
+
+  while (lo < hi)
+    {
+      guint32 mid = lo + (hi - lo) / 2;
+      const OstreePackIndexEntry *entry = &pack->entries[mid];
+      int c = memcmp (entry->csum, csum, 32);
+
+      if (c == 0)
+        c = (int)entry->objtype - (int)objtype;
+
+      if (c < 0)
+        lo = mid + 1;
+      else if (c > 0)
+        hi = mid;
+      else
+        return entry;
+    }
+
+  return NULL;
+}
+
+static gboolean
+open_pack_dir (OstreeRepo    *self,
+               gboolean       create,
+               int           *out_dfd,
+               GError       **error)
+{
+  if (create)
+    {
+      if (mkdirat (self->objects_dir_fd, "pack", 0777) == -1 && errno != EEXIST)
+        {
+          ot_util_set_error_from_errno (error, errno);
+          return FALSE;
+        }
+    }
+
+  *out_dfd = ot_opendirat (self->objects_dir_fd, "pack", TRUE);
+  if (*out_dfd == -1)
+    {
+      if (errno == ENOENT && !create)
+        return TRUE;
+      ot_util_set_error_from_errno (error, errno);
+      return FALSE;
+    }
+  return TRUE;
+}
+
+static guint64
+stat_mtime_nsec (const struct stat *stbuf)
+{
+  return (guint64)stbuf->st_mtim.tv_sec * G_GUINT64_CONSTANT (1000000000) + stbuf->st_mtim.tv_nsec;
+}
+
+/* Must be called with cache_lock held */
+static gboolean
+ensure_packs_loaded_unlocked (OstreeRepo    *self,
+                              GCancellable  *cancellable,
+                              GError       **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_ptrarray GPtrArray *meta_packs = NULL;
+  gs_unref_ptrarray GPtrArray *content_packs = NULL;
+  guint64 mtime = 0;
+  int pack_dfd = -1;
+  DIR *d = NULL;
+  struct dirent *dent;
+
+  if (self->cached_meta_indexes)
+    return TRUE;
+
+  meta_packs = g_ptr_array_new_with_free_func ((GDestroyNotify)pack_free);
+  content_packs = g_ptr_array_new_with_free_func ((GDestroyNotify)pack_free);
+
+  if (!open_pack_dir (self, FALSE, &pack_dfd, error))
+    goto out;
+
+  if (pack_dfd != -1)
+    {
+      struct stat stbuf;
+
+      /* Taken before reading the directory, so a pack added meanwhile
+       * makes the next check see a change.
+       */
+      if (fstat (pack_dfd, &stbuf) == -1)
+        {
+          ot_util_set_error_from_errno (error, errno);
+          goto out;
+        }
+      mtime = stat_mtime_nsec (&stbuf);
+
+      d = fdopendir (pack_dfd);
+      if (!d)
+        {
+          ot_util_set_error_from_errno (error, errno);
+          goto out;
+        }
+      pack_dfd = -1; /* Transfer ownership */
+
+      while ((dent = readdir (d)) != NULL)
+        {
+          const char *name = dent->d_name;
+          const char *prefix;
+          GPtrArray *target;
+          gs_free char *checksum = NULL;
+          OstreeRepoPack *pack;
+
+          if (g_str_has_prefix (name, OSTREE_PACK_META_PREFIX))
+            {
+              prefix = OSTREE_PACK_META_PREFIX;
+              target = meta_packs;
+            }
+          else if (g_str_has_prefix (name, OSTREE_PACK_CONTENT_PREFIX))
+            {
+              prefix = OSTREE_PACK_CONTENT_PREFIX;
+              target = content_packs;
+            }
+          else
+            continue;
+
+          if (!g_str_has_suffix (name, ".index"))
+            continue;
+
+          checksum = g_strndup (name + strlen (prefix),
+                                strlen (name) - strlen (prefix) - strlen (".index"));
+          if (!ostree_validate_checksum_string (checksum, NULL))
+            continue;
+
+          if (!pack_open (dirfd (d), prefix, checksum, &pack, cancellable, error))
+            goto out;
+          g_ptr_array_add (target, pack);
+        }
+    }
+
+  ret = TRUE;
+  self->cached_meta_indexes = meta_packs;
+  meta_packs = NULL;
+  self->cached_content_indexes = content_packs;
+  content_packs = NULL;
+  self->cached_packs_mtime = mtime;
+ out:
+  if (d)
+    (void) closedir (d);
+  if (pack_dfd != -1)
+    (void) close (pack_dfd);
+  return ret;
+}
+
+/* Must be called with cache_lock held.  Another process may have
+ * repacked since the packs were loaded; if objects/pack changed, load
+ * them again and set @out_reloaded.
+ */
+static gboolean
+reload_packs_if_changed_unlocked (OstreeRepo    *self,
+                                  gboolean      *out_reloaded,
+                                  GCancellable  *cancellable,
+                                  GError       **error)
+{
+  struct stat stbuf;
+  guint64 mtime = 0;
+
+  *out_reloaded = FALSE;
+
+  if (fstatat (self->objects_dir_fd, "pack", &stbuf, 0) == 0)
+    mtime = stat_mtime_nsec (&stbuf);
+  else if (errno != ENOENT)
+    {
+      ot_util_set_error_from_errno (error, errno);
+      return FALSE;
+    }
+
+  if (self->cached_meta_indexes && mtime == self->cached_packs_mtime)
+    return TRUE;
+
+  g_clear_pointer (&self->cached_meta_indexes, (GDestroyNotify) g_ptr_array_unref);
+  g_clear_pointer (&self->cached_content_indexes, (GDestroyNotify) g_ptr_array_unref);
+  if (!ensure_packs_loaded_unlocked (self, cancellable, error))
+    return FALSE;
+
+  *out_reloaded = TRUE;
+  return TRUE;
+}
+
+static GPtrArray *
+packs_for_objtype (OstreeRepo       *self,
+                   OstreeObjectType  objtype)
+{
+  return OSTREE_OBJECT_TYPE_IS_META (objtype) ?
+    self->cached_meta_indexes : self->cached_content_indexes;
+}
+
+/* Must be called with cache_lock held */
+static gboolean
+lookup_packed_object_unlocked (OstreeRepo           *self,
+                               OstreeObjectType      objtype,
+                               const char           *checksum,
+                               const guchar         *csum,
+                               gboolean             *out_found,
+                               GBytes              **out_data,
+                               GError              **error)
+{
+  GPtrArray *packs = packs_for_objtype (self, objtype);
+  guint i;
+
+  *out_found = FALSE;
+
+  for (i = 0; i < packs->len; i++)
+    {
+      OstreeRepoPack *pack = packs->pdata[i];
+      const OstreePackIndexEntry *entry = pack_lookup (pack, csum, objtype);
+      guint64 offset, size;
+
+      if (!entry)
+        continue;
+
+      offset = GUINT64_FROM_BE (entry->offset);
+      size = GUINT64_FROM_BE (entry->size);
+      if (offset > g_bytes_get_size (pack->data)
+          || size > g_bytes_get_size (pack->data) - offset)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Corrupted pack %s: object %s.%s out of bounds",
+                       pack->checksum, checksum,
+                       ostree_object_type_to_string (objtype));
+          return FALSE;
+        }
+
+      *out_found = TRUE;
+      if (out_data)
+        *out_data = g_bytes_new_from_bytes (pack->data, offset, size);
+      break;
+    }
+
+  return TRUE;
+}
+
+/**
+ * _ostree_repo_find_packed_object:
+ * @self: Repo
+ * @objtype: Object type
+ * @checksum: ASCII SHA256 checksum
+ * @out_found: (out): Whether or not the object is contained in a pack
+ * @out_data: (out) (allow-none): Stored object data, referencing the mapped pack
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Look up an object in the pack files of @self (not including any
+ * parent repository).  For content objects, the returned data is in
+ * archive-z2 form.  If the object isn't found, packs written since
+ * they were last loaded are picked up.
+ */
+gboolean
+_ostree_repo_find_packed_object (OstreeRepo           *self,
+                                 OstreeObjectType      objtype,
+                                 const char           *checksum,
+                                 gboolean             *out_found,
+                                 GBytes              **out_data,
+                                 GCancellable         *cancellable,
+                                 GError              **error)
+{
+  gboolean ret = FALSE;
+  gboolean locked = FALSE;
+  guchar csum[32];
+  gs_unref_bytes GBytes *ret_data = NULL;
+  gboolean ret_found = FALSE;
+  gboolean reloaded;
+
+  if (!OSTREE_OBJECT_TYPE_IS_META (objtype)
+      && self->mode != OSTREE_REPO_MODE_ARCHIVE_Z2)
+    {
+      *out_found = FALSE;
+      return TRUE;
+    }
+
+  ostree_checksum_inplace_to_bytes (checksum, csum);
+
+  g_mutex_lock (&self->cache_lock);
+  locked = TRUE;
+
+  if (!ensure_packs_loaded_unlocked (self, cancellable, error))
+    goto out;
+
+  if (!lookup_packed_object_unlocked (self, objtype, checksum, csum, &ret_found,
+                                      out_data ? &ret_data : NULL, error))
+    goto out;
+
+  if (!ret_found)
+    {
+      if (!reload_packs_if_changed_unlocked (self, &reloaded, cancellable, error))
+        goto out;
+      if (reloaded
+          && !lookup_packed_object_unlocked (self, objtype, checksum, csum, &ret_found,
+                                             out_data ? &ret_data : NULL, error))
+        goto out;
+    }
+
+  ret = TRUE;
+  *out_found = ret_found;
+  ot_transfer_out_value (out_data, &ret_data);
+ out:
+  if (locked)
+    g_mutex_unlock (&self->cache_lock);
+  return ret;
+}
+
+static void
+add_packed_objects (GHashTable     *inout_objects,
+                    OstreeRepoPack *pack)
+{
+  guint i;
+
+  for (i = 0; i < pack->n_entries; i++)
+    {
+      const OstreePackIndexEntry *entry = &pack->entries[i];
+      char checksum[65];
+      gs_unref_variant GVariant *key = NULL;
+      gs_unref_ptrarray GPtrArray *packs = g_ptr_array_new ();
+      gs_free const char **existing_packs = NULL;
+      gboolean is_loose = FALSE;
+      GVariant *existing;
+      GVariant *value;
+
+      ostree_checksum_inplace_from_bytes (entry->csum, checksum);
+      key = g_variant_ref_sink (ostree_object_name_serialize (checksum, entry->objtype));
+
+      existing = g_hash_table_lookup (inout_objects, key);
+      if (existing)
+        {
+          const char **iter;
+
+          g_variant_get (existing, "(b^a&s)", &is_loose, &existing_packs);
+          for (iter = existing_packs; iter && *iter; iter++)
+            g_ptr_array_add (packs, (char*)*iter);
+        }
+      g_ptr_array_add (packs, pack->checksum);
+
+      value = g_variant_new ("(b@as)", is_loose,
+                             g_variant_new_strv ((const char *const*)packs->pdata, packs->len));
+      g_hash_table_replace (inout_objects, g_variant_ref (key),
+                            g_variant_ref_sink (value));
+    }
+}
+
+/**
+ * _ostree_repo_list_packed_objects:
+ * @self: Repo
+ * @inout_objects: Map of serialized object name to %OSTREE_REPO_LIST_OBJECTS_VARIANT_TYPE
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Add the packed objects of @self to @inout_objects, appending the
+ * containing pack checksums to any entry which already exists.
+ */
+gboolean
+_ostree_repo_list_packed_objects (OstreeRepo     *self,
+                                  GHashTable     *inout_objects,
+                                  GCancellable   *cancellable,
+                                  GError        **error)
+{
+  gboolean ret = FALSE;
+  gboolean reloaded;
+  guint i;
+
+  g_mutex_lock (&self->cache_lock);
+
+  if (!reload_packs_if_changed_unlocked (self, &reloaded, cancellable, error))
+    goto out;
+
+  for (i = 0; i < self->cached_meta_indexes->len; i++)
+    add_packed_objects (inout_objects, self->cached_meta_indexes->pdata[i]);
+  for (i = 0; i < self->cached_content_indexes->len; i++)
+    add_packed_objects (inout_objects, self->cached_content_indexes->pdata[i]);
+
+  ret = TRUE;
+ out:
+  g_mutex_unlock (&self->cache_lock);
+  return ret;
+}
+
+typedef struct {
+  guint8 csum[32];
+  OstreeObjectType objtype;
+  guint64 offset;
+  guint64 size;
+} PackBuildEntry;
+
+static int
+compare_build_entries (gconstpointer a,
+                       gconstpointer b)
+{
+  const PackBuildEntry *entry_a = a;
+  const PackBuildEntry *entry_b = b;
+  int c = memcmp (entry_a->csum, entry_b->csum, 32);
+
+  if (c != 0)
+    return c;
+  return (int)entry_a->objtype - (int)entry_b->objtype;
+}
+
+static gboolean
+write_padding (GOutputStream  *out,
+               guint64        *inout_offset,
+               GCancellable   *cancellable,
+               GError        **error)
+{
+  static const guint8 zeroes[OSTREE_PACK_ALIGNMENT] = { 0, };
+  gsize padding = (OSTREE_PACK_ALIGNMENT - (*inout_offset % OSTREE_PACK_ALIGNMENT)) % OSTREE_PACK_ALIGNMENT;
+
+  if (padding > 0)
+    {
+      gsize bytes_written;
+      if (!g_output_stream_write_all (out, zeroes, padding, &bytes_written,
+                                      cancellable, error))
+        return FALSE;
+      *inout_offset += padding;
+    }
+  return TRUE;
+}
+
+static gboolean
+write_pack_data (OstreeRepo     *self,
+                 GArray         *entries,
+                 char          **out_tmpname,
+                 GCancellable   *cancellable,
+                 GError        **error)
+{
+  gboolean ret = FALSE;
+  gs_free char *tmpname = NULL;
+  gs_unref_object GOutputStream *out = NULL;
+  guint64 offset = 0;
+  gsize bytes_written;
+  guint i;
+
+  if (!gs_file_open_in_tmpdir_at (self->tmp_dir_fd, 0644, &tmpname, &out,
+                                  cancellable, error))
+    goto out;
+
+  if (!g_output_stream_write_all (out, OSTREE_PACK_DATA_MAGIC, 8, &bytes_written,
+                                  cancellable, error))
+    goto out;
+  offset += 8;
+
+  for (i = 0; i < entries->len; i++)
+    {
+      PackBuildEntry *entry = &g_array_index (entries, PackBuildEntry, i);
+      char checksum[65];
+      char loose_path[_OSTREE_LOOSE_PATH_MAX];
+      int fd = -1;
+      GMappedFile *mfile;
+      gboolean write_ok;
+
+      if (!write_padding (out, &offset, cancellable, error))
+        goto out;
+
+      ostree_checksum_inplace_from_bytes (entry->csum, checksum);
+      _ostree_loose_path (loose_path, checksum, entry->objtype, self->mode);
+
+      if (!gs_file_openat_noatime (self->objects_dir_fd, loose_path, &fd,
+                                   cancellable, error))
+        goto out;
+      mfile = g_mapped_file_new_from_fd (fd, FALSE, error);
+      (void) close (fd);
+      if (!mfile)
+        goto out;
+
+      entry->offset = offset;
+      entry->size = g_mapped_file_get_length (mfile);
+      write_ok = g_output_stream_write_all (out, g_mapped_file_get_contents (mfile),
+                                            entry->size, &bytes_written,
+                                            cancellable, error);
+      g_mapped_file_unref (mfile);
+      if (!write_ok)
+        goto out;
+      offset += entry->size;
+    }
+
+  if (!g_output_stream_flush (out, cancellable, error))
+    goto out;
+  if (!self->disable_fsync
+      && fsync (g_file_descriptor_based_get_fd ((GFileDescriptorBased*)out)) == -1)
+    {
+      ot_util_set_error_from_errno (error, errno);
+      goto out;
+    }
+  if (!g_output_stream_close (out, cancellable, error))
+    goto out;
+
+  ret = TRUE;
+  ot_transfer_out_value (out_tmpname, &tmpname);
+ out:
+  if (tmpname)
+    (void) unlinkat (self->tmp_dir_fd, tmpname, 0);
+  return ret;
+}
+
+static GBytes *
+build_pack_index (GArray *entries)
+{
+  gsize size = sizeof (OstreePackIndexHeader) + entries->len * sizeof (OstreePackIndexEntry);
+  guint8 *buf = g_malloc0 (size);
+  OstreePackIndexHeader *header = (OstreePackIndexHeader*)buf;
+  OstreePackIndexEntry *index_entries = (OstreePackIndexEntry*)(buf + sizeof (OstreePackIndexHeader));
+  guint32 fanout[256] = { 0, };
+  guint i;
+
+  memcpy (header->magic, OSTREE_PACK_INDEX_MAGIC, 8);
+  header->n_entries = GUINT32_TO_BE (entries->len);
+
+  for (i = 0; i < entries->len; i++)
+    {
+      PackBuildEntry *entry = &g_array_index (entries, PackBuildEntry, i);
+
+      memcpy (index_entries[i].csum, entry->csum, 32);
+      index_entries[i].objtype = entry->objtype;
+      index_entries[i].offset = GUINT64_TO_BE (entry->offset);
+      index_entries[i].size = GUINT64_TO_BE (entry->size);
+      fanout[entry->csum[0]]++;
+    }
+
+  for (i = 1; i < 256; i++)
+    fanout[i] += fanout[i-1];
+  for (i = 0; i < 256; i++)
+    header->fanout[i] = GUINT32_TO_BE (fanout[i]);
+
+  return g_bytes_new_take (buf, size);
+}
+
+static gboolean
+write_one_pack (OstreeRepo     *self,
+                int             pack_dfd,
+                const char     *prefix,
+                GArray         *entries,
+                GCancellable   *cancellable,
+                GError        **error)
+{
+  gboolean ret = FALSE;
+  gs_free char *data_tmpname = NULL;
+  gs_free char *index_tmpname = NULL;
+  gs_free char *pack_checksum = NULL;
+  gs_free char *data_name = NULL;
+  gs_free char *index_name = NULL;
+  gs_unref_bytes GBytes *index = NULL;
+  gs_unref_object GOutputStream *index_out = NULL;
+  gsize bytes_written;
+
+  g_array_sort (entries, compare_build_entries);
+
+  if (!write_pack_data (self, entries, &data_tmpname, cancellable, error))
+    goto out;
+
+  index = build_pack_index (entries);
+  pack_checksum = g_compute_checksum_for_bytes (G_CHECKSUM_SHA256, index);
+
+  if (!gs_file_open_in_tmpdir_at (self->tmp_dir_fd, 0644, &index_tmpname, &index_out,
+                                  cancellable, error))
+    goto out;
+  if (!g_output_stream_write_all (index_out, g_bytes_get_data (index, NULL),
+                                  g_bytes_get_size (index), &bytes_written,
+                                  cancellable, error))
+    goto out;
+  if (!g_output_stream_flush (index_out, cancellable, error))
+    goto out;
+  if (!self->disable_fsync
+      && fsync (g_file_descriptor_based_get_fd ((GFileDescriptorBased*)index_out)) == -1)
+    {
+      ot_util_set_error_from_errno (error, errno);
+      goto out;
+    }
+  if (!g_output_stream_close (index_out, cancellable, error))
+    goto out;
+
+  /* The index is what makes a pack visible, so it goes in last */
+  data_name = g_strconcat (prefix, pack_checksum, ".data", NULL);
+  index_name = g_strconcat (prefix, pack_checksum, ".index", NULL);
+  if (renameat (self->tmp_dir_fd, data_tmpname, pack_dfd, data_name) == -1)
+    {
+      ot_util_set_error_from_errno (error, errno);
+      goto out;
+    }
+  g_clear_pointer (&data_tmpname, g_free);
+  if (renameat (self->tmp_dir_fd, index_tmpname, pack_dfd, index_name) == -1)
+    {
+      ot_util_set_error_from_errno (error, errno);
+      goto out;
+    }
+  g_clear_pointer (&index_tmpname, g_free);
+
+  /* Lookups load the new pack along with any others */
+  g_mutex_lock (&self->cache_lock);
+  g_clear_pointer (&self->cached_meta_indexes, (GDestroyNotify) g_ptr_array_unref);
+  g_clear_pointer (&self->cached_content_indexes, (GDestroyNotify) g_ptr_array_unref);
+  g_mutex_unlock (&self->cache_lock);
+
+  ret = TRUE;
+ out:
+  if (data_tmpname)
+    (void) unlinkat (self->tmp_dir_fd, data_tmpname, 0);
+  if (index_tmpname)
+    (void) unlinkat (self->tmp_dir_fd, index_tmpname, 0);
+  return ret;
+}
+
+/**
+ * ostree_repo_repack:
+ * @self: Repo
+ * @out_n_objects_packed: (out) (allow-none): Number of loose objects moved into packs
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Move the loose metadata objects of @self into a new pack file,
+ * along with the loose content objects if @self is in
+ * %OSTREE_REPO_MODE_ARCHIVE_Z2 mode.  Packed objects are looked up
+ * via a memory mapped index, which avoids one file per object when
+ * traversing history.
+ *
+ * Note that pull over HTTP currently only retrieves loose objects, so
+ * a repository served to remote clients should not be repacked.
+ */
+gboolean
+ostree_repo_repack (OstreeRepo     *self,
+                    guint          *out_n_objects_packed,
+                    GCancellable   *cancellable,
+                    GError        **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_hashtable GHashTable *objects = NULL;
+  GHashTableIter hashiter;
+  gpointer key, value;
+  GArray *meta_entries = NULL;
+  GArray *content_entries = NULL;
+  int pack_dfd = -1;
+  gboolean loaded;
+  guint i;
+
+  meta_entries = g_array_new (FALSE, FALSE, sizeof (PackBuildEntry));
+  content_entries = g_array_new (FALSE, FALSE, sizeof (PackBuildEntry));
+
+  g_mutex_lock (&self->cache_lock);
+  loaded = ensure_packs_loaded_unlocked (self, cancellable, error);
+  g_mutex_unlock (&self->cache_lock);
+  if (!loaded)
+    goto out;
+
+  if (!ostree_repo_list_objects (self, OSTREE_REPO_LIST_OBJECTS_LOOSE, &objects,
+                                 cancellable, error))
+    goto out;
+
+  g_hash_table_iter_init (&hashiter, objects);
+  while (g_hash_table_iter_next (&hashiter, &key, &value))
+    {
+      const char *checksum;
+      OstreeObjectType objtype;
+      gboolean is_stored;
+      char loose_path[_OSTREE_LOOSE_PATH_MAX];
+      PackBuildEntry entry = { { 0, }, };
+
+      ostree_object_name_deserialize (key, &checksum, &objtype);
+
+      if (!OSTREE_OBJECT_TYPE_IS_META (objtype)
+          && self->mode != OSTREE_REPO_MODE_ARCHIVE_Z2)
+        continue;
+
+      /* Skip objects which are only in the parent repository */
+      if (!_ostree_repo_has_loose_object (self, checksum, objtype, &is_stored, loose_path,
+                                          cancellable, error))
+        goto out;
+      if (!is_stored)
+        continue;
+
+      ostree_checksum_inplace_to_bytes (checksum, entry.csum);
+      entry.objtype = objtype;
+      g_array_append_val (OSTREE_OBJECT_TYPE_IS_META (objtype) ? meta_entries : content_entries,
+                          entry);
+    }
+
+  if (meta_entries->len > 0 || content_entries->len > 0)
+    {
+      if (!open_pack_dir (self, TRUE, &pack_dfd, error))
+        goto out;
+    }
+
+  if (meta_entries->len > 0)
+    {
+      if (!write_one_pack (self, pack_dfd, OSTREE_PACK_META_PREFIX, meta_entries,
+                           cancellable, error))
+        goto out;
+    }
+  if (content_entries->len > 0)
+    {
+      if (!write_one_pack (self, pack_dfd, OSTREE_PACK_CONTENT_PREFIX, content_entries,
+                           cancellable, error))
+        goto out;
+    }
+
+  if (pack_dfd != -1 && !self->disable_fsync && fsync (pack_dfd) == -1)
+    {
+      ot_util_set_error_from_errno (error, errno);
+      goto out;
+    }
+
+  /* Now that the packs are safely on disk, drop the loose copies */
+  for (i = 0; i < meta_entries->len + content_entries->len; i++)
+    {
+      PackBuildEntry *entry = i < meta_entries->len ?
+        &g_array_index (meta_entries, PackBuildEntry, i) :
+        &g_array_index (content_entries, PackBuildEntry, i - meta_entries->len);
+      char checksum[65];
+      char loose_path[_OSTREE_LOOSE_PATH_MAX];
+
+      ostree_checksum_inplace_from_bytes (entry->csum, checksum);
+      _ostree_loose_path (loose_path, checksum, entry->objtype, self->mode);
+      if (unlinkat (self->objects_dir_fd, loose_path, 0) == -1 && errno != ENOENT)
+        {
+          ot_util_set_error_from_errno (error, errno);
+          goto out;
+        }
+    }
+
+  ret = TRUE;
+  if (out_n_objects_packed)
+    *out_n_objects_packed = meta_entries->len + content_entries->len;
+ out:
+  if (pack_dfd != -1)
+    (void) close (pack_dfd);
+  g_array_unref (meta_entries);
+  g_array_unref (content_entries);
+  return ret;
+}
@@ -54,15 +54,25 @@ struct OstreeRepo {
   OstreeRepoTransactionStats txn_stats;
 
   GMutex cache_lock;
-  GPtrArray *cached_meta_indexes;
-  GPtrArray *cached_content_indexes;
+  GPtrArray *cached_meta_indexes; /* Loaded metadata packs, NULL until first lookup */
+  GPtrArray *cached_content_indexes; /* Loaded content packs */
+  guint64 cached_packs_mtime; /* Modification time of objects/pack when loaded, in nanoseconds */
 
   gboolean inited;
   gboolean writable;
   gboolean in_transaction;
   gboolean disable_fsync;
-  GHashTable *loose_object_devino_hash;
+  gboolean batch_fsync;   /* One syncfs() at barriers instead of fsync() per file */
+  gboolean tmpfile_checked;     /* check_tmpfile_support() has run */
+  gboolean tmpfile_unsupported; /* O_TMPFILE failed for tmp/, or can't be linked */
+  gboolean tmpfile_link_empty_path; /* linkat (AT_EMPTY_PATH) works, /proc isn't needed */
+  GHashTable *loose_object_devino_hash; /* (dev, ino) -> checksum, protected by cache_lock */
+  GBytes *devino_cache;                 /* Mapped state/devino-cache */
+  gboolean devino_cache_loaded;
+  gboolean devino_cache_scanned;
+  gboolean devino_cache_dirty;
   GHashTable *updated_uncompressed_dirs;
+  GHashTable *uncompressed_cache_accessed; /* checksum -> index entry, protected by cache_lock */
   GHashTable *object_sizes;
 
   uid_t target_owner_uid;
@@ -72,6 +82,8 @@ struct OstreeRepo {
   OstreeRepoMode mode;
   gboolean enable_uncompressed_cache;
   gboolean generate_sizes;
+  int compression_level;
+  guint64 uncompressed_cache_size; /* Bytes; 0 means unlimited */
 
   OstreeRepo *parent_repo;
 };
@@ -82,6 +94,26 @@ _ostree_repo_ensure_loose_objdir_at (int             dfd,
                                      GCancellable   *cancellable,
                                      GError        **error);
 
+gboolean
+_ostree_repo_fsync_each_file (OstreeRepo *self);
+
+gboolean
+_ostree_repo_syncfs (OstreeRepo     *self,
+                     int             dfd,
+                     GCancellable   *cancellable,
+                     GError        **error);
+
+void
+_ostree_repo_uncompressed_cache_touch (OstreeRepo   *self,
+                                       const char   *checksum,
+                                       guint64       size);
+
+gboolean
+_ostree_repo_uncompressed_cache_flush (OstreeRepo    *self,
+                                       gboolean       force,
+                                       GCancellable  *cancellable,
+                                       GError       **error);
+
 gboolean
 _ostree_repo_find_object (OstreeRepo           *self,
                           OstreeObjectType      objtype,
@@ -90,6 +122,21 @@ _ostree_repo_find_object (OstreeRepo           *self,
                           GCancellable         *cancellable,
                           GError             **error);
 
+gboolean
+_ostree_repo_find_packed_object (OstreeRepo           *self,
+                                 OstreeObjectType      objtype,
+                                 const char           *checksum,
+                                 gboolean             *out_found,
+                                 GBytes              **out_data,
+                                 GCancellable         *cancellable,
+                                 GError              **error);
+
+gboolean
+_ostree_repo_list_packed_objects (OstreeRepo     *self,
+                                  GHashTable     *inout_objects,
+                                  GCancellable   *cancellable,
+                                  GError        **error);
+
 GFile *
 _ostree_repo_get_commit_metadata_loose_path (OstreeRepo        *self,
                                              const char        *checksum);
@@ -121,6 +168,34 @@ _ostree_repo_write_directory_meta (OstreeRepo   *self,
                                    guchar      **out_csum,
                                    GCancellable *cancellable,
                                    GError      **error);
+
+gboolean
+_ostree_repo_write_archive_content (OstreeRepo         *self,
+                                    const char         *expected_checksum,
+                                    GFile              *archive_path,
+                                    guchar            **out_csum,
+                                    GCancellable       *cancellable,
+                                    GError            **error);
+
+gboolean
+_ostree_repo_write_loose_object_reflink (OstreeRepo         *self,
+                                         OstreeObjectType    objtype,
+                                         const char         *checksum,
+                                         int                 src_fd,
+                                         GFileInfo          *file_info,
+                                         GVariant           *xattrs,
+                                         gboolean           *out_did_reflink,
+                                         GCancellable       *cancellable,
+                                         GError            **error);
+
+void
+_ostree_repo_write_archive_content_async (OstreeRepo               *self,
+                                          const char               *expected_checksum,
+                                          GFile                    *archive_path,
+                                          GCancellable             *cancellable,
+                                          GAsyncReadyCallback       callback,
+                                          gpointer                  user_data);
+
 gboolean
 _ostree_repo_update_refs (OstreeRepo        *self,
                           GHashTable        *refs,
@@ -145,6 +220,37 @@ _ostree_repo_file_new_root (OstreeRepo  *repo,
                             const char  *contents_checksum,
                             const char  *metadata_checksum);
 
+void
+_ostree_repo_devino_cache_prepare (OstreeRepo   *self);
+
+gboolean
+_ostree_repo_devino_cache_ensure (OstreeRepo    *self,
+                                  GCancellable  *cancellable,
+                                  GError       **error);
+
+gboolean
+_ostree_repo_devino_cache_lookup (OstreeRepo   *self,
+                                  guint32       dev,
+                                  guint64       ino,
+                                  char         *out_checksum);
+
+void
+_ostree_repo_devino_cache_add (OstreeRepo   *self,
+                               const char   *checksum);
+
+gboolean
+_ostree_repo_devino_cache_flush (OstreeRepo    *self,
+                                 GCancellable  *cancellable,
+                                 GError       **error);
+
+void
+_ostree_repo_devino_cache_clear (OstreeRepo   *self);
+
+gboolean
+_ostree_repo_devino_cache_invalidate (OstreeRepo    *self,
+                                      GCancellable  *cancellable,
+                                      GError       **error);
+
 OstreeRepoCommitFilterResult
 _ostree_repo_commit_modifier_apply (OstreeRepo               *self,
                                     OstreeRepoCommitModifier *modifier,
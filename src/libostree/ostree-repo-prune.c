@@ -212,6 +212,16 @@ ostree_repo_prune (OstreeRepo        *self,
                                      cancellable, error))
         goto out;
     }
+
+  /* Drop deleted objects from the hardlink cache; it is rebuilt by the
+   * next scan.
+   */
+  if (!(flags & OSTREE_REPO_PRUNE_FLAGS_NO_PRUNE) && data.n_unreachable_content > 0)
+    {
+      if (!_ostree_repo_devino_cache_invalidate (self, cancellable, error))
+        goto out;
+    }
+
   ret = TRUE;
   *out_objects_total = (data.n_reachable_meta + data.n_unreachable_meta +
                         data.n_reachable_content + data.n_unreachable_content);
@@ -53,7 +53,6 @@ typedef struct {
   gboolean          gpg_verify;
 
   GVariant         *summary;
-  GPtrArray        *static_delta_metas;
   GHashTable       *expected_commit_sizes; /* Maps commit checksum to known size */
   GHashTable       *commit_to_depth; /* Maps commit checksum maximum depth */
   GHashTable       *scanned_metadata; /* Maps object name to itself */
@@ -63,10 +62,13 @@ typedef struct {
   guint             n_outstanding_metadata_write_requests;
   guint             n_outstanding_content_fetches;
   guint             n_outstanding_content_write_requests;
+  guint             n_outstanding_deltapart_fetches;
   gint              n_requested_metadata;
   gint              n_requested_content;
+  gint              n_requested_deltaparts;
   guint             n_fetched_metadata;
   guint             n_fetched_content;
+  guint             n_fetched_deltaparts;
 
   int               maxdepth;
   guint64           start_time;
@@ -88,6 +90,14 @@ typedef struct {
   gboolean     is_detached_meta;
 } FetchObjectData;
 
+typedef struct {
+  OtPullData  *pull_data;
+  GVariant    *objects;
+  GVariant    *expected_checksum;
+  guint64      usize;
+  guint        i;
+} FetchStaticDeltaData;
+
 static SoupURI *
 suburi_new (SoupURI   *base,
             const char *first,
@@ -161,6 +171,8 @@ update_progress (gpointer user_data)
   ostree_async_progress_set_uint (pull_data->progress, "fetched", fetched);
   ostree_async_progress_set_uint (pull_data->progress, "requested", requested);
   ostree_async_progress_set_uint (pull_data->progress, "scanned-metadata", n_scanned_metadata);
+  ostree_async_progress_set_uint (pull_data->progress, "fetched-delta-parts", pull_data->n_fetched_deltaparts);
+  ostree_async_progress_set_uint (pull_data->progress, "total-delta-parts", pull_data->n_requested_deltaparts);
   ostree_async_progress_set_uint64 (pull_data->progress, "bytes-transferred", bytes_transferred);
   ostree_async_progress_set_uint64 (pull_data->progress, "start-time", start_time);
 
@@ -200,7 +212,8 @@ check_outstanding_requests_handle_error (OtPullData          *pull_data,
                                          GError              *error)
 {
   gboolean current_fetch_idle = (pull_data->n_outstanding_metadata_fetches == 0 &&
-                                 pull_data->n_outstanding_content_fetches == 0);
+                                 pull_data->n_outstanding_content_fetches == 0 &&
+                                 pull_data->n_outstanding_deltapart_fetches == 0);
   gboolean current_write_idle = (pull_data->n_outstanding_metadata_write_requests == 0 &&
                                  pull_data->n_outstanding_content_write_requests == 0);
   gboolean current_idle = current_fetch_idle && current_write_idle;
@@ -673,6 +686,19 @@ content_fetch_on_complete (GObject        *object,
   g_assert (objtype == OSTREE_OBJECT_TYPE_FILE);
 
   g_debug ("fetch of %s complete", ostree_object_to_string (checksum, objtype));
+
+  /* The remote is always archive-z2; if we are too, keep the
+   * compressed object as is rather than recompressing it.
+   */
+  if (ostree_repo_get_mode (pull_data->repo) == OSTREE_REPO_MODE_ARCHIVE_Z2)
+    {
+      pull_data->n_outstanding_content_write_requests++;
+      _ostree_repo_write_archive_content_async (pull_data->repo, checksum,
+                                                temp_path,
+                                                cancellable,
+                                                content_fetch_on_write_complete, fetch_data);
+      goto out;
+    }
   
   if (!ostree_content_file_parse (TRUE, temp_path, FALSE,
                                   &file_in, &file_info, &xattrs,
@@ -1198,58 +1224,388 @@ load_remote_repo_config (OtPullData    *pull_data,
   return ret;
 }
 
-#if 0
 static gboolean
 request_static_delta_meta_sync (OtPullData  *pull_data,
-                                const char  *ref,
-                                const char  *checksum,
+                                const char  *from_revision,
+                                const char  *to_revision,
                                 GVariant   **out_delta_meta,
                                 GCancellable *cancellable,
                                 GError     **error)
 {
   gboolean ret = FALSE;
-  gs_free char *from_revision = NULL;
-  SoupURI *target_uri = NULL;
+  gs_free char *delta_name = _ostree_get_relative_static_delta_path (from_revision, to_revision);
+  gs_unref_bytes GBytes *delta_meta_data = NULL;
   gs_unref_variant GVariant *ret_delta_meta = NULL;
+  SoupURI *target_uri = NULL;
 
-  if (!ostree_repo_resolve_rev (pull_data->repo, ref, TRUE, &from_revision, error))
+  target_uri = suburi_new (pull_data->base_uri, delta_name, NULL);
+
+  if (!fetch_uri_contents_membuf_sync (pull_data, target_uri, FALSE, TRUE,
+                                       &delta_meta_data,
+                                       cancellable, error))
     goto out;
 
-  if (from_revision == NULL)
+  if (delta_meta_data)
     {
-      initiate_commit_scan (pull_data, checksum);
+      ret_delta_meta = ot_variant_new_from_bytes ((GVariantType*)OSTREE_STATIC_DELTA_META_FORMAT,
+                                                  delta_meta_data, FALSE);
+      g_variant_ref_sink (ret_delta_meta);
     }
-  else
+  
+  ret = TRUE;
+  gs_transfer_out_value (out_delta_meta, &ret_delta_meta);
+ out:
+  if (target_uri)
+    soup_uri_free (target_uri);
+  return ret;
+}
+
+static gboolean
+fetch_commit_detached_metadata_sync (OtPullData    *pull_data,
+                                     const char    *checksum,
+                                     GCancellable  *cancellable,
+                                     GError       **error)
+{
+  gboolean ret = FALSE;
+  char buf[_OSTREE_LOOSE_PATH_MAX];
+  gs_unref_bytes GBytes *bytes = NULL;
+  SoupURI *target_uri = NULL;
+
+  _ostree_loose_path_with_suffix (buf, checksum, OSTREE_OBJECT_TYPE_COMMIT,
+                                  pull_data->remote_mode, "meta");
+  target_uri = suburi_new (pull_data->base_uri, "objects", buf, NULL);
+
+  if (!fetch_uri_contents_membuf_sync (pull_data, target_uri, FALSE, TRUE,
+                                       &bytes, cancellable, error))
+    goto out;
+
+  if (bytes)
     {
-      gs_free char *delta_name = _ostree_get_relative_static_delta_path (from_revision, checksum);
-      gs_unref_bytes GBytes *delta_meta_data = NULL;
-      gs_unref_variant GVariant *delta_meta = NULL;
+      gs_unref_variant GVariant *metadata =
+        g_variant_ref_sink (ot_variant_new_from_bytes (G_VARIANT_TYPE ("a{sv}"), bytes, FALSE));
 
-      target_uri = suburi_new (pull_data->base_uri, delta_name, NULL);
+      if (!ostree_repo_write_commit_detached_metadata (pull_data->repo, checksum, metadata,
+                                                       cancellable, error))
+        goto out;
+    }
 
-      if (!fetch_uri_contents_membuf_sync (pull_data, target_uri, FALSE, TRUE,
-                                           &delta_meta_data,
-                                           pull_data->cancellable, error))
+  ret = TRUE;
+ out:
+  if (target_uri)
+    soup_uri_free (target_uri);
+  return ret;
+}
+
+static void
+fetch_static_delta_data_free (FetchStaticDeltaData *fetch_data)
+{
+  g_variant_unref (fetch_data->objects);
+  g_variant_unref (fetch_data->expected_checksum);
+  g_free (fetch_data);
+}
+
+static void
+static_deltapart_fetch_on_complete (GObject           *object,
+                                    GAsyncResult      *result,
+                                    gpointer           user_data)
+{
+  FetchStaticDeltaData *fetch_data = user_data;
+  OtPullData *pull_data = fetch_data->pull_data;
+  gs_unref_object GFile *temp_path = NULL;
+  gs_unref_bytes GBytes *bytes = NULL;
+  gs_unref_variant GVariant *part = NULL;
+  GMappedFile *mfile = NULL;
+  GError *local_error = NULL;
+  GError **error = &local_error;
+
+  g_debug ("fetch static delta part %u complete", fetch_data->i);
+
+  temp_path = _ostree_fetcher_request_uri_with_partial_finish ((OstreeFetcher*)object, result, error);
+  if (!temp_path)
+    goto out;
+
+  mfile = gs_file_map_noatime (temp_path, pull_data->cancellable, error);
+  if (!mfile)
+    goto out;
+  bytes = g_mapped_file_get_bytes (mfile);
+  g_mapped_file_unref (mfile);
+
+  /* We hold the mapping now, see comment in content fetch path */
+  (void) gs_file_unlink (temp_path, NULL, NULL);
+
+  if (!_ostree_static_delta_part_open (bytes, ostree_checksum_bytes_peek (fetch_data->expected_checksum),
+                                       fetch_data->usize,
+                                       &part, pull_data->cancellable, error))
+    goto out;
+
+  if (!_ostree_static_delta_part_execute (pull_data->repo, fetch_data->objects, part,
+                                          pull_data->cancellable, error))
+    {
+      g_prefix_error (error, "executing delta part %u: ", fetch_data->i);
+      goto out;
+    }
+
+  pull_data->n_fetched_deltaparts++;
+ out:
+  g_assert (pull_data->n_outstanding_deltapart_fetches > 0);
+  pull_data->n_outstanding_deltapart_fetches--;
+  check_outstanding_requests_handle_error (pull_data, local_error);
+  fetch_static_delta_data_free (fetch_data);
+}
+
+/* Estimated cost in bytes of an individual object request beyond its
+ * content (HTTP request and response headers), used to weigh a delta
+ * against fetching the objects it contains one by one.
+ */
+#define OSTREE_PULL_OBJECT_REQUEST_OVERHEAD 512
+
+/*
+ * Add the estimated cost of the parts of @delta_meta which contain
+ * objects we don't have to @inout_delta_cost, and that of fetching
+ * those objects individually to @inout_objects_cost.
+ */
+static gboolean
+static_delta_add_costs (OtPullData   *pull_data,
+                        GVariant     *delta_meta,
+                        guint64      *inout_delta_cost,
+                        guint64      *inout_objects_cost,
+                        GCancellable *cancellable,
+                        GError      **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_variant GVariant *headers = NULL;
+  guint i, n;
+
+  headers = g_variant_get_child_value (delta_meta, 3);
+  n = g_variant_n_children (headers);
+
+  for (i = 0; i < n; i++)
+    {
+      guint64 size;
+      guint64 usize;
+      guint n_objects;
+      guint n_missing;
+      gboolean have_all;
+      gs_unref_variant GVariant *header = NULL;
+      gs_unref_variant GVariant *csum_v = NULL;
+      gs_unref_variant GVariant *objects = NULL;
+
+      header = g_variant_get_child_value (headers, i);
+      g_variant_get (header, "(@aytt@ay)", &csum_v, &size, &usize, &objects);
+
+      if (!ostree_checksum_bytes_peek_validate (csum_v, error))
         goto out;
 
-      if (delta_meta_data)
-        {
-          ret_delta_meta = ot_variant_new_from_bytes ((GVariantType*)OSTREE_STATIC_DELTA_META_FORMAT,
-                                                      delta_meta_data, FALSE);
-        }
+      if (!_ostree_repo_static_delta_part_have_all_objects (pull_data->repo, objects,
+                                                            &have_all, &n_missing,
+                                                            cancellable, error))
+        goto out;
+
+      if (have_all)
+        continue;
+
+      n_objects = g_variant_n_children (objects) / OSTREE_STATIC_DELTA_OBJTYPE_CSUM_LEN;
+      *inout_delta_cost += size;
+      *inout_objects_cost += (size * n_missing) / n_objects;
+      *inout_objects_cost += n_missing * OSTREE_PULL_OBJECT_REQUEST_OVERHEAD;
     }
-  
+
   ret = TRUE;
-  gs_transfer_out_value (out_delta_meta, &ret_delta_meta);
  out:
   return ret;
 }
-#endif
 
-static void
-process_one_static_delta_meta (OtPullData   *pull_data,
-                               GVariant     *delta_meta)
+/*
+ * Fetch and execute the parts of @delta_meta which contain objects we
+ * don't have, and wait for them to complete.
+ */
+static gboolean
+fetch_static_delta_parts (OtPullData   *pull_data,
+                          const char   *from_revision,
+                          const char   *to_revision,
+                          GVariant     *delta_meta,
+                          GCancellable *cancellable,
+                          GError      **error)
 {
+  gboolean ret = FALSE;
+  gs_unref_variant GVariant *headers = NULL;
+  guint i, n;
+
+  headers = g_variant_get_child_value (delta_meta, 3);
+  n = g_variant_n_children (headers);
+
+  for (i = 0; i < n; i++)
+    {
+      guint64 size;
+      guint64 usize;
+      gboolean have_all;
+      gs_free char *deltapart_path = NULL;
+      gs_unref_variant GVariant *header = NULL;
+      gs_unref_variant GVariant *csum_v = NULL;
+      gs_unref_variant GVariant *objects = NULL;
+      FetchStaticDeltaData *fetch_data;
+      SoupURI *target_uri;
+
+      header = g_variant_get_child_value (headers, i);
+      g_variant_get (header, "(@aytt@ay)", &csum_v, &size, &usize, &objects);
+
+      if (!_ostree_repo_static_delta_part_have_all_objects (pull_data->repo, objects,
+                                                            &have_all, NULL,
+                                                            cancellable, error))
+        goto out;
+
+      if (have_all)
+        continue;
+
+      fetch_data = g_new0 (FetchStaticDeltaData, 1);
+      fetch_data->pull_data = pull_data;
+      fetch_data->i = i;
+      fetch_data->expected_checksum = g_variant_ref (csum_v);
+      fetch_data->usize = usize;
+      fetch_data->objects = g_variant_ref (objects);
+
+      deltapart_path = _ostree_get_relative_static_delta_part_path (from_revision, to_revision, i);
+      target_uri = suburi_new (pull_data->base_uri, deltapart_path, NULL);
+      _ostree_fetcher_request_uri_with_partial_async (pull_data->fetcher, target_uri, size,
+                                                      pull_data->cancellable,
+                                                      static_deltapart_fetch_on_complete,
+                                                      fetch_data);
+      pull_data->n_outstanding_deltapart_fetches++;
+      pull_data->n_requested_deltaparts++;
+      soup_uri_free (target_uri);
+    }
+
+  if (!run_mainloop_monitor_fetcher (pull_data))
+    goto out;
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/*
+ * Apply the static delta described by @delta_meta, fetching only the
+ * parts which contain objects we don't have.  Since a part is only
+ * available as a whole, a part which is mostly present locally can
+ * cost more than fetching its missing objects individually; in that
+ * case, and if a delta it chains to is unavailable, @out_used_delta
+ * is set to %FALSE and the caller should fall back to scanning the
+ * commit.
+ *
+ * The deltas of a chain are applied in order, since each one may
+ * need objects of the commit the previous one produced.
+ */
+static gboolean
+process_one_static_delta (OtPullData   *pull_data,
+                          const char   *from_revision,
+                          const char   *to_revision,
+                          GVariant     *delta_meta,
+                          gboolean     *out_used_delta,
+                          GCancellable *cancellable,
+                          GError      **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_variant GVariant *fallbacks_v = NULL;
+  gs_unref_ptrarray GPtrArray *fallbacks = NULL;
+  gs_unref_ptrarray GPtrArray *fallback_metas = NULL;
+  guint64 delta_cost = 0;
+  guint64 objects_cost = 0;
+  guint i;
+  gs_free char *delta_name = NULL;
+
+  *out_used_delta = FALSE;
+
+  if (from_revision)
+    delta_name = g_strconcat (from_revision, "-", to_revision, NULL);
+  else
+    delta_name = g_strdup (to_revision);
+
+  fallbacks_v = g_variant_get_child_value (delta_meta, 2);
+  if (!_ostree_static_delta_parse_fallbacks (fallbacks_v, from_revision, to_revision,
+                                             &fallbacks, error))
+    goto out;
+
+  fallback_metas = g_ptr_array_new_with_free_func ((GDestroyNotify)g_variant_unref);
+  for (i = 0; i < fallbacks->len; i += 2)
+    {
+      const char *fallback_from = fallbacks->pdata[i];
+      const char *fallback_to = fallbacks->pdata[i+1];
+      gs_unref_variant GVariant *fallback_meta = NULL;
+      gs_unref_variant GVariant *nested_fallbacks = NULL;
+
+      if (!request_static_delta_meta_sync (pull_data, fallback_from, fallback_to,
+                                           &fallback_meta, cancellable, error))
+        goto out;
+
+      if (!fallback_meta)
+        {
+          g_debug ("delta %s needs missing delta %s-%s; not using it",
+                   delta_name, fallback_from, fallback_to);
+          ret = TRUE;
+          goto out;
+        }
+
+      nested_fallbacks = g_variant_get_child_value (fallback_meta, 2);
+      if (g_variant_n_children (nested_fallbacks) > 0)
+        {
+          g_debug ("delta %s-%s in chain %s has fallbacks itself; not using it",
+                   fallback_from, fallback_to, delta_name);
+          ret = TRUE;
+          goto out;
+        }
+
+      if (!static_delta_add_costs (pull_data, fallback_meta, &delta_cost, &objects_cost,
+                                   cancellable, error))
+        goto out;
+
+      g_ptr_array_add (fallback_metas, g_variant_ref (fallback_meta));
+    }
+
+  if (!static_delta_add_costs (pull_data, delta_meta, &delta_cost, &objects_cost,
+                               cancellable, error))
+    goto out;
+
+  if (delta_cost > objects_cost)
+    {
+      g_debug ("delta %s costs %" G_GUINT64_FORMAT " bytes, objects %" G_GUINT64_FORMAT "; fetching objects",
+               delta_name, delta_cost, objects_cost);
+      ret = TRUE;
+      goto out;
+    }
+
+  *out_used_delta = TRUE;
+
+  if (!fetch_commit_detached_metadata_sync (pull_data, to_revision, cancellable, error))
+    goto out;
+
+  /* Mark the commit as partial, so that the scan after applying the
+   * delta traverses it fully, verifying it and picking up anything
+   * the delta didn't provide.
+   */
+  {
+    gs_unref_object GFile *commitpartial_path = get_commitpartial_path (pull_data->repo, to_revision);
+    if (!g_file_replace_contents (commitpartial_path, "", 0, NULL, FALSE,
+                                  G_FILE_CREATE_REPLACE_DESTINATION, NULL,
+                                  cancellable, error))
+      goto out;
+  }
+
+  for (i = 0; i < fallback_metas->len; i++)
+    {
+      g_debug ("applying delta %s-%s of chain %s", (char*)fallbacks->pdata[i*2],
+               (char*)fallbacks->pdata[i*2+1], delta_name);
+      if (!fetch_static_delta_parts (pull_data, fallbacks->pdata[i*2], fallbacks->pdata[i*2+1],
+                                     fallback_metas->pdata[i], cancellable, error))
+        goto out;
+    }
+
+  if (!fetch_static_delta_parts (pull_data, from_revision, to_revision, delta_meta,
+                                 cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  return ret;
 }
 
 /* documented in ostree-repo.c */
@@ -1306,7 +1662,6 @@ ostree_repo_pull_with_options (OstreeRepo             *self,
   gpointer key, value;
   gboolean tls_permissive = FALSE;
   OstreeFetcherConfigFlags fetcher_flags = 0;
-  guint i;
   gs_free char *remote_key = NULL;
   gs_free char *path = NULL;
   gs_free char *baseurl = NULL;
@@ -1537,8 +1892,6 @@ ostree_repo_pull_with_options (OstreeRepo             *self,
       goto out;
     }
 
-  pull_data->static_delta_metas = g_ptr_array_new_with_free_func ((GDestroyNotify)g_variant_unref);
-
   if (is_mirror && !refs_to_fetch && !configured_branches)
     {
       SoupURI *summary_uri = NULL;
@@ -1671,15 +2024,61 @@ ostree_repo_pull_with_options (OstreeRepo             *self,
   g_hash_table_iter_init (&hash_iter, requested_refs_to_fetch);
   while (g_hash_table_iter_next (&hash_iter, &key, &value))
     {
-      const char *checksum = value;
-      if (!scan_one_metadata_object (pull_data, checksum, OSTREE_OBJECT_TYPE_COMMIT,
-                                     0, pull_data->cancellable, error))
+      const char *ref = key;
+      const char *to_revision = value;
+      gs_free char *local_ref = NULL;
+      gs_free char *from_revision = NULL;
+      gs_unref_variant GVariant *delta_meta = NULL;
+
+      local_ref = is_mirror ? g_strdup (ref) : g_strdup_printf ("%s/%s", pull_data->remote_name, ref);
+      if (!ostree_repo_resolve_rev (pull_data->repo, local_ref, TRUE, &from_revision, error))
         goto out;
-    }
 
-  for (i = 0; i < pull_data->static_delta_metas->len; i++)
-    {
-      process_one_static_delta_meta (pull_data, pull_data->static_delta_metas->pdata[i]);
+      /* Static deltas carry complete commits, so they don't apply to
+       * subdirectory pulls.
+       */
+      if (g_strcmp0 (from_revision, to_revision) != 0 && !pull_data->dir)
+        {
+          gboolean have_from_commit = FALSE;
+
+          if (from_revision &&
+              !ostree_repo_has_object (pull_data->repo, OSTREE_OBJECT_TYPE_COMMIT, from_revision,
+                                       &have_from_commit, cancellable, error))
+            goto out;
+
+          /* Without the previous commit, look for a delta from
+           * scratch; it replaces a request per object with a few
+           * large ones.
+           */
+          if (!have_from_commit)
+            {
+              g_free (from_revision);
+              from_revision = NULL;
+            }
+
+          if (!request_static_delta_meta_sync (pull_data, from_revision, to_revision,
+                                               &delta_meta, cancellable, error))
+            goto out;
+        }
+
+      if (delta_meta)
+        {
+          gboolean used_delta;
+
+          if (!process_one_static_delta (pull_data, from_revision, to_revision, delta_meta,
+                                         &used_delta, cancellable, error))
+            goto out;
+          g_debug ("static delta %s%s%s: %s", from_revision ? from_revision : "",
+                   from_revision ? "-" : "", to_revision,
+                   used_delta ? "applied" : "skipped");
+        }
+
+      /* After a delta, this verifies the commit and fetches anything
+       * still missing; otherwise it starts a regular object pull.
+       */
+      if (!scan_one_metadata_object (pull_data, to_revision, OSTREE_OBJECT_TYPE_COMMIT,
+                                     0, pull_data->cancellable, error))
+        goto out;
     }
 
   /* Now await work completion */
@@ -1769,7 +2168,6 @@ ostree_repo_pull_with_options (OstreeRepo             *self,
   if (pull_data->base_uri)
     soup_uri_free (pull_data->base_uri);
   g_clear_pointer (&pull_data->summary, (GDestroyNotify) g_variant_unref);
-  g_clear_pointer (&pull_data->static_delta_metas, (GDestroyNotify) g_ptr_array_unref);
   g_clear_pointer (&pull_data->commit_to_depth, (GDestroyNotify) g_hash_table_unref);
   g_clear_pointer (&pull_data->expected_commit_sizes, (GDestroyNotify) g_hash_table_unref);
   g_clear_pointer (&pull_data->scanned_metadata, (GDestroyNotify) g_hash_table_unref);
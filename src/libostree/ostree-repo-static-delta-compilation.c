@@ -28,18 +28,74 @@
 #include "ostree-diff.h"
 #include "otutil.h"
 #include "ostree-varint.h"
+#include "ostree-lzma-compressor.h"
+#include "ostree-chain-input-stream.h"
+#include "ostree-checksum-input-stream.h"
+#include "bupsplit.h"
+
+/* Same cap on chunk length as bup uses */
+#define ROLLSUM_BLOB_MAX (8192*4)
 
 typedef struct {
   guint64 uncompressed_size;
   GPtrArray *objects;
   GString *payload;
   GString *operations;
+
+  /* Memory accounted against the builder's budget */
+  guint64 resident_size;
+
+  /* Set by compress_part_thread() */
+  GFile *tempfile;
+  guchar *checksum;
+  guint64 content_size;
+  guint64 compressed_size;
+  GError *error;
 } OstreeStaticDeltaPartBuilder;
 
+/*
+ * Full parts are handed to a thread pool which compresses them into
+ * temporary files.  The payloads of queued and in progress parts,
+ * plus the one being filled, are kept under max_resident_size; the
+ * generator blocks in submit_part() until there is room.
+ */
 typedef struct {
+  OstreeRepo *repo;
+  guint8 compression;
   GPtrArray *parts;
+
+  GThreadPool *compress_pool;
+  GCancellable *cancellable;
+  GMutex lock;
+  GCond cond;
+  guint64 max_resident_size;
+  guint64 resident_size;
 } OstreeStaticDeltaBuilder;
 
+/* A run of the new file data, either copied from the old object at
+ * @from_offset, or shipped in the payload if @from_offset is -1.
+ */
+typedef struct {
+  guint64 offset;
+  guint64 len;
+  gint64 from_offset;
+} RollsumSegment;
+
+typedef struct {
+  const char *from_checksum;
+  GBytes *to_bytes;
+  GArray *segments;
+  guint64 matched_size;
+} RollsumMatches;
+
+static void
+rollsum_matches_free (RollsumMatches *matches)
+{
+  g_bytes_unref (matches->to_bytes);
+  g_array_unref (matches->segments);
+  g_free (matches);
+}
+
 static void
 ostree_static_delta_part_builder_unref (OstreeStaticDeltaPartBuilder *part_builder)
 {
@@ -49,6 +105,13 @@ ostree_static_delta_part_builder_unref (OstreeStaticDeltaPartBuilder *part_build
     g_string_free (part_builder->payload, TRUE);
   if (part_builder->operations)
     g_string_free (part_builder->operations, TRUE);
+  if (part_builder->tempfile)
+    {
+      (void) gs_file_unlink (part_builder->tempfile, NULL, NULL);
+      g_object_unref (part_builder->tempfile);
+    }
+  g_free (part_builder->checksum);
+  g_clear_error (&part_builder->error);
   g_free (part_builder);
 }
 
@@ -64,6 +127,160 @@ allocate_part (OstreeStaticDeltaBuilder *builder)
   return part;
 }
 
+/*
+ * Serialize the (ayay) part content as a stream, rather than having
+ * g_variant_new() copy the payload and operations into one buffer.
+ * The tuple has a single framing offset (the end of the payload),
+ * whose width depends on the total size as in gvariant-serialiser.c.
+ */
+static GInputStream *
+part_content_stream_new (GBytes  *payload,
+                         GBytes  *operations,
+                         guint64 *out_size)
+{
+  gsize payload_size = g_bytes_get_size (payload);
+  gsize body_size = payload_size + g_bytes_get_size (operations);
+  gsize framing_size;
+  guint64 framing_le;
+  gs_unref_ptrarray GPtrArray *streams =
+    g_ptr_array_new_with_free_func ((GDestroyNotify)g_object_unref);
+
+  if (body_size + 1 <= G_MAXUINT8)
+    framing_size = 1;
+  else if (body_size + 2 <= G_MAXUINT16)
+    framing_size = 2;
+  else if (body_size + 4 <= G_MAXUINT32)
+    framing_size = 4;
+  else
+    framing_size = 8;
+
+  /* The low order bytes come first in little endian */
+  framing_le = GUINT64_TO_LE ((guint64) payload_size);
+
+  g_ptr_array_add (streams, g_memory_input_stream_new_from_bytes (payload));
+  g_ptr_array_add (streams, g_memory_input_stream_new_from_bytes (operations));
+  g_ptr_array_add (streams, g_memory_input_stream_new_from_data (g_memdup (&framing_le, framing_size),
+                                                                 framing_size, g_free));
+  *out_size = body_size + framing_size;
+
+  return (GInputStream*)ostree_chain_input_stream_new (streams);
+}
+
+static gboolean
+write_part (OstreeStaticDeltaBuilder      *builder,
+            OstreeStaticDeltaPartBuilder  *part,
+            GCancellable                  *cancellable,
+            GError                       **error)
+{
+  gboolean ret = FALSE;
+  gssize n_spliced;
+  gsize bytes_written;
+  guint8 digest[32];
+  gsize digest_len = sizeof (digest);
+  gs_unref_bytes GBytes *payload_b = NULL;
+  gs_unref_bytes GBytes *operations_b = NULL;
+  gs_unref_object GInputStream *content_in = NULL;
+  gs_unref_object GInputStream *compressed_in = NULL;
+  gs_unref_object GInputStream *checksum_in = NULL;
+  gs_unref_object GConverter *compressor = NULL;
+  gs_unref_object GOutputStream *part_temp_outstream = NULL;
+  ot_cleanup_checksum OtChecksum *checksum = NULL;
+
+  payload_b = g_string_free_to_bytes (part->payload);
+  part->payload = NULL;
+  operations_b = g_string_free_to_bytes (part->operations);
+  part->operations = NULL;
+
+  content_in = part_content_stream_new (payload_b, operations_b, &part->content_size);
+
+  if (builder->compression == 'g')
+    compressor = (GConverter*)g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_RAW, 9);
+  else if (builder->compression == 'x')
+    compressor = (GConverter*)_ostree_lzma_compressor_new (NULL);
+
+  if (compressor)
+    compressed_in = g_converter_input_stream_new (content_in, compressor);
+  else
+    compressed_in = g_object_ref (content_in);
+
+  /* A part is serialized as (yay); the byte array is last, so it has
+   * no framing, and the checksum covers the compression byte too.
+   */
+  checksum = ot_checksum_new (G_CHECKSUM_SHA256);
+  ot_checksum_update (checksum, &builder->compression, 1);
+  checksum_in = (GInputStream*)_ostree_checksum_input_stream_new (compressed_in, checksum);
+
+  if (!gs_file_open_in_tmpdir (builder->repo->tmp_dir, 0644,
+                               &part->tempfile, &part_temp_outstream,
+                               cancellable, error))
+    goto out;
+
+  if (!g_output_stream_write_all (part_temp_outstream, &builder->compression, 1,
+                                  &bytes_written, cancellable, error))
+    goto out;
+
+  n_spliced = g_output_stream_splice (part_temp_outstream, checksum_in,
+                                      G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE |
+                                      G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET,
+                                      cancellable, error);
+  if (n_spliced < 0)
+    goto out;
+
+  ot_checksum_get_digest (checksum, digest, &digest_len);
+  part->checksum = g_memdup (digest, sizeof (digest));
+  part->compressed_size = 1 + n_spliced;
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+static void
+compress_part_thread (gpointer   data,
+                      gpointer   user_data)
+{
+  OstreeStaticDeltaPartBuilder *part = data;
+  OstreeStaticDeltaBuilder *builder = user_data;
+
+  (void) write_part (builder, part, builder->cancellable, &part->error);
+
+  /* write_part() consumed these, but not on early errors */
+  if (part->payload)
+    {
+      g_string_free (part->payload, TRUE);
+      part->payload = NULL;
+    }
+  if (part->operations)
+    {
+      g_string_free (part->operations, TRUE);
+      part->operations = NULL;
+    }
+
+  g_mutex_lock (&builder->lock);
+  builder->resident_size -= part->resident_size;
+  g_cond_signal (&builder->cond);
+  g_mutex_unlock (&builder->lock);
+}
+
+static void
+submit_part (OstreeStaticDeltaBuilder      *builder,
+             OstreeStaticDeltaPartBuilder  *part)
+{
+  part->resident_size = part->payload->allocated_len + part->operations->allocated_len;
+
+  g_mutex_lock (&builder->lock);
+  /* Leave room for the next part to fill up, but always allow at
+   * least one part in flight so progress is made.
+   */
+  while (builder->resident_size > 0 &&
+         builder->resident_size + part->resident_size + OSTREE_STATIC_DELTA_PART_MAX_SIZE_BYTES > builder->max_resident_size)
+    g_cond_wait (&builder->cond, &builder->lock);
+  builder->resident_size += part->resident_size;
+  g_mutex_unlock (&builder->lock);
+
+  g_thread_pool_push (builder->compress_pool, part, NULL);
+}
+
 static GBytes *
 objtype_checksum_array_new (GPtrArray *objects)
 {
@@ -90,269 +307,890 @@ objtype_checksum_array_new (GPtrArray *objects)
   return g_byte_array_free_to_bytes (ret);
 }
 
-static gboolean 
-generate_delta_lowlatency (OstreeRepo                       *repo,
-                           const char                       *from,
-                           const char                       *to,
-                           OstreeStaticDeltaBuilder         *builder,
-                           GCancellable                     *cancellable,
-                           GError                          **error)
+static GPtrArray *
+rollsum_chunks (GBytes *bytes)
+{
+  GPtrArray *ret = g_ptr_array_new_with_free_func ((GDestroyNotify)g_bytes_unref);
+  gsize len;
+  const guint8 *data = g_bytes_get_data (bytes, &len);
+  gsize pos = 0;
+
+  while (pos < len)
+    {
+      int bits;
+      gsize chunklen;
+
+      /* Bounding the scan keeps data without split points (such as
+       * runs of zeroes) linear.
+       */
+      chunklen = bupsplit_find_ofs (data + pos, (int) MIN (len - pos, ROLLSUM_BLOB_MAX), &bits);
+      if (chunklen == 0)
+        chunklen = MIN (len - pos, ROLLSUM_BLOB_MAX);
+
+      g_ptr_array_add (ret, g_bytes_new_from_bytes (bytes, pos, chunklen));
+      pos += chunklen;
+    }
+
+  return ret;
+}
+
+/*
+ * Split the old and new versions of a file at rollsum boundaries, and
+ * compute which parts of the new one can be copied from the old one.
+ * Returns %NULL in @out_matches if nothing can be reused.
+ */
+static gboolean
+compute_rollsum_matches (OstreeRepo       *repo,
+                         const char       *from_checksum,
+                         const char       *to_checksum,
+                         RollsumMatches  **out_matches,
+                         GCancellable     *cancellable,
+                         GError          **error)
 {
   gboolean ret = FALSE;
-  GHashTableIter hashiter;
-  gpointer key, value;
-  OstreeStaticDeltaPartBuilder *current_part = NULL;
-  gs_unref_object GFile *root_from = NULL;
-  gs_unref_object GFile *root_to = NULL;
-  gs_unref_ptrarray GPtrArray *modified = NULL;
-  gs_unref_ptrarray GPtrArray *removed = NULL;
-  gs_unref_ptrarray GPtrArray *added = NULL;
-  gs_unref_hashtable GHashTable *to_reachable_objects = NULL;
-  gs_unref_hashtable GHashTable *from_reachable_objects = NULL;
-  gs_unref_hashtable GHashTable *new_reachable_objects = NULL;
+  guint i;
+  const guint8 *from_data;
+  const guint8 *to_data;
+  guint64 matched_size = 0;
+  RollsumMatches *ret_matches = NULL;
+  gs_unref_bytes GBytes *from_bytes = NULL;
+  gs_unref_bytes GBytes *to_bytes = NULL;
+  gs_unref_ptrarray GPtrArray *from_chunks = NULL;
+  gs_unref_ptrarray GPtrArray *to_chunks = NULL;
+  gs_unref_hashtable GHashTable *from_index = NULL;
+  GArray *segments = NULL;
 
-  if (!ostree_repo_read_commit (repo, from, &root_from, NULL,
-                                cancellable, error))
-    goto out;
-  if (!ostree_repo_read_commit (repo, to, &root_to, NULL,
-                                cancellable, error))
+  if (!_ostree_static_delta_load_content_bytes (repo, from_checksum, &from_bytes,
+                                                cancellable, error))
     goto out;
-
-  /* Gather a filesystem level diff; when we do heuristics to ship
-   * just parts of changed files, we can make use of this data.
-   */
-  modified = g_ptr_array_new_with_free_func ((GDestroyNotify) ostree_diff_item_unref);
-  removed = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
-  added = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
-  if (!ostree_diff_dirs (OSTREE_DIFF_FLAGS_NONE, root_from, root_to, modified, removed, added,
-                         cancellable, error))
+  if (!_ostree_static_delta_load_content_bytes (repo, to_checksum, &to_bytes,
+                                                cancellable, error))
     goto out;
 
-  if (!ostree_repo_traverse_commit (repo, from, -1, &from_reachable_objects,
-                                    cancellable, error))
-    goto out;
+  from_data = g_bytes_get_data (from_bytes, NULL);
+  to_data = g_bytes_get_data (to_bytes, NULL);
 
-  if (!ostree_repo_traverse_commit (repo, to, -1, &to_reachable_objects,
-                                    cancellable, error))
-    goto out;
+  from_chunks = rollsum_chunks (from_bytes);
+  to_chunks = rollsum_chunks (to_bytes);
 
-  new_reachable_objects = ostree_repo_traverse_new_reachable ();
+  /* Keys and values are owned by from_chunks; keep the first copy of
+   * any repeated chunk.
+   */
+  from_index = g_hash_table_new (g_bytes_hash, g_bytes_equal);
+  for (i = 0; i < from_chunks->len; i++)
+    {
+      GBytes *chunk = from_chunks->pdata[i];
+      if (!g_hash_table_contains (from_index, chunk))
+        g_hash_table_insert (from_index, chunk, chunk);
+    }
 
-  g_hash_table_iter_init (&hashiter, to_reachable_objects);
-  while (g_hash_table_iter_next (&hashiter, &key, &value))
+  segments = g_array_new (FALSE, FALSE, sizeof (RollsumSegment));
+  for (i = 0; i < to_chunks->len; i++)
     {
-      GVariant *serialized_key = key;
+      GBytes *chunk = to_chunks->pdata[i];
+      GBytes *match = g_hash_table_lookup (from_index, chunk);
+      RollsumSegment segment;
+      RollsumSegment *last = NULL;
 
-      if (g_hash_table_contains (from_reachable_objects, serialized_key))
-        continue;
+      segment.offset = (const guint8*)g_bytes_get_data (chunk, NULL) - to_data;
+      segment.len = g_bytes_get_size (chunk);
+      if (match)
+        {
+          segment.from_offset = (const guint8*)g_bytes_get_data (match, NULL) - from_data;
+          matched_size += segment.len;
+        }
+      else
+        segment.from_offset = -1;
 
-      g_hash_table_insert (new_reachable_objects, g_variant_ref (serialized_key), serialized_key);
-    }
+      if (segments->len > 0)
+        last = &g_array_index (segments, RollsumSegment, segments->len - 1);
 
-  current_part = allocate_part (builder);
+      /* Merge with the previous segment if it continues it */
+      if (last != NULL &&
+          ((last->from_offset == -1 && segment.from_offset == -1) ||
+           (last->from_offset != -1 && segment.from_offset != -1 &&
+            last->from_offset + last->len == segment.from_offset)))
+        last->len += segment.len;
+      else
+        g_array_append_val (segments, segment);
+    }
 
-  g_hash_table_iter_init (&hashiter, new_reachable_objects);
-  while (g_hash_table_iter_next (&hashiter, &key, &value))
+  if (matched_size > 0)
     {
-      GVariant *serialized_key = key;
-      const char *checksum;
-      OstreeObjectType objtype;
-      guint64 content_size;
-      gsize object_payload_start;
-      gs_unref_object GInputStream *content_stream = NULL;
-      gsize bytes_read;
-      const guint readlen = 4096;
+      ret_matches = g_new0 (RollsumMatches, 1);
+      ret_matches->from_checksum = from_checksum;
+      ret_matches->to_bytes = g_bytes_ref (to_bytes);
+      ret_matches->segments = segments;
+      segments = NULL;
+      ret_matches->matched_size = matched_size;
+    }
 
-      ostree_object_name_deserialize (serialized_key, &checksum, &objtype);
+  ret = TRUE;
+  *out_matches = ret_matches;
+ out:
+  if (segments)
+    g_array_unref (segments);
+  return ret;
+}
 
-      if (!ostree_repo_load_object_stream (repo, objtype, checksum,
-                                           &content_stream, &content_size,
-                                           cancellable, error))
-        goto out;
+/*
+ * Emit the operations to rebuild a content object from @matches.  The
+ * header of the content stream (which has already been read up to
+ * the file data) always comes from the payload.  The input target is
+ * the payload again on return.
+ */
+static gboolean
+write_rollsum_object (OstreeStaticDeltaPartBuilder  *current_part,
+                      GInputStream                  *content_stream,
+                      gsize                          header_size,
+                      RollsumMatches                *matches,
+                      GCancellable                  *cancellable,
+                      GError                       **error)
+{
+  gboolean ret = FALSE;
+  guint i;
+  gsize bytes_read;
+  gsize header_start;
+  const guint8 *to_data;
+  gboolean reading_object = FALSE;
+  guint8 from_csum[32];
 
-      current_part->uncompressed_size += content_size;
+  ostree_checksum_inplace_to_bytes (matches->from_checksum, from_csum);
+  to_data = g_bytes_get_data (matches->to_bytes, NULL);
 
-      /* Ensure we have at least one object per delta, even if a given
-       * object is larger.
-       */
-      if (current_part->objects->len > 0 &&
-          current_part->payload->len + content_size > OSTREE_STATIC_DELTA_PART_MAX_SIZE_BYTES)
-        {
-          current_part = allocate_part (builder);
-        } 
+  header_start = current_part->payload->len;
+  g_string_set_size (current_part->payload, header_start + header_size);
+  if (!g_input_stream_read_all (content_stream,
+                                current_part->payload->str + header_start,
+                                header_size, &bytes_read,
+                                cancellable, error))
+    goto out;
+  if (bytes_read != header_size)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Short read of content object header");
+      goto out;
+    }
 
-      g_ptr_array_add (current_part->objects, g_variant_ref (serialized_key));
+  g_string_append_c (current_part->operations, (gchar)OSTREE_STATIC_DELTA_OP_WRITE);
+  _ostree_write_varuint64 (current_part->operations, header_start);
+  _ostree_write_varuint64 (current_part->operations, header_size);
 
-      object_payload_start = current_part->payload->len;
+  for (i = 0; i < matches->segments->len; i++)
+    {
+      RollsumSegment *segment = &g_array_index (matches->segments, RollsumSegment, i);
 
-      while (TRUE)
+      if (segment->from_offset == -1)
         {
-          gsize empty_space;
+          gsize payload_start = current_part->payload->len;
 
-          empty_space = current_part->payload->allocated_len - current_part->payload->len;
-          if (empty_space < readlen)
+          if (reading_object)
             {
-              gsize origlen;
-              origlen = current_part->payload->len;
-              g_string_set_size (current_part->payload, current_part->payload->allocated_len + (readlen - empty_space));
-              current_part->payload->len = origlen;
+              g_string_append_c (current_part->operations, (gchar)OSTREE_STATIC_DELTA_OP_READPAYLOAD);
+              reading_object = FALSE;
             }
-
-          if (!g_input_stream_read_all (content_stream,
-                                        current_part->payload->str + current_part->payload->len,
-                                        readlen,
-                                        &bytes_read,
-                                        cancellable, error))
-            goto out;
-          if (bytes_read == 0)
-            break;
-          
-          current_part->payload->len += bytes_read;
+          g_string_append_len (current_part->payload,
+                               (const char*)to_data + segment->offset, segment->len);
+          g_string_append_c (current_part->operations, (gchar)OSTREE_STATIC_DELTA_OP_WRITE);
+          _ostree_write_varuint64 (current_part->operations, payload_start);
+          _ostree_write_varuint64 (current_part->operations, segment->len);
+        }
+      else
+        {
+          if (!reading_object)
+            {
+              g_string_append_c (current_part->operations, (gchar)OSTREE_STATIC_DELTA_OP_READOBJECT);
+              g_string_append_len (current_part->operations, (const char*)from_csum, sizeof (from_csum));
+              reading_object = TRUE;
+            }
+          g_string_append_c (current_part->operations, (gchar)OSTREE_STATIC_DELTA_OP_WRITE);
+          _ostree_write_varuint64 (current_part->operations, segment->from_offset);
+          _ostree_write_varuint64 (current_part->operations, segment->len);
         }
-      
-      g_string_append_c (current_part->operations, (gchar)OSTREE_STATIC_DELTA_OP_WRITE);
-      _ostree_write_varuint64 (current_part->operations, object_payload_start);
-      _ostree_write_varuint64 (current_part->operations, content_size);
-      g_printerr ("write %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT "\n", (guint64) object_payload_start, (guint64)(content_size));
-      g_string_append_c (current_part->operations, (gchar)OSTREE_STATIC_DELTA_OP_CLOSE);
     }
 
+  if (reading_object)
+    g_string_append_c (current_part->operations, (gchar)OSTREE_STATIC_DELTA_OP_READPAYLOAD);
+
   ret = TRUE;
  out:
   return ret;
 }
 
-/**
- * ostree_repo_static_delta_generate:
- * @self: Repo
- * @opt: High level optimization choice
- * @from: ASCII SHA256 checksum of origin
- * @to: ASCII SHA256 checksum of target
- * @metadata: (allow-none): Optional metadata
- * @cancellable: Cancellable
- * @error: Error
- *
- * Generate a lookaside "static delta" from @from which can generate
- * the objects in @to.  This delta is an optimization over fetching
- * individual objects, and can be conveniently stored and applied
- * offline.
+/*
+ * Compare the file data of two regular file content objects, ignoring
+ * their headers.
  */
-gboolean
-ostree_repo_static_delta_generate (OstreeRepo                   *self,
-                                   OstreeStaticDeltaGenerateOpt  opt,
-                                   const char                   *from,
-                                   const char                   *to,
-                                   GVariant                     *metadata,
-                                   GCancellable                 *cancellable,
-                                   GError                      **error)
+static gboolean
+content_data_equal (OstreeRepo       *repo,
+                    const char       *from_checksum,
+                    const char       *to_checksum,
+                    gboolean         *out_equal,
+                    GCancellable     *cancellable,
+                    GError          **error)
 {
   gboolean ret = FALSE;
-  OstreeStaticDeltaBuilder builder = { 0, };
-  guint i;
-  GVariant *metadata_source;
-  gs_unref_variant_builder GVariantBuilder *part_headers = NULL;
-  gs_unref_ptrarray GPtrArray *part_tempfiles = NULL;
-  gs_unref_variant GVariant *delta_descriptor = NULL;
-  gs_free char *descriptor_relpath = NULL;
-  gs_unref_object GFile *descriptor_path = NULL;
-  gs_unref_object GFile *descriptor_dir = NULL;
-  gs_unref_variant GVariant *tmp_metadata = NULL;
-
-  builder.parts = g_ptr_array_new_with_free_func ((GDestroyNotify)ostree_static_delta_part_builder_unref);
+  gboolean ret_equal = FALSE;
+  const gsize bufsize = 64 * 1024;
+  gs_free guint8 *from_buf = NULL;
+  gs_free guint8 *to_buf = NULL;
+  gs_unref_object GInputStream *from_in = NULL;
+  gs_unref_object GInputStream *to_in = NULL;
+  gs_unref_object GFileInfo *from_info = NULL;
+  gs_unref_object GFileInfo *to_info = NULL;
 
-  /* Ignore optimization flags */
-  if (!generate_delta_lowlatency (self, from, to, &builder,
-                                  cancellable, error))
+  if (!ostree_repo_load_file (repo, from_checksum, &from_in, &from_info, NULL,
+                              cancellable, error))
+    goto out;
+  if (!ostree_repo_load_file (repo, to_checksum, &to_in, &to_info, NULL,
+                              cancellable, error))
     goto out;
 
-  part_headers = g_variant_builder_new (G_VARIANT_TYPE ("a" OSTREE_STATIC_DELTA_META_ENTRY_FORMAT));
-  part_tempfiles = g_ptr_array_new_with_free_func (g_object_unref);
-  for (i = 0; i < builder.parts->len; i++)
+  if (g_file_info_get_size (from_info) != g_file_info_get_size (to_info))
     {
-      OstreeStaticDeltaPartBuilder *part_builder = builder.parts->pdata[i];
-      GBytes *payload_b;
-      GBytes *operations_b;
-      gs_free guchar *part_checksum = NULL;
-      gs_free_checksum GChecksum *checksum = NULL;
-      gs_unref_bytes GBytes *objtype_checksum_array = NULL;
-      gs_unref_bytes GBytes *checksum_bytes = NULL;
-      gs_unref_object GFile *part_tempfile = NULL;
-      gs_unref_object GOutputStream *part_temp_outstream = NULL;
-      gs_unref_object GInputStream *part_in = NULL;
-      gs_unref_object GInputStream *part_payload_in = NULL;
-      gs_unref_object GMemoryOutputStream *part_payload_out = NULL;
-      gs_unref_object GConverterOutputStream *part_payload_compressor = NULL;
-      gs_unref_object GConverter *zlib_compressor = NULL;
-      gs_unref_variant GVariant *delta_part_content = NULL;
-      gs_unref_variant GVariant *delta_part = NULL;
-      gs_unref_variant GVariant *delta_part_header = NULL;
-
-      payload_b = g_string_free_to_bytes (part_builder->payload);
-      part_builder->payload = NULL;
-      
-      operations_b = g_string_free_to_bytes (part_builder->operations);
-      part_builder->operations = NULL;
-      /* FIXME - avoid duplicating memory here */
-      delta_part_content = g_variant_new ("(@ay@ay)",
-                                          ot_gvariant_new_ay_bytes (payload_b),
-                                          ot_gvariant_new_ay_bytes (operations_b));
-      g_variant_ref_sink (delta_part_content);
-
-      /* Hardcode gzip for now */
-      zlib_compressor = (GConverter*)g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_RAW, 9);
-      part_payload_in = ot_variant_read (delta_part_content);
-      part_payload_out = (GMemoryOutputStream*)g_memory_output_stream_new (NULL, 0, g_realloc, g_free);
-      part_payload_compressor = (GConverterOutputStream*)g_converter_output_stream_new ((GOutputStream*)part_payload_out, zlib_compressor);
-
-      if (0 > g_output_stream_splice ((GOutputStream*)part_payload_compressor, part_payload_in,
-                                      G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET | G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE,
-                                      cancellable, error))
-        goto out;
+      ret = TRUE;
+      *out_equal = FALSE;
+      goto out;
+    }
 
-      /* FIXME - avoid duplicating memory here */
-      delta_part = g_variant_new ("(y@ay)",
-                                  (guint8)'g',
-                                  ot_gvariant_new_ay_bytes (g_memory_output_stream_steal_as_bytes (part_payload_out)));
+  from_buf = g_malloc (bufsize);
+  to_buf = g_malloc (bufsize);
+  while (TRUE)
+    {
+      gsize from_read;
+      gsize to_read;
 
-      if (!gs_file_open_in_tmpdir (self->tmp_dir, 0644,
-                                   &part_tempfile, &part_temp_outstream,
-                                   cancellable, error))
+      if (!g_input_stream_read_all (from_in, from_buf, bufsize, &from_read,
+                                    cancellable, error))
         goto out;
-      part_in = ot_variant_read (delta_part);
-      if (!ot_gio_splice_get_checksum (part_temp_outstream, part_in,
-                                       &part_checksum,
-                                       cancellable, error))
+      if (!g_input_stream_read_all (to_in, to_buf, bufsize, &to_read,
+                                    cancellable, error))
         goto out;
 
-      checksum_bytes = g_bytes_new (part_checksum, 32);
-      objtype_checksum_array = objtype_checksum_array_new (part_builder->objects);
-      delta_part_header = g_variant_new ("(@aytt@ay)",
-                                         ot_gvariant_new_ay_bytes (checksum_bytes),
-                                         g_variant_get_size (delta_part),
-                                         part_builder->uncompressed_size,
-                                         ot_gvariant_new_ay_bytes (objtype_checksum_array));
-      g_variant_builder_add_value (part_headers, g_variant_ref (delta_part_header));
-      g_ptr_array_add (part_tempfiles, g_object_ref (part_tempfile));
+      if (from_read != to_read || memcmp (from_buf, to_buf, from_read) != 0)
+        break;
+      if (from_read == 0)
+        {
+          ret_equal = TRUE;
+          break;
+        }
     }
 
-  descriptor_relpath = _ostree_get_relative_static_delta_path (from, to);
-  descriptor_path = g_file_resolve_relative_path (self->repodir, descriptor_relpath);
-  descriptor_dir = g_file_get_parent (descriptor_path);
+  ret = TRUE;
+  *out_equal = ret_equal;
+ out:
+  return ret;
+}
 
-  if (!gs_file_ensure_directory (descriptor_dir, TRUE, cancellable, error))
+/*
+ * Emit the operations to rebuild content object @checksum from the
+ * data of @from_checksum, with only the new file header in the
+ * payload.
+ */
+static gboolean
+write_rewriteheader_object (OstreeRepo                    *repo,
+                            OstreeStaticDeltaPartBuilder  *current_part,
+                            const char                    *from_checksum,
+                            const char                    *checksum,
+                            GCancellable                  *cancellable,
+                            GError                       **error)
+{
+  gboolean ret = FALSE;
+  gsize header_start;
+  gsize header_size;
+  guint8 from_csum[32];
+  gs_unref_object GFileInfo *file_info = NULL;
+  gs_unref_variant GVariant *xattrs = NULL;
+  gs_unref_variant GVariant *header = NULL;
+
+  if (!ostree_repo_load_file (repo, checksum, NULL, &file_info, &xattrs,
+                              cancellable, error))
     goto out;
 
-  for (i = 0; i < builder.parts->len; i++)
-    {
-      GFile *tempfile = part_tempfiles->pdata[i];
-      gs_free char *part_relpath = _ostree_get_relative_static_delta_part_path (from, to, i);
-      gs_unref_object GFile *part_path = g_file_resolve_relative_path (self->repodir, part_relpath);
+  header = _ostree_file_header_new (file_info, xattrs);
+  header_start = current_part->payload->len;
+  header_size = g_variant_get_size (header);
+  g_string_append_len (current_part->payload, g_variant_get_data (header), header_size);
 
-      if (!gs_file_rename (tempfile, part_path, cancellable, error))
-        goto out;
-    }
+  ostree_checksum_inplace_to_bytes (from_checksum, from_csum);
+  g_string_append_c (current_part->operations, (gchar)OSTREE_STATIC_DELTA_OP_REWRITEHEADER);
+  _ostree_write_varuint64 (current_part->operations, header_start);
+  _ostree_write_varuint64 (current_part->operations, header_size);
+  g_string_append_len (current_part->operations, (const char*)from_csum, sizeof (from_csum));
 
-  if (metadata != NULL)
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/*
+ * Record a path for each content object reachable from
+ * @dirtree_checksum, used to order similar files next to each other.
+ */
+static gboolean
+collect_content_paths (OstreeRepo       *repo,
+                       const char       *dirtree_checksum,
+                       const char       *path,
+                       int               recursion_depth,
+                       GHashTable       *visited_dirtrees,
+                       GHashTable       *inout_content_paths,
+                       GCancellable     *cancellable,
+                       GError          **error)
+{
+  gboolean ret = FALSE;
+  guint i, n;
+  gs_unref_variant GVariant *tree = NULL;
+  gs_unref_variant GVariant *files_variant = NULL;
+  gs_unref_variant GVariant *dirs_variant = NULL;
+
+  if (recursion_depth > OSTREE_MAX_RECURSION)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Maximum recursion limit reached during traversal");
+      goto out;
+    }
+
+  if (g_hash_table_contains (visited_dirtrees, dirtree_checksum))
+    {
+      ret = TRUE;
+      goto out;
+    }
+  g_hash_table_add (visited_dirtrees, g_strdup (dirtree_checksum));
+
+  if (!ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_DIR_TREE, dirtree_checksum,
+                                 &tree, error))
+    goto out;
+
+  files_variant = g_variant_get_child_value (tree, 0);
+  n = g_variant_n_children (files_variant);
+  for (i = 0; i < n; i++)
+    {
+      const char *filename;
+      gs_unref_variant GVariant *csum_v = NULL;
+      gs_free char *checksum = NULL;
+
+      g_variant_get_child (files_variant, i, "(&s@ay)", &filename, &csum_v);
+      checksum = ostree_checksum_from_bytes_v (csum_v);
+
+      if (g_hash_table_contains (inout_content_paths, checksum))
+        continue;
+
+      g_hash_table_insert (inout_content_paths, checksum,
+                           g_build_filename (path, filename, NULL));
+      checksum = NULL;
+    }
+
+  dirs_variant = g_variant_get_child_value (tree, 1);
+  n = g_variant_n_children (dirs_variant);
+  for (i = 0; i < n; i++)
+    {
+      const char *dirname;
+      gs_unref_variant GVariant *content_csum_v = NULL;
+      gs_unref_variant GVariant *metadata_csum_v = NULL;
+      gs_free char *subtree_checksum = NULL;
+      gs_free char *subpath = NULL;
+
+      g_variant_get_child (dirs_variant, i, "(&s@ay@ay)",
+                           &dirname, &content_csum_v, &metadata_csum_v);
+      subtree_checksum = ostree_checksum_from_bytes_v (content_csum_v);
+      subpath = g_build_filename (path, dirname, NULL);
+
+      if (!collect_content_paths (repo, subtree_checksum, subpath, recursion_depth + 1,
+                                  visited_dirtrees, inout_content_paths,
+                                  cancellable, error))
+        goto out;
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/*
+ * Traversal results which can be shared by several deltas.  When
+ * generating in parallel, the cache is filled beforehand, so the
+ * generators only read it.
+ */
+typedef struct {
+  /* commit checksum -> reachable objects, see ostree_repo_traverse_commit() */
+  GHashTable *reachable;
+  /* commit checksum -> table of content checksum -> path */
+  GHashTable *content_paths;
+} DeltaTraversalCache;
+
+static void
+delta_traversal_cache_init (DeltaTraversalCache *cache)
+{
+  cache->reachable = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                            (GDestroyNotify)g_hash_table_unref);
+  cache->content_paths = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                                (GDestroyNotify)g_hash_table_unref);
+}
+
+static void
+delta_traversal_cache_clear (DeltaTraversalCache *cache)
+{
+  g_clear_pointer (&cache->reachable, g_hash_table_unref);
+  g_clear_pointer (&cache->content_paths, g_hash_table_unref);
+}
+
+/*
+ * Compute the traversal results for @commit which are asked for; the
+ * content paths are only needed for commits which deltas are
+ * generated to.
+ */
+static gboolean
+traverse_delta_commit (OstreeRepo       *repo,
+                       const char       *commit,
+                       GHashTable      **out_reachable,
+                       GHashTable      **out_content_paths,
+                       GCancellable     *cancellable,
+                       GError          **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_hashtable GHashTable *ret_reachable = NULL;
+  gs_unref_hashtable GHashTable *ret_content_paths = NULL;
+
+  if (out_reachable &&
+      !ostree_repo_traverse_commit (repo, commit, -1, &ret_reachable,
+                                    cancellable, error))
+    goto out;
+
+  if (out_content_paths)
+    {
+      gs_unref_variant GVariant *commit_v = NULL;
+      gs_unref_variant GVariant *tree_csum_v = NULL;
+      gs_free char *tree_checksum = NULL;
+      gs_unref_hashtable GHashTable *visited_dirtrees = NULL;
+
+      if (!ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_COMMIT, commit, &commit_v, error))
+        goto out;
+      g_variant_get_child (commit_v, 6, "@ay", &tree_csum_v);
+      tree_checksum = ostree_checksum_from_bytes_v (tree_csum_v);
+
+      ret_content_paths = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+      visited_dirtrees = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+      if (!collect_content_paths (repo, tree_checksum, "/", 0,
+                                  visited_dirtrees, ret_content_paths,
+                                  cancellable, error))
+        goto out;
+    }
+
+  ret = TRUE;
+  ot_transfer_out_value (out_reachable, &ret_reachable);
+  ot_transfer_out_value (out_content_paths, &ret_content_paths);
+ out:
+  return ret;
+}
+
+static gboolean
+delta_traversal_cache_ensure (OstreeRepo           *repo,
+                              DeltaTraversalCache  *cache,
+                              const char           *commit,
+                              gboolean              want_content_paths,
+                              GCancellable         *cancellable,
+                              GError              **error)
+{
+  gboolean ret = FALSE;
+  gboolean need_reachable = !g_hash_table_contains (cache->reachable, commit);
+  gboolean need_content_paths = want_content_paths &&
+    !g_hash_table_contains (cache->content_paths, commit);
+  GHashTable *reachable = NULL;
+  GHashTable *content_paths = NULL;
+
+  if (!traverse_delta_commit (repo, commit,
+                              need_reachable ? &reachable : NULL,
+                              need_content_paths ? &content_paths : NULL,
+                              cancellable, error))
+    goto out;
+
+  if (reachable)
+    g_hash_table_insert (cache->reachable, g_strdup (commit), reachable);
+  if (content_paths)
+    g_hash_table_insert (cache->content_paths, g_strdup (commit), content_paths);
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+typedef struct {
+  GVariant *serialized_key;
+  const char *checksum;
+  OstreeObjectType objtype;
+  const char *basename;
+  const char *extension;
+  guint64 size;
+} DeltaObjectSortEntry;
+
+static int
+compare_delta_objects (gconstpointer  a,
+                       gconstpointer  b)
+{
+  const DeltaObjectSortEntry *entry_a = *(DeltaObjectSortEntry**)a;
+  const DeltaObjectSortEntry *entry_b = *(DeltaObjectSortEntry**)b;
+  gboolean a_is_meta = OSTREE_OBJECT_TYPE_IS_META (entry_a->objtype);
+  gboolean b_is_meta = OSTREE_OBJECT_TYPE_IS_META (entry_b->objtype);
+  int r;
+
+  /* Metadata first, then content */
+  if (a_is_meta != b_is_meta)
+    return a_is_meta ? -1 : 1;
+  if (entry_a->objtype != entry_b->objtype)
+    return entry_a->objtype < entry_b->objtype ? -1 : 1;
+
+  r = strcmp (entry_a->extension, entry_b->extension);
+  if (r != 0)
+    return r;
+  r = strcmp (entry_a->basename, entry_b->basename);
+  if (r != 0)
+    return r;
+  if (entry_a->size != entry_b->size)
+    return entry_a->size < entry_b->size ? -1 : 1;
+
+  return strcmp (entry_a->checksum, entry_b->checksum);
+}
+
+/*
+ * Order the new objects so that similar ones end up adjacent in the
+ * payload, within the compressor's window: group by object type, and
+ * content by file extension, name and size.  Objects which are
+ * reachable from several paths are placed by the first one found.
+ * @content_paths maps content checksums to paths in the new commit.
+ */
+static gboolean
+sort_new_objects (OstreeRepo       *repo,
+                  GHashTable       *content_paths,
+                  GHashTable       *new_objects,
+                  GPtrArray       **out_sorted,
+                  GCancellable     *cancellable,
+                  GError          **error)
+{
+  gboolean ret = FALSE;
+  guint i;
+  GHashTableIter hashiter;
+  gpointer key, value;
+  gs_unref_ptrarray GPtrArray *entries = NULL;
+  gs_unref_ptrarray GPtrArray *ret_sorted = NULL;
+
+  entries = g_ptr_array_new_with_free_func (g_free);
+  g_hash_table_iter_init (&hashiter, new_objects);
+  while (g_hash_table_iter_next (&hashiter, &key, &value))
+    {
+      DeltaObjectSortEntry *entry = g_new0 (DeltaObjectSortEntry, 1);
+      const char *path = NULL;
+
+      entry->serialized_key = key;
+      ostree_object_name_deserialize (key, &entry->checksum, &entry->objtype);
+      entry->basename = "";
+      entry->extension = "";
+
+      if (entry->objtype == OSTREE_OBJECT_TYPE_FILE)
+        path = g_hash_table_lookup (content_paths, entry->checksum);
+      if (path)
+        {
+          const char *dot;
+
+          entry->basename = strrchr (path, '/') + 1;
+          dot = strrchr (entry->basename, '.');
+          if (dot && dot != entry->basename)
+            entry->extension = dot + 1;
+        }
+
+      if (!ostree_repo_query_object_storage_size (repo, entry->objtype, entry->checksum,
+                                                  &entry->size, cancellable, error))
+        {
+          g_free (entry);
+          goto out;
+        }
+
+      g_ptr_array_add (entries, entry);
+    }
+
+  g_ptr_array_sort (entries, compare_delta_objects);
+
+  ret_sorted = g_ptr_array_new_with_free_func ((GDestroyNotify)g_variant_unref);
+  for (i = 0; i < entries->len; i++)
+    {
+      DeltaObjectSortEntry *entry = entries->pdata[i];
+      g_ptr_array_add (ret_sorted, g_variant_ref (entry->serialized_key));
+    }
+
+  ret = TRUE;
+  ot_transfer_out_value (out_sorted, &ret_sorted);
+ out:
+  return ret;
+}
+
+static gboolean 
+generate_delta (OstreeRepo                       *repo,
+                OstreeStaticDeltaGenerateOpt      opt,
+                const char                       *from,
+                const char                       *to,
+                OstreeStaticDeltaBuilder         *builder,
+                DeltaTraversalCache              *cache,
+                GCancellable                     *cancellable,
+                GError                          **error)
+{
+  gboolean ret = FALSE;
+  guint i;
+  GHashTableIter hashiter;
+  gpointer key, value;
+  OstreeStaticDeltaPartBuilder *current_part = NULL;
+  gs_unref_object GFile *root_from = NULL;
+  gs_unref_object GFile *root_to = NULL;
+  gs_unref_ptrarray GPtrArray *modified = NULL;
+  gs_unref_ptrarray GPtrArray *removed = NULL;
+  gs_unref_ptrarray GPtrArray *added = NULL;
+  GHashTable *to_reachable_objects;
+  GHashTable *to_content_paths;
+  GHashTable *from_reachable_objects;
+  gs_unref_hashtable GHashTable *empty_reachable_objects = NULL;
+  gs_unref_hashtable GHashTable *new_reachable_objects = NULL;
+  gs_unref_hashtable GHashTable *modified_sources = NULL;
+  gs_unref_ptrarray GPtrArray *sorted_objects = NULL;
+
+  if (!ostree_repo_read_commit (repo, to, &root_to, NULL,
+                                cancellable, error))
+    goto out;
+
+  /* Gather a filesystem level diff; modified files are candidates
+   * for shipping only their changed parts.
+   */
+  modified = g_ptr_array_new_with_free_func ((GDestroyNotify) ostree_diff_item_unref);
+  removed = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
+  added = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
+  if (from != NULL)
+    {
+      if (!ostree_repo_read_commit (repo, from, &root_from, NULL,
+                                    cancellable, error))
+        goto out;
+
+      if (!ostree_diff_dirs (OSTREE_DIFF_FLAGS_NONE, root_from, root_to, modified, removed, added,
+                             cancellable, error))
+        goto out;
+
+      if (!delta_traversal_cache_ensure (repo, cache, from, FALSE,
+                                         cancellable, error))
+        goto out;
+      from_reachable_objects = g_hash_table_lookup (cache->reachable, from);
+    }
+  else
+    {
+      empty_reachable_objects = ostree_repo_traverse_new_reachable ();
+      from_reachable_objects = empty_reachable_objects;
+    }
+
+  if (!delta_traversal_cache_ensure (repo, cache, to, TRUE,
+                                     cancellable, error))
+    goto out;
+  to_reachable_objects = g_hash_table_lookup (cache->reachable, to);
+  to_content_paths = g_hash_table_lookup (cache->content_paths, to);
+
+  new_reachable_objects = ostree_repo_traverse_new_reachable ();
+
+  g_hash_table_iter_init (&hashiter, to_reachable_objects);
+  while (g_hash_table_iter_next (&hashiter, &key, &value))
+    {
+      GVariant *serialized_key = key;
+
+      if (g_hash_table_contains (from_reachable_objects, serialized_key))
+        continue;
+
+      g_hash_table_insert (new_reachable_objects, g_variant_ref (serialized_key), serialized_key);
+    }
+
+  /* Map new file content objects to the old version of the same
+   * path.  Those with unchanged data are always rebuilt from it;
+   * rolling checksums are only worth their cost when optimizing for
+   * size.
+   */
+  modified_sources = g_hash_table_new (g_str_hash, g_str_equal);
+  for (i = 0; i < modified->len; i++)
+    {
+      OstreeDiffItem *modifieditem = modified->pdata[i];
+      gs_unref_variant GVariant *objname = NULL;
+
+      if (g_file_info_get_file_type (modifieditem->src_info) != G_FILE_TYPE_REGULAR ||
+          g_file_info_get_file_type (modifieditem->target_info) != G_FILE_TYPE_REGULAR)
+        continue;
+
+      objname = ostree_object_name_serialize (modifieditem->target_checksum,
+                                              OSTREE_OBJECT_TYPE_FILE);
+      if (!g_hash_table_contains (new_reachable_objects, objname))
+        continue;
+
+      /* The diff items outlive the table */
+      if (!g_hash_table_contains (modified_sources, modifieditem->target_checksum))
+        g_hash_table_insert (modified_sources, modifieditem->target_checksum,
+                             modifieditem->src_checksum);
+    }
+
+  if (!sort_new_objects (repo, to_content_paths, new_reachable_objects, &sorted_objects,
+                         cancellable, error))
+    goto out;
+
+  current_part = allocate_part (builder);
+
+  for (i = 0; i < sorted_objects->len; i++)
+    {
+      GVariant *serialized_key = sorted_objects->pdata[i];
+      const char *checksum;
+      OstreeObjectType objtype;
+      guint64 content_size;
+      guint64 object_payload_size;
+      gsize object_payload_start;
+      gs_unref_object GInputStream *content_stream = NULL;
+      gsize bytes_read;
+      const guint readlen = 4096;
+      RollsumMatches *matches = NULL;
+      gsize header_size = 0;
+      const char *from_checksum = NULL;
+      gboolean data_equal = FALSE;
+
+      ostree_object_name_deserialize (serialized_key, &checksum, &objtype);
+
+      if (!ostree_repo_load_object_stream (repo, objtype, checksum,
+                                           &content_stream, &content_size,
+                                           cancellable, error))
+        goto out;
+
+      object_payload_size = content_size;
+      if (objtype == OSTREE_OBJECT_TYPE_FILE)
+        from_checksum = g_hash_table_lookup (modified_sources, checksum);
+      if (from_checksum != NULL)
+        {
+          if (!content_data_equal (repo, from_checksum, checksum, &data_equal,
+                                   cancellable, error))
+            goto out;
+
+          /* Just the new header goes in the payload */
+          if (data_equal)
+            object_payload_size = 0;
+          else if (opt == OSTREE_STATIC_DELTA_GENERATE_OPT_MAJOR &&
+                   !compute_rollsum_matches (repo, from_checksum, checksum, &matches,
+                                             cancellable, error))
+            goto out;
+          if (matches)
+            {
+              header_size = content_size - g_bytes_get_size (matches->to_bytes);
+              object_payload_size = content_size - matches->matched_size;
+            }
+        }
+
+      /* Ensure we have at least one object per delta, even if a given
+       * object is larger.
+       */
+      if (current_part->objects->len > 0 &&
+          current_part->payload->len + object_payload_size > OSTREE_STATIC_DELTA_PART_MAX_SIZE_BYTES)
+        {
+          submit_part (builder, current_part);
+          current_part = allocate_part (builder);
+        } 
+
+      g_ptr_array_add (current_part->objects, g_variant_ref (serialized_key));
+      current_part->uncompressed_size += content_size;
+
+      if (data_equal)
+        {
+          g_debug ("rewriting header of %s from %s", checksum, from_checksum);
+          if (!write_rewriteheader_object (repo, current_part, from_checksum, checksum,
+                                           cancellable, error))
+            goto out;
+          g_string_append_c (current_part->operations, (gchar)OSTREE_STATIC_DELTA_OP_CLOSE);
+          continue;
+        }
+
+      if (matches)
+        {
+          gboolean wrote_object;
+
+          g_debug ("rollsum for %s: %" G_GUINT64_FORMAT "/%" G_GUINT64_FORMAT " bytes reused from %s",
+                   checksum, matches->matched_size, (guint64) g_bytes_get_size (matches->to_bytes),
+                   matches->from_checksum);
+          wrote_object = write_rollsum_object (current_part, content_stream, header_size,
+                                               matches, cancellable, error);
+          rollsum_matches_free (matches);
+          if (!wrote_object)
+            goto out;
+          g_string_append_c (current_part->operations, (gchar)OSTREE_STATIC_DELTA_OP_CLOSE);
+          continue;
+        }
+
+      object_payload_start = current_part->payload->len;
+
+      while (TRUE)
+        {
+          gsize empty_space;
+
+          empty_space = current_part->payload->allocated_len - current_part->payload->len;
+          if (empty_space < readlen)
+            {
+              gsize origlen;
+              origlen = current_part->payload->len;
+              g_string_set_size (current_part->payload, current_part->payload->allocated_len + (readlen - empty_space));
+              current_part->payload->len = origlen;
+            }
+
+          if (!g_input_stream_read_all (content_stream,
+                                        current_part->payload->str + current_part->payload->len,
+                                        readlen,
+                                        &bytes_read,
+                                        cancellable, error))
+            goto out;
+          if (bytes_read == 0)
+            break;
+          
+          current_part->payload->len += bytes_read;
+        }
+      
+      g_string_append_c (current_part->operations, (gchar)OSTREE_STATIC_DELTA_OP_WRITE);
+      _ostree_write_varuint64 (current_part->operations, object_payload_start);
+      _ostree_write_varuint64 (current_part->operations, content_size);
+      g_string_append_c (current_part->operations, (gchar)OSTREE_STATIC_DELTA_OP_CLOSE);
+    }
+
+  if (current_part->objects->len > 0)
+    submit_part (builder, current_part);
+  else
+    g_ptr_array_remove (builder->parts, current_part);
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/*
+ * Save the descriptor of a delta; @fallbacks and @part_headers are
+ * consumed if floating.
+ */
+static gboolean
+write_delta_descriptor (OstreeRepo                   *self,
+                        const char                   *from,
+                        const char                   *to,
+                        GVariant                     *metadata,
+                        GVariant                     *fallbacks,
+                        GVariant                     *part_headers,
+                        GCancellable                 *cancellable,
+                        GError                      **error)
+{
+  gboolean ret = FALSE;
+  GVariant *metadata_source;
+  GDateTime *now;
+  gs_free char *descriptor_relpath = NULL;
+  gs_unref_object GFile *descriptor_path = NULL;
+  gs_unref_object GFile *descriptor_dir = NULL;
+  gs_unref_variant GVariant *tmp_metadata = NULL;
+  gs_unref_variant GVariant *delta_descriptor = NULL;
+
+  descriptor_relpath = _ostree_get_relative_static_delta_path (from, to);
+  descriptor_path = g_file_resolve_relative_path (self->repodir, descriptor_relpath);
+  descriptor_dir = g_file_get_parent (descriptor_path);
+
+  if (!gs_file_ensure_directory (descriptor_dir, TRUE, cancellable, error))
+    goto out;
+
+  if (metadata != NULL)
     metadata_source = metadata;
   else
     {
@@ -365,21 +1203,617 @@ ostree_repo_static_delta_generate (OstreeRepo                   *self,
       metadata_source = tmp_metadata;
     }
 
-  {
-    GDateTime *now = g_date_time_new_now_utc ();
-    delta_descriptor = g_variant_new ("(@(a(ss)a(say))taya" OSTREE_STATIC_DELTA_META_ENTRY_FORMAT ")",
-                                      metadata_source,
-                                      GUINT64_TO_BE (g_date_time_to_unix (now)),
-                                      g_variant_builder_new (G_VARIANT_TYPE ("ay")),
-                                      part_headers);
-    g_date_time_unref (now);
-  }
+  now = g_date_time_new_now_utc ();
+  delta_descriptor = g_variant_new ("(@(a(ss)a(say))t@ay@a" OSTREE_STATIC_DELTA_META_ENTRY_FORMAT ")",
+                                    metadata_source,
+                                    GUINT64_TO_BE (g_date_time_to_unix (now)),
+                                    fallbacks,
+                                    part_headers);
+  g_variant_ref_sink (delta_descriptor);
+  g_date_time_unref (now);
 
   if (!ot_util_variant_save (descriptor_path, delta_descriptor, cancellable, error))
     goto out;
 
   ret = TRUE;
  out:
+  return ret;
+}
+
+/*
+ * Find the shortest chain of existing deltas from @from to @to.
+ * Deltas which are chains themselves are not used.  The result is a
+ * fallback array for a delta descriptor.
+ */
+static gboolean
+find_delta_chain (OstreeRepo       *self,
+                  const char       *from,
+                  const char       *to,
+                  GBytes          **out_fallbacks,
+                  GCancellable     *cancellable,
+                  GError          **error)
+{
+  gboolean ret = FALSE;
+  guint i;
+  const char *cur;
+  gs_unref_ptrarray GPtrArray *delta_names = NULL;
+  gs_unref_hashtable GHashTable *edges = NULL;
+  gs_unref_hashtable GHashTable *reached_from = NULL;
+  gs_unref_ptrarray GPtrArray *path = NULL;
+  GQueue queue = G_QUEUE_INIT;
+  GByteArray *fallbacks = NULL;
+
+  if (!ostree_repo_list_static_delta_names (self, &delta_names, cancellable, error))
+    goto out;
+
+  /* Map each from commit to the array of to commits of its deltas */
+  edges = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                 (GDestroyNotify)g_ptr_array_unref);
+  for (i = 0; i < delta_names->len; i++)
+    {
+      const char *name = delta_names->pdata[i];
+      GPtrArray *targets;
+      gs_free char *delta_from = NULL;
+      gs_unref_object GFile *meta_path = NULL;
+      gs_unref_variant GVariant *meta = NULL;
+      gs_unref_variant GVariant *meta_fallbacks = NULL;
+
+      if (strlen (name) != 129 || name[64] != '-')
+        continue;
+
+      delta_from = g_strndup (name, 64);
+      if (!(ostree_validate_checksum_string (delta_from, NULL) &&
+            ostree_validate_checksum_string (name + 65, NULL)))
+        continue;
+
+      meta_path = ot_gfile_resolve_path_printf (self->deltas_dir, "%s/meta", name);
+      if (!ot_util_variant_map (meta_path, G_VARIANT_TYPE (OSTREE_STATIC_DELTA_META_FORMAT),
+                                FALSE, &meta, error))
+        goto out;
+      meta_fallbacks = g_variant_get_child_value (meta, 2);
+      if (g_variant_n_children (meta_fallbacks) > 0)
+        continue;
+
+      targets = g_hash_table_lookup (edges, delta_from);
+      if (!targets)
+        {
+          targets = g_ptr_array_new_with_free_func (g_free);
+          g_hash_table_insert (edges, g_strdup (delta_from), targets);
+        }
+      g_ptr_array_add (targets, g_strdup (name + 65));
+    }
+
+  /* Breadth first search; values are owned by edges, except @from */
+  reached_from = g_hash_table_new (g_str_hash, g_str_equal);
+  g_hash_table_insert (reached_from, (char*)from, NULL);
+  g_queue_push_tail (&queue, (char*)from);
+  while (!g_queue_is_empty (&queue) && !g_hash_table_contains (reached_from, to))
+    {
+      GPtrArray *targets;
+
+      cur = g_queue_pop_head (&queue);
+      targets = g_hash_table_lookup (edges, cur);
+      if (!targets)
+        continue;
+
+      for (i = 0; i < targets->len; i++)
+        {
+          char *target = targets->pdata[i];
+          if (g_hash_table_contains (reached_from, target))
+            continue;
+          g_hash_table_insert (reached_from, target, (char*)cur);
+          g_queue_push_tail (&queue, target);
+        }
+    }
+
+  if (!g_hash_table_contains (reached_from, to))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                   "No chain of static deltas from %s to %s", from, to);
+      goto out;
+    }
+
+  /* Walk back from @to, then emit the chain in order */
+  path = g_ptr_array_new ();
+  for (cur = to; cur != NULL; cur = g_hash_table_lookup (reached_from, cur))
+    g_ptr_array_add (path, (char*)cur);
+
+  fallbacks = g_byte_array_new ();
+  for (i = path->len - 1; i > 0; i--)
+    {
+      guint8 csum[32];
+
+      ostree_checksum_inplace_to_bytes (path->pdata[i], csum);
+      g_byte_array_append (fallbacks, csum, sizeof (csum));
+      ostree_checksum_inplace_to_bytes (path->pdata[i-1], csum);
+      g_byte_array_append (fallbacks, csum, sizeof (csum));
+    }
+
+  ret = TRUE;
+  *out_fallbacks = g_byte_array_free_to_bytes (fallbacks);
+  fallbacks = NULL;
+ out:
+  g_queue_clear (&queue);
+  if (fallbacks)
+    g_byte_array_unref (fallbacks);
+  return ret;
+}
+
+/*
+ * Write a descriptor without parts, which refers to existing deltas
+ * leading from @from to @to.
+ */
+static gboolean
+generate_delta_chain (OstreeRepo                   *self,
+                      const char                   *from,
+                      const char                   *to,
+                      GVariant                     *metadata,
+                      GCancellable                 *cancellable,
+                      GError                      **error)
+{
+  gboolean ret = FALSE;
+  gs_free char *descriptor_relpath = NULL;
+  gs_unref_object GFile *descriptor_path = NULL;
+  gs_unref_bytes GBytes *fallbacks = NULL;
+
+  if (from == NULL)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                   "A chain of static deltas needs a from commit");
+      goto out;
+    }
+
+  descriptor_relpath = _ostree_get_relative_static_delta_path (from, to);
+  descriptor_path = g_file_resolve_relative_path (self->repodir, descriptor_relpath);
+  if (g_file_query_exists (descriptor_path, NULL))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_EXISTS,
+                   "Static delta %s-%s already exists", from, to);
+      goto out;
+    }
+
+  if (!find_delta_chain (self, from, to, &fallbacks, cancellable, error))
+    goto out;
+
+  if (!write_delta_descriptor (self, from, to, metadata,
+                               ot_gvariant_new_ay_bytes (fallbacks),
+                               g_variant_new_array (G_VARIANT_TYPE (OSTREE_STATIC_DELTA_META_ENTRY_FORMAT), NULL, 0),
+                               cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+static gboolean
+generate_static_delta (OstreeRepo                   *self,
+                       OstreeStaticDeltaGenerateOpt  opt,
+                       const char                   *from,
+                       const char                   *to,
+                       GVariant                     *metadata,
+                       GVariant                     *params,
+                       DeltaTraversalCache          *cache,
+                       GCancellable                 *cancellable,
+                       GError                      **error)
+{
+  gboolean ret = FALSE;
+  OstreeStaticDeltaBuilder builder = { 0, };
+  guint i;
+  guint32 max_memory_mb = 0;
+  gboolean chain = FALSE;
+  gs_unref_variant_builder GVariantBuilder *part_headers = NULL;
+  gs_free char *descriptor_relpath = NULL;
+  gs_unref_object GFile *descriptor_path = NULL;
+  gs_unref_object GFile *descriptor_dir = NULL;
+
+  builder.repo = self;
+  builder.compression = 'g';
+  builder.cancellable = cancellable;
+  g_mutex_init (&builder.lock);
+  g_cond_init (&builder.cond);
+  builder.parts = g_ptr_array_new_with_free_func ((GDestroyNotify)ostree_static_delta_part_builder_unref);
+
+  if (params)
+    {
+      (void) g_variant_lookup (params, "compression", "y", &builder.compression);
+      (void) g_variant_lookup (params, "max-memory-size", "u", &max_memory_mb);
+      (void) g_variant_lookup (params, "chain", "b", &chain);
+    }
+
+  if (!(builder.compression == 0 || builder.compression == 'g' || builder.compression == 'x'))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                   "Invalid static delta compression type '%u'", builder.compression);
+      goto out;
+    }
+
+  if (chain)
+    {
+      if (!generate_delta_chain (self, from, to, metadata,
+                                 cancellable, error))
+        goto out;
+      ret = TRUE;
+      goto out;
+    }
+
+  builder.compress_pool = ot_thread_pool_new_nproc (compress_part_thread, &builder);
+  if (max_memory_mb > 0)
+    builder.max_resident_size = (guint64)max_memory_mb * 1024 * 1024;
+  else
+    builder.max_resident_size = (guint64)(g_thread_pool_get_max_threads (builder.compress_pool) + 1) *
+      OSTREE_STATIC_DELTA_PART_MAX_SIZE_BYTES;
+
+  if (!generate_delta (self, opt, from, to, &builder, cache,
+                       cancellable, error))
+    goto out;
+
+  /* Wait for the remaining parts to be written */
+  g_thread_pool_free (builder.compress_pool, FALSE, TRUE);
+  builder.compress_pool = NULL;
+
+  part_headers = g_variant_builder_new (G_VARIANT_TYPE ("a" OSTREE_STATIC_DELTA_META_ENTRY_FORMAT));
+  for (i = 0; i < builder.parts->len; i++)
+    {
+      OstreeStaticDeltaPartBuilder *part_builder = builder.parts->pdata[i];
+      gs_unref_bytes GBytes *objtype_checksum_array = NULL;
+      gs_unref_bytes GBytes *checksum_bytes = NULL;
+      GVariant *delta_part_header;
+
+      if (part_builder->error)
+        {
+          g_propagate_error (error, part_builder->error);
+          part_builder->error = NULL;
+          g_prefix_error (error, "writing delta part %u: ", i);
+          goto out;
+        }
+
+      /* Clients refuse parts whose payload exceeds this */
+      if (part_builder->content_size > _ostree_static_delta_part_max_payload_size (part_builder->uncompressed_size))
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Delta part %u payload of %" G_GUINT64_FORMAT " bytes is too large for its objects",
+                       i, part_builder->content_size);
+          goto out;
+        }
+
+      checksum_bytes = g_bytes_new (part_builder->checksum, 32);
+      objtype_checksum_array = objtype_checksum_array_new (part_builder->objects);
+      delta_part_header = g_variant_new ("(@aytt@ay)",
+                                         ot_gvariant_new_ay_bytes (checksum_bytes),
+                                         part_builder->compressed_size,
+                                         part_builder->uncompressed_size,
+                                         ot_gvariant_new_ay_bytes (objtype_checksum_array));
+      g_variant_builder_add_value (part_headers, delta_part_header);
+    }
+
+  descriptor_relpath = _ostree_get_relative_static_delta_path (from, to);
+  descriptor_path = g_file_resolve_relative_path (self->repodir, descriptor_relpath);
+  descriptor_dir = g_file_get_parent (descriptor_path);
+
+  if (!gs_file_ensure_directory (descriptor_dir, TRUE, cancellable, error))
+    goto out;
+
+  for (i = 0; i < builder.parts->len; i++)
+    {
+      OstreeStaticDeltaPartBuilder *part_builder = builder.parts->pdata[i];
+      gs_free char *part_relpath = _ostree_get_relative_static_delta_part_path (from, to, i);
+      gs_unref_object GFile *part_path = g_file_resolve_relative_path (self->repodir, part_relpath);
+
+      if (!gs_file_rename (part_builder->tempfile, part_path, cancellable, error))
+        goto out;
+      g_clear_object (&part_builder->tempfile);
+    }
+
+  if (!write_delta_descriptor (self, from, to, metadata,
+                               g_variant_new_array (G_VARIANT_TYPE_BYTE, NULL, 0),
+                               g_variant_builder_end (part_headers),
+                               cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  /* On error, drop queued parts but let running ones finish */
+  if (builder.compress_pool)
+    g_thread_pool_free (builder.compress_pool, TRUE, TRUE);
   g_clear_pointer (&builder.parts, g_ptr_array_unref);
+  g_mutex_clear (&builder.lock);
+  g_cond_clear (&builder.cond);
+  return ret;
+}
+
+/**
+ * ostree_repo_static_delta_generate:
+ * @self: Repo
+ * @opt: High level optimization choice
+ * @from: (allow-none): ASCII SHA256 checksum of origin, or %NULL
+ * @to: ASCII SHA256 checksum of target
+ * @metadata: (allow-none): Optional metadata
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Like ostree_repo_static_delta_generate_with_params(), with default
+ * parameters.
+ */
+gboolean
+ostree_repo_static_delta_generate (OstreeRepo                   *self,
+                                   OstreeStaticDeltaGenerateOpt  opt,
+                                   const char                   *from,
+                                   const char                   *to,
+                                   GVariant                     *metadata,
+                                   GCancellable                 *cancellable,
+                                   GError                      **error)
+{
+  return ostree_repo_static_delta_generate_with_params (self, opt, from, to, metadata, NULL,
+                                                        cancellable, error);
+}
+
+/**
+ * ostree_repo_static_delta_generate_with_params:
+ * @self: Repo
+ * @opt: High level optimization choice
+ * @from: (allow-none): ASCII SHA256 checksum of origin, or %NULL
+ * @to: ASCII SHA256 checksum of target
+ * @metadata: (allow-none): Optional metadata
+ * @params: (allow-none): Parameters, of type a{sv}
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Generate a lookaside "static delta" from @from which can generate
+ * the objects in @to.  This delta is an optimization over fetching
+ * individual objects, and can be conveniently stored and applied
+ * offline.
+ *
+ * If @from is %NULL, the delta contains every object of @to; this
+ * allows an initial pull to download a few large parts rather than
+ * each object individually.
+ *
+ * With %OSTREE_STATIC_DELTA_GENERATE_OPT_MAJOR, files modified
+ * between the two commits are compared with a rolling checksum, and
+ * only the changed parts are included in the delta.
+ *
+ * The following keys are recognized in @params:
+ *
+ *   - compression: y: Compression of the parts: 'g' for gzip (the
+ *     default), 'x' for LZMA, or 0 for none
+ *   - max-memory-size: u: Approximate limit in megabytes on the
+ *     uncompressed part data held in memory; parts are compressed in
+ *     parallel within this budget.  The default allows one part per
+ *     CPU.
+ *   - chain: b: Rather than computing a new delta, refer to a chain
+ *     of existing deltas leading from @from to @to, so that clients
+ *     several commits behind can use them
+ */
+gboolean
+ostree_repo_static_delta_generate_with_params (OstreeRepo                   *self,
+                                               OstreeStaticDeltaGenerateOpt  opt,
+                                               const char                   *from,
+                                               const char                   *to,
+                                               GVariant                     *metadata,
+                                               GVariant                     *params,
+                                               GCancellable                 *cancellable,
+                                               GError                      **error)
+{
+  gboolean ret;
+  DeltaTraversalCache cache;
+
+  delta_traversal_cache_init (&cache);
+  ret = generate_static_delta (self, opt, from, to, metadata, params, &cache,
+                               cancellable, error);
+  delta_traversal_cache_clear (&cache);
+  return ret;
+}
+
+typedef struct {
+  OstreeRepo *repo;
+  const char *commit;
+  gboolean want_content_paths;
+  GHashTable *reachable;
+  GHashTable *content_paths;
+  GCancellable *cancellable;
+  GError *error;
+} DeltaTraverseTask;
+
+static void
+traverse_commit_thread (gpointer   data,
+                        gpointer   user_data)
+{
+  DeltaTraverseTask *task = data;
+
+  (void) traverse_delta_commit (task->repo, task->commit, &task->reachable,
+                                task->want_content_paths ? &task->content_paths : NULL,
+                                task->cancellable, &task->error);
+}
+
+/**
+ * ostree_repo_static_delta_generate_for_refs:
+ * @self: Repo
+ * @opt: High level optimization choice
+ * @refs: (array zero-terminated=1): Refs to generate deltas for
+ * @depth: Number of parent commits of each ref to generate deltas from
+ * @params: (allow-none): Parameters, of type a{sv}, as for ostree_repo_static_delta_generate_with_params()
+ * @out_generated: (out) (element-type utf8) (allow-none): Names (FROM-TO) of the deltas generated
+ * @out_skipped: (out) (element-type utf8) (allow-none): Names of the deltas which already existed
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * For each ref in @refs, generate static deltas to the commit it
+ * points to from each of its last @depth ancestors.  Deltas which
+ * already exist are skipped, as are ancestors which aren't stored
+ * locally.
+ *
+ * This is much cheaper than generating the deltas one at a time:
+ * every commit is traversed only once, in parallel.  The deltas are
+ * then generated in turn, each compressing its parts in parallel.
+ */
+gboolean
+ostree_repo_static_delta_generate_for_refs (OstreeRepo                   *self,
+                                            OstreeStaticDeltaGenerateOpt  opt,
+                                            const char * const           *refs,
+                                            guint                         depth,
+                                            GVariant                     *params,
+                                            GPtrArray                   **out_generated,
+                                            GPtrArray                   **out_skipped,
+                                            GCancellable                 *cancellable,
+                                            GError                      **error)
+{
+  gboolean ret = FALSE;
+  guint i;
+  GHashTableIter hashiter;
+  gpointer key, value;
+  GThreadPool *pool = NULL;
+  DeltaTraversalCache cache;
+  gs_unref_hashtable GHashTable *seen_pairs = NULL;
+  gs_unref_hashtable GHashTable *commits = NULL;
+  gs_unref_ptrarray GPtrArray *pairs = NULL;
+  gs_unref_ptrarray GPtrArray *ret_generated = NULL;
+  gs_unref_ptrarray GPtrArray *ret_skipped = NULL;
+  GPtrArray *traverse_tasks = NULL;
+
+  delta_traversal_cache_init (&cache);
+
+  /* Collect the pairs, as from and to in turn, and the commits to
+   * traverse; the value is whether the content paths of the commit
+   * are needed.
+   */
+  seen_pairs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  commits = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  pairs = g_ptr_array_new_with_free_func (g_free);
+  ret_generated = g_ptr_array_new_with_free_func (g_free);
+  ret_skipped = g_ptr_array_new_with_free_func (g_free);
+  for (i = 0; refs[i] != NULL; i++)
+    {
+      guint j;
+      gs_free char *to = NULL;
+      gs_free char *from = NULL;
+
+      if (!ostree_repo_resolve_rev (self, refs[i], FALSE, &to, error))
+        goto out;
+
+      from = g_strdup (to);
+      for (j = 0; j < depth; j++)
+        {
+          gs_unref_variant GVariant *commit = NULL;
+          gs_free char *parent = NULL;
+          gs_free char *delta_relpath = NULL;
+          gs_unref_object GFile *delta_meta = NULL;
+          gs_unref_object GFile *delta_dir = NULL;
+          gboolean have_parent;
+
+          if (!ostree_repo_load_variant (self, OSTREE_OBJECT_TYPE_COMMIT, from, &commit, error))
+            goto out;
+          parent = ostree_commit_get_parent (commit);
+          if (!parent)
+            break;
+          if (!ostree_repo_has_object (self, OSTREE_OBJECT_TYPE_COMMIT, parent,
+                                       &have_parent, cancellable, error))
+            goto out;
+          if (!have_parent)
+            break;
+
+          g_free (from);
+          from = parent;
+          parent = NULL;
+
+          delta_relpath = _ostree_get_relative_static_delta_path (from, to);
+          delta_meta = g_file_resolve_relative_path (self->repodir, delta_relpath);
+          delta_dir = g_file_get_parent (delta_meta);
+          if (g_file_query_exists (delta_dir, NULL))
+            {
+              g_ptr_array_add (ret_skipped, g_strconcat (from, "-", to, NULL));
+              continue;
+            }
+
+          if (g_hash_table_contains (seen_pairs, delta_relpath))
+            continue;
+          g_hash_table_add (seen_pairs, delta_relpath);
+          delta_relpath = NULL;
+
+          if (!g_hash_table_contains (commits, from))
+            g_hash_table_insert (commits, g_strdup (from), GINT_TO_POINTER (FALSE));
+          g_hash_table_replace (commits, g_strdup (to), GINT_TO_POINTER (TRUE));
+
+          g_ptr_array_add (pairs, g_strdup (from));
+          g_ptr_array_add (pairs, g_strdup (to));
+        }
+    }
+
+  /* Traverse all commits up front, in parallel; after this the cache
+   * is only read.
+   */
+  traverse_tasks = g_ptr_array_new_with_free_func (g_free);
+  pool = ot_thread_pool_new_nproc (traverse_commit_thread, NULL);
+  g_hash_table_iter_init (&hashiter, commits);
+  while (g_hash_table_iter_next (&hashiter, &key, &value))
+    {
+      DeltaTraverseTask *task = g_new0 (DeltaTraverseTask, 1);
+      task->repo = self;
+      task->commit = key;
+      task->want_content_paths = GPOINTER_TO_INT (value);
+      task->cancellable = cancellable;
+      g_ptr_array_add (traverse_tasks, task);
+      g_thread_pool_push (pool, task, NULL);
+    }
+  g_thread_pool_free (pool, FALSE, TRUE);
+  pool = NULL;
+
+  for (i = 0; i < traverse_tasks->len; i++)
+    {
+      DeltaTraverseTask *task = traverse_tasks->pdata[i];
+
+      if (task->error)
+        {
+          g_propagate_error (error, task->error);
+          task->error = NULL;
+          goto out;
+        }
+    }
+
+  for (i = 0; i < traverse_tasks->len; i++)
+    {
+      DeltaTraverseTask *task = traverse_tasks->pdata[i];
+
+      g_hash_table_insert (cache.reachable, g_strdup (task->commit), task->reachable);
+      task->reachable = NULL;
+      if (task->content_paths)
+        {
+          g_hash_table_insert (cache.content_paths, g_strdup (task->commit), task->content_paths);
+          task->content_paths = NULL;
+        }
+    }
+
+  /* Each delta already compresses its parts on a thread per CPU, so
+   * generate them one at a time.
+   */
+  for (i = 0; i < pairs->len; i += 2)
+    {
+      const char *from = pairs->pdata[i];
+      const char *to = pairs->pdata[i+1];
+
+      if (!generate_static_delta (self, opt, from, to, NULL, params, &cache,
+                                  cancellable, error))
+        {
+          g_prefix_error (error, "generating delta %s-%s: ", from, to);
+          goto out;
+        }
+      g_ptr_array_add (ret_generated, g_strconcat (from, "-", to, NULL));
+    }
+
+  ret = TRUE;
+  gs_transfer_out_value (out_generated, &ret_generated);
+  gs_transfer_out_value (out_skipped, &ret_skipped);
+ out:
+  if (traverse_tasks)
+    {
+      for (i = 0; i < traverse_tasks->len; i++)
+        {
+          DeltaTraverseTask *task = traverse_tasks->pdata[i];
+          g_clear_pointer (&task->reachable, g_hash_table_unref);
+          g_clear_pointer (&task->content_paths, g_hash_table_unref);
+          g_clear_error (&task->error);
+        }
+      g_ptr_array_unref (traverse_tasks);
+    }
+  delta_traversal_cache_clear (&cache);
   return ret;
 }
@@ -20,8 +20,12 @@
 
 #include "config.h"
 
+#include <string.h>
+#include <gio/gfiledescriptorbased.h>
+
 #include "ostree-repo-private.h"
 #include "ostree-repo-static-delta-private.h"
+#include "ostree-lzma-decompressor.h"
 #include "otutil.h"
 
 gboolean
@@ -50,6 +54,70 @@ _ostree_static_delta_parse_checksum_array (GVariant      *array,
   return TRUE;
 }
 
+/**
+ * _ostree_static_delta_parse_fallbacks:
+ * @array: Fallback array of a delta descriptor
+ * @from: (allow-none): ASCII checksum of the from commit of the descriptor
+ * @to: (allow-none): ASCII checksum of the to commit of the descriptor
+ * @out_fallbacks: (out) (element-type utf8): From and to ASCII checksums of each fallback delta, in turn
+ * @error: Error
+ *
+ * Validate that the fallbacks form a chain starting at @from and
+ * ending at @to; where either is %NULL, that end isn't checked.
+ */
+gboolean
+_ostree_static_delta_parse_fallbacks (GVariant      *array,
+                                      const char    *from,
+                                      const char    *to,
+                                      GPtrArray    **out_fallbacks,
+                                      GError       **error)
+{
+  gboolean ret = FALSE;
+  gsize n = g_variant_n_children (array);
+  const guint8 *data = g_variant_get_data (array);
+  guint i;
+  gs_unref_ptrarray GPtrArray *ret_fallbacks = g_ptr_array_new_with_free_func (g_free);
+
+  if (n % OSTREE_STATIC_DELTA_FALLBACK_CSUM_LEN != 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Invalid fallback array length %" G_GSIZE_FORMAT, n);
+      goto out;
+    }
+
+  for (i = 0; i < n / OSTREE_STATIC_DELTA_FALLBACK_CSUM_LEN; i++)
+    {
+      const guint8 *entry = data + (i * OSTREE_STATIC_DELTA_FALLBACK_CSUM_LEN);
+      char *fallback_from = ostree_checksum_from_bytes (entry);
+      char *fallback_to = ostree_checksum_from_bytes (entry + 32);
+      const char *expected_from = i > 0 ? ret_fallbacks->pdata[ret_fallbacks->len - 1] : from;
+
+      g_ptr_array_add (ret_fallbacks, fallback_from);
+      g_ptr_array_add (ret_fallbacks, fallback_to);
+
+      if (expected_from != NULL && strcmp (expected_from, fallback_from) != 0)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Fallback delta %s-%s doesn't start at %s",
+                       fallback_from, fallback_to, expected_from);
+          goto out;
+        }
+    }
+
+  if (to != NULL && ret_fallbacks->len > 0 &&
+      strcmp (ret_fallbacks->pdata[ret_fallbacks->len - 1], to) != 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Fallback deltas end at %s, not %s",
+                   (char*)ret_fallbacks->pdata[ret_fallbacks->len - 1], to);
+      goto out;
+    }
+
+  ret = TRUE;
+  gs_transfer_out_value (out_fallbacks, &ret_fallbacks);
+ out:
+  return ret;
+}
 
 /**
  * ostree_repo_list_static_delta_names:
@@ -115,16 +183,29 @@ ostree_repo_list_static_delta_names (OstreeRepo                  *self,
   return ret;
 }
 
-static gboolean
-have_all_objects (OstreeRepo             *repo,
-                  GVariant               *checksum_array,
-                  gboolean               *out_have_all,
-                  GCancellable           *cancellable,
-                  GError                **error)
+/**
+ * _ostree_repo_static_delta_part_have_all_objects:
+ * @repo: Repo
+ * @checksum_array: Object list of a delta part
+ * @out_have_all: (out): Whether all objects of the part are already stored
+ * @out_n_missing: (out) (allow-none): Number of objects which are not stored
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * If @out_n_missing is %NULL, this stops at the first missing object.
+ */
+gboolean
+_ostree_repo_static_delta_part_have_all_objects (OstreeRepo             *repo,
+                                                 GVariant               *checksum_array,
+                                                 gboolean               *out_have_all,
+                                                 guint                  *out_n_missing,
+                                                 GCancellable           *cancellable,
+                                                 GError                **error)
 {
   gboolean ret = FALSE;
   guint8 *checksums_data;
   guint i,n_checksums;
+  guint n_missing = 0;
   gboolean have_object = TRUE;
 
   if (!_ostree_static_delta_parse_checksum_array (checksum_array,
@@ -149,72 +230,438 @@ have_all_objects (OstreeRepo             *repo,
         goto out;
 
       if (!have_object)
-        break;
+        {
+          n_missing++;
+          if (!out_n_missing)
+            break;
+        }
 
       checksums_data += OSTREE_STATIC_DELTA_OBJTYPE_CSUM_LEN;
     }
 
   ret = TRUE;
-  *out_have_all = have_object;
+  *out_have_all = (n_missing == 0);
+  if (out_n_missing)
+    *out_n_missing = n_missing;
  out:
   return ret;
 }
 
+/**
+ * _ostree_static_delta_part_max_payload_size:
+ * @usize: Uncompressed size of a part's objects, from its header
+ *
+ * A part's payload holds at most the data of its objects plus the
+ * operations writing them, so a part that inflates to more than this
+ * is corrupt or hostile.  The bound is loose enough for parts written
+ * by any version of the generator.
+ */
+guint64
+_ostree_static_delta_part_max_payload_size (guint64 usize)
+{
+  if (usize > (G_MAXUINT64 - OSTREE_STATIC_DELTA_PART_MAX_SIZE_BYTES) / 2)
+    return G_MAXUINT64;
+  return usize * 2 + OSTREE_STATIC_DELTA_PART_MAX_SIZE_BYTES;
+}
+
+/*
+ * Inflate @len bytes at @data, which may decompress to at most
+ * @max_size bytes.  The output buffer never grows beyond that, so a
+ * corrupt or hostile part can't make us allocate without bound.
+ */
 static gboolean
-zlib_uncompress_data (GBytes       *data,
-                      GBytes      **out_uncompressed,
-                      GCancellable *cancellable,
-                      GError      **error)
+uncompress_part (GConverter    *decompressor,
+                 const guint8  *data,
+                 gsize          len,
+                 guint64        max_size,
+                 GBytes       **out_uncompressed,
+                 GCancellable  *cancellable,
+                 GError       **error)
 {
   gboolean ret = FALSE;
-  gs_unref_object GMemoryInputStream *memin = (GMemoryInputStream*)g_memory_input_stream_new_from_bytes (data);
-  gs_unref_object GMemoryOutputStream *memout = (GMemoryOutputStream*)g_memory_output_stream_new (NULL, 0, g_realloc, g_free);
-  gs_unref_object GConverter *zlib_decomp =
-    (GConverter*) g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_RAW);
-  gs_unref_object GInputStream *convin = g_converter_input_stream_new ((GInputStream*)memin, zlib_decomp);
-
-  if (0 > g_output_stream_splice ((GOutputStream*)memout, convin,
-                                  G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE |
-                                  G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET,
-                                  cancellable, error))
-    goto out;
+  gsize in_pos = 0;
+  gsize out_pos = 0;
+  gsize out_max;
+  gsize out_allocated;
+  guint8 *outbuf = NULL;
+
+  /* One byte of slack lets us detect output beyond @max_size */
+  out_max = max_size >= G_MAXSIZE ? G_MAXSIZE : max_size + 1;
+  out_allocated = MIN (out_max, MAX (len * 4, 4096));
+  outbuf = g_malloc (out_allocated);
+
+  while (TRUE)
+    {
+      GConverterResult res;
+      gsize bytes_read = 0;
+      gsize bytes_written = 0;
+      GError *temp_error = NULL;
+
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        goto out;
+
+      res = g_converter_convert (decompressor, data + in_pos, len - in_pos,
+                                 outbuf + out_pos, out_allocated - out_pos,
+                                 G_CONVERTER_INPUT_AT_END,
+                                 &bytes_read, &bytes_written, &temp_error);
+      if (res == G_CONVERTER_ERROR)
+        {
+          if (!g_error_matches (temp_error, G_IO_ERROR, G_IO_ERROR_NO_SPACE))
+            {
+              g_propagate_error (error, temp_error);
+              goto out;
+            }
+          g_clear_error (&temp_error);
+        }
+      else
+        {
+          in_pos += bytes_read;
+          out_pos += bytes_written;
+          if (res == G_CONVERTER_FINISHED)
+            break;
+        }
+
+      if (out_pos > max_size)
+        break;
+
+      if (out_allocated - out_pos < 4096 && out_allocated < out_max)
+        {
+          out_allocated = out_allocated > out_max / 2 ? out_max : out_allocated * 2;
+          outbuf = g_realloc (outbuf, out_allocated);
+        }
+      else if (bytes_read == 0 && bytes_written == 0)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Static delta part failed to decompress within %" G_GUINT64_FORMAT " bytes",
+                       max_size);
+          goto out;
+        }
+    }
+
+  if (out_pos > max_size)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Static delta part decompresses to more than %" G_GUINT64_FORMAT " bytes",
+                   max_size);
+      goto out;
+    }
+  if (in_pos != len)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Trailing data after compressed static delta part");
+      goto out;
+    }
 
   ret = TRUE;
-  *out_uncompressed = g_memory_output_stream_steal_as_bytes (memout);
+  *out_uncompressed = g_bytes_new_take (outbuf, out_pos);
+  outbuf = NULL;
  out:
+  g_free (outbuf);
   return ret;
 }
 
 /**
- * ostree_repo_static_delta_execute_offline:
- * @self: Repo
- * @dir: Path to a directory containing static delta data
- * @skip_validation: If %TRUE, assume data integrity
+ * _ostree_static_delta_part_open:
+ * @part_bytes: Raw contents of a delta part, including the compression byte
+ * @expected_checksum: (allow-none): Binary SHA256 of @part_bytes, or %NULL to skip validation
+ * @usize: Uncompressed size of the part's objects, from its header
+ * @out_part: (out): Uncompressed part, of type %OSTREE_STATIC_DELTA_PART_PAYLOAD_FORMAT
  * @cancellable: Cancellable
  * @error: Error
  *
- * Given a directory representing an already-downloaded static delta
- * on disk, apply it, generating a new commit.  The directory must be
- * named with the form "FROM-TO", where both are checksums, and it
- * must contain a file named "meta", along with at least one part.
+ * Validate and decompress a delta part, ready for
+ * _ostree_static_delta_part_execute().  The checksum is verified
+ * before anything is decompressed, and the payload may not exceed
+ * _ostree_static_delta_part_max_payload_size() of @usize.
  */
 gboolean
-ostree_repo_static_delta_execute_offline (OstreeRepo                    *self,
-                                          GFile                         *dir,
-                                          gboolean                       skip_validation,
-                                          GCancellable                  *cancellable,
-                                          GError                      **error)
+_ostree_static_delta_part_open (GBytes         *part_bytes,
+                                const guchar   *expected_checksum,
+                                guint64         usize,
+                                GVariant      **out_part,
+                                GCancellable   *cancellable,
+                                GError        **error)
+{
+  gboolean ret = FALSE;
+  gsize partlen;
+  const guint8 *partdata;
+  guint64 max_size = _ostree_static_delta_part_max_payload_size (usize);
+  gs_unref_object GConverter *decomp = NULL;
+  gs_unref_bytes GBytes *payload = NULL;
+  gs_unref_variant GVariant *ret_part = NULL;
+
+  partdata = g_bytes_get_data (part_bytes, &partlen);
+
+  if (partlen < 1)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Corrupted 0 length byte static delta part");
+      goto out;
+    }
+
+  if (expected_checksum)
+    {
+      ot_cleanup_checksum OtChecksum *checksum = ot_checksum_new (G_CHECKSUM_SHA256);
+      guint8 actual_checksum[32];
+      gsize digest_len = sizeof (actual_checksum);
+
+      ot_checksum_update (checksum, partdata, partlen);
+      ot_checksum_get_digest (checksum, actual_checksum, &digest_len);
+      if (ostree_cmp_checksum_bytes (expected_checksum, actual_checksum) != 0)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Checksum mismatch in static delta part");
+          goto out;
+        }
+    }
+
+  switch (partdata[0])
+    {
+    case 0:
+      if (partlen - 1 > max_size)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Static delta part is %" G_GSIZE_FORMAT " bytes, more than %" G_GUINT64_FORMAT,
+                       partlen - 1, max_size);
+          goto out;
+        }
+      payload = g_bytes_new_from_bytes (part_bytes, 1, partlen - 1);
+      break;
+    case 'g':
+      decomp = (GConverter*) g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_RAW);
+      break;
+    case 'x':
+      decomp = (GConverter*) _ostree_lzma_decompressor_new ();
+      break;
+    default:
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Invalid compression type '%u' in static delta part",
+                   partdata[0]);
+      goto out;
+    }
+
+  if (decomp)
+    {
+      if (!uncompress_part (decomp, partdata + 1, partlen - 1, max_size,
+                            &payload, cancellable, error))
+        goto out;
+    }
+
+  ret_part = ot_variant_new_from_bytes (G_VARIANT_TYPE (OSTREE_STATIC_DELTA_PART_PAYLOAD_FORMAT),
+                                        payload, FALSE);
+  g_variant_ref_sink (ret_part);
+
+  ret = TRUE;
+  ot_transfer_out_value (out_part, &ret_part);
+ out:
+  return ret;
+}
+
+/**
+ * _ostree_static_delta_load_content_bytes:
+ * @repo: Repo
+ * @checksum: ASCII SHA256 checksum of a regular file content object
+ * @out_bytes: (out): File data, without the header
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Load the data of a regular file for random access; used as a
+ * source for rollsum matches both when compiling and when executing
+ * a delta.  Where the object is stored uncompressed, it is mapped
+ * rather than read.
+ */
+gboolean
+_ostree_static_delta_load_content_bytes (OstreeRepo      *repo,
+                                         const char      *checksum,
+                                         GBytes         **out_bytes,
+                                         GCancellable    *cancellable,
+                                         GError         **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_object GInputStream *in = NULL;
+  gs_unref_object GFileInfo *file_info = NULL;
+  gs_unref_bytes GBytes *ret_bytes = NULL;
+
+  if (!ostree_repo_load_file (repo, checksum, &in, &file_info, NULL,
+                              cancellable, error))
+    goto out;
+
+  if (g_file_info_get_file_type (file_info) != G_FILE_TYPE_REGULAR)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Content object %s is not a regular file", checksum);
+      goto out;
+    }
+
+  if (G_IS_FILE_DESCRIPTOR_BASED (in))
+    {
+      int fd = g_file_descriptor_based_get_fd ((GFileDescriptorBased*)in);
+      GMappedFile *mfile;
+      GError *temp_error = NULL;
+
+      mfile = g_mapped_file_new_from_fd (fd, FALSE, &temp_error);
+      if (!mfile)
+        {
+          g_propagate_error (error, temp_error);
+          goto out;
+        }
+      ret_bytes = g_mapped_file_get_bytes (mfile);
+      g_mapped_file_unref (mfile);
+    }
+  else
+    {
+      gs_unref_object GMemoryOutputStream *memout =
+        (GMemoryOutputStream*)g_memory_output_stream_new (NULL, 0, g_realloc, g_free);
+
+      if (0 > g_output_stream_splice ((GOutputStream*)memout, in,
+                                      G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE |
+                                      G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET,
+                                      cancellable, error))
+        goto out;
+      ret_bytes = g_memory_output_stream_steal_as_bytes (memout);
+    }
+
+  if (g_bytes_get_size (ret_bytes) != g_file_info_get_size (file_info))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Short read of content object %s", checksum);
+      goto out;
+    }
+
+  ret = TRUE;
+  ot_transfer_out_value (out_bytes, &ret_bytes);
+ out:
+  return ret;
+}
+
+typedef struct {
+  OstreeRepo *repo;
+  guint index;
+  GFile *part_path;
+  const guchar *expected_checksum;
+  guint64 usize;
+  GVariant *objects;
+  GCancellable *cancellable;
+  GError *error;
+} StaticDeltaPartTask;
+
+static void
+static_delta_part_task_free (StaticDeltaPartTask *task)
+{
+  g_object_unref (task->part_path);
+  g_variant_unref (task->objects);
+  g_clear_error (&task->error);
+  g_free (task);
+}
+
+static gboolean
+execute_part_file (StaticDeltaPartTask  *task,
+                   GError              **error)
+{
+  gboolean ret = FALSE;
+  GMappedFile *mfile;
+  gs_unref_bytes GBytes *bytes = NULL;
+  gs_unref_variant GVariant *part = NULL;
+
+  mfile = gs_file_map_noatime (task->part_path, task->cancellable, error);
+  if (!mfile)
+    goto out;
+  bytes = g_mapped_file_get_bytes (mfile);
+  g_mapped_file_unref (mfile);
+
+  if (!_ostree_static_delta_part_open (bytes, task->expected_checksum, task->usize,
+                                       &part, task->cancellable, error))
+    {
+      g_prefix_error (error, "opening delta part %u: ", task->index);
+      goto out;
+    }
+
+  if (!_ostree_static_delta_part_execute (task->repo, task->objects, part,
+                                          task->cancellable, error))
+    {
+      g_prefix_error (error, "executing delta part %u: ", task->index);
+      goto out;
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+static void
+execute_part_thread (gpointer   data,
+                     gpointer   user_data)
+{
+  StaticDeltaPartTask *task = data;
+
+  (void) execute_part_file (task, &task->error);
+}
+
+static gboolean
+execute_offline_internal (OstreeRepo                    *self,
+                          GFile                         *dir,
+                          gboolean                       skip_validation,
+                          gboolean                       allow_fallbacks,
+                          GCancellable                  *cancellable,
+                          GError                      **error)
 {
   gboolean ret = FALSE;
   guint i, n;
+  GThreadPool *pool = NULL;
   gs_unref_object GFile *meta_file = g_file_get_child (dir, "meta");
   gs_unref_variant GVariant *meta = NULL;
+  gs_unref_variant GVariant *fallbacks_v = NULL;
   gs_unref_variant GVariant *headers = NULL;
+  gs_unref_ptrarray GPtrArray *fallbacks = NULL;
+  gs_unref_ptrarray GPtrArray *tasks =
+    g_ptr_array_new_with_free_func ((GDestroyNotify)static_delta_part_task_free);
+  gs_free char *dir_name = g_file_get_basename (dir);
+  const char *from = NULL;
+  const char *to = NULL;
 
   if (!ot_util_variant_map (meta_file, G_VARIANT_TYPE (OSTREE_STATIC_DELTA_META_FORMAT),
                             FALSE, &meta, error))
     goto out;
 
+  /* Deltas within a repository are named FROM-TO, or TO from scratch */
+  if (strlen (dir_name) == 129 && dir_name[64] == '-')
+    {
+      dir_name[64] = '\0';
+      from = dir_name;
+      to = dir_name + 65;
+    }
+  else
+    to = dir_name;
+  if ((from && !ostree_validate_checksum_string (from, NULL))
+      || !ostree_validate_checksum_string (to, NULL))
+    from = to = NULL;
+
+  fallbacks_v = g_variant_get_child_value (meta, 2);
+  if (!_ostree_static_delta_parse_fallbacks (fallbacks_v, from, to, &fallbacks, error))
+    goto out;
+
+  if (fallbacks->len > 0 && !allow_fallbacks)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "Fallback deltas may not have fallbacks themselves");
+      goto out;
+    }
+
+  /* Each delta of the chain depends on the commit of the previous one */
+  for (i = 0; i < fallbacks->len; i += 2)
+    {
+      gs_unref_object GFile *deltas_dir = g_file_get_parent (dir);
+      gs_free char *name = g_strconcat (fallbacks->pdata[i], "-", fallbacks->pdata[i+1], NULL);
+      gs_unref_object GFile *fallback_dir = g_file_get_child (deltas_dir, name);
+
+      if (!execute_offline_internal (self, fallback_dir, skip_validation, FALSE,
+                                     cancellable, error))
+        {
+          g_prefix_error (error, "applying fallback delta %s: ", name);
+          goto out;
+        }
+    }
+
   headers = g_variant_get_child_value (meta, 3);
   n = g_variant_n_children (headers);
   for (i = 0; i < n; i++)
@@ -223,18 +670,16 @@ ostree_repo_static_delta_execute_offline (OstreeRepo                    *self,
       guint64 usize;
       const guchar *csum;
       gboolean have_all;
+      StaticDeltaPartTask *task;
       gs_unref_variant GVariant *header = NULL;
       gs_unref_variant GVariant *csum_v = NULL;
       gs_unref_variant GVariant *objects = NULL;
-      gs_unref_object GFile *part_path = NULL;
-      gs_unref_variant GVariant *part = NULL;
-      gs_unref_object GInputStream *raw_in = NULL;
-      gs_unref_object GInputStream *in = NULL;
 
       header = g_variant_get_child_value (headers, i);
       g_variant_get (header, "(@aytt@ay)", &csum_v, &size, &usize, &objects);
 
-      if (!have_all_objects (self, objects, &have_all, cancellable, error))
+      if (!_ostree_repo_static_delta_part_have_all_objects (self, objects, &have_all, NULL,
+                                                            cancellable, error))
         goto out;
 
       /* If we already have these objects, don't bother executing the
@@ -243,87 +688,45 @@ ostree_repo_static_delta_execute_offline (OstreeRepo                    *self,
       if (have_all)
         continue;
 
+      /* Points into meta, which outlives the tasks */
       csum = ostree_checksum_bytes_peek_validate (csum_v, error);
       if (!csum)
         goto out;
 
-      part_path = ot_gfile_resolve_path_printf (dir, "%u", i);
+      task = g_new0 (StaticDeltaPartTask, 1);
+      task->repo = self;
+      task->index = i;
+      task->part_path = ot_gfile_resolve_path_printf (dir, "%u", i);
+      task->expected_checksum = skip_validation ? NULL : csum;
+      task->usize = usize;
+      task->objects = g_variant_ref (objects);
+      task->cancellable = cancellable;
+      g_ptr_array_add (tasks, task);
+    }
 
-      in = (GInputStream*)g_file_read (part_path, cancellable, error);
-      if (!in)
+  if (tasks->len == 1)
+    {
+      if (!execute_part_file (tasks->pdata[0], error))
         goto out;
+    }
+  else if (tasks->len > 1)
+    {
+      pool = ot_thread_pool_new_nproc (execute_part_thread, NULL);
+      for (i = 0; i < tasks->len; i++)
+        g_thread_pool_push (pool, tasks->pdata[i], NULL);
+      g_thread_pool_free (pool, FALSE, TRUE);
+      pool = NULL;
 
-      if (!skip_validation)
+      for (i = 0; i < tasks->len; i++)
         {
-          gs_unref_object GInputStream *tmp_in = NULL;
-          gs_free guchar *actual_checksum = NULL;
-
-          tmp_in = (GInputStream*)g_file_read (part_path, cancellable, error);
-          if (!tmp_in)
-            goto out;
-
-          if (!ot_gio_checksum_stream (tmp_in, &actual_checksum,
-                                       cancellable, error))
-            goto out;
-
-          if (ostree_cmp_checksum_bytes (csum, actual_checksum) != 0)
+          StaticDeltaPartTask *task = tasks->pdata[i];
+          if (task->error)
             {
-              g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-                           "Checksum mismatch in static delta %s part %u",
-                           gs_file_get_path_cached (dir), i);
+              g_propagate_error (error, task->error);
+              task->error = NULL;
               goto out;
             }
         }
-
-      {
-        GMappedFile *mfile = gs_file_map_noatime (part_path, cancellable, error);
-        gs_unref_bytes GBytes *bytes = NULL;
-        gs_unref_bytes GBytes *payload = NULL;
-        gsize partlen;
-        const guint8*partdata;
-
-        if (!mfile)
-          goto out;
-
-        bytes = g_mapped_file_get_bytes (mfile);
-        g_mapped_file_unref (mfile);
-
-        partdata = g_bytes_get_data (bytes, &partlen);
-
-        if (partlen < 1)
-          {
-            g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-                         "Corrupted 0 length byte part %s/%i",
-                         gs_file_get_basename_cached (dir),
-                         i);
-            goto out;
-          }
-        
-        switch (partdata[0])
-          {
-          case 0:
-            payload = g_bytes_new_from_bytes (bytes, 1, partlen - 1);
-            break;
-          case 'g':
-            {
-              gs_unref_bytes GBytes *subbytes = g_bytes_new_from_bytes (bytes, 1, partlen - 1);
-              if (!zlib_uncompress_data (subbytes, &payload,
-                                         cancellable, error))
-                goto out;
-            }
-            break;
-          }
-        
-        part = ot_variant_new_from_bytes (G_VARIANT_TYPE (OSTREE_STATIC_DELTA_PART_PAYLOAD_FORMAT),
-                                          payload, FALSE);
-        
-        
-        if (!_ostree_static_delta_part_execute (self, objects, part, cancellable, error))
-          {
-            g_prefix_error (error, "executing delta part %i: ", i);
-            goto out;
-          }
-      }
     }
 
   ret = TRUE;
@@ -331,3 +734,31 @@ ostree_repo_static_delta_execute_offline (OstreeRepo                    *self,
   return ret;
 }
 
+/**
+ * ostree_repo_static_delta_execute_offline:
+ * @self: Repo
+ * @dir: Path to a directory containing static delta data
+ * @skip_validation: If %TRUE, assume data integrity
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Given a directory representing an already-downloaded static delta
+ * on disk, apply it, generating a new commit.  The directory must be
+ * named with the form "FROM-TO", where both are checksums, or just
+ * "TO" for a delta from scratch, and it must contain a file named
+ * "meta", along with the parts it lists.
+ *
+ * Parts only depend on objects of the FROM commit, so they are
+ * applied in parallel.  A delta which chains other deltas together
+ * expects to find them next to @dir, and applies them in turn first.
+ */
+gboolean
+ostree_repo_static_delta_execute_offline (OstreeRepo                    *self,
+                                          GFile                         *dir,
+                                          gboolean                       skip_validation,
+                                          GCancellable                  *cancellable,
+                                          GError                      **error)
+{
+  return execute_offline_internal (self, dir, skip_validation, TRUE,
+                                   cancellable, error);
+}
@@ -28,6 +28,8 @@ G_BEGIN_DECLS
 #define OSTREE_STATIC_DELTA_PART_MAX_SIZE_BYTES (16*1024*1024)
 /* 1 byte for object type, 32 bytes for checksum */
 #define OSTREE_STATIC_DELTA_OBJTYPE_CSUM_LEN 33
+/* 32 bytes for the from checksum, 32 bytes for the to checksum */
+#define OSTREE_STATIC_DELTA_FALLBACK_CSUM_LEN 64
 
 /**
  * OSTREE_STATIC_DELTA_PART_PAYLOAD_FORMAT:
@@ -70,22 +72,51 @@ G_BEGIN_DECLS
  * fetched and applied before this one.  This is a fairly generic
  * recursion mechanism that would potentially allow saving significant
  * storage space on the server.
+ *
+ * Each of these is a pair of binary checksums; the first starts at
+ * the from commit of this delta, and each following one at the to
+ * commit of the previous one.  A delta which only chains existing
+ * deltas together has no parts.  Deltas in such a chain may not have
+ * fallbacks themselves.
  */ 
 #define OSTREE_STATIC_DELTA_META_FORMAT "(a{sv}taya" OSTREE_STATIC_DELTA_META_ENTRY_FORMAT ")"
 
+guint64 _ostree_static_delta_part_max_payload_size (guint64 usize);
+
+gboolean _ostree_static_delta_part_open (GBytes         *part_bytes,
+                                         const guchar   *expected_checksum,
+                                         guint64         usize,
+                                         GVariant      **out_part,
+                                         GCancellable   *cancellable,
+                                         GError        **error);
+
 gboolean _ostree_static_delta_part_execute (OstreeRepo      *repo,
                                             GVariant        *header,
                                             GVariant        *part,
                                             GCancellable    *cancellable,
                                             GError         **error);
 
+gboolean _ostree_static_delta_load_content_bytes (OstreeRepo      *repo,
+                                                  const char      *checksum,
+                                                  GBytes         **out_bytes,
+                                                  GCancellable    *cancellable,
+                                                  GError         **error);
+
+gboolean _ostree_repo_static_delta_part_have_all_objects (OstreeRepo             *repo,
+                                                          GVariant               *checksum_array,
+                                                          gboolean               *out_have_all,
+                                                          guint                  *out_n_missing,
+                                                          GCancellable           *cancellable,
+                                                          GError                **error);
+
 typedef enum {
   OSTREE_STATIC_DELTA_OP_FETCH = 1,
   OSTREE_STATIC_DELTA_OP_WRITE = 2,
   OSTREE_STATIC_DELTA_OP_GUNZIP = 3,
   OSTREE_STATIC_DELTA_OP_CLOSE = 4,
   OSTREE_STATIC_DELTA_OP_READOBJECT = 5,
-  OSTREE_STATIC_DELTA_OP_READPAYLOAD = 6
+  OSTREE_STATIC_DELTA_OP_READPAYLOAD = 6,
+  OSTREE_STATIC_DELTA_OP_REWRITEHEADER = 7
 } OstreeStaticDeltaOpCode;
 
 gboolean
@@ -93,5 +124,12 @@ _ostree_static_delta_parse_checksum_array (GVariant      *array,
                                            guint8       **out_checksums_array,
                                            guint         *out_n_checksums,
                                            GError       **error);
+
+gboolean
+_ostree_static_delta_parse_fallbacks (GVariant      *array,
+                                      const char    *from,
+                                      const char    *to,
+                                      GPtrArray    **out_fallbacks,
+                                      GError       **error);
 G_END_DECLS
 
@@ -22,6 +22,7 @@
 
 #include <string.h>
 
+#include "ostree-core-private.h"
 #include "ostree-repo-private.h"
 #include "ostree-repo-static-delta-private.h"
 #include "otutil.h"
@@ -42,7 +43,11 @@ typedef struct {
   const guint8   *output_target;
   GFile          *output_tmp_path;
   GOutputStream  *output_tmp_stream;
+
   const guint8   *input_target_csum;
+  GBytes         *input_target_bytes;
+  const guint8   *input_data;
+  guint64         input_size;
 
   const guint8   *payload_data;
   guint64         payload_size; 
@@ -68,6 +73,9 @@ OPPROTO(fetch)
 OPPROTO(write)
 OPPROTO(gunzip)
 OPPROTO(close)
+OPPROTO(readobject)
+OPPROTO(readpayload)
+OPPROTO(rewriteheader)
 #undef OPPROTO
 
 static OstreeStaticDeltaOperation op_dispatch_table[] = {
@@ -75,6 +83,9 @@ static OstreeStaticDeltaOperation op_dispatch_table[] = {
   { "write", dispatch_write },
   { "gunzip", dispatch_gunzip },
   { "close", dispatch_close },
+  { "readobject", dispatch_readobject },
+  { "readpayload", dispatch_readpayload },
+  { "rewriteheader", dispatch_rewriteheader },
   { NULL }
 };
 
@@ -142,6 +153,8 @@ _ostree_static_delta_part_execute (OstreeRepo      *repo,
 
   state->payload_data = g_variant_get_data (payload);
   state->payload_size = g_variant_get_size (payload);
+  state->input_data = state->payload_data;
+  state->input_size = state->payload_size;
 
   state->oplen = g_variant_n_children (ops);
   state->opdata = g_variant_get_data (ops);
@@ -157,7 +170,6 @@ _ostree_static_delta_part_execute (OstreeRepo      *repo,
           goto out;
         }
       op = &op_dispatch_table[opcode-1];
-      g_printerr ("dispatch %u\n", opcode-1);
       state->oplen--;
       state->opdata++;
       if (!op->func (repo, state, cancellable, error))
@@ -168,6 +180,7 @@ _ostree_static_delta_part_execute (OstreeRepo      *repo,
 
   ret = TRUE;
  out:
+  g_clear_pointer (&state->input_target_bytes, g_bytes_unref);
   return ret;
 }
 
@@ -206,7 +219,7 @@ validate_ofs (StaticDeltaExecutionState  *state,
               GError                    **error)
 {
   if (G_UNLIKELY (offset + length < offset ||
-                  offset + length > state->payload_size))
+                  offset + length > state->input_size))
     {
       g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
                    "Invalid offset/length %" G_GUINT64_FORMAT "/%" G_GUINT64_FORMAT,
@@ -242,7 +255,7 @@ dispatch_write (OstreeRepo                 *repo,
     goto out;
 
   if (!g_output_stream_write_all (state->output_tmp_stream,
-                                  state->payload_data + offset,
+                                  state->input_data + offset,
                                   length,
                                   &bytes_written,
                                   cancellable, error))
@@ -282,7 +295,7 @@ dispatch_gunzip (OstreeRepo                 *repo,
   if (!validate_ofs (state, offset, length, error))
     goto out;
 
-  payload_in = g_memory_input_stream_new_from_data (state->payload_data + offset, length, NULL);
+  payload_in = g_memory_input_stream_new_from_data (state->input_data + offset, length, NULL);
   zlib_decomp = (GConverter*)g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_RAW);
   zlib_in = g_converter_input_stream_new (payload_in, zlib_decomp);
 
@@ -306,6 +319,7 @@ dispatch_close (OstreeRepo                 *repo,
 {
   gboolean ret = FALSE;
   char tmp_checksum[65];
+  gs_free guchar *actual_csum = NULL;
 
   if (state->checksum_index == state->n_checksums)
     {
@@ -324,21 +338,24 @@ dispatch_close (OstreeRepo                 *repo,
 
   ostree_checksum_inplace_from_bytes (state->output_target, tmp_checksum);
 
+  /* Deltas may be fetched from an untrusted source, so always ask for
+   * the computed checksum; this makes the write verify it against
+   * the expected one.
+   */
   if (OSTREE_OBJECT_TYPE_IS_META (state->output_objtype))
     {
       gs_unref_variant GVariant *metadata = NULL;
 
       if (!ot_util_variant_map (state->output_tmp_path,
                                 ostree_metadata_variant_type (state->output_objtype),
-                                TRUE, &metadata, error))
+                                FALSE, &metadata, error))
         goto out;
 
       if (!ostree_repo_write_metadata (repo, state->output_objtype, tmp_checksum,
-                                       metadata, NULL, cancellable, error))
+                                       metadata, &actual_csum, cancellable, error))
         goto out;
 
-      g_print ("Wrote metadata object '%s'\n",
-               tmp_checksum);
+      g_debug ("Wrote metadata object '%s'", tmp_checksum);
     }
   else
     {
@@ -355,12 +372,11 @@ dispatch_close (OstreeRepo                 *repo,
         goto out;
       
       if (!ostree_repo_write_content (repo, tmp_checksum, in,
-                                      g_file_info_get_size (info), NULL,
+                                      g_file_info_get_size (info), &actual_csum,
                                       cancellable, error))
         goto out;
 
-      g_print ("Wrote content object '%s'\n",
-               tmp_checksum);
+      g_debug ("Wrote content object '%s'", tmp_checksum);
     }
 
   state->output_target = NULL;
@@ -379,3 +395,146 @@ dispatch_close (OstreeRepo                 *repo,
     g_prefix_error (error, "opcode close: ");
   return ret;
 }
+
+static gboolean
+dispatch_readobject (OstreeRepo                 *repo,
+                     StaticDeltaExecutionState  *state,
+                     GCancellable               *cancellable,  
+                     GError                    **error)
+{
+  gboolean ret = FALSE;
+  const guint8 *csum;
+  char tmp_checksum[65];
+  gs_unref_bytes GBytes *bytes = NULL;
+
+  if (G_UNLIKELY(state->oplen < 32))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                   "Expected 32 bytes for readobject op");
+      goto out;
+    }
+  csum = state->opdata;
+  state->opdata += 32;
+  state->oplen -= 32;
+
+  /* Consecutive modified objects commonly share a source */
+  if (state->input_target_csum != NULL &&
+      ostree_cmp_checksum_bytes (state->input_target_csum, csum) == 0)
+    {
+      state->input_data = g_bytes_get_data (state->input_target_bytes, NULL);
+      state->input_size = g_bytes_get_size (state->input_target_bytes);
+      ret = TRUE;
+      goto out;
+    }
+
+  ostree_checksum_inplace_from_bytes (csum, tmp_checksum);
+
+  if (!_ostree_static_delta_load_content_bytes (repo, tmp_checksum, &bytes,
+                                                cancellable, error))
+    goto out;
+
+  g_clear_pointer (&state->input_target_bytes, g_bytes_unref);
+  state->input_target_bytes = g_bytes_ref (bytes);
+  state->input_target_csum = csum;
+  state->input_data = g_bytes_get_data (bytes, NULL);
+  state->input_size = g_bytes_get_size (bytes);
+
+  ret = TRUE;
+ out:
+  if (!ret)
+    g_prefix_error (error, "opcode readobject: ");
+  return ret;
+}
+
+static gboolean
+dispatch_readpayload (OstreeRepo                 *repo,
+                      StaticDeltaExecutionState  *state,
+                      GCancellable               *cancellable,  
+                      GError                    **error)
+{
+  state->input_data = state->payload_data;
+  state->input_size = state->payload_size;
+  return TRUE;
+}
+
+static gboolean
+dispatch_rewriteheader (OstreeRepo                 *repo,
+                        StaticDeltaExecutionState  *state,
+                        GCancellable               *cancellable,  
+                        GError                    **error)
+{
+  gboolean ret = FALSE;
+  guint64 offset;
+  guint64 length;
+  const guint8 *csum;
+  char tmp_checksum[65];
+  gs_unref_variant GVariant *header = NULL;
+  gs_unref_variant GVariant *xattrs = NULL;
+  gs_unref_object GFileInfo *file_info = NULL;
+  gs_unref_object GFileInfo *src_info = NULL;
+  gs_unref_object GInputStream *src_in = NULL;
+  gs_unref_object GInputStream *content_in = NULL;
+
+  if (!read_varuint64 (state, &offset, error))
+    goto out;
+  if (!read_varuint64 (state, &length, error))
+    goto out;
+  if (!validate_ofs (state, offset, length, error))
+    goto out;
+
+  if (G_UNLIKELY(state->oplen < 32))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                   "Expected 32 bytes for rewriteheader op");
+      goto out;
+    }
+  csum = state->opdata;
+  state->opdata += 32;
+  state->oplen -= 32;
+
+  header = g_variant_new_from_data (_OSTREE_FILE_HEADER_GVARIANT_FORMAT,
+                                    state->input_data + offset, length,
+                                    FALSE, NULL, NULL);
+  g_variant_ref_sink (header);
+  if (!g_variant_is_normal_form (header))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Corrupted file header");
+      goto out;
+    }
+
+  if (!_ostree_file_header_parse (header, &file_info, &xattrs, error))
+    goto out;
+
+  ostree_checksum_inplace_from_bytes (csum, tmp_checksum);
+
+  if (!ostree_repo_load_file (repo, tmp_checksum, &src_in, &src_info, NULL,
+                              cancellable, error))
+    goto out;
+
+  if (g_file_info_get_file_type (file_info) != G_FILE_TYPE_REGULAR ||
+      g_file_info_get_file_type (src_info) != G_FILE_TYPE_REGULAR)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Can only rewrite the header of regular files");
+      goto out;
+    }
+
+  g_file_info_set_size (file_info, g_file_info_get_size (src_info));
+
+  if (!ostree_raw_file_to_content_stream (src_in, file_info, xattrs,
+                                          &content_in, NULL,
+                                          cancellable, error))
+    goto out;
+
+  if (0 > g_output_stream_splice (state->output_tmp_stream, content_in,
+                                  G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE,
+                                  cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  if (!ret)
+    g_prefix_error (error, "opcode rewriteheader: ");
+  return ret;
+}
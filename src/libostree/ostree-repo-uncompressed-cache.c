@@ -0,0 +1,436 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2014 Colin Walters <walters@verbum.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include "ostree-core-private.h"
+#include "ostree-repo-private.h"
+#include "otutil.h"
+#include "libgsystem.h"
+
+/* User mode checkouts from an archive-z2 repository hardlink to
+ * unpacked copies of content objects in uncompressed-objects-cache.
+ * When core.uncompressed-cache-size is set, the cache is kept within
+ * that many bytes by removing the least recently used objects.
+ *
+ * Rather than scanning the cache directories, object sizes and
+ * access times are kept in state/uncompressed-cache-index: a fixed
+ * header followed by fixed size entries, in host byte order.  A
+ * checkout records each cached object it uses in
+ * uncompressed_cache_accessed, and when it completes these are
+ * merged into the index, which is then trimmed to size and
+ * rewritten.  A missing or invalid index is rebuilt once from the
+ * cache directories, using the atime of each file.  Concurrent
+ * checkouts may lose each other's access times; that only makes
+ * eviction less exact.
+ */
+
+#define OSTREE_UNCOMPRESSED_CACHE_INDEX_MAGIC "OSTUCIX1"
+#define OSTREE_UNCOMPRESSED_CACHE_INDEX_NAME "uncompressed-cache-index"
+
+typedef struct {
+  char magic[8];
+  guint64 n_entries;
+} OstreeUncompressedCacheHeader;
+
+typedef struct {
+  guint8 csum[32];
+  guint64 size;
+  guint64 atime;    /* Microseconds since the epoch */
+} OstreeUncompressedCacheEntry;
+
+G_STATIC_ASSERT (sizeof (OstreeUncompressedCacheHeader) == 16);
+G_STATIC_ASSERT (sizeof (OstreeUncompressedCacheEntry) == 48);
+
+static GHashTable *
+cache_index_new (void)
+{
+  return g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+}
+
+static void
+cache_index_insert (GHashTable                          *index,
+                    const OstreeUncompressedCacheEntry  *entry)
+{
+  g_hash_table_replace (index, ostree_checksum_from_bytes (entry->csum),
+                        g_memdup (entry, sizeof (*entry)));
+}
+
+/**
+ * _ostree_repo_uncompressed_cache_touch:
+ * @self: Repo
+ * @checksum: Checksum of a content object in the uncompressed cache
+ * @size: Size of the object
+ *
+ * Record that a checkout is using @checksum.  May be called from
+ * any thread.
+ */
+void
+_ostree_repo_uncompressed_cache_touch (OstreeRepo   *self,
+                                       const char   *checksum,
+                                       guint64       size)
+{
+  OstreeUncompressedCacheEntry entry = { { 0, }, };
+
+  if (self->uncompressed_cache_size == 0)
+    return;
+
+  ostree_checksum_inplace_to_bytes (checksum, entry.csum);
+  entry.size = size;
+  entry.atime = g_get_real_time ();
+
+  g_mutex_lock (&self->cache_lock);
+  if (!self->uncompressed_cache_accessed)
+    self->uncompressed_cache_accessed = cache_index_new ();
+  cache_index_insert (self->uncompressed_cache_accessed, &entry);
+  g_mutex_unlock (&self->cache_lock);
+}
+
+/* Sets *out_valid to FALSE if there is no usable index file */
+static gboolean
+load_cache_index (OstreeRepo    *self,
+                  GHashTable    *index,
+                  gboolean      *out_valid,
+                  GError       **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_object GFile *path = g_file_get_child (self->state_dir, OSTREE_UNCOMPRESSED_CACHE_INDEX_NAME);
+  gs_free char *contents = NULL;
+  const OstreeUncompressedCacheHeader *header;
+  const OstreeUncompressedCacheEntry *entries;
+  GError *temp_error = NULL;
+  gsize len;
+  guint64 i;
+
+  *out_valid = FALSE;
+
+  if (!g_file_get_contents (gs_file_get_path_cached (path), &contents, &len, &temp_error))
+    {
+      if (g_error_matches (temp_error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        {
+          g_clear_error (&temp_error);
+          ret = TRUE;
+        }
+      else
+        g_propagate_error (error, temp_error);
+      goto out;
+    }
+
+  header = (const OstreeUncompressedCacheHeader*)contents;
+  if (len < sizeof (OstreeUncompressedCacheHeader)
+      || memcmp (header->magic, OSTREE_UNCOMPRESSED_CACHE_INDEX_MAGIC, 8) != 0
+      || (len - sizeof (OstreeUncompressedCacheHeader)) % sizeof (OstreeUncompressedCacheEntry) != 0
+      || (len - sizeof (OstreeUncompressedCacheHeader)) / sizeof (OstreeUncompressedCacheEntry) != header->n_entries)
+    {
+      g_debug ("Ignoring invalid %s", gs_file_get_path_cached (path));
+      ret = TRUE;
+      goto out;
+    }
+
+  entries = (const OstreeUncompressedCacheEntry*)(header + 1);
+  for (i = 0; i < header->n_entries; i++)
+    cache_index_insert (index, &entries[i]);
+
+  ret = TRUE;
+  *out_valid = TRUE;
+ out:
+  return ret;
+}
+
+static gboolean
+scan_cache (OstreeRepo    *self,
+            GHashTable    *index,
+            GCancellable  *cancellable,
+            GError       **error)
+{
+  gboolean ret = FALSE;
+  guint i;
+
+  for (i = 0; i < 256; i++)
+    {
+      char dirname[3];
+      int dfd;
+      DIR *d;
+      struct dirent *dent;
+
+      g_snprintf (dirname, sizeof (dirname), "%02x", i);
+      dfd = openat (self->uncompressed_objects_dir_fd, dirname,
+                    O_RDONLY | O_DIRECTORY | O_NOCTTY | O_CLOEXEC);
+      if (dfd == -1)
+        {
+          if (errno == ENOENT)
+            continue;
+          ot_util_set_error_from_errno (error, errno);
+          goto out;
+        }
+      d = fdopendir (dfd);
+      if (!d)
+        {
+          ot_util_set_error_from_errno (error, errno);
+          (void) close (dfd);
+          goto out;
+        }
+
+      while ((dent = readdir (d)) != NULL)
+        {
+          OstreeUncompressedCacheEntry entry = { { 0, }, };
+          char checksum[65];
+          struct stat stbuf;
+
+          if (strlen (dent->d_name) != 62 + strlen (".file")
+              || !g_str_has_suffix (dent->d_name, ".file"))
+            continue;
+
+          if (fstatat (dfd, dent->d_name, &stbuf, AT_SYMLINK_NOFOLLOW) != 0
+              || !S_ISREG (stbuf.st_mode))
+            continue;
+
+          memcpy (checksum, dirname, 2);
+          memcpy (checksum + 2, dent->d_name, 62);
+          checksum[64] = '\0';
+          if (!ostree_validate_checksum_string (checksum, NULL))
+            continue;
+
+          ostree_checksum_inplace_to_bytes (checksum, entry.csum);
+          entry.size = stbuf.st_size;
+          entry.atime = (guint64)stbuf.st_atim.tv_sec * G_USEC_PER_SEC
+            + stbuf.st_atim.tv_nsec / 1000;
+          cache_index_insert (index, &entry);
+        }
+
+      (void) closedir (d);
+
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        goto out;
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+static gint
+compare_atime (gconstpointer a,
+               gconstpointer b)
+{
+  const OstreeUncompressedCacheEntry *entry_a = *(OstreeUncompressedCacheEntry**)a;
+  const OstreeUncompressedCacheEntry *entry_b = *(OstreeUncompressedCacheEntry**)b;
+
+  if (entry_a->atime != entry_b->atime)
+    return entry_a->atime < entry_b->atime ? -1 : 1;
+  return 0;
+}
+
+/* Remove least recently used objects until @index fits in the budget */
+static gboolean
+evict_lru (OstreeRepo    *self,
+           GHashTable    *index,
+           GError       **error)
+{
+  gboolean ret = FALSE;
+  GHashTableIter hashiter;
+  gpointer hkey, hvalue;
+  gs_unref_ptrarray GPtrArray *by_atime = NULL;
+  guint64 total = 0;
+  guint i;
+
+  g_hash_table_iter_init (&hashiter, index);
+  while (g_hash_table_iter_next (&hashiter, &hkey, &hvalue))
+    total += ((OstreeUncompressedCacheEntry*)hvalue)->size;
+
+  if (total <= self->uncompressed_cache_size)
+    {
+      ret = TRUE;
+      goto out;
+    }
+
+  by_atime = g_ptr_array_new_with_free_func (g_free);
+  g_hash_table_iter_init (&hashiter, index);
+  while (g_hash_table_iter_next (&hashiter, &hkey, &hvalue))
+    {
+      g_hash_table_iter_steal (&hashiter);
+      g_free (hkey);
+      g_ptr_array_add (by_atime, hvalue);
+    }
+  g_ptr_array_sort (by_atime, compare_atime);
+
+  for (i = 0; i < by_atime->len; i++)
+    {
+      OstreeUncompressedCacheEntry *entry = by_atime->pdata[i];
+
+      if (total > self->uncompressed_cache_size)
+        {
+          char checksum[65];
+          char loose_path[_OSTREE_LOOSE_PATH_MAX];
+
+          ostree_checksum_inplace_from_bytes (entry->csum, checksum);
+          _ostree_loose_path (loose_path, checksum, OSTREE_OBJECT_TYPE_FILE, OSTREE_REPO_MODE_BARE);
+          if (unlinkat (self->uncompressed_objects_dir_fd, loose_path, 0) == -1
+              && errno != ENOENT)
+            {
+              ot_util_set_error_from_errno (error, errno);
+              goto out;
+            }
+          total -= entry->size;
+        }
+      else
+        cache_index_insert (index, entry);
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+static gboolean
+write_cache_index (OstreeRepo    *self,
+                   GHashTable    *index,
+                   GCancellable  *cancellable,
+                   GError       **error)
+{
+  gboolean ret = FALSE;
+  GHashTableIter hashiter;
+  gpointer hkey, hvalue;
+  OstreeUncompressedCacheHeader header = { { 0, }, };
+  gs_unref_array GArray *entries = NULL;
+  gs_free char *tmpname = NULL;
+  gs_unref_object GOutputStream *out = NULL;
+  gs_unref_object GFile *path = NULL;
+  gsize bytes_written;
+
+  entries = g_array_sized_new (FALSE, FALSE, sizeof (OstreeUncompressedCacheEntry),
+                               g_hash_table_size (index));
+  g_hash_table_iter_init (&hashiter, index);
+  while (g_hash_table_iter_next (&hashiter, &hkey, &hvalue))
+    g_array_append_vals (entries, hvalue, 1);
+
+  memcpy (header.magic, OSTREE_UNCOMPRESSED_CACHE_INDEX_MAGIC, 8);
+  header.n_entries = entries->len;
+
+  if (!gs_file_open_in_tmpdir_at (self->tmp_dir_fd, 0644, &tmpname, &out,
+                                  cancellable, error))
+    goto out;
+  if (!g_output_stream_write_all (out, &header, sizeof (header), &bytes_written,
+                                  cancellable, error))
+    goto out;
+  if (!g_output_stream_write_all (out, entries->data,
+                                  entries->len * sizeof (OstreeUncompressedCacheEntry),
+                                  &bytes_written, cancellable, error))
+    goto out;
+  if (!g_output_stream_close (out, cancellable, error))
+    goto out;
+
+  if (!gs_file_ensure_directory (self->state_dir, FALSE, cancellable, error))
+    goto out;
+
+  path = g_file_get_child (self->state_dir, OSTREE_UNCOMPRESSED_CACHE_INDEX_NAME);
+  if (renameat (self->tmp_dir_fd, tmpname, AT_FDCWD, gs_file_get_path_cached (path)) == -1)
+    {
+      ot_util_set_error_from_errno (error, errno);
+      goto out;
+    }
+  g_clear_pointer (&tmpname, g_free);
+
+  ret = TRUE;
+ out:
+  if (tmpname)
+    (void) unlinkat (self->tmp_dir_fd, tmpname, 0);
+  return ret;
+}
+
+/**
+ * _ostree_repo_uncompressed_cache_flush:
+ * @self: Repo
+ * @force: Trim the cache even if no checkout used it
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Merge the objects recorded by _ostree_repo_uncompressed_cache_touch()
+ * into the index of @self and its parent repositories, evict the
+ * least recently used objects beyond the configured size, and write
+ * the index back.
+ */
+gboolean
+_ostree_repo_uncompressed_cache_flush (OstreeRepo    *self,
+                                       gboolean       force,
+                                       GCancellable  *cancellable,
+                                       GError       **error)
+{
+  gboolean ret = FALSE;
+  gboolean valid;
+  gs_unref_hashtable GHashTable *accessed = NULL;
+  gs_unref_hashtable GHashTable *index = NULL;
+  GHashTableIter hashiter;
+  gpointer hkey, hvalue;
+
+  if (self->parent_repo)
+    {
+      if (!_ostree_repo_uncompressed_cache_flush (self->parent_repo, force,
+                                                  cancellable, error))
+        goto out;
+    }
+
+  if (self->uncompressed_cache_size == 0
+      || self->uncompressed_objects_dir_fd == -1)
+    {
+      ret = TRUE;
+      goto out;
+    }
+
+  g_mutex_lock (&self->cache_lock);
+  accessed = self->uncompressed_cache_accessed;
+  self->uncompressed_cache_accessed = NULL;
+  g_mutex_unlock (&self->cache_lock);
+
+  if (!accessed && !force)
+    {
+      ret = TRUE;
+      goto out;
+    }
+
+  index = cache_index_new ();
+  if (!load_cache_index (self, index, &valid, error))
+    goto out;
+  if (!valid)
+    {
+      if (!scan_cache (self, index, cancellable, error))
+        goto out;
+    }
+
+  if (accessed)
+    {
+      g_hash_table_iter_init (&hashiter, accessed);
+      while (g_hash_table_iter_next (&hashiter, &hkey, &hvalue))
+        {
+          g_hash_table_iter_steal (&hashiter);
+          g_hash_table_replace (index, hkey, hvalue);
+        }
+    }
+
+  if (!evict_lru (self, index, error))
+    goto out;
+
+  if (!write_cache_index (self, index, cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  return ret;
+}
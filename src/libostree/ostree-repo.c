@@ -30,6 +30,7 @@
 
 #include "ostree-core-private.h"
 #include "ostree-repo-private.h"
+#include "ostree-linuxfsutil.h"
 #include "ostree-repo-file.h"
 #include "ostree-repo-file-enumerator.h"
 #include "ostree-gpg-verifier.h"
@@ -109,10 +110,10 @@ ostree_repo_finalize (GObject *object)
 
   g_clear_object (&self->transaction_lock_path);
 
-  if (self->loose_object_devino_hash)
-    g_hash_table_destroy (self->loose_object_devino_hash);
+  _ostree_repo_devino_cache_clear (self);
   if (self->updated_uncompressed_dirs)
     g_hash_table_destroy (self->updated_uncompressed_dirs);
+  g_clear_pointer (&self->uncompressed_cache_accessed, (GDestroyNotify) g_hash_table_unref);
   if (self->config)
     g_key_file_free (self->config);
   g_clear_pointer (&self->txn_refs, g_hash_table_destroy);
@@ -915,14 +916,86 @@ ostree_repo_open (OstreeRepo    *self,
     self->enable_uncompressed_cache = FALSE;
 
   {
+    gs_free char *compression_level = NULL;
+    char *endp;
+    guint64 level;
+
+    if (!ot_keyfile_get_value_with_default (self->config, "core", "compression-level",
+                                            "9", &compression_level, error))
+      goto out;
+
+    /* Don't fail to open the repository over a bad value, or it
+     * couldn't be fixed with `ostree config set`.  Nor warn, since
+     * callers may make warnings fatal.
+     */
+    level = g_ascii_strtoull (compression_level, &endp, 10);
+    if (endp == compression_level || *endp != '\0' || level > 9)
+      {
+        g_debug ("Invalid compression-level '%s'; must be between 0 and 9, using 9",
+                 compression_level);
+        level = 9;
+      }
+    self->compression_level = level;
+  }
+
+  {
+    gs_free char *cache_size = NULL;
+    char *endp;
+    guint64 size;
+    guint64 multiplier = 1;
+
+    if (!ot_keyfile_get_value_with_default (self->config, "core", "uncompressed-cache-size",
+                                            "0", &cache_size, error))
+      goto out;
+
+    errno = 0;
+    size = g_ascii_strtoull (cache_size, &endp, 10);
+    if (endp != cache_size)
+      {
+        switch (g_ascii_toupper (*endp))
+          {
+          case 'G':
+            multiplier *= 1024;
+            /* fall through */
+          case 'M':
+            multiplier *= 1024;
+            /* fall through */
+          case 'K':
+            multiplier *= 1024;
+            endp++;
+          default:
+            break;
+          }
+      }
+    if (endp == cache_size || *endp != '\0'
+        || errno == ERANGE || size > G_MAXUINT64 / multiplier)
+      {
+        g_debug ("Invalid uncompressed-cache-size '%s', not limiting the cache",
+                 cache_size);
+        size = 0;
+      }
+    self->uncompressed_cache_size = size * multiplier;
+  }
+
+  {
+    gs_free char *fsync_str = NULL;
     gboolean do_fsync;
-    
-    if (!ot_keyfile_get_boolean_with_default (self->config, "core", "fsync",
-                                              TRUE, &do_fsync, error))
+
+    if (!ot_keyfile_get_value_with_default (self->config, "core", "fsync",
+                                            "true", &fsync_str, error))
       goto out;
-    
-    if (!do_fsync)
-      ostree_repo_set_disable_fsync (self, TRUE);
+
+    if (g_ascii_strcasecmp (fsync_str, "batch") == 0)
+      ostree_repo_set_batch_fsync (self, TRUE);
+    else
+      {
+        if (!ot_keyfile_get_boolean_with_default (self->config, "core", "fsync",
+                                                  TRUE, &do_fsync, error))
+          goto out;
+
+        if (!do_fsync)
+          ostree_repo_set_disable_fsync (self, TRUE);
+      }
   }
 
   {
@@ -972,6 +1045,63 @@ ostree_repo_set_disable_fsync (OstreeRepo    *self,
   self->disable_fsync = disable_fsync;
 }
 
+/**
+ * ostree_repo_set_batch_fsync:
+ * @self: An #OstreeRepo
+ * @batch_fsync: If %TRUE, batch fsync
+ *
+ * Rather than calling fsync() on each object, file and directory as
+ * it is written, flush the whole filesystem with a single syncfs()
+ * when a transaction is committed or a checkout completes.  Data is
+ * still on stable storage before it is referenced, but a crash in
+ * the middle of an operation may leave partially written objects
+ * behind; ostree fsck will find these.
+ *
+ * This has no effect if fsync has been disabled with
+ * ostree_repo_set_disable_fsync().
+ */
+void
+ostree_repo_set_batch_fsync (OstreeRepo    *self,
+                             gboolean       batch_fsync)
+{
+  self->batch_fsync = batch_fsync;
+}
+
+/* Whether each file and directory should be fsync()ed as it is
+ * written; if not, _ostree_repo_syncfs() is the barrier.
+ */
+gboolean
+_ostree_repo_fsync_each_file (OstreeRepo *self)
+{
+  return !(self->disable_fsync || self->batch_fsync);
+}
+
+/* With batched fsync, flush everything written so far to the
+ * filesystem containing @dfd.
+ */
+gboolean
+_ostree_repo_syncfs (OstreeRepo     *self,
+                     int             dfd,
+                     GCancellable   *cancellable,
+                     GError        **error)
+{
+  if (self->disable_fsync || !self->batch_fsync)
+    return TRUE;
+
+#ifdef HAVE_SYNCFS
+  if (syncfs (dfd) == -1)
+    {
+      ot_util_set_error_from_errno (error, errno);
+      g_prefix_error (error, "syncfs: ");
+      return FALSE;
+    }
+#else
+  sync ();
+#endif
+
+  return TRUE;
+}
+
 
 /**
  * ostree_repo_get_path:
@@ -1258,18 +1388,40 @@ load_metadata_internal (OstreeRepo       *self,
   gboolean ret = FALSE;
   char loose_path_buf[_OSTREE_LOOSE_PATH_MAX];
   int fd = -1;
+  gboolean is_packed;
+  gs_unref_bytes GBytes *packed_data = NULL;
   gs_unref_object GInputStream *ret_stream = NULL;
   gs_unref_variant GVariant *ret_variant = NULL;
 
   g_return_val_if_fail (OSTREE_OBJECT_TYPE_IS_META (objtype), FALSE);
 
-  _ostree_loose_path (loose_path_buf, sha256, objtype, self->mode);
-
-  if (!openat_allow_noent (self->objects_dir_fd, loose_path_buf, &fd,
-                           cancellable, error))
+  if (!_ostree_repo_find_packed_object (self, objtype, sha256, &is_packed,
+                                        &packed_data, cancellable, error))
     goto out;
 
-  if (fd != -1)
+  if (!is_packed)
+    {
+      _ostree_loose_path (loose_path_buf, sha256, objtype, self->mode);
+
+      if (!openat_allow_noent (self->objects_dir_fd, loose_path_buf, &fd,
+                               cancellable, error))
+        goto out;
+    }
+
+  if (is_packed)
+    {
+      if (out_variant)
+        {
+          ret_variant = ot_variant_new_from_bytes (ostree_metadata_variant_type (objtype),
+                                                   packed_data, TRUE);
+          g_variant_ref_sink (ret_variant);
+        }
+      else if (out_stream)
+        ret_stream = g_memory_input_stream_new_from_bytes (packed_data);
+      if (out_size)
+        *out_size = g_bytes_get_size (packed_data);
+    }
+  else if (fd != -1)
     {
       if (out_variant)
         {
@@ -1435,14 +1587,36 @@ ostree_repo_load_file (OstreeRepo         *self,
       char loose_path_buf[_OSTREE_LOOSE_PATH_MAX];
       int fd = -1;
       struct stat stbuf;
+      gboolean is_packed;
+      gs_unref_bytes GBytes *packed_data = NULL;
       gs_unref_object GInputStream *tmp_stream = NULL;
 
-      _ostree_loose_path (loose_path_buf, checksum, OSTREE_OBJECT_TYPE_FILE, self->mode);
-
-      if (!openat_allow_noent (self->objects_dir_fd, loose_path_buf, &fd,
-                               cancellable, error))
+      if (!_ostree_repo_find_packed_object (self, OSTREE_OBJECT_TYPE_FILE, checksum,
+                                            &is_packed, &packed_data,
+                                            cancellable, error))
         goto out;
 
+      if (is_packed)
+        {
+          tmp_stream = g_memory_input_stream_new_from_bytes (packed_data);
+
+          if (!ostree_content_stream_parse (TRUE, tmp_stream, g_bytes_get_size (packed_data), TRUE,
+                                            out_input ? &ret_input : NULL,
+                                            &ret_file_info, &ret_xattrs,
+                                            cancellable, error))
+            goto out;
+
+          found = TRUE;
+        }
+      else
+        {
+          _ostree_loose_path (loose_path_buf, checksum, OSTREE_OBJECT_TYPE_FILE, self->mode);
+
+          if (!openat_allow_noent (self->objects_dir_fd, loose_path_buf, &fd,
+                                   cancellable, error))
+            goto out;
+        }
+
       if (fd != -1)
         {
           tmp_stream = g_unix_input_stream_new (fd, TRUE);
@@ -1674,6 +1848,14 @@ ostree_repo_has_object (OstreeRepo           *self,
 
   ret_have_object = (loose_path != NULL);
 
+  if (!ret_have_object)
+    {
+      if (!_ostree_repo_find_packed_object (self, objtype, checksum,
+                                            &ret_have_object, NULL,
+                                            cancellable, error))
+        goto out;
+    }
+
   if (!ret_have_object && self->parent_repo)
     {
       if (!ostree_repo_has_object (self->parent_repo, objtype, checksum,
@@ -1698,7 +1880,8 @@ ostree_repo_has_object (OstreeRepo           *self,
  *
  * Remove the object of type @objtype with checksum @sha256
  * from the repository.  An error of type %G_IO_ERROR_NOT_FOUND
- * is thrown if the object does not exist.
+ * is thrown if the object does not exist, and one of type
+ * %G_IO_ERROR_NOT_SUPPORTED if it is only stored in a pack.
  */
 gboolean
 ostree_repo_delete_object (OstreeRepo           *self,
@@ -1708,6 +1891,7 @@ ostree_repo_delete_object (OstreeRepo           *self,
                            GError              **error)
 {
   gboolean ret = FALSE;
+  GError *temp_error = NULL;
   gs_unref_object GFile *objpath = NULL;
 
   if (objtype == OSTREE_OBJECT_TYPE_COMMIT)
@@ -1719,8 +1903,28 @@ ostree_repo_delete_object (OstreeRepo           *self,
     }
 
   objpath = _ostree_repo_get_object_path (self, sha256, objtype);
-  if (!gs_file_unlink (objpath, cancellable, error))
-    goto out;
+  if (!gs_file_unlink (objpath, cancellable, &temp_error))
+    {
+      gboolean is_packed = FALSE;
+
+      if (g_error_matches (temp_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND)
+          && !_ostree_repo_find_packed_object (self, objtype, sha256, &is_packed,
+                                               NULL, cancellable, error))
+        {
+          g_clear_error (&temp_error);
+          goto out;
+        }
+      if (is_packed)
+        {
+          g_clear_error (&temp_error);
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                       "Object %s.%s is packed; packed objects cannot be deleted",
+                       sha256, ostree_object_type_to_string (objtype));
+        }
+      else
+        g_propagate_error (error, temp_error);
+      goto out;
+    }
 
   ret = TRUE;
  out:
@@ -1755,6 +1959,161 @@ copy_detached_metadata (OstreeRepo    *self,
   return ret;
 }
 
+/* Between archive-z2 repos, copy the compressed object as is; sets
+ * *@out_was_loose to %FALSE if it's packed in @source.
+ */
+static gboolean
+import_archive_content_copy (OstreeRepo    *self,
+                             OstreeRepo    *source,
+                             const char    *checksum,
+                             gboolean      *out_was_loose,
+                             GCancellable  *cancellable,
+                             GError       **error)
+{
+  gboolean ret = FALSE;
+  GError *temp_error = NULL;
+  gs_unref_object GFile *src_path = NULL;
+  gs_unref_object GInputStream *src_in = NULL;
+  gs_unref_object GFile *temp_path = NULL;
+  gs_unref_object GOutputStream *temp_out = NULL;
+  gboolean did_reflink;
+
+  src_path = _ostree_repo_get_object_path (source, checksum, OSTREE_OBJECT_TYPE_FILE);
+  src_in = (GInputStream*)g_file_read (src_path, cancellable, &temp_error);
+  if (!src_in)
+    {
+      gboolean is_packed = FALSE;
+
+      if (g_error_matches (temp_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND)
+          && !_ostree_repo_find_packed_object (source, OSTREE_OBJECT_TYPE_FILE, checksum,
+                                               &is_packed, NULL, cancellable, error))
+        {
+          g_clear_error (&temp_error);
+          goto out;
+        }
+      if (is_packed)
+        {
+          g_clear_error (&temp_error);
+          *out_was_loose = FALSE;
+          ret = TRUE;
+        }
+      else
+        g_propagate_error (error, temp_error);
+      goto out;
+    }
+
+  if (!gs_file_open_in_tmpdir (self->tmp_dir, 0644, &temp_path, &temp_out,
+                               cancellable, error))
+    goto out;
+
+  if (!_ostree_linuxfs_fd_reflink (g_file_descriptor_based_get_fd ((GFileDescriptorBased*)src_in),
+                                   g_file_descriptor_based_get_fd ((GFileDescriptorBased*)temp_out),
+                                   &did_reflink, error))
+    {
+      (void) gs_file_unlink (temp_path, NULL, NULL);
+      goto out;
+    }
+
+  if (did_reflink)
+    {
+      if (!g_input_stream_close (src_in, cancellable, error)
+          || !g_output_stream_close (temp_out, cancellable, error))
+        {
+          (void) gs_file_unlink (temp_path, NULL, NULL);
+          goto out;
+        }
+    }
+  else if (g_output_stream_splice (temp_out, src_in,
+                                   G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE |
+                                   G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET,
+                                   cancellable, error) < 0)
+    {
+      (void) gs_file_unlink (temp_path, NULL, NULL);
+      goto out;
+    }
+
+  if (!_ostree_repo_write_archive_content (self, checksum, temp_path, NULL,
+                                           cancellable, error))
+    goto out;
+
+  ret = TRUE;
+  *out_was_loose = TRUE;
+ out:
+  return ret;
+}
+
+/*
+ * For metadata, and for content in bare repositories, the loose
+ * object is stored the same way in both repositories; try to clone
+ * its extents rather than rewriting it.  Sets @out_was_supported to
+ * FALSE if the object must be copied instead.
+ */
+static gboolean
+import_one_object_reflink (OstreeRepo    *self,
+                           OstreeRepo    *source,
+                           const char    *checksum,
+                           OstreeObjectType objtype,
+                           gboolean      *out_was_supported,
+                           GCancellable  *cancellable,
+                           GError       **error)
+{
+  gboolean ret = FALSE;
+  char loose_path_buf[_OSTREE_LOOSE_PATH_MAX];
+  int src_fd = -1;
+  gs_unref_object GFileInfo *file_info = NULL;
+  gs_unref_variant GVariant *xattrs = NULL;
+
+  *out_was_supported = FALSE;
+
+  if (objtype == OSTREE_OBJECT_TYPE_FILE)
+    {
+      if (self->mode != OSTREE_REPO_MODE_BARE)
+        {
+          ret = TRUE;
+          goto out;
+        }
+
+      if (!ostree_repo_load_file (source, checksum, NULL, &file_info, &xattrs,
+                                  cancellable, error))
+        goto out;
+      if (g_file_info_get_file_type (file_info) != G_FILE_TYPE_REGULAR)
+        {
+          ret = TRUE;
+          goto out;
+        }
+    }
+
+  _ostree_loose_path (loose_path_buf, checksum, objtype, self->mode);
+
+  src_fd = openat (source->objects_dir_fd, loose_path_buf, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (src_fd == -1)
+    {
+      /* The object may be packed, or in a parent repo */
+      if (errno == ENOENT)
+        ret = TRUE;
+      else
+        ot_util_set_error_from_errno (error, errno);
+      goto out;
+    }
+
+  if (!_ostree_repo_write_loose_object_reflink (self, objtype, checksum, src_fd,
+                                                file_info, xattrs, out_was_supported,
+                                                cancellable, error))
+    goto out;
+
+  if (*out_was_supported && objtype == OSTREE_OBJECT_TYPE_COMMIT)
+    {
+      if (!copy_detached_metadata (self, source, checksum, cancellable, error))
+        goto out;
+    }
+
+  ret = TRUE;
+ out:
+  if (src_fd != -1)
+    (void) close (src_fd);
+  return ret;
+}
+
 static gboolean
 import_one_object_copy (OstreeRepo    *self,
                         OstreeRepo    *source,
@@ -1767,6 +2126,36 @@ import_one_object_copy (OstreeRepo    *self,
   guint64 length;
   gs_unref_object GInputStream *object = NULL;
 
+  if (self->mode == source->mode)
+    {
+      gboolean was_reflinked;
+
+      if (!import_one_object_reflink (self, source, checksum, objtype,
+                                      &was_reflinked, cancellable, error))
+        goto out;
+      if (was_reflinked)
+        {
+          ret = TRUE;
+          goto out;
+        }
+    }
+
+  if (objtype == OSTREE_OBJECT_TYPE_FILE
+      && self->mode == OSTREE_REPO_MODE_ARCHIVE_Z2
+      && source->mode == OSTREE_REPO_MODE_ARCHIVE_Z2)
+    {
+      gboolean was_loose;
+
+      if (!import_archive_content_copy (self, source, checksum, &was_loose,
+                                        cancellable, error))
+        goto out;
+      if (was_loose)
+        {
+          ret = TRUE;
+          goto out;
+        }
+    }
+
   if (!ostree_repo_load_object_stream (source, objtype, checksum,
                                        &object, &length,
                                        cancellable, error))
@@ -1829,12 +2218,31 @@ import_one_object_link (OstreeRepo    *self,
           *out_was_supported = FALSE;
           ret = TRUE;
         }
+      else if (errno == ENOENT)
+        {
+          gboolean is_packed;
+
+          /* Packed objects have no loose file to link, so copy them */
+          if (!_ostree_repo_find_packed_object (source, objtype, checksum, &is_packed,
+                                                NULL, cancellable, error))
+            goto out;
+          if (is_packed)
+            {
+              *out_was_supported = FALSE;
+              ret = TRUE;
+            }
+          else
+            ot_util_set_error_from_errno (error, ENOENT);
+        }
       else
         ot_util_set_error_from_errno (error, errno);
       
       goto out;
     }
 
+  if (objtype == OSTREE_OBJECT_TYPE_FILE && self->mode == OSTREE_REPO_MODE_BARE)
+    _ostree_repo_devino_cache_add (self, checksum);
+
   if (objtype == OSTREE_OBJECT_TYPE_COMMIT)
     {
       if (!copy_detached_metadata (self, source, checksum, cancellable, error))
@@ -1860,7 +2268,9 @@ import_one_object_link (OstreeRepo    *self,
  * type and on the same filesystem, this will simply be a fast Unix
  * hard link operation.
  *
- * Otherwise, a copy will be performed.
+ * Otherwise, a copy will be performed; on filesystems which support
+ * it, such as btrfs and XFS, the copy shares the data of the
+ * source object where possible.
  */
 gboolean
 ostree_repo_import_object_from (OstreeRepo           *self,
@@ -1923,10 +2333,26 @@ ostree_repo_query_object_storage_size (OstreeRepo           *self,
                                        GError              **error)
 {
   gboolean ret = FALSE;
-  gs_unref_object GFile *objpath = _ostree_repo_get_object_path (self, sha256, objtype);
-  gs_unref_object GFileInfo *finfo = g_file_query_info (objpath, OSTREE_GIO_FAST_QUERYINFO,
-                                                        G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
-                                                        cancellable, error);
+  gboolean is_packed;
+  gs_unref_bytes GBytes *packed_data = NULL;
+  gs_unref_object GFile *objpath = NULL;
+  gs_unref_object GFileInfo *finfo = NULL;
+
+  if (!_ostree_repo_find_packed_object (self, objtype, sha256, &is_packed,
+                                        &packed_data, cancellable, error))
+    goto out;
+
+  if (is_packed)
+    {
+      *out_size = g_bytes_get_size (packed_data);
+      ret = TRUE;
+      goto out;
+    }
+
+  objpath = _ostree_repo_get_object_path (self, sha256, objtype);
+  finfo = g_file_query_info (objpath, OSTREE_GIO_FAST_QUERYINFO,
+                             G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                             cancellable, error);
   if (!finfo)
     goto out;
 
@@ -2029,7 +2455,13 @@ ostree_repo_list_objects (OstreeRepo                  *self,
 
   if (flags & OSTREE_REPO_LIST_OBJECTS_PACKED)
     {
-      /* Nothing for now... */
+      if (!_ostree_repo_list_packed_objects (self, ret_objects, cancellable, error))
+        goto out;
+      if (self->parent_repo)
+        {
+          if (!_ostree_repo_list_packed_objects (self->parent_repo, ret_objects, cancellable, error))
+            goto out;
+        }
     }
 
   ret = TRUE;
@@ -52,6 +52,9 @@ gboolean      ostree_repo_open   (OstreeRepo     *self,
 void          ostree_repo_set_disable_fsync (OstreeRepo    *self,
                                              gboolean       disable_fsync);
 
+void          ostree_repo_set_batch_fsync (OstreeRepo    *self,
+                                           gboolean       batch_fsync);
+
 gboolean      ostree_repo_is_system (OstreeRepo   *repo);
 
 gboolean      ostree_repo_create (OstreeRepo     *self,
@@ -345,6 +348,9 @@ void ostree_repo_commit_modifier_set_xattr_callback (OstreeRepoCommitModifier
 void ostree_repo_commit_modifier_set_sepolicy (OstreeRepoCommitModifier              *modifier,
                                                OstreeSePolicy                        *sepolicy);
 
+void ostree_repo_commit_modifier_set_stat_cache (OstreeRepoCommitModifier              *modifier,
+                                                 GFile                                 *path);
+
 OstreeRepoCommitModifier *ostree_repo_commit_modifier_ref (OstreeRepoCommitModifier *modifier);
 void ostree_repo_commit_modifier_unref (OstreeRepoCommitModifier *modifier);
 
@@ -411,6 +417,16 @@ typedef enum {
   OSTREE_REPO_CHECKOUT_OVERWRITE_UNION_FILES = 1
 } OstreeRepoCheckoutOverwriteMode;
 
+/**
+ * OstreeRepoCheckoutFlags:
+ * @OSTREE_REPO_CHECKOUT_FLAGS_NONE: No special options
+ * @OSTREE_REPO_CHECKOUT_FLAGS_PARALLEL: Check out directories on multiple threads
+ */
+typedef enum {
+  OSTREE_REPO_CHECKOUT_FLAGS_NONE = 0,
+  OSTREE_REPO_CHECKOUT_FLAGS_PARALLEL = (1 << 0)
+} OstreeRepoCheckoutFlags;
+
 gboolean
 ostree_repo_checkout_tree (OstreeRepo               *self,
                            OstreeRepoCheckoutMode    mode,
@@ -421,6 +437,27 @@ ostree_repo_checkout_tree (OstreeRepo               *self,
                            GCancellable             *cancellable,
                            GError                  **error);
 
+gboolean
+ostree_repo_checkout_tree_full (OstreeRepo               *self,
+                                OstreeRepoCheckoutMode    mode,
+                                OstreeRepoCheckoutOverwriteMode    overwrite_mode,
+                                OstreeRepoCheckoutFlags   flags,
+                                GFile                    *destination,
+                                OstreeRepoFile           *source,
+                                GFileInfo                *source_info,
+                                GCancellable             *cancellable,
+                                GError                  **error);
+
+gboolean
+ostree_repo_checkout_tree_update (OstreeRepo               *self,
+                                  OstreeRepoCheckoutMode    mode,
+                                  GFile                    *destination,
+                                  OstreeRepoFile           *from_source,
+                                  OstreeRepoFile           *source,
+                                  GFileInfo                *source_info,
+                                  GCancellable             *cancellable,
+                                  GError                  **error);
+
 gboolean       ostree_repo_checkout_gc (OstreeRepo        *self,
                                         GCancellable      *cancellable,
                                         GError           **error);
@@ -489,6 +526,25 @@ gboolean ostree_repo_static_delta_generate (OstreeRepo                   *self,
                                             GCancellable                 *cancellable,
                                             GError                      **error);
 
+gboolean ostree_repo_static_delta_generate_with_params (OstreeRepo                   *self,
+                                                        OstreeStaticDeltaGenerateOpt  opt,
+                                                        const char                   *from,
+                                                        const char                   *to,
+                                                        GVariant                     *metadata,
+                                                        GVariant                     *params,
+                                                        GCancellable                 *cancellable,
+                                                        GError                      **error);
+
+gboolean ostree_repo_static_delta_generate_for_refs (OstreeRepo                   *self,
+                                                     OstreeStaticDeltaGenerateOpt  opt,
+                                                     const char * const           *refs,
+                                                     guint                         depth,
+                                                     GVariant                     *params,
+                                                     GPtrArray                   **out_generated,
+                                                     GPtrArray                   **out_skipped,
+                                                     GCancellable                 *cancellable,
+                                                     GError                      **error);
+
 gboolean ostree_repo_static_delta_execute_offline (OstreeRepo                    *self,
                                                    GFile                         *dir,
                                                    gboolean                       skip_validation,
@@ -532,6 +588,11 @@ gboolean ostree_repo_prune (OstreeRepo        *self,
                             GCancellable      *cancellable,
                             GError           **error);
 
+gboolean ostree_repo_repack (OstreeRepo        *self,
+                             guint             *out_n_objects_packed,
+                             GCancellable      *cancellable,
+                             GError           **error);
+
 /**
  * OstreeRepoPullFlags:
  * @OSTREE_REPO_PULL_FLAGS_NONE: No special options for pull
@@ -25,6 +25,7 @@
 
 #include "ostree-sysroot-private.h"
 #include "ostree-core-private.h"
+#include "ostree-repo-private.h"
 #include "ostree-linuxfsutil.h"
 #include "otutil.h"
 #include "libgsystem.h"
@@ -53,7 +54,8 @@ dfd_and_name_get_all_xattrs (int            dfd,
 }
 
 static gboolean
-copy_one_file_fsync_at (int              src_parent_dfd,
+copy_one_file_fsync_at (OstreeRepo      *repo,
+                        int              src_parent_dfd,
                         int              dest_parent_dfd,
                         struct stat     *stbuf,
                         const char      *name,
@@ -107,7 +109,8 @@ copy_one_file_fsync_at (int              src_parent_dfd,
           goto out;
         }
 
-      if (fdatasync (dest_fd) != 0)
+      /* With batched fsync, the sync before the bootloader swap covers this */
+      if (_ostree_repo_fsync_each_file (repo) && fdatasync (dest_fd) != 0)
         {
           ot_util_set_error_from_errno (error, errno);
           goto out;
@@ -200,7 +203,8 @@ dirfd_copy_attributes_and_xattrs (int            src_parent_dfd,
 }
 
 static gboolean
-copy_dir_recurse_fsync (int              src_parent_dfd,
+copy_dir_recurse_fsync (OstreeRepo      *repo,
+                        int              src_parent_dfd,
                         int              dest_parent_dfd,
                         const char      *name,
                         GCancellable    *cancellable,
@@ -254,13 +258,13 @@ copy_dir_recurse_fsync (int              src_parent_dfd,
 
       if (S_ISDIR (child_stbuf.st_mode))
         {
-          if (!copy_dir_recurse_fsync (src_dfd, dest_dfd, name,
+          if (!copy_dir_recurse_fsync (repo, src_dfd, dest_dfd, name,
                                        cancellable, error))
             goto out;
         }
       else
         {
-          if (!copy_one_file_fsync_at (src_dfd, dest_dfd,
+          if (!copy_one_file_fsync_at (repo, src_dfd, dest_dfd,
                                        &child_stbuf, name,
                                        cancellable, error))
             goto out;
@@ -268,7 +272,7 @@ copy_dir_recurse_fsync (int              src_parent_dfd,
     }
 
   /* And finally, fsync the fd */
-  if (fsync (dest_dfd) != 0)
+  if (_ostree_repo_fsync_each_file (repo) && fsync (dest_dfd) != 0)
     {
       ot_util_set_error_from_errno (error, errno);
       goto out;
@@ -373,7 +377,8 @@ ensure_directory_from_template (int                 orig_etc_fd,
  * link, or a directory.  Directories will be copied recursively.
  */
 static gboolean
-copy_modified_config_file (int                 orig_etc_fd,
+copy_modified_config_file (OstreeRepo         *repo,
+                           int                 orig_etc_fd,
                            int                 modified_etc_fd,
                            int                 new_etc_fd,
                            const char         *path,
@@ -451,13 +456,13 @@ copy_modified_config_file (int                 orig_etc_fd,
 
   if (S_ISDIR (modified_stbuf.st_mode))
     {
-      if (!copy_dir_recurse_fsync (modified_etc_fd, new_etc_fd, path,
+      if (!copy_dir_recurse_fsync (repo, modified_etc_fd, new_etc_fd, path,
                                    cancellable, error))
         goto out;
     }
   else if (S_ISLNK (modified_stbuf.st_mode) || S_ISREG (modified_stbuf.st_mode))
     {
-      if (!copy_one_file_fsync_at (modified_etc_fd, new_etc_fd,
+      if (!copy_one_file_fsync_at (repo, modified_etc_fd, new_etc_fd,
                                    &modified_stbuf, path,
                                    cancellable, error))
         goto out;
@@ -470,7 +475,7 @@ copy_modified_config_file (int                 orig_etc_fd,
       goto out;
     }
 
-  if (fsync (dest_parent_dfd) != 0)
+  if (_ostree_repo_fsync_each_file (repo) && fsync (dest_parent_dfd) != 0)
     {
       ot_util_set_error_from_errno (error, errno);
       goto out;
@@ -495,7 +500,8 @@ copy_modified_config_file (int                 orig_etc_fd,
  * changed in @new_etc, the modified version always wins.
  */
 static gboolean
-merge_etc_changes (GFile          *orig_etc,
+merge_etc_changes (OstreeRepo     *repo,
+                   GFile          *orig_etc,
                    GFile          *modified_etc,
                    GFile          *new_etc,
                    GCancellable   *cancellable,
@@ -564,7 +570,7 @@ merge_etc_changes (GFile          *orig_etc,
 
       g_assert (path);
 
-      if (!copy_modified_config_file (orig_etc_fd, modified_etc_fd, new_etc_fd, path,
+      if (!copy_modified_config_file (repo, orig_etc_fd, modified_etc_fd, new_etc_fd, path,
                                       cancellable, error))
         goto out;
     }
@@ -575,7 +581,7 @@ merge_etc_changes (GFile          *orig_etc,
 
       g_assert (path);
 
-      if (!copy_modified_config_file (orig_etc_fd, modified_etc_fd, new_etc_fd, path,
+      if (!copy_modified_config_file (repo, orig_etc_fd, modified_etc_fd, new_etc_fd, path,
                                       cancellable, error))
         goto out;
     }
@@ -633,8 +639,9 @@ checkout_deployment_tree (OstreeSysroot     *sysroot,
   if (!ot_util_ensure_directory_and_fsync (deploy_parent, cancellable, error))
     goto out;
   
-  if (!ostree_repo_checkout_tree (repo, 0, 0, deploy_target_path, OSTREE_REPO_FILE (root),
-                                  file_info, cancellable, error))
+  if (!ostree_repo_checkout_tree_full (repo, 0, 0, OSTREE_REPO_CHECKOUT_FLAGS_PARALLEL,
+                                       deploy_target_path, OSTREE_REPO_FILE (root),
+                                       file_info, cancellable, error))
     goto out;
 
   ret = TRUE;
@@ -865,6 +872,7 @@ selinux_relabel_var_if_needed (OstreeSysroot                 *sysroot,
 
 static gboolean
 merge_configuration (OstreeSysroot         *sysroot,
+                     OstreeRepo            *repo,
                      OstreeDeployment      *previous_deployment,
                      OstreeDeployment      *deployment,
                      GFile                 *deployment_path,
@@ -949,7 +957,7 @@ merge_configuration (OstreeSysroot         *sysroot,
 
   if (source_etc_path)
     {
-      if (!merge_etc_changes (source_etc_pristine_path, source_etc_path, deployment_etc_path, 
+      if (!merge_etc_changes (repo, source_etc_pristine_path, source_etc_path, deployment_etc_path, 
                               cancellable, error))
         goto out;
     }
@@ -1113,7 +1121,8 @@ checksum_from_kernel_src (GFile        *src,
 
 /* FIXME: We should really do individual fdatasync() on files/dirs,
  * since this causes us to block on unrelated I/O.  However, it's just
- * safer for now.
+ * safer for now.  When the repo batches fsync, this is also the
+ * barrier for the merged /etc.
  */
 static gboolean
 full_system_sync (GCancellable      *cancellable,
@@ -1899,7 +1908,7 @@ ostree_sysroot_deploy_tree (OstreeSysroot     *self,
   bootconfig = ostree_bootconfig_parser_new ();
   ostree_deployment_set_bootconfig (new_deployment, bootconfig);
 
-  if (!merge_configuration (self, merge_deployment, new_deployment,
+  if (!merge_configuration (self, repo, merge_deployment, new_deployment,
                             new_deployment_path,
                             &sepolicy,
                             cancellable, error))
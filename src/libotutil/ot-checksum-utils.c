@@ -23,16 +23,138 @@
 #include "config.h"
 
 #include "otutil.h"
+#include "ot-sha256.h"
 
 #include <string.h>
 
+struct OtChecksum {
+  /* Exactly one of these is in use */
+  GChecksum *gchecksum;
+  OtSha256 sha256;
+
+  gboolean finished;
+  guint8 digest[OT_SHA256_DIGEST_LEN];
+  char hexdigest[OT_SHA256_DIGEST_LEN * 2 + 1];
+};
+
+OtChecksum *
+ot_checksum_new (GChecksumType checksum_type)
+{
+  OtChecksum *checksum = g_new0 (OtChecksum, 1);
+
+  if (checksum_type == G_CHECKSUM_SHA256 && ot_sha256_get_implementation () != NULL)
+    ot_sha256_init (&checksum->sha256);
+  else
+    checksum->gchecksum = g_checksum_new (checksum_type);
+
+  return checksum;
+}
+
+void
+ot_checksum_update (OtChecksum    *checksum,
+                    gconstpointer  data,
+                    gsize          len)
+{
+  if (checksum->gchecksum)
+    {
+      g_checksum_update (checksum->gchecksum, data, len);
+      return;
+    }
+
+  g_return_if_fail (!checksum->finished);
+
+  ot_sha256_update (&checksum->sha256, data, len);
+}
+
+static void
+ot_checksum_finish (OtChecksum *checksum)
+{
+  static const char hexchars[] = "0123456789abcdef";
+  guint i;
+
+  if (checksum->finished)
+    return;
+
+  ot_sha256_finish (&checksum->sha256, checksum->digest);
+  for (i = 0; i < OT_SHA256_DIGEST_LEN; i++)
+    {
+      checksum->hexdigest[2 * i] = hexchars[checksum->digest[i] >> 4];
+      checksum->hexdigest[2 * i + 1] = hexchars[checksum->digest[i] & 0xf];
+    }
+  checksum->hexdigest[OT_SHA256_DIGEST_LEN * 2] = '\0';
+  checksum->finished = TRUE;
+}
+
+/**
+ * ot_checksum_get_string:
+ * @checksum: A checksum
+ *
+ * Like g_checksum_get_string(); no further data may be added
+ * afterwards.
+ *
+ * Returns: (transfer none): Hexadecimal digest
+ */
+const char *
+ot_checksum_get_string (OtChecksum *checksum)
+{
+  if (checksum->gchecksum)
+    return g_checksum_get_string (checksum->gchecksum);
+
+  ot_checksum_finish (checksum);
+  return checksum->hexdigest;
+}
+
+/**
+ * ot_checksum_get_digest:
+ * @checksum: A checksum
+ * @buffer: Output buffer
+ * @digest_len: (inout): Length of @buffer, set to the digest length
+ *
+ * Like g_checksum_get_digest(); no further data may be added
+ * afterwards.
+ */
+void
+ot_checksum_get_digest (OtChecksum *checksum,
+                        guint8     *buffer,
+                        gsize      *digest_len)
+{
+  if (checksum->gchecksum)
+    {
+      g_checksum_get_digest (checksum->gchecksum, buffer, digest_len);
+      return;
+    }
+
+  g_return_if_fail (*digest_len >= OT_SHA256_DIGEST_LEN);
+
+  ot_checksum_finish (checksum);
+  memcpy (buffer, checksum->digest, OT_SHA256_DIGEST_LEN);
+  *digest_len = OT_SHA256_DIGEST_LEN;
+}
+
+void
+ot_checksum_free (OtChecksum *checksum)
+{
+  if (checksum->gchecksum)
+    g_checksum_free (checksum->gchecksum);
+  g_free (checksum);
+}
+
+void
+ot_checksum_cleanup (void *loc)
+{
+  OtChecksum *checksum = *((OtChecksum**)loc);
+
+  if (checksum)
+    ot_checksum_free (checksum);
+}
+
 guchar *
-ot_csum_from_gchecksum (GChecksum  *checksum)
+ot_csum_from_checksum (OtChecksum  *checksum)
 {
   guchar *ret = g_malloc (32);
   gsize len = 32;
   
-  g_checksum_get_digest (checksum, ret, &len);
+  ot_checksum_get_digest (checksum, ret, &len);
   g_assert (len == 32);
   return ret;
 }
@@ -42,7 +164,7 @@ ot_gio_write_update_checksum (GOutputStream  *out,
                               gconstpointer   data,
                               gsize           len,
                               gsize          *out_bytes_written,
-                              GChecksum      *checksum,
+                              OtChecksum     *checksum,
                               GCancellable   *cancellable,
                               GError        **error)
 {
@@ -60,7 +182,7 @@ ot_gio_write_update_checksum (GOutputStream  *out,
     }
 
   if (checksum)
-    g_checksum_update (checksum, data, len);
+    ot_checksum_update (checksum, data, len);
   
   ret = TRUE;
  out:
@@ -70,7 +192,7 @@ ot_gio_write_update_checksum (GOutputStream  *out,
 gboolean
 ot_gio_splice_update_checksum (GOutputStream  *out,
                                GInputStream   *in,
-                               GChecksum      *checksum,
+                               OtChecksum     *checksum,
                                GCancellable   *cancellable,
                                GError        **error)
 {
@@ -111,20 +233,20 @@ ot_gio_splice_get_checksum (GOutputStream  *out,
                             GError        **error)
 {
   gboolean ret = FALSE;
-  GChecksum *checksum = NULL;
+  OtChecksum *checksum = NULL;
   gs_free guchar *ret_csum = NULL;
 
-  checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  checksum = ot_checksum_new (G_CHECKSUM_SHA256);
 
   if (!ot_gio_splice_update_checksum (out, in, checksum, cancellable, error))
     goto out;
 
-  ret_csum = ot_csum_from_gchecksum (checksum);
+  ret_csum = ot_csum_from_checksum (checksum);
 
   ret = TRUE;
   ot_transfer_out_value (out_csum, &ret_csum);
  out:
-  g_clear_pointer (&checksum, (GDestroyNotify) g_checksum_free);
+  g_clear_pointer (&checksum, (GDestroyNotify) ot_checksum_free);
   return ret;
 }
 
@@ -145,7 +267,7 @@ ot_checksum_file (GFile          *file,
                   GCancellable   *cancellable,
                   GError        **error)
 {
-  GChecksum *checksum = NULL;
+  OtChecksum *checksum = NULL;
   char *ret = NULL;
   gs_unref_object GInputStream *in = NULL;
 
@@ -153,14 +275,14 @@ ot_checksum_file (GFile          *file,
   if (!in)
     goto out;
 
-  checksum = g_checksum_new (checksum_type);
+  checksum = ot_checksum_new (checksum_type);
 
   if (!ot_gio_splice_update_checksum (NULL, in, checksum, cancellable, error))
     goto out;
 
-  ret = g_strdup (g_checksum_get_string (checksum));
+  ret = g_strdup (ot_checksum_get_string (checksum));
  out:
-  g_clear_pointer (&checksum, (GDestroyNotify) g_checksum_free);
+  g_clear_pointer (&checksum, (GDestroyNotify) ot_checksum_free);
   return ret;
 
 }
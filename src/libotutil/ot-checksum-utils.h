@@ -26,13 +26,34 @@
 
 G_BEGIN_DECLS
 
-guchar *ot_csum_from_gchecksum (GChecksum *checksum);
+/* A GChecksum work-alike which uses the CPU's SHA-256 instructions
+ * when available; see ot-sha256.c.
+ */
+typedef struct OtChecksum OtChecksum;
+
+OtChecksum *ot_checksum_new (GChecksumType checksum_type);
+
+void ot_checksum_update (OtChecksum    *checksum,
+                         gconstpointer  data,
+                         gsize          len);
+
+const char *ot_checksum_get_string (OtChecksum *checksum);
+
+void ot_checksum_get_digest (OtChecksum *checksum,
+                             guint8     *buffer,
+                             gsize      *digest_len);
+
+void ot_checksum_free (OtChecksum *checksum);
+void ot_checksum_cleanup (void *loc);
+#define ot_cleanup_checksum __attribute__ ((cleanup(ot_checksum_cleanup)))
+
+guchar *ot_csum_from_checksum (OtChecksum *checksum);
 
 gboolean ot_gio_write_update_checksum (GOutputStream  *out,
                                        gconstpointer   data,
                                        gsize           len,
                                        gsize          *out_bytes_written,
-                                       GChecksum      *checksum,
+                                       OtChecksum     *checksum,
                                        GCancellable   *cancellable,
                                        GError        **error);
 
@@ -44,7 +65,7 @@ gboolean ot_gio_splice_get_checksum (GOutputStream  *out,
 
 gboolean ot_gio_splice_update_checksum (GOutputStream  *out,
                                         GInputStream   *in,
-                                        GChecksum      *checksum,
+                                        OtChecksum     *checksum,
                                         GCancellable   *cancellable,
                                         GError        **error);
 
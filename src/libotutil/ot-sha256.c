@@ -0,0 +1,346 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2014 Colin Walters <walters@verbum.org>.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ * Author: Colin Walters <walters@verbum.org>
+ */
+
+
+/* SHA-256 using the CPU's dedicated instructions: the Intel SHA
+ * extensions on x86, and the ARMv8 cryptography extensions on
+ * aarch64.  Support is detected once at runtime; when the CPU (or the
+ * compiler) lacks them, ot_sha256_get_implementation() returns %NULL
+ * and callers use GChecksum instead.  See OtChecksum in
+ * ot-checksum-utils.c.
+ *
+ * Setting OSTREE_SHA256_ACCEL=0 in the environment disables the
+ * accelerated code.
+ */
+
+#include "config.h"
+
+#include "ot-sha256.h"
+
+#include <string.h>
+
+#if defined(HAVE_SHA_NI_INTRINSICS)
+#include <cpuid.h>
+#include <immintrin.h>
+#elif defined(HAVE_ARM_SHA2_INTRINSICS)
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#ifndef HWCAP_SHA2
+#define HWCAP_SHA2 (1 << 6)
+#endif
+#endif
+
+typedef void (*OtSha256CompressFunc) (guint32       state[8],
+                                      const guint8 *blocks,
+                                      gsize         n_blocks);
+
+static const guint32 sha256_initial_state[8] = {
+  0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+  0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+#if defined(HAVE_SHA_NI_INTRINSICS) || defined(HAVE_ARM_SHA2_INTRINSICS)
+static const guint32 sha256_k[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+  0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+  0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+  0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+  0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+  0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+  0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+  0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+  0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+#endif
+
+#if defined(HAVE_SHA_NI_INTRINSICS)
+
+/* Each iteration of the loop below does four rounds; W[] holds the
+ * message schedule as a ring of four 4-word groups.  The state is
+ * kept in the ABEF/CDGH word order the sha256rnds2 instruction
+ * wants.
+ */
+__attribute__((target("sha,sse4.1,ssse3")))
+static void
+sha256_compress_x86 (guint32       state[8],
+                     const guint8 *blocks,
+                     gsize         n_blocks)
+{
+  const __m128i byteswap = _mm_set_epi64x (0x0c0d0e0f08090a0bULL,
+                                           0x0405060700010203ULL);
+  __m128i state0, state1, tmp;
+
+  tmp = _mm_loadu_si128 ((const __m128i*) &state[0]);
+  state1 = _mm_loadu_si128 ((const __m128i*) &state[4]);
+  tmp = _mm_shuffle_epi32 (tmp, 0xB1);          /* CDAB */
+  state1 = _mm_shuffle_epi32 (state1, 0x1B);    /* EFGH */
+  state0 = _mm_alignr_epi8 (tmp, state1, 8);    /* ABEF */
+  state1 = _mm_blend_epi16 (state1, tmp, 0xF0); /* CDGH */
+
+  while (n_blocks-- > 0)
+    {
+      const __m128i abef_save = state0;
+      const __m128i cdgh_save = state1;
+      __m128i w[4];
+      __m128i msg;
+      guint i;
+
+      for (i = 0; i < 16; i++)
+        {
+          if (i < 4)
+            w[i] = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i*) (blocks + 16 * i)),
+                                     byteswap);
+
+          msg = _mm_add_epi32 (w[i % 4], _mm_loadu_si128 ((const __m128i*) &sha256_k[4 * i]));
+          state1 = _mm_sha256rnds2_epu32 (state1, state0, msg);
+
+          if (i >= 3 && i < 15)
+            {
+              tmp = _mm_alignr_epi8 (w[i % 4], w[(i + 3) % 4], 4);
+              w[(i + 1) % 4] = _mm_add_epi32 (w[(i + 1) % 4], tmp);
+              w[(i + 1) % 4] = _mm_sha256msg2_epu32 (w[(i + 1) % 4], w[i % 4]);
+            }
+
+          msg = _mm_shuffle_epi32 (msg, 0x0E);
+          state0 = _mm_sha256rnds2_epu32 (state0, state1, msg);
+
+          if (i >= 1 && i < 13)
+            w[(i + 3) % 4] = _mm_sha256msg1_epu32 (w[(i + 3) % 4], w[i % 4]);
+        }
+
+      state0 = _mm_add_epi32 (state0, abef_save);
+      state1 = _mm_add_epi32 (state1, cdgh_save);
+      blocks += 64;
+    }
+
+  tmp = _mm_shuffle_epi32 (state0, 0x1B);       /* FEBA */
+  state1 = _mm_shuffle_epi32 (state1, 0xB1);    /* DCHG */
+  state0 = _mm_blend_epi16 (tmp, state1, 0xF0); /* DCBA */
+  state1 = _mm_alignr_epi8 (state1, tmp, 8);    /* HGFE */
+
+  _mm_storeu_si128 ((__m128i*) &state[0], state0);
+  _mm_storeu_si128 ((__m128i*) &state[4], state1);
+}
+
+static OtSha256CompressFunc
+sha256_detect (const char **out_name)
+{
+  unsigned int eax, ebx, ecx, edx;
+
+  if (__get_cpuid_max (0, NULL) < 7)
+    return NULL;
+
+  __cpuid_count (1, 0, eax, ebx, ecx, edx);
+  if (!(ecx & bit_SSSE3) || !(ecx & bit_SSE4_1))
+    return NULL;
+
+  __cpuid_count (7, 0, eax, ebx, ecx, edx);
+  if (!(ebx & (1 << 29)))
+    return NULL;
+
+  *out_name = "x86-sha";
+  return sha256_compress_x86;
+}
+
+#elif defined(HAVE_ARM_SHA2_INTRINSICS)
+
+/* As above, W[] is a ring of four 4-word message schedule groups;
+ * each iteration does four rounds and computes the group needed
+ * four iterations later.
+ */
+__attribute__((target("+crypto")))
+static void
+sha256_compress_arm (guint32       state[8],
+                     const guint8 *blocks,
+                     gsize         n_blocks)
+{
+  uint32x4_t state0 = vld1q_u32 (&state[0]);
+  uint32x4_t state1 = vld1q_u32 (&state[4]);
+
+  while (n_blocks-- > 0)
+    {
+      const uint32x4_t abcd_save = state0;
+      const uint32x4_t efgh_save = state1;
+      uint32x4_t w[4];
+      uint32x4_t wk, tmp;
+      guint i;
+
+      for (i = 0; i < 4; i++)
+        w[i] = vreinterpretq_u32_u8 (vrev32q_u8 (vld1q_u8 (blocks + 16 * i)));
+
+      for (i = 0; i < 16; i++)
+        {
+          wk = vaddq_u32 (w[i % 4], vld1q_u32 (&sha256_k[4 * i]));
+          tmp = state0;
+          state0 = vsha256hq_u32 (state0, state1, wk);
+          state1 = vsha256h2q_u32 (state1, tmp, wk);
+
+          if (i < 12)
+            w[i % 4] = vsha256su1q_u32 (vsha256su0q_u32 (w[i % 4], w[(i + 1) % 4]),
+                                        w[(i + 2) % 4], w[(i + 3) % 4]);
+        }
+
+      state0 = vaddq_u32 (state0, abcd_save);
+      state1 = vaddq_u32 (state1, efgh_save);
+      blocks += 64;
+    }
+
+  vst1q_u32 (&state[0], state0);
+  vst1q_u32 (&state[4], state1);
+}
+
+static OtSha256CompressFunc
+sha256_detect (const char **out_name)
+{
+  if (!(getauxval (AT_HWCAP) & HWCAP_SHA2))
+    return NULL;
+
+  *out_name = "armv8-sha2";
+  return sha256_compress_arm;
+}
+
+#else
+
+static OtSha256CompressFunc
+sha256_detect (const char **out_name)
+{
+  return NULL;
+}
+
+#endif
+
+static OtSha256CompressFunc sha256_compress;
+static const char *sha256_implementation;
+
+static void
+sha256_init_dispatch (void)
+{
+  static gsize initialized;
+
+  if (g_once_init_enter (&initialized))
+    {
+      const char *accel = g_getenv ("OSTREE_SHA256_ACCEL");
+
+      if (accel == NULL || strcmp (accel, "0") != 0)
+        sha256_compress = sha256_detect (&sha256_implementation);
+
+      g_once_init_leave (&initialized, 1);
+    }
+}
+
+/**
+ * ot_sha256_get_implementation:
+ *
+ * Returns: (transfer none): A short name for the accelerated SHA-256
+ * implementation in use, or %NULL if there is none
+ */
+const char *
+ot_sha256_get_implementation (void)
+{
+  sha256_init_dispatch ();
+  return sha256_compress ? sha256_implementation : NULL;
+}
+
+void
+ot_sha256_init (OtSha256 *sha)
+{
+  sha256_init_dispatch ();
+  g_assert (sha256_compress != NULL);
+
+  memcpy (sha->state, sha256_initial_state, sizeof (sha->state));
+  sha->n_bytes = 0;
+  sha->buf_len = 0;
+}
+
+void
+ot_sha256_update (OtSha256      *sha,
+                  gconstpointer  data,
+                  gsize          len)
+{
+  const guint8 *p = data;
+
+  sha->n_bytes += len;
+
+  if (sha->buf_len > 0)
+    {
+      gsize n = MIN (sizeof (sha->buf) - sha->buf_len, len);
+
+      memcpy (sha->buf + sha->buf_len, p, n);
+      sha->buf_len += n;
+      p += n;
+      len -= n;
+
+      if (sha->buf_len < sizeof (sha->buf))
+        return;
+
+      sha256_compress (sha->state, sha->buf, 1);
+      sha->buf_len = 0;
+    }
+
+  if (len >= 64)
+    {
+      sha256_compress (sha->state, p, len / 64);
+      p += len & ~((gsize)63);
+      len &= 63;
+    }
+
+  if (len > 0)
+    {
+      memcpy (sha->buf, p, len);
+      sha->buf_len = len;
+    }
+}
+
+void
+ot_sha256_finish (OtSha256 *sha,
+                  guint8    digest[OT_SHA256_DIGEST_LEN])
+{
+  guint64 n_bits = sha->n_bytes * 8;
+  guint i;
+
+  sha->buf[sha->buf_len++] = 0x80;
+  if (sha->buf_len > 56)
+    {
+      memset (sha->buf + sha->buf_len, 0, sizeof (sha->buf) - sha->buf_len);
+      sha256_compress (sha->state, sha->buf, 1);
+      sha->buf_len = 0;
+    }
+  memset (sha->buf + sha->buf_len, 0, 56 - sha->buf_len);
+  for (i = 0; i < 8; i++)
+    sha->buf[56 + i] = (guint8) (n_bits >> (56 - 8 * i));
+  sha256_compress (sha->state, sha->buf, 1);
+
+  for (i = 0; i < 8; i++)
+    {
+      digest[4 * i]     = (guint8) (sha->state[i] >> 24);
+      digest[4 * i + 1] = (guint8) (sha->state[i] >> 16);
+      digest[4 * i + 2] = (guint8) (sha->state[i] >> 8);
+      digest[4 * i + 3] = (guint8) sha->state[i];
+    }
+}
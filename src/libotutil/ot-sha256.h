@@ -0,0 +1,53 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2014 Colin Walters <walters@verbum.org>.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ * Author: Colin Walters <walters@verbum.org>
+ */
+
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define OT_SHA256_DIGEST_LEN 32
+
+/* SHA-256 state for the hardware accelerated implementation; only
+ * usable when ot_sha256_get_implementation() returns non-%NULL.
+ */
+typedef struct {
+  guint32 state[8];
+  guint64 n_bytes;
+  guint8  buf[64];
+  guint   buf_len;
+} OtSha256;
+
+const char *ot_sha256_get_implementation (void);
+
+void ot_sha256_init (OtSha256 *sha);
+
+void ot_sha256_update (OtSha256      *sha,
+                       gconstpointer  data,
+                       gsize          len);
+
+void ot_sha256_finish (OtSha256 *sha,
+                       guint8    digest[OT_SHA256_DIGEST_LEN]);
+
+G_END_DECLS
@@ -51,6 +51,7 @@ static OstreeCommand commands[] = {
 #endif
   { "refs", ostree_builtin_refs, 0 },
   { "remote", ostree_builtin_remote, 0 },
+  { "repack", ostree_builtin_repack, 0 },
   { "reset", ostree_builtin_reset, 0 },
   { "rev-parse", ostree_builtin_rev_parse, 0 },
   { "show", ostree_builtin_show, 0 },
@@ -35,6 +35,8 @@ static char *opt_subpath;
 static gboolean opt_union;
 static gboolean opt_from_stdin;
 static char *opt_from_file;
+static gboolean opt_parallel;
+static char *opt_update_from;
 
 static GOptionEntry options[] = {
   { "user-mode", 'U', 0, G_OPTION_ARG_NONE, &opt_user_mode, "Do not change file ownership or initialize extended attributes", NULL },
@@ -43,6 +45,8 @@ static GOptionEntry options[] = {
   { "allow-noent", 0, 0, G_OPTION_ARG_NONE, &opt_allow_noent, "Do nothing if specified path does not exist", NULL },
   { "from-stdin", 0, 0, G_OPTION_ARG_NONE, &opt_from_stdin, "Process many checkouts from standard input", NULL },
   { "from-file", 0, 0, G_OPTION_ARG_STRING, &opt_from_file, "Process many checkouts from input file", NULL },
+  { "parallel", 0, 0, G_OPTION_ARG_NONE, &opt_parallel, "Check out directories on multiple threads", NULL },
+  { "update-from", 0, 0, G_OPTION_ARG_STRING, &opt_update_from, "Update an existing checkout of REV, changing only what differs", "REV" },
   { NULL }
 };
 
@@ -59,6 +63,9 @@ process_one_checkout (OstreeRepo           *repo,
   gs_unref_object GFile *root = NULL;
   gs_unref_object GFile *subtree = NULL;
   gs_unref_object GFileInfo *file_info = NULL;
+  gs_free char *resolved_from_commit = NULL;
+  gs_unref_object GFile *from_root = NULL;
+  gs_unref_object GFile *from_subtree = NULL;
 
   if (!ostree_repo_read_commit (repo, resolved_commit, &root, NULL, cancellable, error))
     goto out;
@@ -86,10 +93,41 @@ process_one_checkout (OstreeRepo           *repo,
       goto out;
     }
 
-  if (!ostree_repo_checkout_tree (repo, opt_user_mode ? OSTREE_REPO_CHECKOUT_MODE_USER : 0,
-                                  opt_union ? OSTREE_REPO_CHECKOUT_OVERWRITE_UNION_FILES : 0,
-                                  target, OSTREE_REPO_FILE (subtree), file_info, cancellable, error))
-    goto out;
+  if (opt_update_from)
+    {
+      if (opt_union || opt_parallel)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "--update-from cannot be used with %s",
+                       opt_union ? "--union" : "--parallel");
+          goto out;
+        }
+
+      if (!ostree_repo_resolve_rev (repo, opt_update_from, FALSE, &resolved_from_commit, error))
+        goto out;
+      if (!ostree_repo_read_commit (repo, resolved_from_commit, &from_root, NULL,
+                                    cancellable, error))
+        goto out;
+
+      if (subpath)
+        from_subtree = g_file_resolve_relative_path (from_root, subpath);
+      else
+        from_subtree = g_object_ref (from_root);
+
+      if (!ostree_repo_checkout_tree_update (repo, opt_user_mode ? OSTREE_REPO_CHECKOUT_MODE_USER : 0,
+                                             target, OSTREE_REPO_FILE (from_subtree),
+                                             OSTREE_REPO_FILE (subtree), file_info,
+                                             cancellable, error))
+        goto out;
+    }
+  else
+    {
+      if (!ostree_repo_checkout_tree_full (repo, opt_user_mode ? OSTREE_REPO_CHECKOUT_MODE_USER : 0,
+                                           opt_union ? OSTREE_REPO_CHECKOUT_OVERWRITE_UNION_FILES : 0,
+                                           opt_parallel ? OSTREE_REPO_CHECKOUT_FLAGS_PARALLEL : 0,
+                                           target, OSTREE_REPO_FILE (subtree), file_info, cancellable, error))
+        goto out;
+    }
                       
   ret = TRUE;
  out:
@@ -31,6 +31,7 @@ static char *opt_subject;
 static char *opt_body;
 static char *opt_branch;
 static char *opt_statoverride_file;
+static char *opt_stat_cache_file;
 static char **opt_metadata_strings;
 static char **opt_detached_metadata_strings;
 static gboolean opt_link_checkout_speedup;
@@ -47,6 +48,7 @@ static char *opt_gpg_homedir;
 #endif
 static gboolean opt_generate_sizes;
 static gboolean opt_disable_fsync;
+static gboolean opt_batch_fsync;
 
 #define ARG_EQ(x, y) (g_ascii_strcasecmp(x, y) == 0)
 /* create a function to parse the --fsync option, and current parse it the
@@ -74,6 +76,11 @@ static gboolean opt__fsync(const gchar *option_name,
     opt_disable_fsync = 1;
   else if (ARG_EQ(value, "no"))
     opt_disable_fsync = 1;
+  else if (ARG_EQ(value, "batch"))
+    {
+      opt_disable_fsync = 0;
+      opt_batch_fsync = 1;
+    }
   else
     /* do we want to complain here? */
     return 0;
@@ -96,6 +103,7 @@ static GOptionEntry options[] = {
   { "tar-autocreate-parents", 0, 0, G_OPTION_ARG_NONE, &opt_tar_autocreate_parents, "When loading tar archives, automatically create parent directories as needed", NULL },
   { "skip-if-unchanged", 0, 0, G_OPTION_ARG_NONE, &opt_skip_if_unchanged, "If the contents are unchanged from previous commit, do nothing", NULL },
   { "statoverride", 0, 0, G_OPTION_ARG_FILENAME, &opt_statoverride_file, "File containing list of modifications to make to permissions", "path" },
+  { "stat-cache", 0, 0, G_OPTION_ARG_FILENAME, &opt_stat_cache_file, "Skip reading files whose stat information is unchanged since the last commit with this cache", "path" },
   { "table-output", 0, 0, G_OPTION_ARG_NONE, &opt_table_output, "Output more information in a KEY: VALUE format", NULL },
 #ifdef HAVE_GPGME
   { "gpg-sign", 0, 0, G_OPTION_ARG_STRING_ARRAY, &opt_key_ids, "GPG Key ID to sign the commit with", "key-id"},
@@ -365,16 +373,25 @@ ostree_builtin_commit (int argc, char **argv, OstreeRepo *repo, GCancellable *ca
     flags |= OSTREE_REPO_COMMIT_MODIFIER_FLAGS_GENERATE_SIZES;
   if (opt_disable_fsync)
     ostree_repo_set_disable_fsync (repo, TRUE);
+  if (opt_batch_fsync)
+    ostree_repo_set_batch_fsync (repo, TRUE);
 
   if (flags != 0
       || opt_owner_uid >= 0
       || opt_owner_gid >= 0
       || opt_statoverride_file != NULL
+      || opt_stat_cache_file != NULL
       || opt_no_xattrs)
     {
       modifier = ostree_repo_commit_modifier_new (flags, commit_filter, mode_adds, NULL);
     }
 
+  if (opt_stat_cache_file)
+    {
+      gs_unref_object GFile *stat_cache_path = g_file_new_for_path (opt_stat_cache_file);
+      ostree_repo_commit_modifier_set_stat_cache (modifier, stat_cache_path);
+    }
+
   if (!ostree_repo_resolve_rev (repo, opt_branch, TRUE, &parent, error))
     goto out;
 
@@ -157,7 +157,11 @@ load_and_fsck_one_object (OstreeRepo            *repo,
           if (opt_delete)
             {
               g_printerr ("%s\n", msg);
-              (void) ostree_repo_delete_object (repo, objtype, checksum, cancellable, NULL);
+              if (!ostree_repo_delete_object (repo, objtype, checksum, cancellable, &temp_error))
+                {
+                  g_printerr ("%s\n", temp_error->message);
+                  g_clear_error (&temp_error);
+                }
               *out_found_corruption = TRUE;
             }
           else
@@ -23,18 +23,131 @@
 #include "ot-builtins.h"
 #include "ostree.h"
 #include "otutil.h"
+#include "ostree-repo-static-delta-private.h"
 
 static char *opt_from_rev;
 static char *opt_to_rev;
 static char *opt_apply;
+static gboolean opt_empty;
+static gboolean opt_chain;
+static char *opt_compression;
+static int opt_max_memory_size;
+static char **opt_refs;
+static int opt_depth = 1;
 
 static GOptionEntry options[] = {
   { "from", 0, 0, G_OPTION_ARG_STRING, &opt_from_rev, "Create delta from revision REV", "REV" },
+  { "empty", 0, 0, G_OPTION_ARG_NONE, &opt_empty, "Create delta from scratch, containing all objects of the target", NULL },
   { "to", 0, 0, G_OPTION_ARG_STRING, &opt_to_rev, "Create delta to revision REV", "REV" },
   { "apply", 0, 0, G_OPTION_ARG_FILENAME, &opt_apply, "Apply delta from PATH", "PATH" },
+  { "chain", 0, 0, G_OPTION_ARG_NONE, &opt_chain, "Refer to a chain of existing deltas instead of computing a new one", NULL },
+  { "compression", 0, 0, G_OPTION_ARG_STRING, &opt_compression, "Compress delta parts with METHOD (none, gzip, lzma; default gzip)", "METHOD" },
+  { "max-memory-size", 0, 0, G_OPTION_ARG_INT, &opt_max_memory_size, "Keep at most about MB megabytes of uncompressed delta data in memory", "MB" },
+  { "ref", 0, 0, G_OPTION_ARG_STRING_ARRAY, &opt_refs, "Create deltas to the commit of REF (may be given multiple times)", "REF" },
+  { "depth", 0, 0, G_OPTION_ARG_INT, &opt_depth, "With --ref, create deltas from each of the last N commits (default 1)", "N" },
   { NULL }
 };
 
+static gboolean
+get_generate_params (GOptionContext  *context,
+                     GVariant       **out_params,
+                     GError         **error)
+{
+  gboolean ret = FALSE;
+  GVariantBuilder parambuilder;
+
+  g_variant_builder_init (&parambuilder, G_VARIANT_TYPE ("a{sv}"));
+  if (opt_compression)
+    {
+      guint8 compression;
+
+      if (strcmp (opt_compression, "none") == 0)
+        compression = 0;
+      else if (strcmp (opt_compression, "gzip") == 0)
+        compression = 'g';
+      else if (strcmp (opt_compression, "lzma") == 0)
+        compression = 'x';
+      else
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                       "Unknown compression method '%s'", opt_compression);
+          goto out;
+        }
+      g_variant_builder_add (&parambuilder, "{sv}", "compression",
+                             g_variant_new_byte (compression));
+    }
+  if (opt_max_memory_size < 0)
+    {
+      ot_util_usage_error (context, "--max-memory-size must not be negative", error);
+      goto out;
+    }
+  if (opt_max_memory_size > 0)
+    g_variant_builder_add (&parambuilder, "{sv}", "max-memory-size",
+                           g_variant_new_uint32 (opt_max_memory_size));
+  if (opt_chain)
+    g_variant_builder_add (&parambuilder, "{sv}", "chain",
+                           g_variant_new_boolean (TRUE));
+  ret = TRUE;
+  *out_params = g_variant_ref_sink (g_variant_builder_end (&parambuilder));
+ out:
+  if (!ret)
+    g_variant_builder_clear (&parambuilder);
+  return ret;
+}
+
+/* Print the size of the objects in each part of a generated delta,
+ * and the ratio they were compressed by.
+ */
+static gboolean
+print_delta_stats (OstreeRepo     *repo,
+                   const char     *from,
+                   const char     *to,
+                   GError        **error)
+{
+  gboolean ret = FALSE;
+  guint i, n;
+  guint64 total_size = 0;
+  guint64 total_usize = 0;
+  gs_free char *relpath = NULL;
+  gs_unref_object GFile *meta_path = NULL;
+  gs_unref_variant GVariant *meta = NULL;
+  gs_unref_variant GVariant *headers = NULL;
+
+  if (from)
+    relpath = g_strdup_printf ("deltas/%s-%s/meta", from, to);
+  else
+    relpath = g_strdup_printf ("deltas/%s/meta", to);
+  meta_path = g_file_resolve_relative_path (ostree_repo_get_path (repo), relpath);
+
+  if (!ot_util_variant_map (meta_path, G_VARIANT_TYPE (OSTREE_STATIC_DELTA_META_FORMAT),
+                            FALSE, &meta, error))
+    goto out;
+
+  headers = g_variant_get_child_value (meta, 3);
+  n = g_variant_n_children (headers);
+  for (i = 0; i < n; i++)
+    {
+      guint64 size;
+      guint64 usize;
+      gs_unref_variant GVariant *csum_v = NULL;
+      gs_unref_variant GVariant *objects = NULL;
+
+      g_variant_get_child (headers, i, "(@aytt@ay)", &csum_v, &size, &usize, &objects);
+      g_print ("part %u: %u objects of %" G_GUINT64_FORMAT " bytes, compressed to %" G_GUINT64_FORMAT " (%.1f%%)\n",
+               i, (guint) (g_variant_n_children (objects) / OSTREE_STATIC_DELTA_OBJTYPE_CSUM_LEN),
+               usize, size, usize > 0 ? 100.0 * size / usize : 100.0);
+      total_size += size;
+      total_usize += usize;
+    }
+
+  g_print ("total: %u parts, objects of %" G_GUINT64_FORMAT " bytes, compressed to %" G_GUINT64_FORMAT "\n",
+           n, total_usize, total_size);
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
 gboolean
 ostree_builtin_static_delta (int argc, char **argv, OstreeRepo *repo, GCancellable *cancellable, GError **error)
 {
@@ -66,7 +179,39 @@ ostree_builtin_static_delta (int argc, char **argv, OstreeRepo *repo, GCancellab
       if (argc >= 2 && opt_to_rev == NULL)
         opt_to_rev = argv[1];
 
-      if (argc < 2 && opt_to_rev == NULL)
+      if (opt_refs)
+        {
+          guint i;
+          gs_unref_variant GVariant *params = NULL;
+          gs_unref_ptrarray GPtrArray *generated = NULL;
+          gs_unref_ptrarray GPtrArray *skipped = NULL;
+
+          if (opt_to_rev || opt_from_rev || opt_empty || opt_chain)
+            {
+              ot_util_usage_error (context, "--ref can't be combined with a single delta", error);
+              goto out;
+            }
+          if (opt_depth < 1)
+            {
+              ot_util_usage_error (context, "--depth must be at least 1", error);
+              goto out;
+            }
+
+          if (!get_generate_params (context, &params, error))
+            goto out;
+
+          if (!ostree_repo_static_delta_generate_for_refs (repo, OSTREE_STATIC_DELTA_GENERATE_OPT_MAJOR,
+                                                           (const char * const *)opt_refs, opt_depth,
+                                                           params, &generated, &skipped,
+                                                           cancellable, error))
+            goto out;
+
+          for (i = 0; i < skipped->len; i++)
+            g_print ("Skipping existing delta %s\n", (char*)skipped->pdata[i]);
+          for (i = 0; i < generated->len; i++)
+            g_print ("Generated delta %s\n", (char*)generated->pdata[i]);
+        }
+      else if (argc < 2 && opt_to_rev == NULL)
         {
           guint i;
           if (!ostree_repo_list_static_delta_names (repo, &delta_names, cancellable, error))
@@ -90,8 +235,22 @@ ostree_builtin_static_delta (int argc, char **argv, OstreeRepo *repo, GCancellab
           gs_free char *from_resolved = NULL;
           gs_free char *to_resolved = NULL;
           gs_free char *from_parent_str = NULL;
+          gs_unref_variant GVariant *params = NULL;
+
+          if (!get_generate_params (context, &params, error))
+            goto out;
+
+          if (opt_empty && opt_from_rev != NULL)
+            {
+              ot_util_usage_error (context, "--empty and --from=REV are mutually exclusive", error);
+              goto out;
+            }
 
-          if (opt_from_rev == NULL)
+          if (opt_empty)
+            {
+              from_source = NULL;
+            }
+          else if (opt_from_rev == NULL)
             {
               from_parent_str = g_strconcat (opt_to_rev, "^", NULL);
               from_source = from_parent_str;
@@ -101,17 +260,20 @@ ostree_builtin_static_delta (int argc, char **argv, OstreeRepo *repo, GCancellab
               from_source = opt_from_rev;
             }
 
-          if (!ostree_repo_resolve_rev (repo, from_source, FALSE, &from_resolved, error))
+          if (from_source != NULL &&
+              !ostree_repo_resolve_rev (repo, from_source, FALSE, &from_resolved, error))
             goto out;
           if (!ostree_repo_resolve_rev (repo, opt_to_rev, FALSE, &to_resolved, error))
             goto out;
 
           g_print ("Generating static delta:\n");
-          g_print ("  From: %s\n", from_resolved);
+          g_print ("  From: %s\n", from_resolved ? from_resolved : "empty");
           g_print ("  To:   %s\n", to_resolved);
-          if (!ostree_repo_static_delta_generate (repo, OSTREE_STATIC_DELTA_GENERATE_OPT_MAJOR,
-                                                  from_resolved, to_resolved, NULL,
-                                                  cancellable, error))
+          if (!ostree_repo_static_delta_generate_with_params (repo, OSTREE_STATIC_DELTA_GENERATE_OPT_MAJOR,
+                                                              from_resolved, to_resolved, NULL,
+                                                              params, cancellable, error))
+            goto out;
+          if (!print_delta_stats (repo, from_resolved, to_resolved, error))
             goto out;
         }
       else
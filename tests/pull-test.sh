@@ -45,6 +45,12 @@ ${CMD_PREFIX} ostree --repo=mirrorrepo fsck
 $OSTREE show main >/dev/null
 echo "ok pull mirror"
 
+cd ${test_tmpdir}
+for obj in $(cd mirrorrepo/objects && find . -name '*.filez'); do
+    cmp ostree-srv/gnomerepo/objects/${obj} mirrorrepo/objects/${obj}
+done
+echo "ok pull mirror stores compressed content as is"
+
 cd ${test_tmpdir}
 ostree --repo=ostree-srv/gnomerepo commit -b main -s "Metadata string" --add-detached-metadata-string=SIGNATURE=HANCOCK --tree=ref=main
 ${CMD_PREFIX} ostree --repo=repo pull origin main
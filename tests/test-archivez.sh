@@ -21,7 +21,7 @@ set -e
 
 . $(dirname $0)/libtest.sh
 
-echo '1..11'
+echo '1..15'
 
 setup_test_repository "archive-z2"
 echo "ok setup"
@@ -36,3 +36,99 @@ ostree --repo=repo2 pull aremote
 ostree --repo=repo2 rev-parse aremote/test2
 ostree --repo=repo2 fsck
 echo "ok pull with from file:/// uri"
+
+cd ${test_tmpdir}
+rm -rf big-files
+mkdir big-files
+seq 2000000 > big-files/counting
+head -c 5000000 /dev/urandom > big-files/random
+${CMD_PREFIX} ostree --repo=repo commit -b big -s big --tree=dir=big-files
+${CMD_PREFIX} ostree --repo=repo fsck
+rm -rf big-checkout
+${CMD_PREFIX} ostree --repo=repo checkout -U big big-checkout
+cmp big-files/counting big-checkout/counting
+cmp big-files/random big-checkout/random
+echo "ok commit large files with parallel compression"
+
+cd ${test_tmpdir}
+rm -rf level-files
+mkdir level-files
+seq 100000 > level-files/counting
+head -c 200000 /dev/urandom > level-files/random
+gzip -c level-files/counting > level-files/counting.gz
+${CMD_PREFIX} ostree --repo=repo config set core.compression-level 1
+${CMD_PREFIX} ostree --repo=repo commit -b level -s level --tree=dir=level-files
+${CMD_PREFIX} ostree --repo=repo config set core.compression-level 0
+seq 100001 200000 > level-files/counting2
+${CMD_PREFIX} ostree --repo=repo commit -b level -s level0 --tree=dir=level-files
+${CMD_PREFIX} ostree --repo=repo fsck
+rm -rf level-checkout
+${CMD_PREFIX} ostree --repo=repo checkout -U level level-checkout
+for f in counting counting2 random counting.gz; do
+    cmp level-files/$f level-checkout/$f
+done
+${CMD_PREFIX} ostree --repo=repo config set core.compression-level 10
+# An invalid level falls back to the default, and must not stop the
+# repository from being opened, so it can still be fixed
+G_MESSAGES_DEBUG=all ${CMD_PREFIX} ostree --repo=repo fsck >debug.txt 2>&1
+assert_file_has_content debug.txt "Invalid compression-level"
+seq 200001 300000 > level-files/counting3
+${CMD_PREFIX} ostree --repo=repo commit -b level -s level10 --tree=dir=level-files
+${CMD_PREFIX} ostree --repo=repo fsck
+rm -rf level-checkout
+${CMD_PREFIX} ostree --repo=repo checkout -U level level-checkout
+cmp level-files/counting3 level-checkout/counting3
+${CMD_PREFIX} ostree --repo=repo config set core.compression-level 9
+echo "ok compression level"
+
+cache_size() {
+    find repo/uncompressed-objects-cache -type f -printf '%s\n' | awk '{ s += $1 } END { print s + 0 }'
+}
+
+is_cached() {
+    test -n "$(find repo/uncompressed-objects-cache -samefile $1)"
+}
+
+rm -rf level-checkout
+${CMD_PREFIX} ostree --repo=repo config set core.uncompressed-cache-size 1K
+${CMD_PREFIX} ostree --repo=repo checkout -U level level-checkout
+assert_has_file repo/state/uncompressed-cache-index
+test $(cache_size) -le 1024
+for f in counting counting2 random counting.gz; do
+    cmp level-files/$f level-checkout/$f
+done
+# Invalid sizes leave the cache unlimited
+for size in 1X 20000000000000000G; do
+    ${CMD_PREFIX} ostree --repo=repo config set core.uncompressed-cache-size $size
+    G_MESSAGES_DEBUG=all ${CMD_PREFIX} ostree --repo=repo fsck >debug.txt 2>&1
+    assert_file_has_content debug.txt "Invalid uncompressed-cache-size"
+    rm -rf level-checkout
+    ${CMD_PREFIX} ostree --repo=repo checkout -U level level-checkout
+    test $(cache_size) -gt 1024
+done
+${CMD_PREFIX} ostree --repo=repo config set core.uncompressed-cache-size 0
+${CMD_PREFIX} ostree --repo=repo fsck
+echo "ok uncompressed cache size limit"
+
+cd ${test_tmpdir}
+rm -rf lru-files lru-checkout-*
+for f in a b c; do
+    mkdir -p lru-files/$f
+    head -c 40000 /dev/urandom > lru-files/$f/$f
+    ${CMD_PREFIX} ostree --repo=repo commit -b lru-$f -s lru-$f --tree=dir=lru-files/$f
+done
+# Room for two of the three objects
+${CMD_PREFIX} ostree --repo=repo config set core.uncompressed-cache-size 100K
+${CMD_PREFIX} ostree --repo=repo checkout -U lru-a lru-checkout-a
+${CMD_PREFIX} ostree --repo=repo checkout -U lru-b lru-checkout-b
+# Using a again makes b the least recently used
+${CMD_PREFIX} ostree --repo=repo checkout -U lru-a lru-checkout-a2
+${CMD_PREFIX} ostree --repo=repo checkout -U lru-c lru-checkout-c
+test $(cache_size) -le 102400
+is_cached lru-checkout-a/a
+is_cached lru-checkout-c/c
+if is_cached lru-checkout-b/b; then
+    assert_not_reached "least recently used object was kept"
+fi
+${CMD_PREFIX} ostree --repo=repo config set core.uncompressed-cache-size 0
+echo "ok uncompressed cache evicts least recently used"
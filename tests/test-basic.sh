@@ -19,7 +19,7 @@
 
 set -e
 
-echo "1..41"
+echo "1..52"
 
 . $(dirname $0)/libtest.sh
 
@@ -138,6 +138,26 @@ ${CMD_PREFIX} ostree --repo=repo2 init
 ${CMD_PREFIX} ostree --repo=repo2 pull-local repo
 echo "ok pull-local"
 
+# Objects can't be hardlinked across filesystems, nor cloned, so this
+# goes through the copying import.
+cd ${test_tmpdir}
+shmdir=$(mktemp -d /dev/shm/ostree-test.XXXXXX 2>/dev/null || true)
+if test -n "${shmdir}" && test "$(stat -c %d ${shmdir})" != "$(stat -c %d repo)"; then
+    ${CMD_PREFIX} ostree --repo=${shmdir}/repo init
+    ${CMD_PREFIX} ostree --repo=${shmdir}/repo pull-local repo
+    ${CMD_PREFIX} ostree --repo=${shmdir}/repo fsck
+    if find ${shmdir}/repo/objects -type f -name '*.file' -newermt '1970-01-02' | grep -q .; then
+        assert_not_reached "imported content objects have a nonzero mtime"
+    fi
+    ${CMD_PREFIX} ostree --repo=${shmdir}/repo checkout test2 ${shmdir}/checkout
+    assert_file_has_content ${shmdir}/checkout/yet/another/tree/green 'leaf'
+    rm -rf ${shmdir}
+    echo "ok pull-local across filesystems"
+else
+    test -z "${shmdir}" || rm -rf ${shmdir}
+    echo "ok pull-local across filesystems # SKIP /dev/shm is not a separate filesystem"
+fi
+
 cd ${test_tmpdir}
 ${CMD_PREFIX} ostree --repo=repo2 checkout test2 test2-checkout-from-local-clone
 cd test2-checkout-from-local-clone
@@ -263,6 +283,16 @@ $OSTREE checkout test2 test2-checkout
 (cd test2-checkout && $OSTREE commit --link-checkout-speedup -b test2 -s "tmp")
 echo "ok commit with link speedup"
 
+cd ${test_tmpdir}
+assert_has_file repo/state/devino-cache
+echo "new file" > test2-checkout/newfile
+(cd test2-checkout && $OSTREE commit --link-checkout-speedup -b test2 -s "tmp2")
+rm -rf test2-checkout-2
+$OSTREE checkout test2 test2-checkout-2
+diff -r test2-checkout test2-checkout-2
+rm -rf test2-checkout-2
+echo "ok commit with cached link speedup"
+
 cd ${test_tmpdir}
 $OSTREE ls test2
 echo "ok ls with no argument"
@@ -365,3 +395,145 @@ mkdir -p test2-checkout
 cd test2-checkout
 touch should-not-be-fsynced
 $OSTREE commit -b test2 -s "Unfsynced commit" --fsync=false
+
+cd ${test_tmpdir}
+rm -rf manyfiles manyfiles-checkout
+mkdir -p manyfiles
+for d in a b c; do
+    mkdir manyfiles/$d
+    for i in $(seq 1 700); do
+        echo "$d $i" > manyfiles/$d/file$i
+    done
+done
+$OSTREE commit -b manyfiles -s "Many files" --tree=dir=manyfiles
+$OSTREE fsck -q
+$OSTREE checkout manyfiles manyfiles-checkout
+diff -r manyfiles manyfiles-checkout
+echo "ok commit many files"
+
+cd ${test_tmpdir}
+rm -rf statcache-tree statcache-checkout stat-cache
+mkdir -p statcache-tree/sub
+echo one > statcache-tree/one
+echo two > statcache-tree/sub/two
+# Entries for files modified just before the cache is written are not
+# trusted, so backdate them
+touch -d '2 days ago' statcache-tree/one statcache-tree/sub/two
+$OSTREE commit -b statcache -s "Stat cache" --stat-cache=stat-cache --tree=dir=statcache-tree
+assert_has_file stat-cache
+echo uno > statcache-tree/one
+$OSTREE commit -b statcache -s "Stat cache 2" --stat-cache=stat-cache --table-output --tree=dir=statcache-tree > statcache-stats.txt
+# Only the modified file is read again
+assert_file_has_content statcache-stats.txt '^Content Total: 1$'
+$OSTREE checkout statcache statcache-checkout
+assert_file_has_content statcache-checkout/one uno
+diff -r statcache-tree statcache-checkout
+echo "ok commit with stat cache"
+
+cd ${test_tmpdir}
+rm -rf statcache-tree2 statcache-checkout
+mkdir statcache-tree2
+echo three > statcache-tree2/three
+touch -d '2 days ago' statcache-tree/one statcache-tree2/three
+$OSTREE commit -b statcache -s "Stat cache 3" --stat-cache=stat-cache --tree=dir=statcache-tree --tree=dir=statcache-tree2
+echo dos > statcache-tree/sub/two
+$OSTREE commit -b statcache -s "Stat cache 4" --stat-cache=stat-cache --table-output --tree=dir=statcache-tree --tree=dir=statcache-tree2 > statcache-stats.txt
+# Entries for both trees are kept
+assert_file_has_content statcache-stats.txt '^Content Total: 1$'
+$OSTREE checkout statcache statcache-checkout
+assert_file_has_content statcache-checkout/sub/two dos
+assert_file_has_content statcache-checkout/three three
+echo "ok commit with stat cache shared by several trees"
+
+cd ${test_tmpdir}
+rm -rf tmpfile-tree tmpfile-checkout
+mkdir -p tmpfile-tree/sub
+echo tmpfile > tmpfile-tree/sub/contents
+ln -s sub/contents tmpfile-tree/link
+$OSTREE commit -b tmpfile -s "Temporary files" --tree=dir=tmpfile-tree
+test $(ls -d repo/objects/[0-9a-f][0-9a-f] | wc -l) = 256
+$OSTREE fsck -q
+$OSTREE checkout tmpfile tmpfile-checkout
+diff -r tmpfile-tree tmpfile-checkout
+echo "ok commit with preallocated object directories"
+
+cd ${test_tmpdir}
+rm -rf batch-fsync-tree batch-fsync-checkout
+mkdir -p batch-fsync-tree/sub
+echo batched > batch-fsync-tree/sub/contents
+$OSTREE commit -b batch-fsync -s "Batched fsync" --fsync=batch --tree=dir=batch-fsync-tree
+cp repo/config repo/config.orig
+$OSTREE config set core.fsync batch
+$OSTREE checkout batch-fsync batch-fsync-checkout
+mv repo/config.orig repo/config
+$OSTREE fsck -q
+diff -r batch-fsync-tree batch-fsync-checkout
+echo "ok batched fsync"
+
+cd ${test_tmpdir}
+rm -rf manyfiles-parallel
+$OSTREE checkout --parallel manyfiles manyfiles-parallel
+diff -r manyfiles manyfiles-parallel
+test $(stat -c '%a' manyfiles/b) = $(stat -c '%a' manyfiles-parallel/b)
+$OSTREE checkout --parallel --union manyfiles manyfiles-parallel
+diff -r manyfiles manyfiles-parallel
+echo "ok parallel checkout"
+
+cd ${test_tmpdir}
+rm -rf manydirs manydirs-parallel
+mkdir manydirs
+for d in $(seq 300); do
+    mkdir -p manydirs/$d/sub
+    echo $d > manydirs/$d/sub/file
+done
+$OSTREE commit -b manydirs -s "Many directories" --tree=dir=manydirs
+(ulimit -n 64; $OSTREE checkout --parallel manydirs manydirs-parallel)
+diff -r manydirs manydirs-parallel
+echo "ok parallel checkout of more directories than open files"
+
+cd ${test_tmpdir}
+rm -rf update-tree update-checkout update-fresh
+mkdir -p update-tree/same/deep update-tree/changed update-tree/gone update-tree/becomes-file
+echo same > update-tree/same/deep/file
+echo old > update-tree/changed/file
+echo gone > update-tree/gone/file
+echo gone > update-tree/changed/removed
+echo dir > update-tree/becomes-file/file
+echo file > update-tree/becomes-dir
+$OSTREE commit -b update -s "Update from" --tree=dir=update-tree
+$OSTREE checkout update update-checkout
+echo new > update-tree/changed/file
+echo added > update-tree/changed/added
+rm -rf update-tree/gone update-tree/changed/removed update-tree/becomes-file update-tree/becomes-dir
+echo file > update-tree/becomes-file
+mkdir update-tree/becomes-dir
+echo dir > update-tree/becomes-dir/file
+chmod 0750 update-tree/changed
+$OSTREE commit -b update -s "Update to" --tree=dir=update-tree
+for opt in --union --parallel; do
+    if $OSTREE checkout --update-from=update^ $opt update update-checkout 2>err.txt; then
+        assert_not_reached "--update-from with $opt succeeded"
+    fi
+    assert_file_has_content err.txt "cannot be used with $opt"
+done
+$OSTREE checkout --update-from=update^ update update-checkout
+$OSTREE checkout update update-fresh
+diff -r update-fresh update-checkout
+assert_file_has_content update-checkout/changed/file new
+test $(stat -c '%a' update-checkout/changed) = 750
+echo "ok checkout update from previous commit"
+
+cd ${test_tmpdir}
+rm -rf large-tree large-checkout
+mkdir large-tree
+seq 1 200000 > large-tree/counting
+cp large-tree/counting large-tree/counting-copy
+echo small > large-tree/small
+$OSTREE commit -b large -s "Large files" --tree=dir=large-tree
+$OSTREE fsck
+$OSTREE checkout large large-checkout
+cmp large-tree/counting large-checkout/counting
+cmp large-tree/counting-copy large-checkout/counting-copy
+$OSTREE ls -C large /counting > counting-ls.txt
+assert_file_has_content counting-ls.txt $(${CMD_PREFIX} ostree checksum large-tree/counting)
+echo "ok commit large files into bare repo"
@@ -0,0 +1,83 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2014 Colin Walters <walters@verbum.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include "libgsystem.h"
+
+#include "otutil.h"
+#include "ot-sha256.h"
+
+static void
+check_one (const guint8 *data,
+           gsize         len,
+           gsize         chunk)
+{
+  GChecksum *expected = g_checksum_new (G_CHECKSUM_SHA256);
+  OtChecksum *actual = ot_checksum_new (G_CHECKSUM_SHA256);
+  gsize offset;
+
+  g_checksum_update (expected, data, len);
+  for (offset = 0; offset < len; offset += chunk)
+    ot_checksum_update (actual, data + offset, MIN (chunk, len - offset));
+
+  g_assert_cmpstr (ot_checksum_get_string (actual), ==, g_checksum_get_string (expected));
+
+  g_checksum_free (expected);
+  ot_checksum_free (actual);
+}
+
+static void
+test_sha256 (void)
+{
+  const gsize chunks[] = { 1, 3, 63, 64, 65, 4096 };
+  guint8 data[1024];
+  gsize len;
+  guint i;
+
+  if (g_test_verbose ())
+    g_test_message ("SHA-256 implementation: %s",
+                    ot_sha256_get_implementation () ? ot_sha256_get_implementation () : "GChecksum");
+
+  for (i = 0; i < sizeof (data); i++)
+    data[i] = (guint8) g_test_rand_int ();
+
+  /* Covers every padding case: the length fitting in the last block
+   * or spilling into another one.
+   */
+  for (len = 0; len <= sizeof (data); len++)
+    {
+      for (i = 0; i < G_N_ELEMENTS (chunks); i++)
+        check_one (data, len, chunks[i]);
+    }
+}
+
+int
+main (int argc, char **argv)
+{
+
+  g_setenv ("GIO_USE_VFS", "local", TRUE);
+
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/ostree/checksum/sha256", test_sha256);
+
+  return g_test_run ();
+}
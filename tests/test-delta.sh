@@ -24,7 +24,7 @@ set -e
 bindatafiles="bash true ostree"
 morebindatafiles="false ls"
 
-echo '1..2'
+echo '1..9'
 
 mkdir repo
 ostree --repo=repo init --mode=archive-z2
@@ -61,10 +61,13 @@ ostree static-delta --repo=repo
 
 origrev=$(ostree --repo=repo rev-parse test^)
 newrev=$(ostree --repo=repo rev-parse test)
-ostree static-delta --repo=repo --from=${origrev} --to=${newrev}
+ostree static-delta --repo=repo --from=${origrev} --to=${newrev} > generate.txt
+assert_file_has_content generate.txt '^part 0: '
 
 assert_has_dir repo/deltas/${origrev}-${newrev}
 
+echo 'ok generate'
+
 mkdir repo2
 ostree --repo=repo2 init --mode=archive-z2
 ostree --repo=repo2 pull-local repo ${origrev}
@@ -72,3 +75,133 @@ ostree --repo=repo2 pull-local repo ${origrev}
 ostree --repo=repo2 static-delta --apply=repo/deltas/${origrev}-${newrev}
 ostree --repo=repo2 fsck
 ostree --repo=repo2 show ${newrev}
+
+echo 'ok apply'
+
+# Part headers give the size of the objects written, not of the part
+# payload; deltas from any generator must apply.
+ostree static-delta --repo=repo --compression=none --from=${origrev} --to=${newrev} > generate-none.txt
+usize=$(sed -ne 's/^part 0: [0-9]* objects of \([0-9]*\) bytes.*/\1/p' generate-none.txt)
+payloadsize=$(($(stat -c '%s' repo/deltas/${origrev}-${newrev}/0) - 1))
+test ${usize} -gt 0
+test ${payloadsize} != ${usize}
+
+mkdir repo-none
+ostree --repo=repo-none init --mode=archive-z2
+ostree --repo=repo-none pull-local repo ${origrev}
+ostree --repo=repo-none static-delta --apply=repo/deltas/${origrev}-${newrev}
+ostree --repo=repo-none fsck
+ostree --repo=repo-none show ${newrev}
+
+echo 'ok apply delta with object sizes in part headers'
+
+ostree static-delta --repo=repo --compression=lzma --from=${origrev} --to=${newrev}
+test "$(head -c 1 repo/deltas/${origrev}-${newrev}/0)" = x
+
+mkdir repo3
+ostree --repo=repo3 init --mode=archive-z2
+ostree --repo=repo3 pull-local repo ${origrev}
+ostree --repo=repo3 static-delta --apply=repo/deltas/${origrev}-${newrev}
+ostree --repo=repo3 fsck
+ostree --repo=repo3 show ${newrev}
+
+echo 'ok lzma'
+
+cp -r repo/deltas/${origrev}-${newrev} corrupted-delta
+dd if=/dev/zero of=corrupted-delta/0 bs=1 count=8 seek=64 conv=notrunc 2>/dev/null
+mkdir repo4
+ostree --repo=repo4 init --mode=archive-z2
+ostree --repo=repo4 pull-local repo ${origrev}
+if ostree --repo=repo4 static-delta --apply=corrupted-delta 2>err.txt; then
+    assert_not_reached "applied a corrupted delta"
+fi
+assert_file_has_content err.txt "Checksum mismatch"
+
+echo 'ok corrupted delta'
+
+# A small change to an incompressible file should only cost about a
+# rollsum chunk, not the whole file.
+dd if=/dev/urandom of=files/random bs=1024 count=1024 2>/dev/null
+ostree --repo=repo commit -b test -s test --tree=dir=files
+echo tail >> files/random
+ostree --repo=repo commit -b test -s test --tree=dir=files
+origrev=$(ostree --repo=repo rev-parse test^)
+newrev=$(ostree --repo=repo rev-parse test)
+ostree static-delta --repo=repo --max-memory-size=1 --from=${origrev} --to=${newrev}
+deltasize=$(cat repo/deltas/${origrev}-${newrev}/[0-9]* | wc -c)
+if test ${deltasize} -gt 262144; then
+    echo "delta is ${deltasize} bytes"; exit 1
+fi
+
+ostree --repo=repo2 pull-local repo ${origrev}
+ostree --repo=repo2 static-delta --apply=repo/deltas/${origrev}-${newrev}
+ostree --repo=repo2 fsck
+ostree --repo=repo2 checkout -U ${newrev} checkout-random
+cmp files/random checkout-random/random
+
+echo 'ok rollsum delta'
+
+# Only the header of a file whose mode changed should be shipped.
+chmod a+x files/random
+ostree --repo=repo commit -b test -s test --tree=dir=files
+origrev=$(ostree --repo=repo rev-parse test^)
+newrev=$(ostree --repo=repo rev-parse test)
+ostree static-delta --repo=repo --from=${origrev} --to=${newrev}
+deltasize=$(cat repo/deltas/${origrev}-${newrev}/[0-9]* | wc -c)
+if test ${deltasize} -gt 4096; then
+    echo "delta is ${deltasize} bytes"; exit 1
+fi
+
+ostree --repo=repo2 static-delta --apply=repo/deltas/${origrev}-${newrev}
+ostree --repo=repo2 fsck
+ostree --repo=repo2 checkout -U ${newrev} checkout-chmod
+test -x checkout-chmod/random
+cmp files/random checkout-chmod/random
+
+echo 'ok rewrite header delta'
+
+# Chain the existing deltas from the first permuted commit onwards.
+rev1=$(ostree --repo=repo rev-parse test^^^)
+rev2=$(ostree --repo=repo rev-parse test^^)
+rev4=$(ostree --repo=repo rev-parse test)
+ostree static-delta --repo=repo --from=${rev1} --to=${rev2}
+ostree static-delta --repo=repo --chain --from=${rev1} --to=${rev4} > chain.txt
+assert_file_has_content chain.txt '^total: 0 parts'
+assert_has_file repo/deltas/${rev1}-${rev4}/meta
+assert_not_has_file repo/deltas/${rev1}-${rev4}/0
+
+mkdir repo5
+ostree --repo=repo5 init --mode=archive-z2
+ostree --repo=repo5 pull-local repo ${rev1}
+ostree --repo=repo5 static-delta --apply=repo/deltas/${rev1}-${rev4}
+ostree --repo=repo5 fsck
+ostree --repo=repo5 show ${rev4}
+
+# A chain must end at the commit its descriptor is named for
+rev3=$(ostree --repo=repo rev-parse test^)
+cp -r repo/deltas/${rev1}-${rev4} repo/deltas/${rev1}-${rev3}
+mkdir repo7
+ostree --repo=repo7 init --mode=archive-z2
+ostree --repo=repo7 pull-local repo ${rev1}
+if ostree --repo=repo7 static-delta --apply=repo/deltas/${rev1}-${rev3} 2>err.txt; then
+    assert_not_reached "applied a chain ending at the wrong commit"
+fi
+assert_file_has_content err.txt "Fallback deltas end at ${rev4}"
+rm -rf repo/deltas/${rev1}-${rev3}
+
+echo 'ok chained delta'
+
+ostree static-delta --repo=repo --ref=test --depth=3 > batch.txt
+assert_file_has_content batch.txt "^Skipping existing delta ${rev1}-${rev4}"
+assert_file_has_content batch.txt "^Skipping existing delta ${rev3}-${rev4}"
+assert_file_has_content batch.txt "^Generated delta ${rev2}-${rev4}"
+assert_has_file repo/deltas/${rev2}-${rev4}/meta
+
+mkdir repo6
+ostree --repo=repo6 init --mode=archive-z2
+ostree --repo=repo6 pull-local repo ${rev2}
+ostree --repo=repo6 static-delta --apply=repo/deltas/${rev2}-${rev4}
+ostree --repo=repo6 fsck
+ostree --repo=repo6 show ${rev4}
+
+echo 'ok batch deltas'
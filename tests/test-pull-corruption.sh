@@ -23,7 +23,7 @@ set -e
 
 setup_fake_remote_repo1 "archive-z2"
 
-echo '1..2'
+echo '1..4'
 
 repopath=${test_tmpdir}/ostree-srv/gnomerepo
 cp -a ${repopath} ${repopath}.orig
@@ -32,7 +32,7 @@ do_corrupt_pull_test() {
     cd ${test_tmpdir}
     rm repo -rf
     mkdir repo
-    ${CMD_PREFIX} ostree --repo=repo init
+    ${CMD_PREFIX} ostree --repo=repo init "$@"
     ${CMD_PREFIX} ostree --repo=repo remote add --set=gpg-verify=false origin $(cat httpd-address)/ostree/gnomerepo
     if ${CMD_PREFIX} ostree --repo=repo pull origin main; then
         assert_not_reached "pull unexpectedly succeeded!"
@@ -53,3 +53,11 @@ gjs $(dirname $0)/corrupt-repo-ref.js ${repopath} main || true
 assert_file_has_content corrupted-status.txt 'Changed byte'
 do_corrupt_pull_test
 echo "ok corruption $iteration"
+
+# Archive-z2 content is stored as fetched, so anything after the
+# deflate stream must be rejected rather than kept
+cd ${test_tmpdir}
+obj=$(cd ${repopath}/objects && find . -name '*.filez' | head -1)
+echo trailing >> ${repopath}/objects/${obj}
+do_corrupt_pull_test --mode=archive-z2
+echo "ok corruption trailing archive content"
@@ -0,0 +1,100 @@
+#!/bin/bash
+#
+# Copyright (C) 2014 Colin Walters <walters@verbum.org>
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 02111-1307, USA.
+
+set -e
+
+. $(dirname $0)/libtest.sh
+
+setup_fake_remote_repo1 "archive-z2"
+
+echo '1..4'
+
+cd ${test_tmpdir}
+mkdir repo
+${CMD_PREFIX} ostree --repo=repo init
+${CMD_PREFIX} ostree --repo=repo remote add --set=gpg-verify=false origin $(cat httpd-address)/ostree/gnomerepo
+${CMD_PREFIX} ostree --repo=repo pull origin main
+origrev=$(ostree --repo=repo rev-parse origin/main)
+
+cd ${test_tmpdir}
+rm gnomerepo-files -rf
+ostree --repo=ostree-srv/gnomerepo checkout main gnomerepo-files
+cd gnomerepo-files
+echo moomoo > baz/cow
+cp $(which ostree) baz/ostree-binary
+echo newfile > baz/newfile
+ostree --repo=${test_tmpdir}/ostree-srv/gnomerepo commit -b main -s "Delta commit"
+cd ${test_tmpdir}
+newrev=$(ostree --repo=ostree-srv/gnomerepo rev-parse main)
+ostree --repo=ostree-srv/gnomerepo static-delta --from=${origrev} --to=${newrev}
+assert_has_file ostree-srv/gnomerepo/deltas/${origrev}-${newrev}/meta
+
+G_MESSAGES_DEBUG=all ${CMD_PREFIX} ostree --repo=repo pull origin main 2> pull-log.txt
+assert_file_has_content pull-log.txt "static delta ${origrev}-${newrev}: applied"
+${CMD_PREFIX} ostree --repo=repo fsck
+assert_streq "$(ostree --repo=repo rev-parse origin/main)" "${newrev}"
+$OSTREE checkout origin/main checkout-origin-main
+assert_file_has_content checkout-origin-main/baz/cow '^moomoo$'
+assert_file_has_content checkout-origin-main/baz/newfile '^newfile$'
+echo "ok pull static delta"
+
+cd ${test_tmpdir}
+ostree --repo=ostree-srv/gnomerepo commit -b main -s "No delta" --tree=ref=main
+rm checkout-origin-main -rf
+G_MESSAGES_DEBUG=all ${CMD_PREFIX} ostree --repo=repo pull origin main 2> pull-log.txt
+if grep -q "applied" pull-log.txt; then
+    assert_not_reached "used a static delta which doesn't exist"
+fi
+${CMD_PREFIX} ostree --repo=repo fsck
+echo "ok pull without static delta"
+
+cd ${test_tmpdir}
+rev=$(ostree --repo=ostree-srv/gnomerepo rev-parse main)
+ostree --repo=ostree-srv/gnomerepo static-delta --empty --to=${rev}
+assert_has_file ostree-srv/gnomerepo/deltas/${rev}/meta
+mkdir repo2
+${CMD_PREFIX} ostree --repo=repo2 init
+${CMD_PREFIX} ostree --repo=repo2 remote add --set=gpg-verify=false origin $(cat httpd-address)/ostree/gnomerepo
+G_MESSAGES_DEBUG=all ${CMD_PREFIX} ostree --repo=repo2 pull origin main 2> pull-log.txt
+assert_file_has_content pull-log.txt "static delta ${rev}: applied"
+${CMD_PREFIX} ostree --repo=repo2 fsck
+assert_streq "$(ostree --repo=repo2 rev-parse origin/main)" "${rev}"
+echo "ok pull static delta from scratch"
+
+cd ${test_tmpdir}
+prevrev=$(ostree --repo=ostree-srv/gnomerepo rev-parse main)
+cd gnomerepo-files
+echo chained > baz/chained
+ostree --repo=${test_tmpdir}/ostree-srv/gnomerepo commit -b main -s "Chain 1"
+echo chained again >> baz/chained
+ostree --repo=${test_tmpdir}/ostree-srv/gnomerepo commit -b main -s "Chain 2"
+cd ${test_tmpdir}
+midrev=$(ostree --repo=ostree-srv/gnomerepo rev-parse main^)
+newrev=$(ostree --repo=ostree-srv/gnomerepo rev-parse main)
+ostree --repo=ostree-srv/gnomerepo static-delta --from=${prevrev} --to=${midrev}
+ostree --repo=ostree-srv/gnomerepo static-delta --from=${midrev} --to=${newrev}
+ostree --repo=ostree-srv/gnomerepo static-delta --chain --from=${prevrev} --to=${newrev}
+G_MESSAGES_DEBUG=all ${CMD_PREFIX} ostree --repo=repo pull origin main 2> pull-log.txt
+assert_file_has_content pull-log.txt "applying delta ${midrev}-${newrev} of chain"
+assert_file_has_content pull-log.txt "static delta ${prevrev}-${newrev}: applied"
+${CMD_PREFIX} ostree --repo=repo fsck
+rm checkout-origin-main -rf
+$OSTREE checkout origin/main checkout-origin-main
+assert_file_has_content checkout-origin-main/baz/chained '^chained again$'
+echo "ok pull chained static delta"
@@ -0,0 +1,79 @@
+#!/bin/bash
+#
+# Copyright (C) 2014 Colin Walters <walters@verbum.org>
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 02111-1307, USA.
+
+set -e
+
+. $(dirname $0)/libtest.sh
+
+echo '1..7'
+
+setup_test_repository "archive-z2"
+echo "ok setup"
+
+cd ${test_tmpdir}
+$OSTREE repack > repack-output.txt
+assert_file_has_content repack-output.txt "Packed [0-9]* objects"
+assert_has_file repo/objects/pack/ostmetapack-*.index
+assert_has_file repo/objects/pack/ostdatapack-*.data
+if find repo/objects -name '*.commit' -o -name '*.dirtree' -o -name '*.filez' | grep -q .; then
+    assert_not_reached "loose objects remain after repack"
+fi
+$OSTREE fsck
+echo "ok repack"
+
+$OSTREE repack > repack-output.txt
+assert_file_has_content repack-output.txt "No loose objects to pack"
+echo "ok repack idempotent"
+
+rm checkout-test2 -rf
+$OSTREE checkout test2 checkout-test2
+assert_file_has_content checkout-test2/baz/cow moo
+$OSTREE cat test2 /baz/deeper/ohyeah > ohyeah-contents
+assert_file_has_content ohyeah-contents hi
+echo "ok checkout from pack"
+
+cd ${test_tmpdir}/checkout-test2
+$OSTREE commit -b test2 -s 'Same content'
+cd ${test_tmpdir}
+if find repo/objects -name '*.dirtree' -o -name '*.filez' | grep -q .; then
+    assert_not_reached "packed objects were rewritten loose"
+fi
+$OSTREE fsck
+echo "ok commit deduplicates against packs"
+
+mkdir repo2
+${CMD_PREFIX} ostree --repo=repo2 init
+${CMD_PREFIX} ostree --repo=repo2 pull-local repo
+${CMD_PREFIX} ostree --repo=repo2 fsck
+${CMD_PREFIX} ostree --repo=repo2 checkout test2 checkout-repo2
+assert_file_has_content checkout-repo2/baz/cow moo
+echo "ok pull-local from packed repo"
+
+cd ${test_tmpdir}
+mkdir scratch-files
+echo scratch > scratch-files/scratch
+$OSTREE commit -b scratch -s 'Scratch' --tree=dir=scratch-files
+rm repo/refs/heads/scratch
+$OSTREE prune --refs-only --depth=0 > prune-output.txt
+assert_file_has_content prune-output.txt "Deleted [0-9]* objects"
+$OSTREE fsck
+rm checkout-test2 -rf
+$OSTREE checkout test2 checkout-test2
+assert_file_has_content checkout-test2/baz/cow moo
+echo "ok prune after repack"
@@ -24,7 +24,7 @@ if ! setfattr -n user.testvalue -v somevalue test-xattrs; then
     exit 77
 fi
 
-echo "1..2"
+echo "1..3"
 
 . $(dirname $0)/libtest.sh
 
@@ -47,3 +47,21 @@ assert_file_has_content v0 '^testvalue$'
 getfattr -n user.test0 --only-values test2-checkout2/firstfile > v1
 assert_file_has_content v1 '^moo$'
 echo "ok checkout with xattrs"
+
+cd ${test_tmpdir}
+rm -rf xattr-update xattr-update-checkout
+mkdir -p xattr-update/sub
+echo file > xattr-update/sub/file
+setfattr -n user.dropped -v gone xattr-update/sub
+setfattr -n user.kept -v here xattr-update/sub
+ostree --repo=repo commit -b xattr-update -s xattrs --tree=dir=xattr-update
+setfattr -x user.dropped xattr-update/sub
+ostree --repo=repo commit -b xattr-update -s "Drop xattr" --tree=dir=xattr-update
+ostree --repo=repo checkout xattr-update^ xattr-update-checkout
+ostree --repo=repo checkout --update-from=xattr-update^ xattr-update xattr-update-checkout
+getfattr -m . xattr-update-checkout/sub > attrs
+assert_file_has_content attrs '^user.kept'
+if grep -q '^user.dropped' attrs; then
+    assert_not_reached "dropped xattr was kept by update"
+fi
+echo "ok checkout update removes dropped xattrs"